@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+// Caching allocator for host buffers; blocks are rounded up to size classes
+// and recycled through per-thread free lists instead of going back to the
+// system. Each block starts with a header holding the reference counter of
+// the owning Resource, so that a buffer is a single allocation.
+struct Allocator {
+	// Blocks handed out for a memory plan; see MemoryPlan
+	struct Ledger;
+
+	struct alignas(64) Header {
+		std::atomic <long long int> counter;
+		size_t size_class;
+		size_t capacity;
+
+		// Set only for blocks that belong to a plan
+		Ledger *ledger;
+		size_t slot;
+	};
+
+	// Aggregate counters over all threads, since the start of the program
+	struct Statistics {
+		size_t allocations;
+		size_t releases;
+		size_t cache_hits;
+		size_t system_allocations;
+		size_t system_releases;
+		size_t bytes_in_use;
+		size_t peak_bytes_in_use;
+		size_t bytes_cached;
+		size_t planned_allocations;
+	};
+
+	// Data of at least the given number of bytes, 64 byte aligned; the
+	// counter in its header starts at one
+	static void *allocate(size_t, bool = false);
+
+	// Return a block obtained through allocate
+	static void release(void *);
+
+	static Header *header(void *data) {
+		return reinterpret_cast <Header *> (data) - 1;
+	}
+
+	// Free every block cached by the calling thread
+	static void trim();
+
+	static Statistics statistics();
+
+	// Bytes in use right now, without gathering the other statistics
+	static size_t live_bytes();
+
+	// Restart tracking the peak from the current usage
+	static void reset_statistics();
+};
+
+// Memory planning for passes that request the same sequence of blocks every
+// time, such as training steps. The first pass is recorded, along with the
+// releases of its blocks up to the end of the following pass; the blocks
+// released by then are laid out in a single workspace, such that blocks
+// whose lifetimes overlap never share memory, and later passes are served
+// from it without touching the allocator. Requests that stray from the plan
+// fall back to the caching allocator, and the next pass records it anew.
+struct MemoryPlan {
+	MemoryPlan() = default;
+	MemoryPlan(const MemoryPlan &) = delete;
+	MemoryPlan &operator=(const MemoryPlan &) = delete;
+
+	~MemoryPlan();
+
+	// Requests of the calling thread in between belong to the pass
+	void begin();
+	void end();
+
+	// Whether passes are being served from a workspace
+	bool planned() const {
+		return workspace;
+	}
+
+	size_t workspace_bytes() const;
+
+	// Plan of the pass that the calling thread is in, if any; requests on
+	// other threads do not belong to it
+	static MemoryPlan *current();
+
+	// Passes as scopes
+	struct Pass {
+		MemoryPlan &plan;
+
+		Pass(MemoryPlan &p) : plan(p) {
+			plan.begin();
+		}
+
+		~Pass() {
+			plan.end();
+		}
+	};
+
+	// Internal state, for the allocator
+	Allocator::Ledger *recording = nullptr;
+	Allocator::Ledger *workspace = nullptr;
+	size_t cursor = 0;
+	bool deviated = false;
+};
+
+// Printing utilities
+std::string format_as(const Allocator::Statistics &);
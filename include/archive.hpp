@@ -0,0 +1,52 @@
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <memory>
+
+#include <fmt/color.h>
+
+#include "gradients.hpp"
+#include "tensor.hpp"
+
+// Private mapping of a whole file; pages are shared with the page cache,
+// and with other processes mapping the same file, until they are written
+// to, at which point they are copied
+struct MappedFile {
+	unsigned char *data = nullptr;
+	size_t size = 0;
+
+	MappedFile() = default;
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	~MappedFile();
+
+	static std::shared_ptr <MappedFile> from(const std::filesystem::path &);
+};
+
+// Named tensors in a single file: a header, an entry for each tensor with
+// its type, shape and offset, then the raw data of each tensor, aligned.
+// Loaded tensors point straight into the mapping of the file, which stays
+// alive as long as any of them does.
+struct Archive {
+	std::map <std::string, Tensor> tensors;
+
+	// Data offsets are aligned to this many bytes
+	static constexpr size_t ALIGNMENT = 64;
+
+	bool save(const std::filesystem::path &) const;
+
+	static std::optional <Archive> load(const std::filesystem::path &);
+};
+
+// Checkpoints of parameters, along with the state of their optimizer;
+// entries are named by the position of each parameter, since tags change
+// from one run to the next. Loading copies into the parameters, which may
+// be views (e.g. into a ParameterArena), whereas optimizer states are left
+// mapped.
+struct Checkpoint {
+	static bool save(const std::filesystem::path &, const std::vector <Tensor *> &, Optimizer * = nullptr);
+
+	static bool load(const std::filesystem::path &, const std::vector <Tensor *> &, Optimizer * = nullptr);
+};
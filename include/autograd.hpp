@@ -1,10 +1,13 @@
 #pragma once
 
+#include <mutex>
+
 #include <fmt/color.h>
 
 #include "tensor.hpp"
 #include "gradients.hpp"
 #include "kernels.hpp"
+#include "profiler.hpp"
 
 // Autograd functions; note that function can only return a single tensor (tuples are expanded to separate entities)
 using tensor_list = std::vector <Tensor>;
@@ -15,6 +18,14 @@ struct Function {
 	Function(const std::string &str) : tag(str) {}
 	virtual ~Function() {}
 
+	// Copies get a lock of their own
+	Function(const Function &other) : tag(other.tag) {}
+
+	Function &operator=(const Function &other) {
+		tag = other.tag;
+		return *this;
+	}
+
 	// Checking functions
 	template <size_t N>
 	[[gnu::always_inline]]
@@ -29,6 +40,12 @@ struct Function {
 		return {};
 	}
 
+	// Elementwise functions describe themselves as a fused instruction, so
+	// that chains of them can be evaluated in a single kernel
+	virtual std::optional <fused_instruction> fusion() const {
+		return std::nullopt;
+	}
+
 	// Always need a way to get the primal value
 	virtual Tensor forward_args(const tensor_list &) = 0;
 
@@ -37,10 +54,51 @@ struct Function {
 		throw std::runtime_error(fmt::format("Function ({}) has not implemented pullback\n", tag));
 	}
 
+	// Whether forward_args keeps state (e.g. for the pullback), in which
+	// case calls on the same function never run at once
+	virtual bool stateful() const {
+		return false;
+	}
+
+	// Drops what forward_args kept for the pullback, which then has to
+	// recompute it
+	virtual void release() {}
+
+	// Primal value only, without touching the function, so that several
+	// threads can evaluate it at once; functions whose forward_args keeps
+	// state (e.g. for the pullback) must override this
+	virtual Tensor infer_args(const tensor_list &ts) const {
+		return const_cast <Function *> (this)->forward_args(ts);
+	}
+
+	// Entry points for callers of forward_args and pullback_args, which
+	// the profiler sees
+	Tensor call_forward(const tensor_list &ts) {
+		Profiler::Scope scope(tag, Profiler::forward);
+		if (stateful()) {
+			std::lock_guard guard(exclusive);
+			return forward_args(ts);
+		}
+
+		return forward_args(ts);
+	}
+
+	Tensor call_infer(const tensor_list &ts) const {
+		Profiler::Scope scope(tag, Profiler::forward);
+		return infer_args(ts);
+	}
+
+	tensor_list call_pullback(const tensor_list &ts, const Tensor &delta, Tape &tape) const {
+		Profiler::Scope scope(tag, Profiler::pullback);
+		return pullback_args(ts, delta, tape);
+	}
+
 	// Wrapper function to accept variadic list of tensors
 	template <typename ... Args>
 	Tensor forward(const Args & ...args) {
 		std::initializer_list <Tensor> ts { args... };
-		return forward_args(ts);
+		return call_forward(ts);
 	}
+private:
+	std::mutex exclusive;
 };
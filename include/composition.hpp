@@ -1,9 +1,15 @@
 #pragma once
 
+#include <algorithm>
 #include <variant>
 #include <memory>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "autograd.hpp"
+#include "device.hpp"
+#include "scheduler.hpp"
 
 // Helpers
 template <typename T>
@@ -21,6 +27,88 @@ static std::shared_ptr <Function> value_ptr(const T &t)
 	return std::shared_ptr <Function> (new S(t));
 }
 
+struct DynamicDeferred;
+
+// Nodes of expressions are recycled through a free list of each thread,
+// since building an expression allocates a node per operation and frees
+// them all at once after its evaluation
+template <typename T>
+struct expression_allocator {
+	using value_type = T;
+
+	// Blocks kept per thread; others go back to the heap
+	static constexpr size_t CAPACITY = 1 << 12;
+
+	expression_allocator() = default;
+
+	template <typename U>
+	expression_allocator(const expression_allocator <U> &) {}
+
+	T *allocate(size_t n) {
+		pool &p = blocks();
+		if (n != 1 || p.free.empty())
+			return std::allocator <T> ().allocate(n);
+
+		T *ptr = p.free.back();
+		p.free.pop_back();
+		return ptr;
+	}
+
+	void deallocate(T *ptr, size_t n) {
+		if (n != 1 || exited() || blocks().free.size() >= CAPACITY)
+			return std::allocator <T> ().deallocate(ptr, n);
+
+		blocks().free.push_back(ptr);
+	}
+
+	bool operator==(const expression_allocator &) const {
+		return true;
+	}
+private:
+	// Nodes released while a thread exits, after its pool is gone, go
+	// straight back to the heap
+	static bool &exited() {
+		thread_local bool flag = false;
+		return flag;
+	}
+
+	struct pool {
+		std::vector <T *> free;
+
+		~pool() {
+			exited() = true;
+			for (T *ptr : free)
+				std::allocator <T> ().deallocate(ptr, 1);
+		}
+	};
+
+	static pool &blocks() {
+		thread_local pool p;
+		return p;
+	}
+};
+
+// Arguments of an expression; subexpressions are held through shared
+// handles, so that building an expression copies (or moves) only the top
+// node of each argument instead of the whole tree below it
+struct deferred_arg : std::variant <Tensor, std::shared_ptr <DynamicDeferred>> {
+	deferred_arg(const Tensor &t) : variant(t) {}
+	deferred_arg(const DynamicDeferred &);
+	deferred_arg(DynamicDeferred &&);
+
+	bool deferred() const {
+		return index() == 1;
+	}
+
+	const Tensor &tensor() const {
+		return std::get <Tensor> (*this);
+	}
+
+	DynamicDeferred &expression() const {
+		return *std::get <std::shared_ptr <DynamicDeferred>> (*this);
+	}
+};
+
 // Function composition via lazy evaluation
 struct DynamicDeferred {
 	// Function *ftn;
@@ -28,23 +116,85 @@ struct DynamicDeferred {
 
 	Tensor cached_eval;
 	std::vector <Tensor> cached_args;
-	std::vector <std::variant <Tensor, DynamicDeferred>> args;
+	std::vector <deferred_arg> args;
+
+	// Set if only the value of the whole expression was computed, by fusion
+	bool fused = false;
+
+	bool evaluated() const {
+		return cached_args.size() || fused;
+	}
+
+	// TODO: reuse buffers as well
+	Tensor eval(bool fusing = true) {
+		if (evaluated())
+			return cached_eval;
 
-	// TODO: optimize memory and compute by fusing operations and reusing buffers
-	Tensor eval() {
-		if (cached_args.size())
+		branch(fusing);
+		if (fusing && fuse())
 			return cached_eval;
 
 		cached_args.clear();
+		for (auto &v : args)
+			cached_args.push_back(v.deferred() ? v.expression().eval(fusing) : v.tensor());
+
+		cached_eval = ftn->call_forward(cached_args);
+		return cached_eval;
+	}
+
+	// Estimate of the elements touched to evaluate the expression, from its
+	// inputs and the parameters of its functions
+	size_t work() const;
+
+	// Subexpressions to evaluate before this one; those that would be fused
+	// are looked through, down to their own inputs. Nodes shared by several
+	// of them are only visited once
+	void frontier(std::vector <DynamicDeferred *> &pending, bool fusing, std::unordered_set <const DynamicDeferred *> &visited) {
 		for (auto &v : args) {
-			if (std::holds_alternative <Tensor> (v))
-				cached_args.push_back(std::get <Tensor> (v));
-			else
-				cached_args.push_back(std::get <DynamicDeferred> (v));
+			if (!v.deferred())
+				continue;
+
+			DynamicDeferred &dd = v.expression();
+			if (dd.evaluated() || !visited.insert(&dd).second)
+				continue;
+
+			if (fusing && dd.fusable())
+				dd.frontier(pending, fusing, visited);
+			else if (dd.work() >= TASK_THRESHOLD)
+				pending.push_back(&dd);
 		}
+	}
 
-		cached_eval = ftn->forward_args(cached_args);
-		return cached_eval;
+	// Whether the subexpressions share no node, so that evaluating them at
+	// once never touches the same node from two threads
+	static bool disjoint(const std::vector <DynamicDeferred *> &);
+
+	// Evaluates independent subexpressions at once, if at least two of them
+	// are worth a task; the last one runs in place
+	void branch(bool fusing) {
+		if (!Scheduler::concurrent())
+			return;
+
+		std::vector <DynamicDeferred *> pending;
+		std::unordered_set <const DynamicDeferred *> visited;
+		frontier(pending, fusing, visited);
+		if (pending.size() < 2 || !disjoint(pending))
+			return;
+
+		Scheduler::Group group;
+		for (size_t i = 0; i + 1 < pending.size(); i++)
+			Scheduler::spawn(group, [dd = pending[i], fusing]() { dd->eval(fusing); });
+
+		std::exception_ptr error;
+		try {
+			pending.back()->eval(fusing);
+		} catch (...) {
+			error = std::current_exception();
+		}
+
+		Scheduler::wait(group);
+		if (error)
+			std::rethrow_exception(error);
 	}
 
 	operator Tensor() {
@@ -54,57 +204,186 @@ struct DynamicDeferred {
 	// TODO: backward/pullback
 	// backward is pullback is delta of one
 
-	// TODO: blacklisting certain deltas through the tape (e.g. target delta which is never used)
-	tensor_list pullback(const Tensor &delta, Tape &tape) const {
-		// TODO: warn here
-		if (cached_args.empty()) {
-			fmt::print("{} {} eval() must be performed in some manner before invoking pullback.\n",
-					fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
-					fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(dynamic deferred)"));
-			return {};
+	// Both run on a Graph of the expression; see below
+	tensor_list pullback(const Tensor &, Tape &) const;
+	tensor_list backward(Tape &) const;
+
+	// Elementwise fusion; program built from the expression, with every
+	// subexpression that is not elementwise (or already evaluated) as input.
+	// Nodes used more than once in the region are inputs as well, evaluated
+	// once and loaded for every use, instead of being inlined at each use
+	struct fused_program {
+		std::vector <fused_instruction> code;
+		tensor_list inputs;
+		std::unordered_map <const DynamicDeferred *, size_t> uses;
+		std::unordered_map <const DynamicDeferred *, size_t> loaded;
+		size_t depth = 0;
+	};
+
+	bool fusable() const {
+		auto instr = ftn->fusion();
+		return !evaluated() && instr && instr->op != f_sum;
+	}
+
+	// Uses of each node in the region to fuse, walking shared nodes once
+	void count(fused_program &program) const {
+		for (auto &v : args) {
+			if (v.deferred() && v.expression().fusable() && program.uses[&v.expression()]++ == 0)
+				v.expression().count(program);
 		}
+	}
 
-		tensor_list current_deltas = ftn->pullback_args(cached_args, delta, tape);
-		tensor_list original_deltas;
-		for (size_t i = 0; i < args.size(); i++) {
-			const auto &v = args[i];
-			if (std::holds_alternative <Tensor> (v)) {
-				original_deltas.push_back(current_deltas[i]);
+	// Fails as soon as the stack of the program grows past its limit
+	bool compile(fused_program &program) {
+		for (auto &v : args) {
+			if (v.deferred() && v.expression().fusable() && program.uses[&v.expression()] < 2) {
+				if (!v.expression().compile(program))
+					return false;
+
+				continue;
+			}
+
+			size_t input = program.inputs.size();
+			if (!v.deferred()) {
+				program.inputs.push_back(v.tensor().contiguous());
+			} else if (auto [it, inserted] = program.loaded.try_emplace(&v.expression(), input); inserted) {
+				program.inputs.push_back(v.expression().eval().contiguous());
 			} else {
-				const DynamicDeferred &dd = std::get <DynamicDeferred> (v);
-				tensor_list sub_deltas = dd.pullback(current_deltas[i], tape);
-				original_deltas.insert(original_deltas.end(),
-					sub_deltas.begin(), sub_deltas.end());
+				input = it->second;
 			}
+
+			program.code.push_back({ f_load, input });
+			if (++program.depth > FUSED_MAX_DEPTH)
+				return false;
 		}
 
-		return original_deltas;
+		fused_instruction instr = *ftn->fusion();
+		program.code.push_back(instr);
+		program.depth -= fused_arity(instr.op) - 1;
+		return true;
 	}
 
-	tensor_list backward(Tape &tape) const {
-		// TODO: check for dimension of output?
-		return pullback(Tensor::ones({}), tape);
+	// Evaluates the expression in a single pass if it chains at least two
+	// elementwise functions (optionally ending with a sum) over tensors of
+	// the same shape and type; otherwise leaves it to the regular path
+	bool fuse() {
+		auto instr = ftn->fusion();
+		if (!instr)
+			return false;
+
+		fused_program program;
+		if (instr->op == f_sum) {
+			if (args.size() != 1 || !args[0].deferred())
+				return false;
+
+			DynamicDeferred &dd = args[0].expression();
+			if (!dd.fusable())
+				return false;
+
+			dd.count(program);
+			if (!dd.compile(program))
+				return false;
+
+			program.code.push_back(*instr);
+		} else {
+			count(program);
+			if (!compile(program))
+				return false;
+		}
+
+		size_t operations = std::count_if(program.code.begin(), program.code.end(),
+			[](const fused_instruction &code) { return code.op != f_load; });
+		if (operations < 2)
+			return false;
+
+		const Tensor &first = program.inputs[0];
+		std::vector <Resource> buffers;
+		for (const Tensor &t : program.inputs) {
+			// Fused kernels are host only
+			if (!t.shape || t.shape != first.shape || t.buffer.type != first.buffer.type || t.buffer.device != Resource::eCPU)
+				return false;
+
+			buffers.push_back(t.buffer);
+		}
+
+		Resource::Type type = first.buffer.type;
+		Tensor out = (instr->op == f_sum)
+			? Tensor::blank({}, type, first.buffer.device)
+			: Tensor::blank(*first.shape, type, first.buffer.device);
+
+		Profiler::Scope scope(ftn->tag, Profiler::forward);
+		Profiler::flops(operations * first.shape->elements());
+		type_dispatch(type, [&] <typename T> () {
+			cpu_kernel_fused <T> (program.code, buffers, out.buffer, first.shape->elements());
+		});
+
+		cached_eval = out;
+		fused = true;
+		return true;
 	}
 
-	static DynamicDeferred from(const std::shared_ptr <Function> &ftn, const std::vector <std::variant <Tensor, DynamicDeferred>> &args) {
+	static DynamicDeferred from(std::shared_ptr <Function> ftn, std::vector <deferred_arg> args) {
 		DynamicDeferred dd;
 		dd.ftn = std::move(ftn);
-		dd.args = args;
+		dd.args = std::move(args);
 		return dd;
 	}
 
 	static DynamicDeferred from_tensor_list(const std::shared_ptr <Function> ftn, const std::vector <Tensor> &args) {
-		std::vector <std::variant <Tensor, DynamicDeferred>> vargs;
-		for (const auto &t : args)
-			vargs.push_back(t);
-
 		DynamicDeferred dd;
 		dd.ftn = ftn;
-		dd.args = vargs;
+		dd.args.assign(args.begin(), args.end());
 		return dd;
 	}
 };
 
+inline deferred_arg::deferred_arg(const DynamicDeferred &dd)
+		: variant(std::allocate_shared <DynamicDeferred> (expression_allocator <DynamicDeferred> (), dd)) {}
+
+inline deferred_arg::deferred_arg(DynamicDeferred &&dd)
+		: variant(std::allocate_shared <DynamicDeferred> (expression_allocator <DynamicDeferred> (), std::move(dd))) {}
+
+// Expressions recorded once, in topological order; shared subexpressions
+// (the same function over the same inputs) become a single node, and the
+// backward pass accumulates the deltas of every consumer of a node before
+// pulling back through it
+struct Graph {
+	struct Node {
+		std::shared_ptr <Function> ftn; // Null for leaf tensors
+		std::vector <size_t> inputs;
+		Tensor value;
+		size_t consumers = 0;
+	};
+
+	// The output is the last node
+	std::vector <Node> nodes;
+
+	// Leaves in the order of the deltas returned by backward; each is listed
+	// once, at its first use, with the total delta over all of its uses
+	std::vector <size_t> leaves;
+
+	// Values that are already evaluated in the expression are reused
+	static Graph from(const DynamicDeferred &);
+
+	// Evaluates the nodes without a value; unless they are retained for the
+	// backward pass, intermediates are freed after their last consumer
+	Tensor forward(bool = true);
+
+	// Deltas of the leaves; gradients of the tensors on the tape, including
+	// parameters of the functions, are accumulated into it. Intermediates are
+	// freed as soon as the pullbacks of all their consumers have run
+	tensor_list backward(const Tensor &, Tape &);
+	tensor_list backward(Tape &);
+
+	// Both passes run nodes as tasks once their dependencies are done, if
+	// the graph has independent branches worth it; deltas and gradients
+	// are still summed in the same order as when run in sequence
+	bool concurrent() const;
+private:
+	void forward_tasks(bool);
+	void backward_tasks(std::vector <Tensor> &, std::vector <Tape> &, const Tape &);
+};
+
 // Function composition via chaining to construct a new function
 struct Chain;
 
@@ -146,6 +425,25 @@ struct Chain : Function {
 	std::vector <tensor_list> node_args;
 	std::vector <std::shared_ptr <Function>> nodes;
 
+	// Layers whose inputs are kept by forward_args; the pullback recomputes
+	// the inputs of the others from the closest kept one before them, and
+	// layers drop what they keep for their own pullback in the meantime.
+	// Empty keeps the inputs of every layer
+	std::set <size_t> checkpoints;
+
+	// Keeps the inputs of every k-th layer
+	Chain &checkpoint(size_t k) {
+		checkpoints.clear();
+		for (size_t i = 0; i < nodes.size(); i += std::max(k, size_t(1)))
+			checkpoints.insert(i);
+
+		return *this;
+	}
+
+	bool kept(size_t i) const {
+		return checkpoints.empty() || i == 0 || checkpoints.contains(i);
+	}
+
 	// Get parameters from all nodes
 	std::vector <Tensor *> parameters() override {
 		std::vector <Tensor *> ps;
@@ -157,23 +455,63 @@ struct Chain : Function {
 		return ps;
 	}
 
+	bool stateful() const override {
+		return true;
+	}
+
 	Tensor forward_args(const tensor_list &ts) override {
 		node_args = { ts };
 
+#ifdef PETAL_VULKAN
+		// The whole forward is recorded into a single submission
+		std::optional <VulkanBatch> batch;
+		if (!ts.empty() && ts[0].buffer.device == Resource::eVulkan)
+			batch.emplace();
+#endif
+
 		Tensor out;
+		tensor_list args = ts;
 		for (size_t i = 0; i < nodes.size(); i++) {
-			out = nodes[i]->forward_args(node_args.back());
-			node_args.push_back({ out });
+			out = nodes[i]->call_forward(args);
+			args = { out };
+
+			if (!checkpoints.empty())
+				nodes[i]->release();
+
+			node_args.push_back(kept(i + 1) ? args : tensor_list {});
 		}
 
 		return out;
 	}
 
+	void release() override {
+		node_args.clear();
+		for (auto &node : nodes)
+			node->release();
+	}
+
+	// Same as forward_args, without keeping the arguments of each node
+	Tensor infer_args(const tensor_list &ts) const override {
+#ifdef PETAL_VULKAN
+		std::optional <VulkanBatch> batch;
+		if (!ts.empty() && ts[0].buffer.device == Resource::eVulkan)
+			batch.emplace();
+#endif
+
+		if (nodes.empty())
+			return {};
+
+		Tensor out = nodes[0]->call_infer(ts);
+		for (size_t i = 1; i < nodes.size(); i++)
+			out = nodes[i]->call_infer({ out });
+
+		return out;
+	}
+
 	// Evaluate as a lazy operation (recommended for typical ML)
 	template <typename ... Args>
 	DynamicDeferred operator()(const Args & ...args) {
-		std::vector <std::variant <Tensor, DynamicDeferred>> ts { args... };
-		return DynamicDeferred::from(nop_ptr(this), ts);
+		return DynamicDeferred::from(nop_ptr(this), { args... });
 	}
 
 	tensor_list pullback_args(const tensor_list &args, const Tensor &delta, Tape &tape) const override {
@@ -197,15 +535,37 @@ struct Chain : Function {
 		}
 
 		// Do the pullback with cached inputs
-		Tensor d = delta;
-		for (long int i = nodes.size() - 1; i >= 0; i--)
-			d = nodes[i]->pullback_args(node_args[i], d, tape)[0];
+		Tensor d = delta.contiguous();
+		if (checkpoints.empty()) {
+			for (long int i = nodes.size() - 1; i >= 0; i--)
+				d = nodes[i]->call_pullback(node_args[i], d, tape)[0];
+
+			return { d };
+		}
+
+		// Segments from the last, each recomputed from its kept input
+		size_t end = nodes.size();
+		for (long int start = nodes.size() - 1; start >= 0; start--) {
+			if (!kept(start))
+				continue;
+
+			std::vector <tensor_list> segment { node_args[start] };
+			for (size_t i = start; i + 1 < end; i++)
+				segment.push_back({ nodes[i]->call_forward(segment.back()) });
+
+			for (long int i = end - 1; i >= start; i--) {
+				d = nodes[i]->call_pullback(segment[i - start], d, tape)[0];
+				nodes[i]->release();
+			}
+
+			end = start;
+		}
 
 		return { d };
 	}
 
 	tensor_list pullback(const Tensor &delta, Tape &tape) const {
-		return pullback_args(node_args[0], delta, tape);
+		return call_pullback(node_args[0], delta, tape);
 	}
 
 	// Generate string from list of functions
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <condition_variable>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <fmt/color.h>
+
+#include "archive.hpp"
+
+// IDX files, as distributed for MNIST: a big endian header with the
+// dimensions, followed by the raw elements; only unsigned bytes are
+// supported, and the elements are read straight from the mapping
+struct IDX {
+	std::shared_ptr <MappedFile> file;
+	std::vector <size_t> dims;
+	const unsigned char *elements;
+
+	// Number of items along the first dimension, and bytes in each
+	size_t items() const {
+		return dims[0];
+	}
+
+	size_t item_size() const {
+		size_t size = 1;
+		for (size_t i = 1; i < dims.size(); i++)
+			size *= dims[i];
+		return size;
+	}
+
+	const unsigned char *item(size_t i) const {
+		return elements + i * item_size();
+	}
+
+	static std::optional <IDX> from(const std::filesystem::path &);
+};
+
+// Samples (rows of features) along with their targets
+struct Dataset {
+	virtual ~Dataset() = default;
+
+	virtual size_t size() const = 0;
+	virtual size_t features() const = 0;
+	virtual size_t targets() const = 0;
+
+	virtual Resource::Type type() const {
+		return Resource::f32;
+	}
+
+	// Writes the samples with the given indices into the leading rows of X
+	// and Y, which are contiguous; may be called from several threads
+	virtual void decode(const size_t *, size_t, Tensor &, Tensor &) const = 0;
+
+	// Views over the samples in [start, end), for datasets that are
+	// resident in memory
+	virtual std::optional <std::pair <Tensor, Tensor>> view(size_t, size_t) const {
+		return std::nullopt;
+	}
+};
+
+// Images and labels from a pair of IDX files; pixels are normalized to
+// [0, 1] and labels are one-hot encoded, as each batch is decoded
+struct IDXDataset : Dataset {
+	IDX images;
+	IDX labels;
+	size_t classes;
+
+	size_t size() const override {
+		return images.items();
+	}
+
+	size_t features() const override {
+		return images.item_size();
+	}
+
+	size_t targets() const override {
+		return classes;
+	}
+
+	void decode(const size_t *, size_t, Tensor &, Tensor &) const override;
+
+	static std::optional <IDXDataset> from(const std::filesystem::path &, const std::filesystem::path &, size_t = 10);
+};
+
+// Samples and targets stored as the rows of two tensors
+struct TensorDataset : Dataset {
+	Tensor X;
+	Tensor Y;
+
+	size_t size() const override {
+		return X.shape.value()[0];
+	}
+
+	size_t features() const override {
+		return X.shape.value()[1];
+	}
+
+	size_t targets() const override {
+		return Y.shape.value()[1];
+	}
+
+	Resource::Type type() const override {
+		return X.buffer.type;
+	}
+
+	void decode(const size_t *, size_t, Tensor &, Tensor &) const override;
+
+	std::optional <std::pair <Tensor, Tensor>> view(size_t, size_t) const override;
+
+	// Binary cache of the decoded samples, so that later runs skip decoding;
+	// loading maps the samples instead of reading them
+	bool save(const std::filesystem::path &) const;
+	static std::optional <TensorDataset> load(const std::filesystem::path &);
+
+	// Decodes the first samples (all by default) of another dataset
+	static TensorDataset from(const Dataset &, size_t = 0);
+};
+
+struct Batch {
+	Tensor X;
+	Tensor Y;
+};
+
+// Batches over a dataset, decoded ahead of the consumer by worker threads
+// into a ring of buffers that are allocated once and reused; resident
+// datasets that need no per-sample shuffling are served as views instead,
+// without copying. Workers carry on into the following epoch, so that its
+// first batches are ready as soon as the current one ends. A batch stays
+// valid until the following call to next.
+struct DataLoader {
+	enum Shuffle {
+		none,
+		batches,
+		samples
+	};
+
+	struct Options {
+		size_t batch_size = 100;
+		Shuffle shuffle = samples;
+		size_t workers = 2;
+		size_t prefetch = 4;
+		bool drop_last = true;
+		size_t seed = 0;
+	};
+
+	DataLoader(const std::shared_ptr <const Dataset> &, const Options &);
+	DataLoader(const DataLoader &) = delete;
+	DataLoader &operator=(const DataLoader &) = delete;
+
+	~DataLoader();
+
+	// Number of batches in each epoch
+	size_t size() const {
+		return count;
+	}
+
+	// Whether batches are views over the dataset
+	bool zero_copy() const {
+		return views;
+	}
+
+	// Next batch of the epoch; returns nothing once at the end of each
+	// epoch, after which the next one starts
+	std::optional <Batch> next();
+
+	static std::unique_ptr <DataLoader> from(const std::shared_ptr <const Dataset> &, const Options &);
+private:
+	struct Slot {
+		enum {
+			empty,
+			filling,
+			ready,
+			held
+		} state = empty;
+
+		Tensor X;
+		Tensor Y;
+		size_t count = 0;
+	};
+
+	std::shared_ptr <const Dataset> dataset;
+	Options options;
+	size_t count;
+	bool views;
+
+	// Orders of the samples and of the batches; at most two epochs are in
+	// flight at once, so each keeps two
+	std::vector <size_t> order[2];
+	std::vector <size_t> batch_order[2];
+	std::mt19937_64 rng;
+
+	std::vector <Slot> ring;
+	std::vector <std::thread> threads;
+
+	std::mutex lock;
+	std::condition_variable produced;
+	std::condition_variable consumed;
+
+	// Batches are numbered across epochs
+	size_t issued = 0;
+	size_t delivered = 0;
+	bool boundary = false;
+	bool stopping = false;
+
+	void prepare(size_t);
+	std::pair <size_t, size_t> locate(size_t) const;
+	void work();
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <fmt/color.h>
+
+#include "kernels.hpp"
+#include "profiler.hpp"
+
+// CUDA backend, built with PETAL_CUDA; all work is submitted in order to a
+// single stream, and device memory comes from its stream ordered pool.
+// NOTE: source/cuda.cu and DeviceTest.CUDARoundTrip were written without a
+// CUDA toolkit at hand, and have never been run on a GPU; the CUDA job of
+// the CI workflow only checks that they compile
+#ifdef PETAL_CUDA
+
+void *cuda_allocate(size_t);
+void cuda_release(void *);
+
+// Copies between any two of the host and the device; only those into host
+// memory wait for the stream
+void cuda_copy(void *, Resource::Device, const void *, Resource::Device, size_t);
+void cuda_synchronize();
+
+template <typename T>
+void cuda_kernel_fill(const Resource &, T);
+
+template <ewop_mode op, typename T>
+void cuda_kernel_ewop(const Resource &, const Resource &, Resource &);
+
+template <typename T>
+void cuda_kernel_activation(const Resource &, Resource &, gemm_activation);
+
+template <reduce_mode op, typename T>
+void cuda_kernel_reduce(const Resource &, Resource &, size_t, size_t, size_t);
+
+// Operands are strided as for cpu_kernel_gemm, but one of the strides of
+// each must be unit; uses cuBLAS, with the epilogue as a separate kernel
+template <typename T>
+void cuda_kernel_gemm_bias(const Resource &, size_t, size_t, const Resource &, size_t, size_t, const Resource *, Resource &, size_t, size_t, size_t, gemm_activation = gemm_identity);
+
+#endif
+
+// Vulkan backend, built with PETAL_VULKAN; buffers are host visible and
+// stay mapped, so that ptr is their host address and slices are offsets
+// into them. Kernels are compute shaders over Float32 only, which record
+// into a single command buffer, shared by all threads, submitted (and
+// waited for on a fence) after each kernel, or once at the end of the
+// outermost VulkanBatch.
+// NOTE: like cuda.cu, source/vulkan.cpp and the shaders were written
+// without a Vulkan SDK at hand; the Vulkan job of the CI workflow compiles
+// them, and runs the device tests on a software implementation
+#ifdef PETAL_VULKAN
+
+// Returns the mapping of a new buffer, kept alive by the owner
+void *vulkan_allocate(size_t, std::shared_ptr <const void> &);
+
+// Copies involving Vulkan resources, through their mappings
+void vulkan_copy(void *, const void *, size_t);
+void vulkan_synchronize();
+
+struct VulkanBatch {
+	VulkanBatch();
+	~VulkanBatch();
+
+	VulkanBatch(const VulkanBatch &) = delete;
+	VulkanBatch &operator=(const VulkanBatch &) = delete;
+};
+
+template <typename T>
+void vulkan_kernel_fill(const Resource &, T);
+
+template <ewop_mode op, typename T>
+void vulkan_kernel_ewop(const Resource &, const Resource &, Resource &);
+
+template <typename T>
+void vulkan_kernel_activation(const Resource &, Resource &, gemm_activation);
+
+template <reduce_mode op, typename T>
+void vulkan_kernel_reduce(const Resource &, Resource &, size_t, size_t, size_t);
+
+template <typename T>
+void vulkan_kernel_gemm_bias(const Resource &, size_t, size_t, const Resource &, size_t, size_t, const Resource *, Resource &, size_t, size_t, size_t, gemm_activation = gemm_identity);
+
+#endif
+
+// Kernels dispatched on the device of their output
+template <ewop_mode op, typename T>
+void kernel_ewop(const Resource &A, const Resource &B, Resource &C)
+{
+	Profiler::flops(C.elements);
+
+#ifdef PETAL_CUDA
+	if (C.device == Resource::eCUDA)
+		return cuda_kernel_ewop <op, T> (A, B, C);
+#endif
+
+#ifdef PETAL_VULKAN
+	if (C.device == Resource::eVulkan)
+		return vulkan_kernel_ewop <op, T> (A, B, C);
+#endif
+
+	cpu_kernel_ewop <op, T> (A, B, C);
+}
+
+template <typename T>
+void kernel_gemm_bias(const Resource &A, size_t rsA, size_t csA, const Resource &B, size_t rsB, size_t csB,
+		const Resource *bias, Resource &C, size_t N, size_t M, size_t K, gemm_activation act = gemm_identity)
+{
+	Profiler::flops(2 * N * M * K);
+
+#ifdef PETAL_CUDA
+	if (C.device == Resource::eCUDA)
+		return cuda_kernel_gemm_bias <T> (A, rsA, csA, B, rsB, csB, bias, C, N, M, K, act);
+#endif
+
+#ifdef PETAL_VULKAN
+	if (C.device == Resource::eVulkan)
+		return vulkan_kernel_gemm_bias <T> (A, rsA, csA, B, rsB, csB, bias, C, N, M, K, act);
+#endif
+
+	cpu_kernel_gemm_bias <T> (A, rsA, csA, B, rsB, csB, bias, C, N, M, K, act);
+}
+
+// Activations on their own, as applied by the GEMM epilogue
+template <typename T>
+void kernel_activation(const Resource &A, Resource &C, gemm_activation act)
+{
+	Profiler::flops(C.elements);
+
+#ifdef PETAL_CUDA
+	if (C.device == Resource::eCUDA)
+		return cuda_kernel_activation <T> (A, C, act);
+#endif
+
+#ifdef PETAL_VULKAN
+	if (C.device == Resource::eVulkan)
+		return vulkan_kernel_activation <T> (A, C, act);
+#endif
+
+	if (act == gemm_relu)
+		cpu_kernel_map <T> (A, C, [](T a) { return (a > 0) ? a : T(0); });
+	else if (act == gemm_sigmoid)
+		cpu_kernel_map <T> (A, C, [](T a) { return fast_sigmoid(a); });
+	else
+		cpu_kernel_map <T> (A, C, [](T a) { return a; });
+}
+
+template <reduce_mode op, typename T>
+void kernel_reduce(const Resource &A, Resource &C, size_t outer, size_t n, size_t inner)
+{
+	Profiler::flops(outer * n * inner);
+
+#ifdef PETAL_CUDA
+	if (C.device == Resource::eCUDA)
+		return cuda_kernel_reduce <op, T> (A, C, outer, n, inner);
+#endif
+
+#ifdef PETAL_VULKAN
+	if (C.device == Resource::eVulkan)
+		return vulkan_kernel_reduce <op, T> (A, C, outer, n, inner);
+#endif
+
+	cpu_kernel_reduce <op, T> (A, C, outer, n, inner);
+}
+
+// Operations without a kernel for a device fall back to the host, through
+// the pointers of their operands; CUDA memory cannot be read that way, so
+// they are refused instead of faulting, and Vulkan mappings are only read
+// once the commands recorded so far (e.g. within a VulkanBatch) are done
+template <typename ... Resources>
+bool host_accessible(const char *const name, const Resources &... resources)
+{
+	if (((resources.device == Resource::eCUDA) || ...)) {
+		fmt::print("{} {} has no CUDA kernel, move its operands to the host first.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "({})", name));
+		return false;
+	}
+
+#ifdef PETAL_VULKAN
+	if (((resources.device == Resource::eVulkan) || ...))
+		vulkan_synchronize();
+#endif
+
+	return true;
+}
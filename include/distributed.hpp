@@ -0,0 +1,143 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "composition.hpp"
+
+// Processes of a data parallel job, connected in a ring over TCP: each rank
+// listens on its own endpoint, connects to that of the next rank and takes
+// the connection of the previous one. Collectives work on host buffers of
+// floating point elements, and every rank must call them in the same order.
+// Ranks may share a host, or even a process as threads, as long as their
+// endpoints differ.
+struct ProcessGroup {
+	size_t rank = 0;
+	size_t size = 1;
+
+	ProcessGroup(const ProcessGroup &) = delete;
+	ProcessGroup &operator=(const ProcessGroup &) = delete;
+	~ProcessGroup();
+
+	// Sums the buffers of all ranks in place: a reduce-scatter then an
+	// all-gather around the ring, so that each rank sends and receives about
+	// twice its buffer whatever the number of ranks
+	bool all_reduce(const Resource &);
+
+	// Copies the buffer of the given rank into those of the others
+	bool broadcast(const Resource &, size_t = 0);
+
+	// Endpoints of all ranks, as host:port, in order of rank; waits until
+	// the neighbours of this rank are up
+	static std::unique_ptr <ProcessGroup> from(size_t, const std::vector <std::string> &);
+private:
+	ProcessGroup() = default;
+
+	// Sockets to the next rank and from the previous one
+	int next = -1;
+	int previous = -1;
+
+	// Sends to the next rank while receiving from the previous one, so that
+	// neither side blocks on a full socket buffer
+	bool exchange(const char *, size_t, char *, size_t);
+};
+
+// Data parallel training of a chain: every rank runs the same model on its
+// own shard of each batch, and the pullback leaves on the tape the gradients
+// averaged over all ranks, e.g.
+//
+//   auto group = ProcessGroup::from(rank, endpoints);
+//   auto ddp = DataParallel::from(model, *group, {}).value();
+//   auto opt = Adam::from({ &ddp.arena.values });
+//
+//   Tape tape = Tape::from(ddp.parameters());
+//   softmax_cross_entropy(ddp(X), Y).backward(tape);
+//   opt.step(ddp.arena.tape());
+//
+// Parameters are packed into an arena, starting from the values of rank 0.
+// Their gradients are reduced in buckets of about bucket_bytes, from the
+// last layer to the first: a bucket is handed to a communication thread as
+// soon as the pullback is through the layers it covers, and is reduced while
+// the pullback goes on through the earlier layers. The averaged gradients
+// end up in the arena as well, so that optimizers can step over it directly.
+struct DataParallel : Function {
+	std::shared_ptr <Chain> model;
+	ProcessGroup *group;
+	ParameterArena arena;
+
+	struct Options {
+		size_t bucket_bytes = 1 << 20;
+	};
+
+	DataParallel(const std::shared_ptr <Chain> &, ProcessGroup &, const ParameterArena &, const Options &);
+	DataParallel(DataParallel &&) = default;
+	~DataParallel();
+
+	std::vector <Tensor *> parameters() override {
+		return model->parameters();
+	}
+
+	bool stateful() const override {
+		return true;
+	}
+
+	Tensor forward_args(const tensor_list &ts) override {
+		return model->call_forward(ts);
+	}
+
+	void release() override {
+		model->release();
+	}
+
+	Tensor infer_args(const tensor_list &ts) const override {
+		return model->call_infer(ts);
+	}
+
+	tensor_list pullback_args(const tensor_list &, const Tensor &, Tape &) const override;
+
+	template <typename ... Args>
+	DynamicDeferred operator()(const Args & ...args) {
+		return DynamicDeferred::from(nop_ptr(this), { args... });
+	}
+
+	// Packs the parameters of the model and broadcasts them from rank 0
+	static std::optional <DataParallel> from(const std::shared_ptr <Chain> &, ProcessGroup &, const Options &);
+private:
+	// Parameters [first, last) of the arena and the span of their gradients
+	struct Bucket {
+		size_t first;
+		size_t last;
+		Resource grads;
+	};
+
+	// Reduces the buckets handed to it, in order, on a thread of its own
+	struct Reducer {
+		ProcessGroup *group;
+
+		std::deque <const Bucket *> queue;
+		size_t reduced = 0;
+		bool failed = false;
+		bool stopping = false;
+
+		std::mutex lock;
+		std::condition_variable changed;
+		std::thread thread;
+
+		void submit(const Bucket *);
+		bool wait(size_t);
+		void work();
+	};
+
+	std::vector <Bucket> buckets;
+	std::vector <size_t> bucket_of;
+	std::unordered_map <long long int, size_t> index;
+	std::unique_ptr <Reducer> reducer;
+
+	// Copies the gradients of the parameters of a layer into the arena, and
+	// submits the buckets this completes
+	void gather(Function &, const Tape &, std::vector <size_t> &, std::vector <bool> &) const;
+};
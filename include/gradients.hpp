@@ -14,17 +14,66 @@ struct Tape : std::unordered_map <long long int, Tensor> {
 	}
 };
 
+// Parameters packed into one contiguous buffer, and their gradients into
+// another with the same layout; the packed tensors are re-pointed at their
+// slices, so that the functions owning them keep working in place, and each
+// operation over all parameters becomes a single sweep
+struct ParameterArena {
+	Tensor values;
+	Tensor grads;
+
+	std::vector <Tensor *> parameters;
+	std::vector <size_t> offsets;
+
+	// Offsets are aligned to this many bytes
+	static constexpr size_t ALIGNMENT = 64;
+
+	// Gradient of the i-th parameter, as a view into the arena
+	Tensor grad(size_t) const;
+
+	// Copies the gradients of the parameters from the tape, zeroing those
+	// that are missing from it
+	void gather(const Tape &);
+
+	void zero_grad();
+
+	// Scales the gradients so that their global norm is at most the given
+	// bound; returns the norm before clipping
+	double clip(double);
+
+	// Tape with the whole arena as a single entry, for the optimizers
+	Tape tape() const;
+
+	// Parameters must share an element type and device
+	static std::optional <ParameterArena> from(const std::vector <Tensor *> &);
+};
+
+// Per parameter states of an optimizer, by tag
+using state_map = std::unordered_map <long long int, Tensor>;
+
 // Optimizers for applying gradients from the tape
 struct Optimizer {
 	std::unordered_map <long long int, Tensor *> destinations;
 	double lr;
 
+	// Number of steps taken
+	size_t iteration = 0;
+
+	// Update all parameters of the same type in one launch, instead of one
+	// launch per parameter
+	bool foreach = true;
+
 	Optimizer(const std::unordered_map <long long int, Tensor *> &dst, double alpha)
 			: destinations(dst), lr(alpha) {}
 
 	~Optimizer();
 
 	virtual void step(const Tape &) = 0;
+
+	// Named state maps, for checkpoints
+	virtual std::vector <std::pair <std::string, state_map *>> states() {
+		return {};
+	}
 };
 
 struct SGD : Optimizer {
@@ -37,11 +86,15 @@ struct SGD : Optimizer {
 struct Momentum : Optimizer {
 	using Optimizer::Optimizer;
 
-	std::unordered_map <long long int, Tensor> velocity;
+	state_map velocity;
 	double momentum;
 
 	static Momentum from(const std::vector <Tensor *> &, double = 0.01f, double = 0.9f);
 	virtual void step(const Tape &) override;
+
+	virtual std::vector <std::pair <std::string, state_map *>> states() override {
+		return { { "velocity", &velocity } };
+	}
 };
 
 struct Adam : Optimizer {
@@ -49,13 +102,15 @@ struct Adam : Optimizer {
 
 	double beta1 = 0.0f;
 	double beta2 = 0.0f;
-	size_t iteration = 0;
 
-	std::unordered_map <long long int, Tensor> M;
-	std::unordered_map <long long int, Tensor> Mh;
-	std::unordered_map <long long int, Tensor> S;
-	std::unordered_map <long long int, Tensor> Sh;
+	// First and second moments
+	state_map M;
+	state_map S;
 
 	static Adam from(const std::vector <Tensor *> &, double = 0.01f, double = 0.9f, double = 0.999f);
 	virtual void step(const Tape &) override;
+
+	virtual std::vector <std::pair <std::string, state_map *>> states() override {
+		return { { "M", &M }, { "S", &S } };
+	}
 };
@@ -1,7 +1,91 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
 #include "resource.hpp"
 
+// Below this many elements, threading costs more than it saves
+constexpr size_t MAP_PARALLEL_THRESHOLD = 1 << 15;
+
+// Branch free exponential, so that loops calling it vectorize; the argument
+// is clamped to the range where the result is a normal number, split as
+// x = k ln2 + r and exp(r) is expanded as a polynomial (within a few ulp)
+template <typename T>
+[[gnu::always_inline]]
+inline T fast_exp(T x)
+{
+	constexpr bool f64 = std::is_same_v <T, double>;
+	using I = std::conditional_t <f64, int64_t, int32_t>;
+
+	constexpr int mantissa = f64 ? 52 : 23;
+	constexpr I bias = f64 ? 1023 : 127;
+	constexpr T lo = f64 ? -708.0 : -87.0f;
+	constexpr T hi = f64 ? 709.0 : 88.0f;
+
+	// Adding the shifter rounds to an integer, which ends up in the low
+	// bits of the mantissa
+	constexpr T shifter = f64 ? 0x1.8p52 : 0x1.8p23f;
+	constexpr T log2e = 1.44269504088896340736;
+	constexpr T ln2_hi = f64 ? 6.93147180369123816490e-01 : 0.693145751953125f;
+	constexpr T ln2_lo = f64 ? 1.90821492927058770002e-10 : 1.428606765330187e-06f;
+
+	// NOTE: std::min and std::max select references, which does not vectorize
+	x = (x < lo) ? lo : x;
+	x = (x > hi) ? hi : x;
+
+	T t = x * log2e + shifter;
+	T k = t - shifter;
+	I ki = std::bit_cast <I> (t) - std::bit_cast <I> (shifter);
+
+	T r = x - k * ln2_hi - k * ln2_lo;
+
+	// Taylor series, in Horner form
+	constexpr int terms = f64 ? 14 : 8;
+	T p = T(1);
+	#pragma GCC unroll 16
+	for (int n = terms - 1; n > 0; n--)
+		p = T(1) + p * r * (T(1) / T(n));
+
+	return p * std::bit_cast <T> ((ki + bias) << mantissa);
+}
+
+template <typename T>
+[[gnu::always_inline]]
+inline T fast_sigmoid(T x)
+{
+	return T(1) / (T(1) + fast_exp(-x));
+}
+
+// Elementwise maps; the functor is inlined into the SIMD loop
+template <typename T, typename F>
+void cpu_kernel_map(const Resource &A, Resource &C, F ftn)
+{
+	const T *a = A.data <T> ();
+	T *c = C.data <T> ();
+	size_t n = A.elements;
+
+	#pragma omp parallel for simd if (n >= MAP_PARALLEL_THRESHOLD)
+	for (size_t i = 0; i < n; i++)
+		c[i] = ftn(a[i]);
+}
+
+template <typename T, typename F>
+void cpu_kernel_map(const Resource &A, const Resource &B, Resource &C, F ftn)
+{
+	const T *a = A.data <T> ();
+	const T *b = B.data <T> ();
+	T *c = C.data <T> ();
+	size_t n = A.elements;
+
+	#pragma omp parallel for simd if (n >= MAP_PARALLEL_THRESHOLD)
+	for (size_t i = 0; i < n; i++)
+		c[i] = ftn(a[i], b[i]);
+}
+
 // Standard kernels
 enum ewop_mode {
 	kadd,
@@ -10,20 +94,205 @@ enum ewop_mode {
 	kdiv
 };
 
-template <ewop_mode op>
+// Kernels are templated on the element type T of their resources, which
+// must already agree; see type_dispatch for selecting T at runtime
+template <ewop_mode op, typename T>
 void cpu_kernel_ewop(const Resource &A, const Resource &B, Resource &C)
 {
-	#pragma omp parallel for
-	for (size_t i = 0; i < A.elements; i++) {
+	cpu_kernel_map <T> (A, B, C, [](T a, T b) {
 		if constexpr (op == kadd)
-			C.ptr[i] = A.ptr[i] + B.ptr[i];
+			return a + b;
 		if constexpr (op == ksub)
-			C.ptr[i] = A.ptr[i] - B.ptr[i];
+			return a - b;
 		if constexpr (op == kmul)
-			C.ptr[i] = A.ptr[i] * B.ptr[i];
+			return a * b;
 		if constexpr (op == kdiv)
-			C.ptr[i] = A.ptr[i] / B.ptr[i];
+			return a / b;
+	});
+}
+
+// Reductions over the middle axis of A, laid out as (outer, n, inner), into
+// C as (outer, inner); accumulation is in double precision, and argmax
+// stores indices in the element type
+enum reduce_mode {
+	ksum,
+	kmean,
+	kmax,
+	kargmax
+};
+
+template <reduce_mode op, typename T>
+void cpu_kernel_reduce(const Resource &, Resource &, size_t, size_t, size_t);
+
+// Optimizer updates, in place; every slot is read and written once, and all
+// slots of a step are spread over a single parallel region
+enum optimizer_mode {
+	ksgd,
+	kmomentum,
+	kadam
+};
+
+struct optimizer_slot {
+	Resource param;
+	Resource grad;
+	Resource first;  // Velocity for momentum, first moment for Adam
+	Resource second; // Second moment for Adam
+};
+
+struct optimizer_step {
+	double lr;
+	double beta1 = 0.0; // Also the momentum
+	double beta2 = 0.0;
+	double epsilon = 0.0;
+	size_t iteration = 1;
+};
+
+template <optimizer_mode op, typename T>
+void cpu_kernel_optimizer(const std::vector <optimizer_slot> &, const optimizer_step &);
+
+// C = op(A) * op(B), where op optionally transposes its (row major) operand
+template <typename T>
+void cpu_kernel_gemm(const Resource &, const Resource &, Resource &, size_t, size_t, size_t, bool = false, bool = false);
+
+// Strided variant; element (i, j) of an operand X is read from X[i * rs + j * cs]
+template <typename T>
+void cpu_kernel_gemm(const Resource &, size_t, size_t, const Resource &, size_t, size_t, Resource &, size_t, size_t, size_t);
+
+// Epilogues, applied to each tile of C as soon as it is complete
+enum gemm_activation {
+	gemm_identity,
+	gemm_relu,
+	gemm_sigmoid
+};
+
+// C = act(A * B + bias), with the bias (of K elements, optional) added to
+// every row of C; operands are strided as above
+template <typename T>
+void cpu_kernel_gemm_bias(const Resource &, size_t, size_t, const Resource &, size_t, size_t, const Resource *, Resource &, size_t, size_t, size_t, gemm_activation = gemm_identity);
+
+// Copying between two strided layouts of the same shape
+template <typename T>
+void cpu_kernel_strided_copy(const Resource &, const std::vector <long int> &, Resource &, const std::vector <long int> &, const std::vector <long int> &);
+
+// Elementwise operation over two strided operands, into a row major output
+// of the given shape; zero strides broadcast an operand along a dimension
+template <ewop_mode op, typename T>
+void cpu_kernel_strided_ewop(const Resource &, const std::vector <long int> &, const Resource &, const std::vector <long int> &, Resource &, const std::vector <long int> &);
+
+// Square windows over a batch of NHWC images, as used by convolutions and
+// pooling; out of range pixels (in the padding) are zero
+struct conv_shape {
+	size_t batch;
+	size_t height;
+	size_t width;
+	size_t channels;
+	size_t kernel;
+	size_t stride = 1;
+	size_t padding = 0;
+
+	size_t out_height() const {
+		return (height + 2 * padding - kernel) / stride + 1;
+	}
+
+	size_t out_width() const {
+		return (width + 2 * padding - kernel) / stride + 1;
+	}
+
+	// Output pixels over the batch, i.e. rows of the patch matrix
+	size_t pixels() const {
+		return batch * out_height() * out_width();
+	}
+
+	// Elements of a single patch, ordered as (row, column, channel)
+	size_t patch() const {
+		return kernel * kernel * channels;
+	}
+};
+
+// Algorithms for the forward convolution; the automatic choice takes
+// Winograd for 3x3 windows of stride one over enough channels, reads the
+// input as the patch matrix for 1x1 windows, and otherwise goes through
+// im2col over blocks of rows
+enum conv_algorithm {
+	conv_auto,
+	conv_im2col,
+	conv_winograd
+};
+
+// Y (pixels x K) = act(patches(X) * W + bias), with W as (patch x K) and the
+// bias optional; Y is thus NHWC as well
+template <typename T>
+void cpu_kernel_conv2d(const Resource &, const Resource &, const Resource *, Resource &, const conv_shape &, size_t, gemm_activation = gemm_identity, conv_algorithm = conv_auto);
+
+// Delta of the input of the above, from the delta D (pixels x K) of its
+// output; also the forward pass of a transposed convolution
+template <typename T>
+void cpu_kernel_conv2d_input(const Resource &, const Resource &, Resource &, const conv_shape &, size_t);
+
+// Delta of the weights (patch x K), from the input X and the delta D
+template <typename T>
+void cpu_kernel_conv2d_weights(const Resource &, const Resource &, Resource &, const conv_shape &, size_t);
+
+// Pooling over the channels of each window, into (pixels x channels);
+// averages only count the pixels within the image
+enum pool_mode {
+	pool_average,
+	pool_max
+};
+
+template <pool_mode op, typename T>
+void cpu_kernel_pool(const Resource &, Resource &, const conv_shape &);
+
+// Delta of the input X of the above, from the delta D of its output; the
+// delta of a maximum goes to the first of its window
+template <pool_mode op, typename T>
+void cpu_kernel_pool_pullback(const Resource &, const Resource &, Resource &, const conv_shape &);
+
+// Fused elementwise programs, in postfix order over a stack of operands;
+// loads push an input, and every other instruction replaces the operands
+// it consumes by its result (a trailing f_sum reduces it to a scalar)
+enum fused_op {
+	f_load,
+	f_add,
+	f_sub,
+	f_mul,
+	f_div,
+	f_addk,
+	f_scalek,
+	f_square,
+	f_sqrt,
+	f_sigmoid,
+	f_relu,
+	f_sum
+};
+
+struct fused_instruction {
+	fused_op op;
+	size_t index = 0; // Input, for loads
+	double k = 0.0;   // Constant, for f_addk and f_scalek
+};
+
+inline size_t fused_arity(fused_op op)
+{
+	switch (op) {
+	case f_load:
+		return 0;
+	case f_add:
+	case f_sub:
+	case f_mul:
+	case f_div:
+		return 2;
+	default:
+		break;
 	}
+
+	return 1;
 }
 
-void cpu_kernel_gemm(const Resource &, const Resource &, Resource &, size_t, size_t, size_t);
+// Largest stack a program may use
+constexpr size_t FUSED_MAX_DEPTH = 8;
+
+// Evaluates a program over inputs of the same number of elements, in a
+// single pass; the output has as many elements (or one, if reducing)
+template <typename T>
+void cpu_kernel_fused(const std::vector <fused_instruction> &, const std::vector <Resource> &, Resource &, size_t);
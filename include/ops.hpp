@@ -1,71 +1,239 @@
+#pragma once
+
+#include <bit>
 #include <limits>
+#include <unordered_map>
 
 #include "autograd.hpp"
 #include "composition.hpp"
+#include "device.hpp"
 #include "tensor.hpp"
 
 // Standard operations
 namespace ops {
 
+// Binary operations require both operands to have the same element type,
+// and to be on the same device
+inline bool matching_types(const char *const name, const Tensor &A, const Tensor &B)
+{
+	if (A.buffer.device != B.buffer.device) {
+		fmt::print("{} {} expected Tensors on the same device, got {} and {} instead.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "({})", name),
+				A.buffer.device, B.buffer.device);
+		return false;
+	}
+
+	if (A.buffer.type == B.buffer.type)
+		return true;
+
+	fmt::print("{} {} expected Tensors of equal type, got {} and {} instead.\n",
+			fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+			fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "({})", name),
+			A.buffer.type, B.buffer.type);
+
+	return false;
+}
+
+// Shape that two operands broadcast to, as in NumPy: trailing dimensions
+// are aligned, and those of size one (or missing) stretch to match
+inline std::optional <Shape> broadcast_shape(const Shape &A, const Shape &B)
+{
+	const Shape &longer = (A.size() >= B.size()) ? A : B;
+	const Shape &shorter = (A.size() >= B.size()) ? B : A;
+
+	Shape out = longer;
+	size_t lead = longer.size() - shorter.size();
+	for (size_t i = 0; i < shorter.size(); i++) {
+		long int n = shorter.at(i);
+		long int &m = out.at(lead + i);
+		if (n != m && n != 1 && m != 1)
+			return std::nullopt;
+
+		m = (m == 1) ? n : m;
+	}
+
+	return out;
+}
+
+// Binary elementwise operation, broadcasting operands of different shapes
+// through zero strides instead of copies
+template <ewop_mode op>
+Tensor broadcast_ewop(const char *const name, const Tensor &A, const Tensor &B)
+{
+	if (!A.shape || !B.shape || !matching_types(name, A, B))
+		return {};
+
+	if (A.shape == B.shape) {
+		Tensor cA = A.contiguous();
+		Tensor cB = B.contiguous();
+		Tensor out = Tensor::blank_like(cA);
+		type_dispatch(A.buffer.type, [&] <typename T> () {
+			kernel_ewop <op, T> (cA.buffer, cB.buffer, out.buffer);
+		});
+
+		return out;
+	}
+
+	auto shape = broadcast_shape(*A.shape, *B.shape);
+	if (!shape) {
+		fmt::print("{} {} cannot broadcast Tensors of shape {} and {} together.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "({})", name),
+				*A.shape, *B.shape);
+		return {};
+	}
+
+	// TODO: strided kernels for devices
+	if (A.buffer.device != Resource::eCPU) {
+		fmt::print("{} {} broadcasting is only supported for host Tensors.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "({})", name));
+		return {};
+	}
+
+	Tensor bA = A.broadcast(*shape);
+	Tensor bB = B.broadcast(*shape);
+	Tensor out = Tensor::blank(*shape, A.buffer.type);
+
+	Profiler::flops(shape->elements());
+	type_dispatch(A.buffer.type, [&] <typename T> () {
+		cpu_kernel_strided_ewop <op, T> (bA.buffer, bA.stride_vector(), bB.buffer, bB.stride_vector(), out.buffer, *shape);
+	});
+
+	return out;
+}
+
+// Delta of an operand that was broadcast to the shape of the delta, summed
+// over the dimensions it was stretched along
+inline Tensor unbroadcast(const Tensor &delta, const Shape &shape)
+{
+	if (delta.shape == shape)
+		return delta;
+
+	Tensor d = delta.contiguous();
+	Shape current = *d.shape;
+
+	auto reduce = [&](size_t outer, size_t n, size_t inner, const Shape &reduced) {
+		Tensor out = Tensor::blank(reduced, d.buffer.type, d.buffer.device);
+		type_dispatch(d.buffer.type, [&] <typename T> () {
+			kernel_reduce <ksum, T> (d.buffer, out.buffer, outer, n, inner);
+		});
+
+		d = out;
+		current = reduced;
+	};
+
+	// Missing leading dimensions at once, then those of size one
+	size_t lead = current.size() - shape.size();
+	if (lead > 0) {
+		Shape rest = std::vector <long int> (current.begin() + lead, current.end());
+		reduce(1, current.elements() / rest.elements(), rest.elements(), rest);
+	}
+
+	for (size_t i = 0; i < shape.size(); i++) {
+		if (shape.at(i) != 1 || current.at(i) == 1)
+			continue;
+
+		size_t outer = 1;
+		for (size_t j = 0; j < i; j++)
+			outer *= current.at(j);
+
+		Shape reduced = current;
+		reduced.at(i) = 1;
+		reduce(outer, current.at(i), reduced.elements() / outer, reduced);
+	}
+
+	return d;
+}
+
+// Sum or product of each element with a constant; devices go through their
+// elementwise kernels, with the constant filled into the other operand
+template <ewop_mode op>
+Tensor constant_ewop(const Tensor &A, double k)
+{
+	static_assert(op == kadd || op == kmul);
+
+	Tensor cA = A.contiguous();
+	Tensor out = Tensor::blank_like(cA);
+	if (cA.buffer.device != Resource::eCPU) {
+		Tensor K = Tensor::blank_like(cA);
+		K.buffer.memset(k);
+		type_dispatch(A.buffer.type, [&] <typename T> () {
+			kernel_ewop <op, T> (K.buffer, cA.buffer, out.buffer);
+		});
+
+		return out;
+	}
+
+	type_dispatch(A.buffer.type, [&] <typename T> () {
+		cpu_kernel_map <T> (cA.buffer, out.buffer, [k = T(k)](T a) {
+			if constexpr (op == kadd)
+				return k + a;
+			else
+				return k * a;
+		});
+	});
+
+	return out;
+}
+
+inline Tensor negate(const Tensor &A)
+{
+	return constant_ewop <kmul> (A, -1.0);
+}
+
 struct _add : Function {
 	using Function::Function;
 
+	std::optional <fused_instruction> fusion() const override {
+		return fused_instruction { f_add };
+	}
+
 	Tensor forward_args(const tensor_list &ts) override {
+		assert_nargs <2> (ts);
+		return broadcast_ewop <kadd> ("_add", ts[0], ts[1]);
+	}
+
+	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
 		assert_nargs <2> (ts);
 		const Tensor &A = ts[0];
 		const Tensor &B = ts[1];
 
-		// TODO: issue warning to logger
-		if (A.shape != B.shape)
-			return {};
+		Tensor outA = unbroadcast(delta, *A.shape);
+		Tensor outB = unbroadcast(delta, *B.shape);
 
-		Tensor out = Tensor::blank_like(A);
-		cpu_kernel_ewop <kadd> (A.buffer, B.buffer, out.buffer);
-		return out;
+		// Storing deltas
+		if (tape.contains(A.tag))
+			tape[A.tag] = outA;
+		if (tape.contains(B.tag))
+			tape[B.tag] = outB;
+
+		return { outA, outB };
 	}
 } static add("add");
 
 struct _sub : Function {
 	using Function::Function;
 
+	std::optional <fused_instruction> fusion() const override {
+		return fused_instruction { f_sub };
+	}
+
 	Tensor forward_args(const tensor_list &ts) override {
 		assert_nargs <2> (ts);
-		const Tensor &A = ts[0];
-		const Tensor &B = ts[1];
-
-		// TODO: issue warning to logger
-		if (A.shape != B.shape) {
-			fmt::print("{} {} expected Tensors of equal shape, got {} and {} instead.\n",
-					fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
-					fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(_sub)"),
-					*A.shape, *B.shape);
-			return {};
-		}
-
-		Tensor out = Tensor::blank_like(A);
-		cpu_kernel_ewop <ksub> (A.buffer, B.buffer, out.buffer);
-		return out;
+		return broadcast_ewop <ksub> ("_sub", ts[0], ts[1]);
 	}
 
-
 	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
 		assert_nargs <2> (ts);
 		const Tensor &A = ts[0];
 		const Tensor &B = ts[1];
 
-		if (A.shape != B.shape)
-			return {};
-
-		Tensor outA = Tensor::blank_like(A);
-		Tensor outB = Tensor::blank_like(B);
-
-		for (size_t i = 0; i < A.shape->elements(); i++) {
-			outA.buffer.ptr[i] = delta.buffer.ptr[i];
-			outB.buffer.ptr[i] = -delta.buffer.ptr[i];
-		}
+		Tensor outA = unbroadcast(delta, *A.shape);
+		Tensor outB = negate(unbroadcast(delta, *B.shape));
 
 		// Storing deltas
-		// TODO: sum deltas or replace?
 		if (tape.contains(A.tag))
 			tape[A.tag] = outA;
 		if (tape.contains(B.tag))
@@ -78,36 +246,62 @@ struct _sub : Function {
 struct _mul : Function {
 	using Function::Function;
 
+	std::optional <fused_instruction> fusion() const override {
+		return fused_instruction { f_mul };
+	}
+
 	Tensor forward_args(const tensor_list &ts) override {
+		assert_nargs <2> (ts);
+		return broadcast_ewop <kmul> ("_mul", ts[0], ts[1]);
+	}
+
+	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
 		assert_nargs <2> (ts);
 		const Tensor &A = ts[0];
 		const Tensor &B = ts[1];
 
-		// TODO: issue warning to logger
-		if (A.shape != B.shape)
-			return {};
+		Tensor outA = unbroadcast(broadcast_ewop <kmul> ("_mul", delta, B), *A.shape);
+		Tensor outB = unbroadcast(broadcast_ewop <kmul> ("_mul", delta, A), *B.shape);
 
-		Tensor out = Tensor::blank_like(A);
-		cpu_kernel_ewop <kmul> (A.buffer, B.buffer, out.buffer);
-		return out;
+		if (tape.contains(A.tag))
+			tape[A.tag] = outA;
+		if (tape.contains(B.tag))
+			tape[B.tag] = outB;
+
+		return { outA, outB };
 	}
 } static mul("mul");
 
 struct _div : Function {
 	using Function::Function;
 
+	std::optional <fused_instruction> fusion() const override {
+		return fused_instruction { f_div };
+	}
+
 	Tensor forward_args(const tensor_list &ts) override {
+		assert_nargs <2> (ts);
+		return broadcast_ewop <kdiv> ("_div", ts[0], ts[1]);
+	}
+
+	// d(A/B) = dA/B - (A/B) dB/B
+	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
 		assert_nargs <2> (ts);
 		const Tensor &A = ts[0];
 		const Tensor &B = ts[1];
 
-		// TODO: issue warning to logger
-		if (A.shape != B.shape)
-			return {};
+		Tensor quotient = broadcast_ewop <kdiv> ("_div", delta, B);
+		Tensor scaled = broadcast_ewop <kdiv> ("_div", broadcast_ewop <kmul> ("_div", quotient, A), B);
 
-		Tensor out = Tensor::blank_like(A);
-		cpu_kernel_ewop <kdiv> (A.buffer, B.buffer, out.buffer);
-		return out;
+		Tensor outA = unbroadcast(quotient, *A.shape);
+		Tensor outB = negate(unbroadcast(scaled, *B.shape));
+
+		if (tape.contains(A.tag))
+			tape[A.tag] = outA;
+		if (tape.contains(B.tag))
+			tape[B.tag] = outB;
+
+		return { outA, outB };
 	}
 } static div("div");
 
@@ -115,15 +309,22 @@ struct _addk : Function {
 	using Function::Function;
 
 	double k;
+
+	std::optional <fused_instruction> fusion() const override {
+		return fused_instruction { f_addk, 0, k };
+	}
+
 	Tensor forward_args(const tensor_list &ts) override {
 		assert_nargs <1> (ts);
-		const Tensor &A = ts[0];
-		Tensor out = Tensor::blank_like(A);
-		for (size_t i = 0; i < A.buffer.elements; i++)
-			out.buffer.ptr[i] = k + A.buffer.ptr[i];
+		return constant_ewop <kadd> (ts[0], k);
+	}
 
-		// TODO: transform kernel
-		return out;
+	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
+		assert_nargs <1> (ts);
+		if (tape.contains(ts[0].tag))
+			tape[ts[0].tag] = delta;
+
+		return { delta };
 	}
 
 	static _addk from(double k) {
@@ -138,23 +339,19 @@ struct _scalek : Function {
 
 	double k;
 
+	std::optional <fused_instruction> fusion() const override {
+		return fused_instruction { f_scalek, 0, k };
+	}
+
 	Tensor forward_args(const tensor_list &ts) override {
 		assert_nargs <1> (ts);
-		const Tensor &A = ts[0];
-		Tensor out = Tensor::blank_like(A);
-		for (size_t i = 0; i < A.buffer.elements; i++)
-			out.buffer.ptr[i] = k * A.buffer.ptr[i];
-
-		// TODO: transform kernel
-		return out;
+		return constant_ewop <kmul> (ts[0], k);
 	}
 
 	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
 		assert_nargs <1> (ts);
 		const Tensor &A = ts[0];
-		Tensor out = Tensor::blank_like(A);
-		for (size_t i = 0; i < A.buffer.elements; i++)
-			out.buffer.ptr[i] = k * delta.buffer.ptr[i];
+		Tensor out = constant_ewop <kmul> (delta, k);
 
 		if (tape.contains(A.tag))
 			tape[A.tag] = out;
@@ -172,18 +369,28 @@ struct _scalek : Function {
 struct _square : Function {
 	using Function::Function;
 
+	std::optional <fused_instruction> fusion() const override {
+		return fused_instruction { f_square };
+	}
+
 	Tensor forward_args(const tensor_list &ts) override {
-		const Tensor &A = ts[0];
+		Tensor A = ts[0].contiguous();
 		Tensor out = Tensor::blank_like(A);
-		cpu_kernel_ewop <kmul> (A.buffer, A.buffer, out.buffer);
+		type_dispatch(A.buffer.type, [&] <typename T> () {
+			kernel_ewop <kmul, T> (A.buffer, A.buffer, out.buffer);
+		});
 		return out;
 	}
 
 	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
-		const Tensor &A = ts[0];
+		Tensor A = ts[0].contiguous();
+		if (!host_accessible(tag.c_str(), A.buffer, delta.buffer))
+			return {};
+
 		Tensor out = Tensor::blank_like(A);
-		for (size_t i = 0; i < A.buffer.elements; i++)
-			out.buffer.ptr[i] = 2 * delta.buffer.ptr[i] * A.buffer.ptr[i];
+		type_dispatch(A.buffer.type, [&] <typename T> () {
+			cpu_kernel_map <T> (A.buffer, delta.buffer, out.buffer, [](T a, T d) { return 2 * d * a; });
+		});
 
 		if (tape.contains(A.tag))
 			tape[A.tag] = out;
@@ -195,77 +402,238 @@ struct _square : Function {
 struct _sqrt : Function {
 	using Function::Function;
 
+	std::optional <fused_instruction> fusion() const override {
+		return fused_instruction { f_sqrt };
+	}
+
 	Tensor forward_args(const tensor_list &ts) override {
-		const Tensor &A = ts[0];
+		Tensor A = ts[0].contiguous();
+		if (!host_accessible(tag.c_str(), A.buffer))
+			return {};
+
 		Tensor out = Tensor::blank_like(A);
-		// TODO: element wise unary kernel
-		for (size_t i = 0; i < A.buffer.elements; i++) {
-			double x = A.buffer.ptr[i];
-			out.buffer.ptr[i] = std::sqrt(x);
-		}
+		type_dispatch(A.buffer.type, [&] <typename T> () {
+			cpu_kernel_map <T> (A.buffer, out.buffer, [](T a) { return std::sqrt(a); });
+		});
 
 		return out;
 	}
 } static sqrt("sqrt");
 
-struct _sum : Function {
+// Reductions over a single dimension, or over every element by default
+struct _reduction : Function {
 	using Function::Function;
 
-	size_t dim = 0;
+	std::optional <long int> dim = std::nullopt;
+
+	// The input seen as (outer, n, inner), with n along the reduced dimension
+	struct layout {
+		size_t outer;
+		size_t n;
+		size_t inner;
+		Shape shape;
+	};
+
+	std::optional <layout> reduction_layout(const Shape &shape) const {
+		if (!dim)
+			return layout { 1, shape.elements(), 1, {} };
+
+		long int d = (*dim < 0) ? *dim + long(shape.size()) : *dim;
+		if (d < 0 || d >= long(shape.size())) {
+			fmt::print("{} {} cannot reduce dimension {} of a Tensor of shape {}.\n",
+					fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+					fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "({})", tag),
+					*dim, shape);
+			return std::nullopt;
+		}
+
+		layout l { 1, size_t(shape.at(d)), 1, {} };
+		for (long int i = 0; i < long(shape.size()); i++) {
+			if (i < d)
+				l.outer *= shape.at(i);
+			if (i > d)
+				l.inner *= shape.at(i);
+			if (i != d)
+				l.shape.push_back(shape.at(i));
+		}
+
+		return l;
+	}
+
+	template <reduce_mode op>
+	Tensor reduce(const Tensor &A) const {
+		auto l = reduction_layout(*A.shape);
+		if (!l)
+			return {};
+
+		Tensor out = Tensor::blank(l->shape, A.buffer.type, A.buffer.device);
+		type_dispatch(A.buffer.type, [&] <typename T> () {
+			kernel_reduce <op, T> (A.buffer, out.buffer, l->outer, l->n, l->inner);
+		});
+
+		return out;
+	}
+
+	// Repeats a delta of the reduced shape along the reduced dimension
+	Tensor expand(const Tensor &delta, const Shape &shape) const {
+		auto l = reduction_layout(shape);
+		long int outer = l->outer;
+		long int n = l->n;
+		long int inner = l->inner;
+		return delta.reshape(outer, 1, inner)
+			.broadcast({ outer, n, inner })
+			.contiguous()
+			.reshape(shape);
+	}
+};
+
+struct _sum : _reduction {
+	using _reduction::_reduction;
+
+	// Only full reductions can end a fused program
+	std::optional <fused_instruction> fusion() const override {
+		if (dim)
+			return std::nullopt;
+
+		return fused_instruction { f_sum };
+	}
 
-	// TODO: dimension
 	Tensor forward_args(const tensor_list &ts) override {
+		assert_nargs <1> (ts);
+		return reduce <ksum> (ts[0].contiguous());
+	}
+
+	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
 		const Tensor &A = ts[0];
-		Tensor out = Tensor::blank({});
-		double sum = 0.0f;
+		Tensor out = expand(delta, *A.shape);
 
-		size_t elements = A.buffer.elements;
-		for (size_t i = 0; i < elements; i++)
-			sum += A.buffer.ptr[i];
+		if (tape.contains(A.tag))
+			tape[A.tag] = out;
 
-		out.buffer.ptr[0] = sum;
-		return out;
+		return { out };
+	}
+
+	static _sum over(long int dim) {
+		_sum s(fmt::format("sum <{}>", dim));
+		s.dim = dim;
+		return s;
+	}
+} static sum("sum");
+
+struct _mean : _reduction {
+	using _reduction::_reduction;
+
+	Tensor forward_args(const tensor_list &ts) override {
+		assert_nargs <1> (ts);
+		return reduce <kmean> (ts[0].contiguous());
 	}
 
 	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
 		const Tensor &A = ts[0];
-		Tensor out = Tensor::blank_like(A);
+		double k = 1.0 / reduction_layout(*A.shape)->n;
+		Tensor out = ops::constant_ewop <kmul> (expand(delta, *A.shape), k);
+
+		if (tape.contains(A.tag))
+			tape[A.tag] = out;
+
+		return { out };
+	}
+
+	static _mean over(long int dim) {
+		_mean s(fmt::format("mean <{}>", dim));
+		s.dim = dim;
+		return s;
+	}
+} static mean("mean");
+
+struct _max : _reduction {
+	using _reduction::_reduction;
 
-		size_t elements = A.buffer.elements;
-		for (size_t i = 0; i < elements; i++)
-			out.buffer.ptr[i] = delta.buffer.ptr[0];
+	Tensor forward_args(const tensor_list &ts) override {
+		assert_nargs <1> (ts);
+		return reduce <kmax> (ts[0].contiguous());
+	}
+
+	// The delta only flows to the (first) maximum of each reduced row
+	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
+		Tensor A = ts[0].contiguous();
+		Tensor indices = reduce <kargmax> (A);
+		if (!host_accessible(tag.c_str(), indices.buffer, delta.buffer))
+			return {};
+
+		Tensor out = Tensor::zeros_like(A);
+
+		auto l = reduction_layout(*A.shape);
+		type_dispatch(A.buffer.type, [&] <typename T> () {
+			const T *index = indices.buffer.data <T> ();
+			const T *d = delta.buffer.data <T> ();
+			T *o = out.buffer.data <T> ();
+			for (size_t i = 0; i < l->outer; i++) {
+				for (size_t k = 0; k < l->inner; k++) {
+					size_t j = index[i * l->inner + k];
+					o[(i * l->n + j) * l->inner + k] = d[i * l->inner + k];
+				}
+			}
+		});
 
 		if (tape.contains(A.tag))
 			tape[A.tag] = out;
 
 		return { out };
 	}
-} static sum("sum");
 
-// TODO: integer returning operations (e.g. argmax, argmin)
+	static _max over(long int dim) {
+		_max s(fmt::format("max <{}>", dim));
+		s.dim = dim;
+		return s;
+	}
+} static max("max");
+
+// Indices are stored in the element type of the input; not differentiable
+struct _argmax : _reduction {
+	using _reduction::_reduction;
+
+	Tensor forward_args(const tensor_list &ts) override {
+		assert_nargs <1> (ts);
+		return reduce <kargmax> (ts[0].contiguous());
+	}
+
+	static _argmax over(long int dim) {
+		_argmax s(fmt::format("argmax <{}>", dim));
+		s.dim = dim;
+		return s;
+	}
+} static argmax("argmax");
+
+// TODO: integer returning operations (e.g. argmin)
 
 // Classic activations
 struct _relu : Function {
 	using Function::Function;
 
+	std::optional <fused_instruction> fusion() const override {
+		return fused_instruction { f_relu };
+	}
+
 	Tensor forward_args(const tensor_list &ts) override {
-		const Tensor &A = ts[0];
+		Tensor A = ts[0].contiguous();
 		Tensor out = Tensor::blank_like(A);
-		for (size_t i = 0; i < A.shape->elements(); i++) {
-			double x = A.buffer.ptr[i];
-			out.buffer.ptr[i] = std::fmax(0, x);
-		}
+		type_dispatch(A.buffer.type, [&] <typename T> () {
+			kernel_activation <T> (A.buffer, out.buffer, gemm_relu);
+		});
 
 		return out;
 	}
 
 	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
-		const Tensor &A = ts[0];
+		Tensor A = ts[0].contiguous();
+		if (!host_accessible(tag.c_str(), A.buffer, delta.buffer))
+			return {};
+
 		Tensor out = Tensor::blank_like(A);
-		for (size_t i = 0; i < A.shape->elements(); i++) {
-			double x = A.buffer.ptr[i];
-			out.buffer.ptr[i] = delta.buffer.ptr[i] * ((x > 0) ? 1 : 0);
-		}
+		type_dispatch(A.buffer.type, [&] <typename T> () {
+			cpu_kernel_map <T> (A.buffer, delta.buffer, out.buffer, [](T a, T d) { return (a > 0) ? d : T(0); });
+		});
 
 		if (tape.contains(A.tag))
 			tape[A.tag] = out;
@@ -277,22 +645,32 @@ struct _relu : Function {
 struct _sigmoid : Function {
 	using Function::Function;
 
+	std::optional <fused_instruction> fusion() const override {
+		return fused_instruction { f_sigmoid };
+	}
+
 	Tensor forward_args(const tensor_list &ts) override {
-		const Tensor &A = ts[0];
+		Tensor A = ts[0].contiguous();
 		Tensor out = Tensor::blank_like(A);
-		for (size_t i = 0; i < A.shape->elements(); i++)
-			out.buffer.ptr[i] = 1/(1 + std::exp(-A.buffer.ptr[i]));
+		type_dispatch(A.buffer.type, [&] <typename T> () {
+			kernel_activation <T> (A.buffer, out.buffer, gemm_sigmoid);
+		});
 
 		return out;
 	}
 
 	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
-		const Tensor &A = ts[0];
+		Tensor A = ts[0].contiguous();
+		if (!host_accessible(tag.c_str(), A.buffer, delta.buffer))
+			return {};
+
 		Tensor out = Tensor::blank_like(A);
-		for (size_t i = 0; i < A.shape->elements(); i++) {
-			double sigmoid = 1/(1 + std::exp(-A.buffer.ptr[i]));
-			out.buffer.ptr[i] = delta.buffer.ptr[i] * sigmoid * (1 - sigmoid);
-		}
+		type_dispatch(A.buffer.type, [&] <typename T> () {
+			cpu_kernel_map <T> (A.buffer, delta.buffer, out.buffer, [](T a, T d) {
+				T sigmoid = fast_sigmoid(a);
+				return d * sigmoid * (1 - sigmoid);
+			});
+		});
 
 		// fmt::print("delta out into softmax: {}\n", delta[0]);
 		// fmt::print("delta in from softmax: {}\n", out[0]);
@@ -310,88 +688,107 @@ struct _softmax : Function {
 
 	size_t dim = 0;
 
+	// Exponentials of each row shifted by its maximum, and their sums
+	static std::pair <Tensor, Tensor> exponentials(const Tensor &A) {
+		size_t last_shape = A.shape.value()[-1];
+		size_t outer_shape = A.shape->elements() / last_shape;
+
+		Tensor E = Tensor::blank_like(A);
+		Tensor max = Tensor::blank({ outer_shape }, A.buffer.type);
+		Tensor sum = Tensor::blank({ outer_shape }, A.buffer.type);
+
+		type_dispatch(A.buffer.type, [&] <typename T> () {
+			cpu_kernel_reduce <kmax, T> (A.buffer, max.buffer, outer_shape, last_shape, 1);
+
+			const T *a = A.buffer.data <T> ();
+			const T *m = max.buffer.data <T> ();
+			T *e = E.buffer.data <T> ();
+			#pragma omp parallel for if (A.buffer.elements >= MAP_PARALLEL_THRESHOLD)
+			for (size_t i = 0; i < outer_shape; i++) {
+				#pragma omp simd
+				for (size_t j = 0; j < last_shape; j++) {
+					size_t index = i * last_shape + j;
+					e[index] = fast_exp(a[index] - m[i]);
+				}
+			}
+
+			cpu_kernel_reduce <ksum, T> (E.buffer, sum.buffer, outer_shape, last_shape, 1);
+		});
+
+		return { E, sum };
+	}
+
 	// TODO: dimension
 	Tensor forward_args(const tensor_list &ts) override {
 		assert_nargs <1> (ts);
-		const Tensor &A = ts[0];
-
-		Tensor out = Tensor::blank_like(A);
+		Tensor A = ts[0].contiguous();
+		if (!host_accessible(tag.c_str(), A.buffer))
+			return {};
 
 		// fmt::print("input to softmax: {}\n", A[0]);
 
+		auto [out, sums] = exponentials(A);
+
 		size_t last_shape = A.shape.value()[-1];
 		size_t outer_shape = A.shape->elements() / last_shape;
-		for (size_t i = 0; i < outer_shape; i++) {
-			// TODO: cache this line
-			double max = -std::numeric_limits <double> ::max();
-			for (size_t j = 0; j < last_shape; j++) {
-				size_t index = i * last_shape + j;
-				max = std::max(max, A.buffer.ptr[index]);
+		type_dispatch(A.buffer.type, [&] <typename T> () {
+			const T *s = sums.buffer.data <T> ();
+			T *o = out.buffer.data <T> ();
+			#pragma omp parallel for if (A.buffer.elements >= MAP_PARALLEL_THRESHOLD)
+			for (size_t i = 0; i < outer_shape; i++) {
+				T inverse = T(1) / s[i];
+				#pragma omp simd
+				for (size_t j = 0; j < last_shape; j++)
+					o[i * last_shape + j] *= inverse;
 			}
-
-			double sum = 0;
-			for (size_t j = 0; j < last_shape; j++) {
-				size_t index = i * last_shape + j;
-				sum += std::exp(A.buffer.ptr[index] - max);
-			}
-
-			for (size_t j = 0; j < last_shape; j++) {
-				size_t index = i * last_shape + j;
-				out.buffer.ptr[index] = std::exp(A.buffer.ptr[index] - max) / sum;
-			}
-		}
+		});
 
 		// fmt::print("softmax output: {}\n", out);
 
 		return out;
 	}
 
-	// TODO: double check this...
+	// The Jacobian of each row is diag(s) - s s^T, so that the delta is
+	// s * (d - <d, s>) for softmax outputs s
 	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
 		assert_nargs <1> (ts);
-		const Tensor &A = ts[0];
+		Tensor A = ts[0].contiguous();
+		if (!host_accessible(tag.c_str(), A.buffer, delta.buffer))
+			return {};
 
-		Tensor out = Tensor::blank_like(A);
 		// fmt::print("input to softmax: {}\n", A[0]);
 		// fmt::print("  > delta to softmax: {}\n", delta);
 
+		auto [E, sums] = exponentials(A);
+		Tensor out = Tensor::blank_like(A);
+
 		size_t last_shape = A.shape.value()[-1];
 		size_t outer_shape = A.shape->elements() / last_shape;
-		for (size_t i = 0; i < outer_shape; i++) {
-			double max = -std::numeric_limits <double> ::max();
-			for (size_t j = 0; j < last_shape; j++) {
-				size_t index = i * last_shape + j;
-				max = std::max(max, A.buffer.ptr[index]);
-			}
-
-			double sum = 0;
-			for (size_t j = 0; j < last_shape; j++) {
-				size_t index = i * last_shape + j;
-				sum += std::exp(A.buffer.ptr[index] - max);
+		type_dispatch(A.buffer.type, [&] <typename T> () {
+			const T *e = E.buffer.data <T> ();
+			const T *s = sums.buffer.data <T> ();
+			const T *d = delta.buffer.data <T> ();
+			T *o = out.buffer.data <T> ();
+			#pragma omp parallel for if (A.buffer.elements >= MAP_PARALLEL_THRESHOLD)
+			for (size_t i = 0; i < outer_shape; i++) {
+				T inverse = T(1) / s[i];
+
+				T dot = 0;
+				#pragma omp simd reduction(+:dot)
+				for (size_t j = 0; j < last_shape; j++) {
+					size_t index = i * last_shape + j;
+					dot += d[index] * e[index];
+				}
+
+				dot *= inverse;
+
+				#pragma omp simd
+				for (size_t j = 0; j < last_shape; j++) {
+					size_t index = i * last_shape + j;
+					o[index] = e[index] * inverse * (d[index] - dot);
+				}
 			}
-
-			// TODO: multiply by the detla...
-			for (size_t j = 0; j < last_shape; j++) {
-				size_t index = i * last_shape + j;
-				double x = std::exp(A.buffer.ptr[index] - max);
-				out.buffer.ptr[index] = delta.buffer.ptr[index] * x * (sum - x)/(sum * sum);
-
-				// double s = x/sum;
-				// out.buffer.ptr[index] = 0.0f;
-				// for (size_t k = 0; k < last_shape; k++) {
-				// 	size_t sub_index = i * last_shape + k;
-				// 	float de = s * (1 - s);
-				// 	if (k != j) {
-				// 		float os = std::exp(A.buffer.ptr[sub_index] - max)/sum;
-				// 		de = - s * os;
-				// 	}
-				//
-				// 	out.buffer.ptr[index] += de;
-				// }
-				//
-				// out.buffer.ptr[index] *= delta.buffer.ptr[index];
-			}
-		}
+		});
 
 		// fmt::print("delta in from softmax: {}\n", out);
 
@@ -402,7 +799,245 @@ struct _softmax : Function {
 	}
 } static softmax("softmax");
 
-}
+// Cross entropy between softmax(X) and targets Y, averaged over the rows;
+// the log-sum-exp of each row is kept from forward, and since the rows of
+// Y are distributions, the pullback into X is just softmax(X) - Y
+struct _softmax_cross_entropy : Function {
+	using Function::Function;
+
+	// Statistics of the logits seen by the latest forward
+	long long int cached_tag = -1;
+	Tensor cached_lse;
+
+	bool stateful() const override {
+		return true;
+	}
+
+	void release() override {
+		cached_tag = -1;
+		cached_lse = Tensor {};
+	}
+
+	static Tensor log_sum_exp(const Tensor &X) {
+		size_t last_shape = X.shape.value()[-1];
+		size_t outer_shape = X.shape->elements() / last_shape;
+
+		Tensor lse = Tensor::blank({ outer_shape }, X.buffer.type);
+		type_dispatch(X.buffer.type, [&] <typename T> () {
+			const T *x = X.buffer.data <T> ();
+			T *l = lse.buffer.data <T> ();
+			#pragma omp parallel for if (X.buffer.elements >= MAP_PARALLEL_THRESHOLD)
+			for (size_t i = 0; i < outer_shape; i++) {
+				const T *row = &x[i * last_shape];
+
+				T max = -std::numeric_limits <T> ::max();
+				#pragma omp simd reduction(max:max)
+				for (size_t j = 0; j < last_shape; j++)
+					max = (row[j] > max) ? row[j] : max;
+
+				T sum = 0;
+				#pragma omp simd reduction(+:sum)
+				for (size_t j = 0; j < last_shape; j++)
+					sum += fast_exp(row[j] - max);
+
+				l[i] = max + std::log(sum);
+			}
+		});
+
+		return lse;
+	}
+
+	Tensor forward_args(const tensor_list &ts) override {
+		assert_nargs <2> (ts);
+		Tensor X = ts[0].contiguous();
+		Tensor Y = ts[1].contiguous();
+
+		if (X.shape != Y.shape || !matching_types("softmax_cross_entropy", X, Y)
+				|| !host_accessible("softmax_cross_entropy", X.buffer))
+			return {};
+
+		cached_tag = X.tag;
+		cached_lse = log_sum_exp(X);
+
+		return loss(X, Y, cached_lse);
+	}
+
+	Tensor infer_args(const tensor_list &ts) const override {
+		assert_nargs <2> (ts);
+		Tensor X = ts[0].contiguous();
+		Tensor Y = ts[1].contiguous();
+
+		if (X.shape != Y.shape || !matching_types("softmax_cross_entropy", X, Y)
+				|| !host_accessible("softmax_cross_entropy", X.buffer))
+			return {};
+
+		return loss(X, Y, log_sum_exp(X));
+	}
+
+	static Tensor loss(const Tensor &X, const Tensor &Y, const Tensor &lse) {
+		size_t last_shape = X.shape.value()[-1];
+		size_t outer_shape = X.shape->elements() / last_shape;
+
+		Tensor out = Tensor::blank({}, X.buffer.type);
+		type_dispatch(X.buffer.type, [&] <typename T> () {
+			const T *x = X.buffer.data <T> ();
+			const T *y = Y.buffer.data <T> ();
+			const T *l = lse.buffer.data <T> ();
+
+			// -sum_j y_j log softmax(x)_j = lse * sum_j y_j - sum_j y_j x_j
+			double total = 0.0;
+			#pragma omp parallel for reduction(+:total) if (X.buffer.elements >= MAP_PARALLEL_THRESHOLD)
+			for (size_t i = 0; i < outer_shape; i++) {
+				T mass = 0;
+				T dot = 0;
+				#pragma omp simd reduction(+:mass, dot)
+				for (size_t j = 0; j < last_shape; j++) {
+					size_t index = i * last_shape + j;
+					mass += y[index];
+					dot += y[index] * x[index];
+				}
+
+				total += double(l[i]) * mass - dot;
+			}
+
+			out.buffer.data <T> ()[0] = total / outer_shape;
+		});
+
+		return out;
+	}
+
+	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
+		assert_nargs <2> (ts);
+		Tensor X = ts[0].contiguous();
+		Tensor Y = ts[1].contiguous();
+		if (!host_accessible("softmax_cross_entropy", X.buffer, Y.buffer, delta.buffer))
+			return {};
+
+		// Only recomputed if the pullback is for other logits
+		Tensor lse = (X.tag == cached_tag) ? cached_lse : log_sum_exp(X);
+
+		Tensor dX = Tensor::blank_like(X);
+		Tensor dY = Tensor::blank_like(Y);
+
+		size_t last_shape = X.shape.value()[-1];
+		size_t outer_shape = X.shape->elements() / last_shape;
+		type_dispatch(X.buffer.type, [&] <typename T> () {
+			const T *x = X.buffer.data <T> ();
+			const T *y = Y.buffer.data <T> ();
+			const T *l = lse.buffer.data <T> ();
+			T *dx = dX.buffer.data <T> ();
+			T *dy = dY.buffer.data <T> ();
+
+			T k = delta.buffer.data <T> ()[0] / T(outer_shape);
+			#pragma omp parallel for if (X.buffer.elements >= MAP_PARALLEL_THRESHOLD)
+			for (size_t i = 0; i < outer_shape; i++) {
+				// Targets need not sum to one; the softmax is scaled by their mass
+				T mass = 0;
+				#pragma omp simd reduction(+:mass)
+				for (size_t j = 0; j < last_shape; j++)
+					mass += y[i * last_shape + j];
+
+				#pragma omp simd
+				for (size_t j = 0; j < last_shape; j++) {
+					size_t index = i * last_shape + j;
+					T shifted = x[index] - l[i];
+					dx[index] = k * (mass * fast_exp(shifted) - y[index]);
+					dy[index] = -k * shifted;
+				}
+			}
+		});
+
+		if (tape.contains(X.tag))
+			tape[X.tag] = dX;
+		if (tape.contains(Y.tag))
+			tape[Y.tag] = dY;
+
+		return { dX, dY };
+	}
+} static softmax_cross_entropy("softmax_cross_entropy");
+
+// Matrix multiplication of 2D tensors, either of which may be a strided view
+inline void gemm(const Tensor &A, const Tensor &B, Tensor &C)
+{
+	std::vector <long int> sA = A.stride_vector();
+	std::vector <long int> sB = B.stride_vector();
+	type_dispatch(C.buffer.type, [&] <typename T> () {
+		kernel_gemm_bias <T>
+		(
+			A.buffer, sA[0], sA[1],
+			B.buffer, sB[0], sB[1],
+			nullptr, C.buffer,
+			A.shape->at(0), A.shape->at(1), B.shape->at(1)
+		);
+	});
+}
+
+// Delta before an activation of the GEMM epilogue, from its output Y
+inline Tensor activation_delta(gemm_activation activation, const Tensor &Y, const Tensor &D)
+{
+	if (!host_accessible("activation", Y.buffer, D.buffer))
+		return {};
+
+	Tensor DY = Tensor::blank_like(D);
+	type_dispatch(D.buffer.type, [&] <typename T> () {
+		if (activation == gemm_relu)
+			cpu_kernel_map <T> (Y.buffer, D.buffer, DY.buffer, [](T y, T d) { return (y > 0) ? d : T(0); });
+		else
+			cpu_kernel_map <T> (Y.buffer, D.buffer, DY.buffer, [](T y, T d) { return d * y * (1 - y); });
+	});
+
+	return DY;
+}
+
+// Windows of a convolution or pooling over a batch of NHWC images on the
+// host; any number of channels is accepted if none are given
+inline std::optional <conv_shape> window_shape(const char *const name, const Tensor &A, size_t channels, size_t kernel, size_t stride, size_t padding)
+{
+	auto fail = [&](const std::string &reason) -> std::optional <conv_shape> {
+		fmt::print("{} {} {}.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "({})", name),
+				reason);
+		return std::nullopt;
+	};
+
+	if (A.buffer.device != Resource::eCPU)
+		return fail("windows are only computed on the host");
+	if (!A.shape || A.shape->size() != 4)
+		return fail("expected a batch of NHWC images");
+
+	const Shape &shape = *A.shape;
+	if (channels && size_t(shape[3]) != channels)
+		return fail(fmt::format("expected {} channels, got {} instead", channels, shape[3]));
+	if (size_t(shape[1]) + 2 * padding < kernel || size_t(shape[2]) + 2 * padding < kernel)
+		return fail(fmt::format("images of {}x{} are smaller than the window", shape[1], shape[2]));
+
+	return conv_shape {
+		size_t(shape[0]), size_t(shape[1]), size_t(shape[2]), size_t(shape[3]),
+		kernel, stride, padding
+	};
+}
+
+// Batches of images into rows, e.g. between convolutions and Linear layers
+struct _flatten : Function {
+	using Function::Function;
+
+	Tensor forward_args(const tensor_list &ts) override {
+		const Tensor &A = ts[0];
+		return A.reshape(A.shape->at(0), -1);
+	}
+
+	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
+		const Tensor &A = ts[0];
+		Tensor out = delta.reshape(*A.shape);
+		if (tape.contains(A.tag))
+			tape[A.tag] = out;
+
+		return { out };
+	}
+} static flatten("flatten");
+
+}
 
 // TODO: ml namespace
 
@@ -413,107 +1048,527 @@ struct Linear : Function {
 	size_t in;
 	size_t out;
 	bool bias;
-	Tensor W; // Combines weight and bias into a single matrix
+	Tensor W; // Combines weight and bias into a single matrix, bias last
+
+	// Applied in the epilogue of the GEMM
+	gemm_activation activation = gemm_identity;
+
+	// Output of the latest forward, for the activation pullback
+	long long int cached_tag = -1;
+	Tensor cached_out;
 
 	std::vector <Tensor *> parameters() override {
 		return { &W };
 	}
 
-	Tensor forward_args(const tensor_list &ts) override {
-		const Tensor &A = ts[0];
-		// fmt::print("input to linear: {}\n", A);
-		Tensor X = A.reshape(-1, in);
-		Shape pad_shape = *X.shape;
-		pad_shape[-1] = 1;
+	bool stateful() const override {
+		return true;
+	}
 
-		Tensor padding = Tensor::ones(pad_shape);
-		Tensor gemm_in = Tensor::concat(X, padding, 1);
+	void release() override {
+		cached_tag = -1;
+		cached_out = Tensor {};
+	}
+
+	// Views into W
+	Tensor weights() const {
+		return W.slice(0, in);
+	}
+
+	Tensor biases() const {
+		return bias ? W.slice(in, in + 1) : Tensor {};
+	}
+
+	// act(X * weights + biases), without materializing the bias column
+	Tensor affine(const Tensor &A) const {
+		Tensor X = A.reshape(-1, in);
 
 		Shape out_shape = *A.shape;
 		out_shape[-1] = out;
 
-		Tensor gemm_out = Tensor::blank(out_shape);
+		Tensor gemm_out = Tensor::blank(out_shape, W.buffer.type, W.buffer.device);
 
-		cpu_kernel_gemm
-		(
-			 gemm_in.buffer, W.buffer, gemm_out.buffer,
-			 gemm_in.shape.value()[0],
-			 gemm_in.shape.value()[1],
-			 W.shape.value()[1]
-		);
+		Tensor B = weights();
+		std::vector <long int> sX = X.stride_vector();
+		std::vector <long int> sB = B.stride_vector();
+
+		std::optional <Resource> b;
+		if (bias)
+			b = biases().buffer;
+
+		type_dispatch(W.buffer.type, [&] <typename T> () {
+			kernel_gemm_bias <T>
+			(
+				X.buffer, sX[0], sX[1],
+				B.buffer, sB[0], sB[1],
+				b ? &*b : nullptr,
+				gemm_out.buffer,
+				X.shape.value()[0], in, out,
+				activation
+			);
+		});
 
 		return gemm_out;
 	}
 
+	Tensor forward_args(const tensor_list &ts) override {
+		const Tensor &A = ts[0];
+		if (!ops::matching_types("Linear", A, W))
+			return {};
+
+		Tensor Y = affine(A);
+		if (activation != gemm_identity) {
+			cached_tag = A.tag;
+			cached_out = Y;
+		}
+
+		return Y;
+	}
+
+	Tensor infer_args(const tensor_list &ts) const override {
+		const Tensor &A = ts[0];
+		if (!ops::matching_types("Linear", A, W))
+			return {};
+
+		return affine(A);
+	}
+
 	// TODO: also need original inputs always
 	// TODO: need a different structure for this...
 	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
 		const Tensor &A = ts[0];
 
-		// TODO: skip the transpose
-		Tensor Wt = W.transpose();
-		Tensor X = delta.reshape(-1, out);
-		// TODO: different depending on the presence of the bias
-		Shape int_shape = *delta.shape;
-		int_shape[-1] = in + 1;
+		// Through the activation first, using its output
+		Tensor D = delta.reshape(-1, out);
+		if (activation != gemm_identity && W.buffer.device != Resource::eCPU) {
+			fmt::print("{} {} fused activations are only differentiated on the host.\n",
+					fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+					fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(Linear)"));
+			return {};
+		}
 
-		Tensor gemm_int = Tensor::blank(int_shape);
+		if (activation != gemm_identity) {
+			Tensor Y = (A.tag == cached_tag) ? cached_out : affine(A);
+			D = ops::activation_delta(activation, Y, D);
+		}
 
-		cpu_kernel_gemm
-		(
-			 X.buffer, Wt.buffer, gemm_int.buffer,
-			 X.shape.value()[0],
-			 X.shape.value()[1],
-			 Wt.shape.value()[1]
-		);
+		Shape int_shape = *delta.shape;
+		int_shape[-1] = in;
 
-		auto slice = gemm_int.slice(0, int_shape[-1] - 1, int_shape.size() - 1);
-		// fmt::print("delta out into linear: {}\n", delta[0]);
-		// fmt::print("delta in from linear: {}\n", slice[0]);
+		Tensor gemm_int = Tensor::blank(int_shape, W.buffer.type, W.buffer.device);
+
+		// The bias row does not contribute to the input delta, and neither
+		// view copies anything
+		ops::gemm(D, weights().transpose(), gemm_int);
 
 		if (tape.contains(A.tag))
-			tape[A.tag] = slice;
+			tape[A.tag] = gemm_int;
 
 		if (tape.contains(W.tag)) {
-			// TODO: outer product kernel
-			Tensor XA = A.reshape(-1, in);
-			Shape pad_shape = *XA.shape;
-			pad_shape[-1] = 1;
-
-			Tensor padding = Tensor::ones(pad_shape);
-			XA = Tensor::concat(XA, padding, 1);
-			XA = XA.transpose();
-
-			Tensor XD = delta.reshape(-1, out);
-
-			Tensor dW = Tensor::blank({ in + 1, out });
-
-			// TODO: weakly_optional shape
-			cpu_kernel_gemm
-			(
-				 XA.buffer, XD.buffer, dW.buffer,
-				 in + 1, XA.shape.value()[1], out
-			);
+			Tensor X = A.reshape(-1, in);
+			size_t rows = X.shape.value()[0];
+
+			// Weight rows are X^T * D, and the bias row is the sum of the
+			// rows of D; both are written into their place in dW
+			Tensor dW = Tensor::blank(*W.shape, W.buffer.type, W.buffer.device);
+			Tensor dWeights = dW.slice(0, in);
+			ops::gemm(X.transpose(), D, dWeights);
+
+			// Devices have no reduction kernels; the sum is a product with ones
+			if (bias && W.buffer.device != Resource::eCPU) {
+				Tensor dBias = dW.slice(in, in + 1);
+				ops::gemm(Tensor::ones({ 1ul, rows }, W.buffer.type, W.buffer.device), D, dBias);
+			} else if (bias) {
+				Resource dBias = *dW.buffer.slice(in * out, (in + 1) * out);
+				type_dispatch(W.buffer.type, [&] <typename T> () {
+					cpu_kernel_reduce <ksum, T> (D.buffer, dBias, 1, rows, out);
+				});
+			}
 
 			tape[W.tag] = dW;
 		}
 
-		return { slice };
+		return { gemm_int };
 	}
 
 	// Construction
-	static Linear from(size_t in, size_t out, bool bias = true) {
+	static Linear from(size_t in, size_t out, bool bias = true, Resource::Type type = Resource::Type::f32, gemm_activation activation = gemm_identity) {
 		// NOTE: The weight-bias matrix is in transposed form
 		Linear dense(fmt::format("linear ({}x{}:{})", in, out, bias ? "bias" : "no bias"));
 		dense.in = in;
 		dense.out = out;
 		dense.bias = bias;
+		dense.activation = activation;
 		// dense.W = Tensor::randn({ in + bias, out });
-		dense.W = Tensor::xavier(in + bias, out);
+		dense.W = Tensor::xavier(in + bias, out, type);
 		return dense;
 	}
 };
 
+// Convolutions over batches of NHWC images, with square windows; as for
+// Linear, the weights are a single matrix whose rows are the elements of a
+// patch (by row, column and channel) with the bias last, e.g.
+//
+//   Chain model = Conv2D::from(3, 16, 3, { .padding = 1, .activation = gemm_relu })
+//		>> Pool2D::from(pool_max, 2, { .stride = 2 })
+//		>> ops::flatten
+//		>> Linear::from(16 * 16 * 16, 10);
+//
+// Convolutions are host only
+struct Conv2D : Function {
+	using Function::Function;
+
+	size_t in;
+	size_t out;
+	size_t kernel;
+	size_t stride;
+	size_t padding;
+	bool bias;
+	Tensor W;
+
+	// Applied in the epilogue, as for Linear
+	gemm_activation activation = gemm_identity;
+	conv_algorithm algorithm = conv_auto;
+
+	// Output of the latest forward, for the activation pullback
+	long long int cached_tag = -1;
+	Tensor cached_out;
+
+	struct Options {
+		size_t stride = 1;
+		size_t padding = 0;
+		bool bias = true;
+		gemm_activation activation = gemm_identity;
+		Resource::Type type = Resource::f32;
+	};
+
+	std::vector <Tensor *> parameters() override {
+		return { &W };
+	}
+
+	bool stateful() const override {
+		return true;
+	}
+
+	void release() override {
+		cached_tag = -1;
+		cached_out = Tensor {};
+	}
+
+	// Views into W
+	Tensor weights() const {
+		return W.slice(0, kernel * kernel * in);
+	}
+
+	Tensor biases() const {
+		size_t patch = kernel * kernel * in;
+		return bias ? W.slice(patch, patch + 1) : Tensor {};
+	}
+
+	Tensor convolve(const Tensor &A) const {
+		auto s = ops::window_shape("Conv2D", A, in, kernel, stride, padding);
+		if (!s)
+			return {};
+
+		Tensor X = A.contiguous();
+		Tensor Y = Tensor::blank(Shape { s->batch, s->out_height(), s->out_width(), out }, W.buffer.type);
+
+		std::optional <Resource> b;
+		if (bias)
+			b = biases().buffer;
+
+		Profiler::flops(2 * s->pixels() * s->patch() * out);
+		type_dispatch(W.buffer.type, [&] <typename T> () {
+			cpu_kernel_conv2d <T> (X.buffer, W.buffer, b ? &*b : nullptr, Y.buffer, *s, out, activation, algorithm);
+		});
+
+		return Y;
+	}
+
+	Tensor forward_args(const tensor_list &ts) override {
+		const Tensor &A = ts[0];
+		if (!ops::matching_types("Conv2D", A, W))
+			return {};
+
+		Tensor Y = convolve(A);
+		if (Y.shape && activation != gemm_identity) {
+			cached_tag = A.tag;
+			cached_out = Y;
+		}
+
+		return Y;
+	}
+
+	Tensor infer_args(const tensor_list &ts) const override {
+		const Tensor &A = ts[0];
+		if (!ops::matching_types("Conv2D", A, W))
+			return {};
+
+		return convolve(A);
+	}
+
+	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
+		const Tensor &A = ts[0];
+		auto s = ops::window_shape("Conv2D", A, in, kernel, stride, padding);
+		if (!s)
+			return {};
+
+		Tensor X = A.contiguous();
+		Tensor D = delta.contiguous();
+		if (activation != gemm_identity) {
+			Tensor Y = (A.tag == cached_tag) ? cached_out : convolve(A);
+			D = ops::activation_delta(activation, Y, D);
+		}
+
+		Profiler::flops(4 * s->pixels() * s->patch() * out);
+
+		Tensor dX = Tensor::blank_like(X);
+		type_dispatch(W.buffer.type, [&] <typename T> () {
+			cpu_kernel_conv2d_input <T> (D.buffer, W.buffer, dX.buffer, *s, out);
+		});
+
+		if (tape.contains(A.tag))
+			tape[A.tag] = dX;
+
+		if (tape.contains(W.tag)) {
+			// Weight rows from the patches, and the bias row is the sum of
+			// the deltas over all pixels
+			Tensor dW = Tensor::blank(*W.shape, W.buffer.type);
+			type_dispatch(W.buffer.type, [&] <typename T> () {
+				cpu_kernel_conv2d_weights <T> (X.buffer, D.buffer, dW.buffer, *s, out);
+				if (bias) {
+					Resource dBias = *dW.buffer.slice(s->patch() * out);
+					cpu_kernel_reduce <ksum, T> (D.buffer, dBias, 1, s->pixels(), out);
+				}
+			});
+
+			tape[W.tag] = dW;
+		}
+
+		return { dX };
+	}
+
+	static Conv2D from(size_t in, size_t out, size_t kernel, const Options &options) {
+		Conv2D conv(fmt::format("conv2d ({}x{}:{}x{})", in, out, kernel, kernel));
+		conv.in = in;
+		conv.out = out;
+		conv.kernel = kernel;
+		conv.stride = options.stride;
+		conv.padding = options.padding;
+		conv.bias = options.bias;
+		conv.activation = options.activation;
+		conv.W = Tensor::xavier(kernel * kernel * in + options.bias, out, options.type);
+		return conv;
+	}
+};
+
+// Transposed convolutions, the adjoint of a Conv2D from out to in channels
+// with the same window, e.g. for upsampling by the stride; the images grow
+// from h to (h - 1) * stride - 2 * padding + kernel pixels a side. The
+// weights are those of the adjoint convolution, and the bias is apart
+struct ConvTranspose2D : Function {
+	using Function::Function;
+
+	size_t in;
+	size_t out;
+	size_t kernel;
+	size_t stride;
+	size_t padding;
+	bool bias;
+
+	Tensor W; // (kernel * kernel * out) x in
+	Tensor B; // out, if biased
+
+	struct Options {
+		size_t stride = 1;
+		size_t padding = 0;
+		bool bias = true;
+		Resource::Type type = Resource::f32;
+	};
+
+	std::vector <Tensor *> parameters() override {
+		if (bias)
+			return { &W, &B };
+
+		return { &W };
+	}
+
+	// Windows of the adjoint convolution, over the output
+	std::optional <conv_shape> geometry(const Tensor &A) const {
+		if (!ops::window_shape("ConvTranspose2D", A, in, 1, 1, 0))
+			return std::nullopt;
+
+		const Shape &shape = *A.shape;
+		long int height = (shape[1] - 1) * long(stride) - 2 * long(padding) + long(kernel);
+		long int width = (shape[2] - 1) * long(stride) - 2 * long(padding) + long(kernel);
+		if (height <= 0 || width <= 0) {
+			fmt::print("{} {} padding leaves no output for images of {}x{}.\n",
+					fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+					fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(ConvTranspose2D)"),
+					shape[1], shape[2]);
+			return std::nullopt;
+		}
+
+		return conv_shape { size_t(shape[0]), size_t(height), size_t(width), out, kernel, stride, padding };
+	}
+
+	Tensor forward_args(const tensor_list &ts) override {
+		const Tensor &A = ts[0];
+		if (!ops::matching_types("ConvTranspose2D", A, W))
+			return {};
+
+		auto s = geometry(A);
+		if (!s)
+			return {};
+
+		Tensor X = A.contiguous();
+		Tensor Y = Tensor::blank(Shape { s->batch, s->height, s->width, out }, W.buffer.type);
+
+		Profiler::flops(2 * s->pixels() * s->patch() * in);
+		type_dispatch(W.buffer.type, [&] <typename T> () {
+			cpu_kernel_conv2d_input <T> (X.buffer, W.buffer, Y.buffer, *s, in);
+			if (!bias)
+				return;
+
+			T *y = Y.buffer.data <T> ();
+			const T *b = B.buffer.data <T> ();
+			size_t pixels = Y.buffer.elements / out;
+
+			#pragma omp parallel for if (Y.buffer.elements >= MAP_PARALLEL_THRESHOLD)
+			for (size_t i = 0; i < pixels; i++) {
+				#pragma omp simd
+				for (size_t c = 0; c < out; c++)
+					y[i * out + c] += b[c];
+			}
+		});
+
+		return Y;
+	}
+
+	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
+		const Tensor &A = ts[0];
+		auto s = geometry(A);
+		if (!s)
+			return {};
+
+		Tensor X = A.contiguous();
+		Tensor D = delta.contiguous();
+
+		Profiler::flops(4 * s->pixels() * s->patch() * in);
+
+		// The delta of the input is the adjoint convolution of the delta
+		Tensor dX = Tensor::blank_like(X);
+		type_dispatch(W.buffer.type, [&] <typename T> () {
+			cpu_kernel_conv2d <T> (D.buffer, W.buffer, nullptr, dX.buffer, *s, in);
+		});
+
+		if (tape.contains(A.tag))
+			tape[A.tag] = dX;
+
+		if (tape.contains(W.tag)) {
+			Tensor dW = Tensor::blank(*W.shape, W.buffer.type);
+			type_dispatch(W.buffer.type, [&] <typename T> () {
+				cpu_kernel_conv2d_weights <T> (D.buffer, X.buffer, dW.buffer, *s, in);
+			});
+
+			tape[W.tag] = dW;
+		}
+
+		if (bias && tape.contains(B.tag)) {
+			Tensor dB = Tensor::blank(*B.shape, B.buffer.type);
+			type_dispatch(B.buffer.type, [&] <typename T> () {
+				cpu_kernel_reduce <ksum, T> (D.buffer, dB.buffer, 1, D.buffer.elements / out, out);
+			});
+
+			tape[B.tag] = dB;
+		}
+
+		return { dX };
+	}
+
+	static ConvTranspose2D from(size_t in, size_t out, size_t kernel, const Options &options) {
+		ConvTranspose2D conv(fmt::format("conv_transpose2d ({}x{}:{}x{})", in, out, kernel, kernel));
+		conv.in = in;
+		conv.out = out;
+		conv.kernel = kernel;
+		conv.stride = options.stride;
+		conv.padding = options.padding;
+		conv.bias = options.bias;
+		conv.W = Tensor::xavier(kernel * kernel * out, in, options.type);
+		if (options.bias)
+			conv.B = Tensor::zeros({ out }, options.type);
+		return conv;
+	}
+};
+
+// Average or maximum over square windows of NHWC images, for each channel
+struct Pool2D : Function {
+	using Function::Function;
+
+	pool_mode mode;
+	size_t kernel;
+	size_t stride;
+	size_t padding;
+
+	struct Options {
+		size_t stride = 1;
+		size_t padding = 0;
+	};
+
+	Tensor forward_args(const tensor_list &ts) override {
+		const Tensor &A = ts[0];
+		auto s = ops::window_shape("Pool2D", A, 0, kernel, stride, padding);
+		if (!s)
+			return {};
+
+		Tensor X = A.contiguous();
+		Tensor Y = Tensor::blank(Shape { s->batch, s->out_height(), s->out_width(), s->channels }, X.buffer.type);
+
+		Profiler::flops(s->pixels() * s->patch());
+		type_dispatch(X.buffer.type, [&] <typename T> () {
+			if (mode == pool_max)
+				cpu_kernel_pool <pool_max, T> (X.buffer, Y.buffer, *s);
+			else
+				cpu_kernel_pool <pool_average, T> (X.buffer, Y.buffer, *s);
+		});
+
+		return Y;
+	}
+
+	tensor_list pullback_args(const tensor_list &ts, const Tensor &delta, Tape &tape) const override {
+		const Tensor &A = ts[0];
+		auto s = ops::window_shape("Pool2D", A, 0, kernel, stride, padding);
+		if (!s)
+			return {};
+
+		Tensor X = A.contiguous();
+		Tensor D = delta.contiguous();
+		Tensor dX = Tensor::blank_like(X);
+
+		Profiler::flops(s->pixels() * s->patch());
+		type_dispatch(X.buffer.type, [&] <typename T> () {
+			if (mode == pool_max)
+				cpu_kernel_pool_pullback <pool_max, T> (X.buffer, D.buffer, dX.buffer, *s);
+			else
+				cpu_kernel_pool_pullback <pool_average, T> (X.buffer, D.buffer, dX.buffer, *s);
+		});
+
+		if (tape.contains(A.tag))
+			tape[A.tag] = dX;
+
+		return { dX };
+	}
+
+	static Pool2D from(pool_mode mode, size_t kernel, const Options &options) {
+		Pool2D pool(fmt::format("{}_pool2d ({}x{})", (mode == pool_max) ? "max" : "average", kernel, kernel));
+		pool.mode = mode;
+		pool.kernel = kernel;
+		pool.stride = options.stride;
+		pool.padding = options.padding;
+		return pool;
+	}
+};
+
 // Soft requirements for lazy arguments
 template <typename T>
 concept autograd_friendly = std::is_same_v <Tensor, T>
@@ -524,20 +1579,53 @@ concept autograd_friendly = std::is_same_v <Tensor, T>
 // Exporting these functions as lazy evaluations
 template <typename ... Args>
 DynamicDeferred sum(const Args & ...args) {
-	std::initializer_list <std::variant <Tensor, DynamicDeferred>> ts { args... };
-	return DynamicDeferred::from(nop_ptr(&ops::sum), ts);
+	return DynamicDeferred::from(nop_ptr(&ops::sum), { args... });
+}
+
+template <typename T, std::integral I>
+requires autograd_friendly <T>
+DynamicDeferred sum(const T &X, I dim) {
+	return DynamicDeferred::from(value_ptr(ops::_sum::over(dim)), { X });
+}
+
+template <typename T>
+requires autograd_friendly <T>
+DynamicDeferred mean(const T &X) {
+	return DynamicDeferred::from(nop_ptr(&ops::mean), { X });
+}
+
+template <typename T, std::integral I>
+requires autograd_friendly <T>
+DynamicDeferred mean(const T &X, I dim) {
+	return DynamicDeferred::from(value_ptr(ops::_mean::over(dim)), { X });
+}
+
+template <typename T>
+requires autograd_friendly <T>
+DynamicDeferred max(const T &X) {
+	return DynamicDeferred::from(nop_ptr(&ops::max), { X });
+}
+
+template <typename T, std::integral I>
+requires autograd_friendly <T>
+DynamicDeferred max(const T &X, I dim) {
+	return DynamicDeferred::from(value_ptr(ops::_max::over(dim)), { X });
+}
+
+template <typename T, std::integral I>
+requires autograd_friendly <T>
+DynamicDeferred argmax(const T &X, I dim) {
+	return DynamicDeferred::from(value_ptr(ops::_argmax::over(dim)), { X });
 }
 
 template <typename ... Args>
 DynamicDeferred square(const Args & ...args) {
-	std::initializer_list <std::variant <Tensor, DynamicDeferred>> ts { args... };
-	return DynamicDeferred::from(nop_ptr(&ops::square), ts);
+	return DynamicDeferred::from(nop_ptr(&ops::square), { args... });
 }
 
 template <typename ... Args>
 DynamicDeferred sqrt(const Args & ...args) {
-	std::initializer_list <std::variant <Tensor, DynamicDeferred>> ts { args... };
-	return DynamicDeferred::from(nop_ptr(&ops::sqrt), ts);
+	return DynamicDeferred::from(nop_ptr(&ops::sqrt), { args... });
 }
 
 // Activations
@@ -559,47 +1647,72 @@ DynamicDeferred softmax(const T &X) {
 	return DynamicDeferred::from(nop_ptr(&ops::softmax), { X });
 }
 
+// Each node keeps its own copy, since the function caches statistics
+template <typename T, typename U>
+requires autograd_friendly <T> && autograd_friendly <U>
+DynamicDeferred softmax_cross_entropy(const T &X, const U &Y) {
+	return DynamicDeferred::from(value_ptr(ops::softmax_cross_entropy), { X, Y });
+}
+
+// Functions of a constant are shared by the expressions of a thread that
+// use the same constant, so that building an expression neither allocates
+// a function nor formats its tag every time; they keep no state, so that
+// sharing them is safe
+template <typename F>
+std::shared_ptr <Function> interned(double k)
+{
+	thread_local std::unordered_map <uint64_t, std::shared_ptr <Function>> cache;
+	if (cache.size() >= 256)
+		cache.clear();
+
+	std::shared_ptr <Function> &ftn = cache[std::bit_cast <uint64_t> (k)];
+	if (!ftn)
+		ftn = std::make_shared <F> (F::from(k));
+
+	return ftn;
+}
+
 // Operators
 template <typename A>
 requires autograd_friendly <A>
 DynamicDeferred operator+(double k, const A &X)
 {
-	return DynamicDeferred::from(value_ptr(ops::_addk::from(k)), { X });
+	return DynamicDeferred::from(interned <ops::_addk> (k), { X });
 }
 
 template <typename A>
 requires autograd_friendly <A>
 DynamicDeferred operator+(const A &X, double k)
 {
-	return DynamicDeferred::from(value_ptr(ops::_addk::from(k)), { X });
+	return DynamicDeferred::from(interned <ops::_addk> (k), { X });
 }
 
 template <typename A>
 requires autograd_friendly <A>
 DynamicDeferred operator-(double k, const A &X)
 {
-	return DynamicDeferred::from(value_ptr(ops::_addk::from(-k)), { X });
+	return DynamicDeferred::from(interned <ops::_addk> (-k), { X });
 }
 
 template <typename A>
 requires autograd_friendly <A>
 DynamicDeferred operator-(const A &X, double k)
 {
-	return DynamicDeferred::from(value_ptr(ops::_addk::from(-k)), { X });
+	return DynamicDeferred::from(interned <ops::_addk> (-k), { X });
 }
 
 template <typename A>
 requires autograd_friendly <A>
 DynamicDeferred operator*(double k, const A &X)
 {
-	return DynamicDeferred::from(value_ptr(ops::_scalek::from(k)), { X });
+	return DynamicDeferred::from(interned <ops::_scalek> (k), { X });
 }
 
 template <typename A>
 requires autograd_friendly <A>
 DynamicDeferred operator/(const A &X, double k)
 {
-	return DynamicDeferred::from(value_ptr(ops::_scalek::from(1.0f/k)), { X });
+	return DynamicDeferred::from(interned <ops::_scalek> (1.0f/k), { X });
 }
 
 // Binary operators
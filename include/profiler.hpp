@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Profiling of Function calls, per tag and phase: call counts, wall time,
+// FLOPs reported by the kernels, and bytes allocated along with the peak
+// of live host memory. Calls nest (e.g. the layers of a Chain within the
+// Chain), and are recorded as events of each thread, which are exported
+// as a Chrome trace or summarized in a table. The hooks are compiled in
+// with PETAL_PROFILE, and then only cost a relaxed load while disabled.
+struct Profiler {
+	enum Phase {
+		forward,
+		pullback
+	};
+
+	// A completed call; times are in microseconds since the profiler was
+	// started, and counters include those of nested calls
+	struct Event {
+		std::string tag;
+		Phase phase;
+		size_t thread;
+		size_t depth;
+		double start;
+		double duration;
+		double self;
+		size_t flops;
+		size_t bytes;
+		size_t peak;
+	};
+
+	// Events aggregated by tag and phase
+	struct Entry {
+		std::string tag;
+		Phase phase;
+		size_t calls;
+		double total;
+		double self;
+		size_t flops;
+		size_t bytes;
+		size_t peak;
+	};
+
+	static inline std::atomic <bool> enabled = false;
+
+	static bool active() {
+#ifdef PETAL_PROFILE
+		return enabled.load(std::memory_order_relaxed);
+#else
+		return false;
+#endif
+	}
+
+	// Starting discards the events recorded so far
+	static void start();
+	static void stop();
+
+	// Call only while no thread is recording, e.g. after stop
+	static std::vector <Event> events();
+	static std::vector <Entry> summary();
+
+	static bool export_trace(const std::filesystem::path &);
+	static std::string table(size_t = 20);
+
+	// Calls, as scopes; inactive unless the profiler was running when opened
+	struct Scope {
+		bool open = false;
+
+		Scope(std::string_view tag, Phase phase) {
+			if (active()) [[unlikely]]
+				open = begin(tag, phase);
+		}
+
+		~Scope() {
+			if (open) [[unlikely]]
+				end();
+		}
+
+		Scope(const Scope &) = delete;
+		Scope &operator=(const Scope &) = delete;
+	};
+
+	// Counted against the innermost open scope of the calling thread
+	static void flops(size_t n) {
+		if (active()) [[unlikely]]
+			count_flops(n);
+	}
+
+	static void allocated(size_t bytes, size_t live) {
+		if (active()) [[unlikely]]
+			count_allocation(bytes, live);
+	}
+
+private:
+	static bool begin(std::string_view, Phase);
+	static void end();
+	static void count_flops(size_t);
+	static void count_allocation(size_t, size_t);
+};
+
+// Printing utilities
+std::string format_as(Profiler::Phase);
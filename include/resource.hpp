@@ -1,22 +1,36 @@
 #pragma once
 
 #include <cstring>
+#include <memory>
 #include <optional>
 #include <string>
 #include <atomic>
+#include <type_traits>
 
 #include <fmt/core.h>
 
+#include "allocator.hpp"
+
 struct Resource {
-	// TODO: variant of all pointer types and vk buffer
-	double *ptr;
+	// Untyped storage; the element type is given by type. Vulkan buffers
+	// are mapped, and this is their host address
+	void *ptr;
 	size_t elements;
 
 	// Tracking
 	std::atomic <long long int> *counter;
 
+	// Start of the allocation that ptr points into (differs for slices)
+	void *base;
+
+	// Storage that is not from the allocator (e.g. a file mapping) has no
+	// counter, and is instead kept alive by its owner
+	std::shared_ptr <const void> owner;
+
+	// TODO: f16 and bf16
 	enum Type {
-		f32
+		f32,
+		f64
 	} type;
 
 	enum Device {
@@ -29,69 +43,83 @@ struct Resource {
 	bool tracking = false;
 
 	// Initializer list
-	Resource(double *_ptr = nullptr, size_t _elements = 0, std::atomic <long long int> *_counter = nullptr, Type _type = Type::f32, Device _device = Device::eCPU)
-			: ptr(_ptr), elements(_elements), counter(_counter), type(_type), device(_device) {
+	Resource(void *_ptr = nullptr, size_t _elements = 0, std::atomic <long long int> *_counter = nullptr, Type _type = Type::f32, Device _device = Device::eCPU, void *_base = nullptr)
+			: ptr(_ptr), elements(_elements), counter(_counter), base(_base ? _base : _ptr), type(_type), device(_device) {
 		if (tracking)
 			fmt::print("delegating resource, counter = {}/{}\n", (void *) counter, counter ? counter->load() : -1);
 	}
 
-	// Copy constructor(s)
-	Resource(const Resource &other) {
-		// TODO: delegate constructor
-		ptr = other.ptr;
-		elements = other.elements;
-		counter = other.counter;
-		type = other.type;
-		device = other.device;
-		tracking = other.tracking;
-
-		// Add use
+	// Copies share the storage, and moves hand it over, leaving the source
+	// empty without touching the counter
+	Resource(const Resource &other) : owner(other.owner) {
+		assign(other);
 		if (counter)
-			(*counter)++;
+			retain(counter);
 
 		// TODO: mode to profile/count number of copy transactions
-		if (other.tracking)
+		if (other.tracking) [[unlikely]]
 			fmt::print("copy resource (Constructor), counter = {}/{}\n", (void *) counter, counter ? counter->load() : -1);
 	}
 
+	Resource(Resource &&other) noexcept : owner(std::move(other.owner)) {
+		assign(other);
+		other.forget();
+	}
+
 	Resource &operator=(const Resource &other) {
 		if (this == &other)
 			return *this;
 
-		// If there was a valid counter before, lower that (no longer beind used)
-		drop();
-
-		// TODO: delegate constructor
-		// TODO: combine into a function to avoid future bugs
-		ptr = other.ptr;
-		elements = other.elements;
-		counter = other.counter;
-		type = other.type;
-		device = other.device;
-		tracking = other.tracking;
+		// Retain before letting go of the current storage, which may be
+		// what keeps the other one alive
+		if (other.counter)
+			retain(other.counter);
 
-		// Add use
-		if (counter)
-			(*counter)++;
+		drop();
+		assign(other);
+		owner = other.owner;
 
 		// TODO: mode to profile/count number of copy transactions
-		if (other.tracking)
+		if (other.tracking) [[unlikely]]
 			fmt::print("copy resource (Operator=), counter = {}/{}\n", (void *) counter, counter ? counter->load() : -1);
 
 		return *this;
 	}
 
+	Resource &operator=(Resource &&other) noexcept {
+		if (this == &other)
+			return *this;
+
+		drop();
+		assign(other);
+		owner = std::move(other.owner);
+		other.forget();
+		return *this;
+	}
+
 	~Resource() {
 		drop();
 	}
 
-	// Memset each element
-	void memset(double value) const {
-		for (size_t i = 0; i < elements; i++)
-			ptr[i] = value;
+	// Typed access to the underlying storage
+	template <typename T>
+	T *data() const {
+		return static_cast <T *> (ptr);
+	}
+
+	// Size of each element in bytes
+	static size_t element_size(Type type) {
+		return (type == f64) ? sizeof(double) : sizeof(float);
+	}
+
+	size_t bytes() const {
+		return elements * element_size(type);
 	}
 
-	// Slices are not owners
+	// Memset each element
+	void memset(double value) const;
+
+	// Slices share ownership of the original allocation
 	std::optional <Resource> slice(long int start = 0, long int end = -1) const {
 		// NOTE: End is not inclusive
 		if (start >= elements)
@@ -99,91 +127,180 @@ struct Resource {
 		if (end < 0)
 			end = elements;
 
-		return Resource {
-			// TODO: careful here
-			&ptr[start],
+		// The returned copy holds the reference
+		Resource view {
+			static_cast <char *> (ptr) + start * element_size(type),
 			size_t(end - start),
-			nullptr,
-			type, device
+			counter,
+			type, device,
+			base
 		};
+
+		if (counter)
+			retain(counter);
+
+		view.owner = owner;
+		return view;
 	}
 
-	// Copy from another resource
+	// Copy from another resource, possibly on another device
 	bool copy(const Resource &r) {
-		if (elements != r.elements)
+		if (elements != r.elements || type != r.type)
 			return false;
 
-		// TODO: check that the device/API is the same
+		if (device != eCPU || r.device != eCPU)
+			return device_copy(r);
+
 		if (ptr != r.ptr)
-			std::memcpy(ptr, r.ptr, elements * sizeof(double));
+			std::memcpy(ptr, r.ptr, bytes());
 
 		return true;
 	}
 
 	// Cloning resources
 	std::optional <Resource> clone() const {
-		// TODO: infer allocator
-		double *new_ptr = nullptr;
-		switch (device) {
-		case eCPU:
-			new_ptr = new double[elements] { 0 };
-		default:
-			break;
-		}
+		if (!ptr)
+			return std::nullopt;
 
-		if (ptr) {
-			// TODO: depending on the device
-			std::atomic <long long int> *new_counter = new std::atomic <long long int> (1);
-			std::memcpy(new_ptr, ptr, elements * sizeof(double));
+		if (auto cloned = from(elements, type, device)) {
+			cloned->copy(*this);
 			if (tracking)
-				fmt::print("[!!] CLONED RESOURCE: {} elements @{}\n", elements, (void *) new_ptr);
-			return Resource { new_ptr, elements, new_counter, type, device };
+				fmt::print("[!!] CLONED RESOURCE: {} elements @{}\n", elements, (void *) cloned->ptr);
+			return cloned;
 		}
 
 		return std::nullopt;
 	}
 
-	// TODO: .to() function to transfer between devices
+	// Transfer to another device; resources already there are shared. Copies
+	// are ordered on the stream of the device, and only those into host
+	// memory wait for completion
+	std::optional <Resource> to(Device target) const {
+		if (target == device)
+			return *this;
 
-	static std::optional <Resource> from(size_t elements, Resource::Type type, Resource::Device device) {
-		// TODO: custom allocator to track memory and hold pages for a particular device
-		double *ptr = nullptr;
-		switch (device) {
-		case eCPU:
-			ptr = new double[elements] { 0 };
-		default:
-			break;
+		if (auto transferred = from(elements, type, target)) {
+			if (transferred->copy(*this))
+				return transferred;
 		}
 
+		return std::nullopt;
+	}
+
+	// New resource, left uninitialized unless requested otherwise
+	static std::optional <Resource> from(size_t elements, Resource::Type type, Resource::Device device, bool zero = false) {
+		if (device != eCPU)
+			return device_from(elements, type, device, zero);
+
+		void *ptr = Allocator::allocate(elements * element_size(type), zero);
 		if (ptr) {
 			// fmt::print("[!!] NEW RESOURCE: {} elements @{}\n", elements, (void *) ptr);
-			std::atomic <long long int> *counter = new std::atomic <long long int> (1);
+			// The counter lives in the header of the same allocation
+			std::atomic <long long int> *counter = &Allocator::header(ptr)->counter;
 			return Resource { ptr, elements, counter, type, device };
 		}
 
 		return std::nullopt;
 	}
 private:
+	// Allocations and copies involving devices other than the host
+	static std::optional <Resource> device_from(size_t, Type, Device, bool);
+	bool device_copy(const Resource &);
+
+	// Reference counts; atomic unless built with PETAL_NONATOMIC_REFCOUNT,
+	// for programs where only one thread ever touches tensors, in which case
+	// they are plain loads and stores
+	static void retain(std::atomic <long long int> *counter) {
+#ifdef PETAL_NONATOMIC_REFCOUNT
+		counter->store(counter->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+#else
+		counter->fetch_add(1, std::memory_order_relaxed);
+#endif
+	}
+
+	// Whether this was the last reference
+	static bool release(std::atomic <long long int> *counter) {
+#ifdef PETAL_NONATOMIC_REFCOUNT
+		long long int count = counter->load(std::memory_order_relaxed) - 1;
+		counter->store(count, std::memory_order_relaxed);
+		return count == 0;
+#else
+		return counter->fetch_sub(1, std::memory_order_acq_rel) == 1;
+#endif
+	}
+
+	// Every field but the count and the owner
+	void assign(const Resource &other) {
+		ptr = other.ptr;
+		elements = other.elements;
+		counter = other.counter;
+		base = other.base;
+		type = other.type;
+		device = other.device;
+		tracking = other.tracking;
+	}
+
+	// Empties the resource without giving up its reference, which has been
+	// handed to another one
+	void forget() {
+		counter = nullptr;
+		ptr = nullptr;
+		base = nullptr;
+		elements = 0;
+		owner.reset();
+	}
+
 	// Manually dropping count and optional deallocation
 	void drop() {
-		// Only attempt free if it is the original source
+		// Only attempt free if it is the original source; the decrement
+		// and the check are one step, so that only one owner frees
 		if (counter) {
-			(*counter)--;
-			if (tracking)
-				fmt::print("destructor for original source @{} --> {}/{}\n", (void *) ptr, (void *) counter, counter ? counter->load() : -1);
-			if (counter->load() == 0) {
-				if (tracking)
+			bool last = release(counter);
+			if (tracking) [[unlikely]]
+				fmt::print("destructor for original source @{} --> {}/{}\n", (void *) ptr, (void *) counter, counter->load());
+			if (last) {
+				if (tracking) [[unlikely]]
 					fmt::print("--> DESTROYING RESOURCE @{}\n", (void*) ptr);
-				delete counter;
-				delete[] ptr;
+				Allocator::release(base);
 			}
 		}
 
-		counter = nullptr;
-		ptr = nullptr;
+		forget();
 	}
 };
 
+// Element types of each resource type, and vice versa
+template <Resource::Type>
+struct resource_element;
+
+template <>
+struct resource_element <Resource::f32> {
+	using type = float;
+};
+
+template <>
+struct resource_element <Resource::f64> {
+	using type = double;
+};
+
+template <typename T>
+constexpr Resource::Type resource_type_of = std::is_same_v <T, double> ? Resource::f64 : Resource::f32;
+
+// Invokes a template lambda with the element type of a resource, so that
+// its body is specialized for each type at compile time
+template <typename F>
+decltype(auto) type_dispatch(Resource::Type type, F &&ftn)
+{
+	switch (type) {
+	case Resource::f64:
+		return ftn.template operator() <double> ();
+	default:
+		break;
+	}
+
+	return ftn.template operator() <float> ();
+}
+
 // Printing utilities
 std::string format_as(Resource::Type);
 std::string format_as(Resource::Device);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+
+// Least amount of work, as the number of elements touched, for part of an
+// expression to be worth a task of its own
+constexpr size_t TASK_THRESHOLD = 1 << 15;
+
+// Tasks run by a pool of worker threads, for independent parts of an
+// expression; each worker keeps its own queue, taking its latest task
+// first and stealing the oldest ones of the others when it runs out. Tasks
+// may spawn more tasks, and a thread waiting for a group of tasks runs
+// tasks in the meantime, so that waiting within a task never blocks the
+// pool. While several tasks are in flight, the OpenMP threads of their
+// kernels are split between them instead of each kernel asking for all of
+// the cores.
+struct Scheduler {
+	// Tasks to wait for; the first exception thrown by one of them is
+	// thrown again by wait
+	struct Group {
+		std::atomic <size_t> pending = 0;
+		std::exception_ptr error;
+		std::mutex lock;
+	};
+
+	static void spawn(Group &, std::function <void ()>);
+	static void wait(Group &);
+
+	// Threads that run tasks, including the caller of wait; with a single
+	// one, there is nothing to gain from spawning tasks
+	static size_t threads();
+
+	// Resizes the pool, which must be idle; zero picks one thread per core
+	static void set_threads(size_t);
+
+	// Whether work spawned by the calling thread may run elsewhere; not
+	// while it is in a planned pass, since the memory plan only serves the
+	// requests of its own thread
+	static bool concurrent();
+};
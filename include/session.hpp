@@ -0,0 +1,92 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "allocator.hpp"
+#include "composition.hpp"
+
+// Inference over a model shared by several threads, e.g.
+//
+//   auto model = std::make_shared <const Chain> (Linear::from(784, 30) >> ops::sigmoid >> Linear::from(30, 10));
+//
+//   // On each worker
+//   Session session(model);
+//   Tensor Y = session(X);
+//
+// The model is only read, through Function::infer_args, so its parameters
+// must not change while sessions use it. Each session owns the workspace of
+// its requests: a memory plan which, once a request has been seen, serves
+// the intermediate tensors of requests of the same shape without going
+// through the allocator. A session serves one request at a time, on the
+// thread that calls it.
+struct Session {
+	std::shared_ptr <const Function> model;
+	MemoryPlan plan;
+
+	Session(const std::shared_ptr <const Function> &m) : model(m) {}
+
+	Tensor run(const tensor_list &ts) {
+		MemoryPlan::Pass pass(plan);
+		return model->call_infer(ts);
+	}
+
+	template <typename ... Args>
+	Tensor operator()(const Args & ...args) {
+		return run({ args... });
+	}
+};
+
+// Single samples requested from any number of threads, served in batches:
+// requests are gathered into the rows of one input of shape (B, ...) for
+// the model, and the rows of its output are handed back through futures.
+// A batch closes once it holds max_batch requests or once its first request
+// has waited for the latency budget; each worker serves one batch at a time
+// through its own session. Only requests with the same sample shape and
+// type are batched together. Builds without atomic reference counts refuse
+// every request, since samples and results change threads.
+struct Batcher {
+	struct Options {
+		size_t max_batch = 64;
+		std::chrono::microseconds budget { 500 };
+		size_t workers = 1;
+	};
+
+	Batcher(const std::shared_ptr <const Function> &, const Options &);
+	Batcher(const Batcher &) = delete;
+	Batcher &operator=(const Batcher &) = delete;
+
+	// Serves the requests still queued before returning
+	~Batcher();
+
+	// A sample without the batch dimension, e.g. of shape (in); the result
+	// is the matching row of the output, likewise without it, or an empty
+	// tensor if the model failed on the batch
+	std::future <Tensor> submit(const Tensor &);
+
+	static std::unique_ptr <Batcher> from(const std::shared_ptr <const Function> &, const Options &);
+private:
+	struct Request {
+		Tensor X;
+		std::promise <Tensor> result;
+		std::chrono::steady_clock::time_point arrival;
+	};
+
+	std::shared_ptr <const Function> model;
+	Options options;
+
+	std::deque <Request> queue;
+	std::vector <std::thread> threads;
+
+	std::mutex lock;
+	std::condition_variable submitted;
+	bool stopping = false;
+
+	void serve(Session &, std::vector <Request> &);
+	void work();
+};
@@ -0,0 +1,325 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <optional>
+#include <tuple>
+
+#include <fmt/color.h>
+
+#include "composition.hpp"
+#include "ops.hpp"
+
+// Layers with widths fixed at compile time, for StaticChain; each works on
+// raw row major buffers of a batch of rows
+namespace fixed {
+
+template <size_t In, size_t Out, bool Bias = true>
+struct Linear {
+	static constexpr size_t in = In;
+	static constexpr size_t out = Out;
+	static constexpr bool bias = Bias;
+
+	// Same layout as ::Linear, with the bias as the last row
+	Tensor W;
+
+	static constexpr size_t width(size_t w) {
+		return (w == In) ? Out : 0;
+	}
+
+	// Below this many rows, packing for the GEMM costs more than it saves;
+	// rows are then computed directly, with the widths known to the compiler
+	static constexpr size_t direct_rows = 16;
+
+	template <typename T>
+	void apply(const T *x, T *y, size_t rows, gemm_activation act) const {
+		T *w = W.buffer.data <T> ();
+		if (rows <= direct_rows) {
+			if (act == gemm_relu)
+				direct <T, gemm_relu> (x, y, w, rows);
+			else if (act == gemm_sigmoid)
+				direct <T, gemm_sigmoid> (x, y, w, rows);
+			else
+				direct <T, gemm_identity> (x, y, w, rows);
+
+			return;
+		}
+
+		constexpr Resource::Type type = resource_type_of <T>;
+
+		// Views without counters, which cost nothing to make
+		Resource X { (void *) x, rows * In, nullptr, type };
+		Resource Y { y, rows * Out, nullptr, type };
+		Resource weights { w, In * Out, nullptr, type };
+		Resource biases { w + In * Out, Out, nullptr, type };
+
+		cpu_kernel_gemm_bias <T> (X, In, 1, weights, Out, 1, Bias ? &biases : nullptr, Y, rows, In, Out, act);
+	}
+
+	// Each output row accumulates the rows of W scaled by its inputs
+	template <typename T, gemm_activation Act>
+	static void direct(const T *x, T *y, const T *w, size_t rows) {
+		for (size_t r = 0; r < rows; r++) {
+			const T *xr = &x[r * In];
+			T *yr = &y[r * Out];
+
+			#pragma omp simd
+			for (size_t j = 0; j < Out; j++)
+				yr[j] = Bias ? w[In * Out + j] : T(0);
+
+			for (size_t i = 0; i < In; i++) {
+				T xi = xr[i];
+				const T *wi = &w[i * Out];
+
+				#pragma omp simd
+				for (size_t j = 0; j < Out; j++)
+					yr[j] += xi * wi[j];
+			}
+
+			if constexpr (Act == gemm_relu) {
+				#pragma omp simd
+				for (size_t j = 0; j < Out; j++)
+					yr[j] = (yr[j] > 0) ? yr[j] : T(0);
+			} else if constexpr (Act == gemm_sigmoid) {
+				#pragma omp simd
+				for (size_t j = 0; j < Out; j++)
+					yr[j] = fast_sigmoid(yr[j]);
+			}
+		}
+	}
+};
+
+// Activations are folded into the epilogue of the Linear before them, if
+// there is one
+template <gemm_activation Act>
+struct Activation {
+	static constexpr gemm_activation activation = Act;
+
+	static constexpr size_t width(size_t w) {
+		return w;
+	}
+
+	template <typename T>
+	void apply(const T *x, T *y, size_t rows, size_t w) const {
+		constexpr Resource::Type type = resource_type_of <T>;
+		Resource X { (void *) x, rows * w, nullptr, type };
+		Resource Y { y, rows * w, nullptr, type };
+		kernel_activation <T> (X, Y, Act);
+	}
+};
+
+using ReLU = Activation <gemm_relu>;
+using Sigmoid = Activation <gemm_sigmoid>;
+
+// Over each row
+struct Softmax {
+	static constexpr size_t width(size_t w) {
+		return w;
+	}
+
+	template <typename T>
+	void apply(const T *x, T *y, size_t rows, size_t w) const {
+		#pragma omp parallel for if (rows * w >= MAP_PARALLEL_THRESHOLD)
+		for (size_t i = 0; i < rows; i++) {
+			const T *row = &x[i * w];
+			T *out = &y[i * w];
+
+			T max = row[0];
+			for (size_t j = 1; j < w; j++)
+				max = (row[j] > max) ? row[j] : max;
+
+			T sum = 0;
+			#pragma omp simd reduction(+:sum)
+			for (size_t j = 0; j < w; j++) {
+				out[j] = fast_exp(row[j] - max);
+				sum += out[j];
+			}
+
+			T inverse = T(1) / sum;
+			#pragma omp simd
+			for (size_t j = 0; j < w; j++)
+				out[j] *= inverse;
+		}
+	}
+};
+
+template <typename L>
+concept affine = requires { L::in; L::out; L::bias; };
+
+template <typename L>
+concept activation = requires { L::activation; };
+
+}
+
+// Chains of fixed layers for inference, e.g.
+//
+//   StaticChain <fixed::Linear <784, 30>, fixed::Sigmoid, fixed::Linear <30, 10>, fixed::Softmax>
+//
+// Layers are held by value and applied through a recursion that is resolved
+// at compile time, so there are no virtual calls and no tensors in between:
+// intermediate rows alternate between two workspace buffers, reused across
+// calls. Widths are checked when the chain is instantiated. Since the
+// workspace is shared, a chain serves one call at a time.
+template <typename ... Layers>
+struct StaticChain {
+	static constexpr size_t N = sizeof...(Layers);
+
+	static_assert(N > 0, "a StaticChain needs at least one layer");
+
+	using first = std::tuple_element_t <0, std::tuple <Layers...>>;
+
+	static_assert(fixed::affine <first>, "a StaticChain must start with a Linear layer");
+
+	// Widths of the input to each layer, then of the output
+	static constexpr std::array <size_t, N + 1> widths = []() {
+		std::array <size_t, N + 1> w {};
+		w[0] = first::in;
+
+		size_t i = 0;
+		((w[i + 1] = Layers::width(w[i]), i++), ...);
+		return w;
+	}();
+
+	static_assert(std::find(widths.begin(), widths.end(), 0) == widths.end(),
+			"adjacent layers of a StaticChain must agree on their widths");
+
+	static constexpr size_t inputs = widths.front();
+	static constexpr size_t outputs = widths.back();
+	static constexpr size_t widest = *std::max_element(widths.begin() + 1, widths.end() - 1 + (N == 1));
+
+	std::tuple <Layers...> layers;
+	Resource::Type type = Resource::f32;
+
+	// Two buffers of widest x rows each
+	mutable Tensor workspace;
+
+	std::vector <Tensor *> parameters() {
+		std::vector <Tensor *> params;
+		std::apply([&](Layers &...layer) {
+			([&]() {
+				if constexpr (fixed::affine <Layers>)
+					params.push_back(&layer.W);
+			}(), ...);
+		}, layers);
+
+		return params;
+	}
+
+	// Rows of inputs to rows of outputs, both row major
+	template <typename T>
+	void forward(const T *x, T *y, size_t rows) const {
+		if (rows == 0)
+			return;
+
+		if (!workspace.shape || workspace.buffer.elements < 2 * rows * widest)
+			workspace = Tensor::blank({ 2 * rows * widest }, resource_type_of <T>);
+
+		T *a = workspace.buffer.data <T> ();
+		run <0> (x, y, rows, a, a + rows * widest);
+	}
+
+	Tensor forward(const Tensor &X) const {
+		if (!X.shape || X.shape->size() != 2 || X.shape.value()[1] != long(inputs) || X.buffer.type != type || X.buffer.device != Resource::eCPU) {
+			fmt::print("{} {} expected a host Tensor of shape (*, {}) and type {}.\n",
+					fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+					fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(static chain)"),
+					inputs, type);
+			return {};
+		}
+
+		Tensor A = X.contiguous();
+		size_t rows = A.shape.value()[0];
+
+		Tensor Y = Tensor::blank({ rows, outputs }, type);
+		type_dispatch(type, [&] <typename T> () {
+			forward <T> (A.buffer.data <T> (), Y.buffer.data <T> (), rows);
+		});
+
+		return Y;
+	}
+
+	// Fresh parameters, initialized as for ::Linear
+	static StaticChain from(Resource::Type type = Resource::f32) {
+		StaticChain chain;
+		chain.type = type;
+		std::apply([&](Layers &...layer) {
+			([&]() {
+				if constexpr (fixed::affine <Layers>)
+					layer.W = ::Linear::from(Layers::in, Layers::out, Layers::bias, type).W;
+			}(), ...);
+		}, chain.layers);
+
+		return chain;
+	}
+
+	// Sharing the parameters of trained functions (e.g. of a Chain), which
+	// must match the Linear layers in order, shape and type
+	static std::optional <StaticChain> from(const std::vector <Tensor *> &params) {
+		StaticChain chain;
+		std::vector <Tensor *> targets = chain.parameters();
+		if (params.size() != targets.size())
+			return fail(fmt::format("{} parameters for {} Linear layers", params.size(), targets.size()));
+
+		chain.type = params.empty() ? Resource::f32 : params[0]->buffer.type;
+
+		auto expected = chain.shapes();
+		for (size_t i = 0; i < params.size(); i++) {
+			const Tensor &p = *params[i];
+			if (p.shape != expected[i] || p.buffer.type != chain.type || p.buffer.device != Resource::eCPU)
+				return fail(fmt::format("parameter {} does not match its layer", i));
+
+			*targets[i] = p.contiguous();
+		}
+
+		return chain;
+	}
+private:
+	static std::optional <StaticChain> fail(const std::string &reason) {
+		fmt::print("{} {} cannot load parameters: {}.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(static chain)"),
+				reason);
+		return std::nullopt;
+	}
+
+	// Shapes of the parameters of each Linear layer
+	static std::vector <Shape> shapes() {
+		std::vector <Shape> result;
+		([&]() {
+			if constexpr (fixed::affine <Layers>)
+				result.push_back(Shape { long(Layers::in + Layers::bias), long(Layers::out) });
+		}(), ...);
+
+		return result;
+	}
+
+	// Layer I reads x and writes into the output buffer a, or into y for the
+	// last layer; the next reads a and writes into b
+	template <size_t I, typename T>
+	[[gnu::always_inline]]
+	void run(const T *x, T *y, size_t rows, T *a, T *b) const {
+		using L = std::tuple_element_t <I, std::tuple <Layers...>>;
+
+		constexpr bool fused = [&]() {
+			if constexpr (fixed::affine <L> && I + 1 < N)
+				return fixed::activation <std::tuple_element_t <I + 1, std::tuple <Layers...>>>;
+			return false;
+		}();
+
+		constexpr size_t next = fused ? I + 2 : I + 1;
+		T *out = (next == N) ? y : a;
+
+		if constexpr (fixed::affine <L>) {
+			gemm_activation act = gemm_identity;
+			if constexpr (fused)
+				act = std::tuple_element_t <I + 1, std::tuple <Layers...>>::activation;
+
+			std::get <I> (layers).apply(x, out, rows, act);
+		} else {
+			std::get <I> (layers).apply(x, out, rows, widths[I]);
+		}
+
+		if constexpr (next < N)
+			run <next> (out, y, rows, b, a);
+	}
+};
@@ -7,6 +7,8 @@
 #define FMT_HEADER_ONLY
 #include <fmt/format.h>
 
+#include "device.hpp"
+#include "kernels.hpp"
 #include "resource.hpp"
 
 // NOTE: To enable more semantic programming, we use this wrapper over the
@@ -69,6 +71,14 @@ struct Shape : std::vector <long int> {
 		return prod;
 	}
 
+	// Row major strides, in elements
+	std::vector <long int> strides() const {
+		std::vector <long int> st(size(), 1);
+		for (long int i = long(size()) - 2; i >= 0; i--)
+			st[i] = st[i + 1] * parent::operator[](i + 1);
+		return st;
+	}
+
 	Shape pop() const {
 		if (size() < 1)
 			return {};
@@ -141,12 +151,22 @@ struct Tensor {
 	std::optional <Shape> shape = std::nullopt; // TODO: make this weakly optional
 	long long int tag = -1;
 
-	// Tag generation
+	// Element strides of a view into the buffer; empty if row major contiguous
+	std::vector <long int> strides = {};
+
+	// Tag generation; tensors are made on any thread, unless reference
+	// counts are not atomic either
 	static struct {
-		long long int next_tag;
+		std::atomic <long long int> next_tag;
 
 		long long int operator()() {
-			return next_tag++;
+#ifdef PETAL_NONATOMIC_REFCOUNT
+			long long int tag = next_tag.load(std::memory_order_relaxed);
+			next_tag.store(tag + 1, std::memory_order_relaxed);
+			return tag;
+#else
+			return next_tag.fetch_add(1, std::memory_order_relaxed);
+#endif
 		}
 	} tagger;
 
@@ -168,6 +188,44 @@ struct Tensor {
 		return *this;
 	}
 
+	// Memory layout queries
+	std::vector <long int> stride_vector() const {
+		return strides.empty() ? shape->strides() : strides;
+	}
+
+	bool is_contiguous() const {
+		return strides.empty() || strides == shape->strides();
+	}
+
+	// Row major copy of a view, only materialized when necessary; the
+	// result stands for the same value and hence keeps the tag
+	Tensor contiguous() const {
+		if (is_contiguous())
+			return *this;
+
+		// Views of CUDA memory are gathered on the host, and sent back
+		if (buffer.device == Resource::eCUDA) {
+			Tensor host = to(Resource::eCPU);
+			if (!host.shape)
+				return {};
+
+			Tensor out = host.to(buffer.device);
+			out.tag = tag;
+			return out;
+		}
+
+		// Others are copied on the host, once pending device work is done
+		if (!host_accessible("contiguous", buffer))
+			return {};
+
+		Tensor out = Tensor::blank(*shape, buffer.type, buffer.device);
+		type_dispatch(buffer.type, [&] <typename T> () {
+			cpu_kernel_strided_copy <T> (buffer, strides, out.buffer, out.shape->strides(), *shape);
+		});
+		out.tag = tag;
+		return out;
+	}
+
 	// Indexing the topmost dimension
 	// TODO: negative dimensions as well...
 	Tensor operator[](size_t i) const {
@@ -175,18 +233,17 @@ struct Tensor {
 		if (!shape || i >= (*shape)[0])
 			return {};
 
-		Shape sub_shape = shape->pop();
-		size_t start = i * sub_shape.elements();
-		size_t end = start + sub_shape.elements();
-		Resource sub_buffer = buffer.slice(start, end).value();
-		return Tensor { sub_buffer, sub_shape, tagger() };
+		std::vector <long int> st = stride_vector();
+		Resource sub_buffer = buffer.slice(i * st[0]).value();
+		return view(sub_buffer, shape->pop(), { std::next(st.begin()), st.end() });
 	}
 
-	// Reshaping tensors
+	// Reshaping tensors; views are materialized first
 	Tensor reshape(const Shape &other) const {
 		if (auto reshaped = shape->reshape(other)) {
-			Resource reshaped_buffer = *buffer.slice(); // Gets the whole thing for free
-			return Tensor { reshaped_buffer, *reshaped, tagger() };
+			Tensor source = contiguous();
+			Resource reshaped_buffer = *source.buffer.slice(); // Gets the whole thing for free
+			return Tensor { std::move(reshaped_buffer), *reshaped, tagger() };
 		}
 
 		// TODO: error
@@ -202,41 +259,128 @@ struct Tensor {
 		return reshape(other);
 	}
 
-	// Transposing 2D tensors
+	// Permuting dimensions; a view over the same buffer
+	Tensor permute(const std::vector <long int> &dims) const {
+		if (dims.size() != shape->size())
+			return {};
+
+		std::vector <long int> st = stride_vector();
+
+		Shape permuted_shape = *shape;
+		std::vector <long int> permuted_strides(dims.size());
+		for (size_t i = 0; i < dims.size(); i++) {
+			size_t d = (dims[i] < 0) ? dims[i] + dims.size() : dims[i];
+			if (d >= dims.size())
+				return {};
+
+			permuted_shape[i] = shape->at(d);
+			permuted_strides[i] = st[d];
+		}
+
+		return view(buffer, permuted_shape, permuted_strides);
+	}
+
+	template <std::integral ... Ts>
+	Tensor permute(Ts ... dims) const {
+		return permute(std::vector <long int> { (long int) dims... });
+	}
+
+	// Transposing 2D tensors; a view over the same buffer
 	Tensor transpose() const {
 		if (shape->size() != 2)
 			return {};
 
-		size_t rows = shape.value()[0];
-		size_t cols = shape.value()[1];
-		Shape transposed_shape { cols, rows };
-		Tensor transposed = Tensor::blank(transposed_shape);
+		return permute(1, 0);
+	}
+
+	// Broadcasting to a larger shape, aligned on the trailing dimensions;
+	// expanded dimensions have zero stride, so nothing is copied
+	Tensor broadcast(const Shape &target) const {
+		if (target.size() < shape->size())
+			return {};
 
-		// Write the elements
-		for (size_t i = 0; i < rows; i++) {
-			for (size_t j = 0; j < cols; j++)
-				transposed.buffer.ptr[j * rows + i] = buffer.ptr[i * cols + j];
+		std::vector <long int> st = stride_vector();
+		std::vector <long int> broadcast_strides(target.size(), 0);
+
+		size_t lead = target.size() - shape->size();
+		for (size_t i = 0; i < shape->size(); i++) {
+			long int n = shape->at(i);
+			if (n == target.at(lead + i))
+				broadcast_strides[lead + i] = st[i];
+			else if (n != 1)
+				return {};
 		}
 
-		return transposed;
+		return view(buffer, target, broadcast_strides);
 	}
 
 	// Copy tensor data
 	bool copy(const Tensor &other) {
-		if (shape != other.shape)
+		if (shape != other.shape || buffer.type != other.buffer.type)
+			return false;
+
+		if (is_contiguous() && other.is_contiguous())
+			return buffer.copy(other.buffer);
+
+		// Views of CUDA memory are written through a host copy of their span
+		if (buffer.device == Resource::eCUDA || other.buffer.device == Resource::eCUDA) {
+			Tensor source = other.to(Resource::eCPU).contiguous();
+			if (!source.shape)
+				return false;
+			if (is_contiguous())
+				return buffer.copy(source.buffer);
+
+			auto host = buffer.to(Resource::eCPU);
+			return host && view(*host, *shape, strides).copy(source) && buffer.copy(*host);
+		}
+
+		if (!host_accessible("copy", buffer, other.buffer))
 			return false;
 
-		return buffer.copy(other.buffer);
+		type_dispatch(buffer.type, [&] <typename T> () {
+			cpu_kernel_strided_copy <T> (other.buffer, other.stride_vector(), buffer, stride_vector(), *shape);
+		});
+
+		return true;
+	}
+
+	// Same values on another device; tensors already there are returned
+	// as they are
+	Tensor to(Resource::Device device) const {
+		if (buffer.device == device)
+			return *this;
+
+		// Views of device memory are gathered on the host
+		Tensor source = *this;
+		if (!is_contiguous() && buffer.device != Resource::eCPU) {
+			auto host = buffer.to(Resource::eCPU);
+			if (!host)
+				return {};
+
+			source = view(*host, *shape, stride_vector());
+		}
+
+		source = source.contiguous();
+		if (auto transferred = source.buffer.to(device))
+			return Tensor { std::move(*transferred), shape, tagger() };
+
+		return {};
 	}
 
 	// Cloning tensors; does not transfer tracking
 	Tensor clone() const {
+		if (!is_contiguous()) {
+			Tensor out = contiguous();
+			out.tag = tagger();
+			return out;
+		}
+
 		Resource cloned_buffer = *buffer.clone();
-		return Tensor { cloned_buffer, shape, tagger() };
+		return Tensor { std::move(cloned_buffer), shape, tagger() };
 	}
 
-	// Slicing through a single dimension
-	Tensor slice(size_t start, size_t end, size_t dim = 0) {
+	// Slicing through a single dimension; a view over the same buffer
+	Tensor slice(size_t start, size_t end, size_t dim = 0) const {
 		// TODO: allow negatives
 		if (dim >= shape->size())
 			return {};
@@ -245,61 +389,41 @@ struct Tensor {
 		if (start >= end || start > shape.value()[dim] || end > shape.value()[dim])
 			return {};
 
-		size_t prod_before = 1;
-		size_t prod_after = 1;
-		for (size_t i = 0; i < shape->size(); i++) {
-			prod_before *= (i < dim) ? shape.value()[i] : 1;
-			prod_after *= (i > dim) ? shape.value()[i] : 1;
-		}
+		std::vector <long int> st = stride_vector();
 
 		Shape sliced_shape = *shape;
 		sliced_shape[dim] = end - start;
 
-		Tensor sliced = Tensor::blank(sliced_shape);
-		for (size_t i = 0; i < prod_before; i++) {
-			// TODO: put k in the inner loop?
-			for (size_t j = 0; j < end - start; j++) {
-				for (size_t k = 0; k < prod_after; k++) {
-					size_t ithis = i * shape.value()[dim] * prod_after + j * prod_after + k;
-					size_t isliced = i * (end - start) * prod_after + j * prod_after + k;
-					sliced.buffer.ptr[isliced] = buffer.ptr[ithis];
-				}
-			}
-		}
-
-		return sliced;
+		Resource sub_buffer = *buffer.slice(start * st[dim]);
+		return view(sub_buffer, sliced_shape, st);
 	}
 
 	// Blank tensor of a given shape; no memset-ing
 	static Tensor blank(const Shape &shape, Resource::Type type = Resource::Type::f32, Resource::Device device = Resource::Device::eCPU) {
 		if (auto buffer = Resource::from(shape.elements(), type, device))
-			return Tensor { *buffer, shape, tagger() };
+			return Tensor { std::move(*buffer), shape, tagger() };
 
 		return {};
 	}
 
 	static Tensor blank_like(const Tensor &t) {
 		if (auto buffer = Resource::from(t.shape.value().elements(), t.buffer.type, t.buffer.device))
-			return Tensor { *buffer, t.shape.value(), tagger() };
+			return Tensor { std::move(*buffer), t.shape.value(), tagger() };
 
 		return {};
 	}
 
 	// Zero tensor
 	static Tensor zeros(const Shape &shape, Resource::Type type = Resource::Type::f32, Resource::Device device = Resource::Device::eCPU) {
-		if (auto buffer = Resource::from(shape.elements(), type, device)) {
-			buffer->memset(0.0f);
-			return Tensor { *buffer, shape, tagger() };
-		}
+		if (auto buffer = Resource::from(shape.elements(), type, device, true))
+			return Tensor { std::move(*buffer), shape, tagger() };
 
 		return {};
 	}
 
 	static Tensor zeros_like(const Tensor &t) {
-		if (auto buffer = Resource::from(t.shape.value().elements(), t.buffer.type, t.buffer.device)) {
-			buffer->memset(0.0f);
-			return Tensor { *buffer, t.shape.value(), tagger() };
-		}
+		if (auto buffer = Resource::from(t.shape.value().elements(), t.buffer.type, t.buffer.device, true))
+			return Tensor { std::move(*buffer), t.shape.value(), tagger() };
 
 		return {};
 	}
@@ -308,7 +432,7 @@ struct Tensor {
 	static Tensor ones(const Shape &shape, Resource::Type type = Resource::Type::f32, Resource::Device device = Resource::Device::eCPU) {
 		if (auto buffer = Resource::from(shape.elements(), type, device)) {
 			buffer->memset(1.0f);
-			return Tensor { *buffer, shape, tagger() };
+			return Tensor { std::move(*buffer), shape, tagger() };
 		}
 
 		return {};
@@ -317,7 +441,7 @@ struct Tensor {
 	static Tensor ones_like(const Tensor &t) {
 		if (auto buffer = Resource::from(t.shape.value().elements(), t.buffer.type, t.buffer.device)) {
 			buffer->memset(1.0f);
-			return Tensor { *buffer, t.shape.value(), tagger() };
+			return Tensor { std::move(*buffer), t.shape.value(), tagger() };
 		}
 
 		return {};
@@ -326,12 +450,18 @@ struct Tensor {
 	// Identity tensor
 	// TODO: expand for multidim tensors
 	static Tensor identity(size_t N, Resource::Type type = Resource::Type::f32, Resource::Device device = Resource::Device::eCPU) {
+		// CUDA memory is written from the host through a transfer
+		if (device == Resource::eCUDA)
+			return identity(N, type).to(device);
+
 		Shape shape { N, N };
 		if (auto buffer = Resource::from(shape.elements(), type, device)) {
 			buffer->memset(0.0f);
-			for (size_t i = 0; i < N; i++)
-				buffer->ptr[i * N + i] = 1.0f;
-			return Tensor { *buffer, shape, tagger() };
+			type_dispatch(type, [&] <typename T> () {
+				for (size_t i = 0; i < N; i++)
+					buffer->data <T> ()[i * N + i] = T(1);
+			});
+			return Tensor { std::move(*buffer), shape, tagger() };
 		}
 
 		return {};
@@ -342,73 +472,65 @@ struct Tensor {
 		// TODO: allow for negative dim (int)
 
 		// Make sure the shapes match except for the provided dimension
-		// TODO: unpack the shapes here
-		if (A.shape->size() != B.shape->size())
+		if (A.shape->size() != B.shape->size() || dim >= A.shape->size())
 			return {};
 
-		size_t sum = 0;
-		size_t nA = 0;
-		size_t nB = 0;
-		size_t prod_before = 1;
-		size_t prod_after = 1;
 		for (size_t i = 0; i < A.shape->size(); i++) {
-			if (i == dim) {
-				nA = A.shape.value()[i];
-				nB = B.shape.value()[i];
-				sum = nA + nB;
-			} else if (A.shape.value()[i] != B.shape.value()[i]) {
+			if (i != dim && A.shape->at(i) != B.shape->at(i))
 				return {};
-			} else {
-				prod_before *= (sum == 0) ? A.shape.value()[i] : 1;
-				prod_after *= (sum > 0) ? A.shape.value()[i] : 1;
-			}
 		}
 
+		size_t nA = A.shape->at(dim);
+		size_t nB = B.shape->at(dim);
+
 		Shape cat_shape = *A.shape;
-		cat_shape[dim] = sum;
+		cat_shape[dim] = nA + nB;
 
-		Tensor out = Tensor::zeros(cat_shape);
+		// Each input is copied (row by row where possible) into its view of the output
+		Tensor out = Tensor::blank(cat_shape, A.buffer.type, A.buffer.device);
+		out.slice(0, nA, dim).copy(A);
+		out.slice(nA, nA + nB, dim).copy(B);
 
-		const Resource &rA = A.buffer;
-		const Resource &rB = B.buffer;
-		Resource &rout = out.buffer;
+		return out;
+	}
 
-		for (size_t i = 0; i < prod_before; i++) {
-			// TODO: put k in the inner loop?
-			for (size_t j = 0; j < nA; j++) {
-				for (size_t k = 0; k < prod_after; k++) {
-					size_t iA = i * nA * prod_after + j * prod_after + k;
-					size_t iout = i * sum * prod_after + j * prod_after + k;
-					rout.ptr[iout] = rA.ptr[iA];
-				}
-			}
+	// TODO: stack (new dim) and cat (dim=-1)
 
-			for (size_t j = 0; j < nB; j++) {
-				for (size_t k = 0; k < prod_after; k++) {
-					size_t iB = i * nB * prod_after + j * prod_after + k;
-					size_t iout = i * sum * prod_after + (j + nA) * prod_after + k;
-					rout.ptr[iout] = rB.ptr[iB];
-				}
-			}
-		}
+	// View of part of a buffer with arbitrary strides; the buffer is
+	// trimmed to the span actually covered by the view
+	static Tensor view(const Resource &buffer, const Shape &shape, const std::vector <long int> &strides) {
+		if (shape.elements() == 0)
+			return Tensor { buffer, shape, tagger() };
+
+		size_t span = 1;
+		for (size_t i = 0; i < shape.size(); i++)
+			span += (shape.at(i) - 1) * strides[i];
+
+		Tensor out { *buffer.slice(0, span), shape, tagger() };
+		if (strides != shape.strides())
+			out.strides = strides;
 
 		return out;
 	}
 
-	// TODO: stack (new dim) and cat (dim=-1)
-
 	// Random matrix initializations
 	// TODO: dissociate from tensors
 	static Tensor xavier(size_t in, size_t out, Resource::Type type = Resource::Type::f32, Resource::Device device = Resource::Device::eCPU) {
+		if (device == Resource::eCUDA)
+			return xavier(in, out, type).to(device);
+
 		Shape shape { in, out };
 		if (auto buffer = Resource::from(shape.elements(), type, device)) {
 			std::random_device rd;
 			std::mt19937 generator(rd());
 			std::normal_distribution <> distribution(0, std::sqrt(1.0/(in + out)));
 			// TODO: defer then
-			for (size_t i = 0; i < shape.elements(); i++)
-				buffer->ptr[i] = distribution(generator);
-			return Tensor { *buffer, shape, tagger() };
+			type_dispatch(type, [&] <typename T> () {
+				T *values = buffer->data <T> ();
+				for (size_t i = 0; i < shape.elements(); i++)
+					values[i] = distribution(generator);
+			});
+			return Tensor { std::move(*buffer), shape, tagger() };
 		}
 
 		return {};
@@ -416,13 +538,19 @@ struct Tensor {
 
 	// Random tensor
 	static Tensor randn(const Shape &shape, Resource::Type type = Resource::Type::f32, Resource::Device device = Resource::Device::eCPU) {
+		if (device == Resource::eCUDA)
+			return randn(shape, type).to(device);
+
 		if (auto buffer = Resource::from(shape.elements(), type, device)) {
 			std::random_device rd;
 			std::mt19937 generator(rd());
 			std::uniform_real_distribution <> distribution(0, 1);
-			for (size_t i = 0; i < shape.elements(); i++)
-				buffer->ptr[i] = distribution(generator);
-			return Tensor { *buffer, shape, tagger() };
+			type_dispatch(type, [&] <typename T> () {
+				T *values = buffer->data <T> ();
+				for (size_t i = 0; i < shape.elements(); i++)
+					values[i] = distribution(generator);
+			});
+			return Tensor { std::move(*buffer), shape, tagger() };
 		}
 
 		return {};
@@ -0,0 +1,616 @@
+#include <algorithm>
+#include <bit>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "allocator.hpp"
+#include "profiler.hpp"
+
+// Size classes; four per power of two from 64 bytes up to 1 GiB, larger
+// requests than that bypass the cache
+static constexpr size_t MIN_CLASS_BYTES = 64;
+static constexpr size_t MAX_CLASS_EXPONENT = 30;
+static constexpr size_t CLASS_COUNT = 1 + 4 * (MAX_CLASS_EXPONENT - 6);
+static constexpr size_t UNCACHED = ~size_t(0);
+
+// Upper bound on the bytes each thread keeps around for reuse
+static constexpr size_t THREAD_CACHE_LIMIT = size_t(1) << 28;
+
+static size_t size_class(size_t bytes)
+{
+	if (bytes <= MIN_CLASS_BYTES)
+		return 0;
+
+	// Such that 2^e < bytes <= 2^(e + 1), split into quarters
+	size_t e = std::bit_width(bytes - 1) - 1;
+	if (e >= MAX_CLASS_EXPONENT)
+		return UNCACHED;
+
+	size_t quarter = size_t(1) << (e - 2);
+	size_t k = (bytes - (size_t(1) << e) + quarter - 1) / quarter;
+	return 1 + 4 * (e - 6) + (k - 1);
+}
+
+static size_t class_bytes(size_t c)
+{
+	if (c == 0)
+		return MIN_CLASS_BYTES;
+
+	size_t e = 6 + (c - 1) / 4;
+	size_t k = 1 + (c - 1) % 4;
+	return (size_t(1) << e) + k * (size_t(1) << (e - 2));
+}
+
+// Live bytes are tracked globally so that the peak is exact; everything else
+// is counted per thread, without any read-modify-write atomics
+static std::atomic <size_t> bytes_in_use;
+static std::atomic <size_t> peak_bytes_in_use;
+
+static size_t add_in_use(size_t bytes)
+{
+	size_t now = bytes_in_use.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+	size_t peak = peak_bytes_in_use.load(std::memory_order_relaxed);
+	while (now > peak && !peak_bytes_in_use.compare_exchange_weak(peak, now, std::memory_order_relaxed));
+	return now;
+}
+
+// Only the owning thread writes these, others may read them
+struct ThreadCounters {
+	std::atomic <size_t> allocations;
+	std::atomic <size_t> releases;
+	std::atomic <size_t> cache_hits;
+	std::atomic <size_t> system_allocations;
+	std::atomic <size_t> system_releases;
+	std::atomic <size_t> bytes_cached;
+	std::atomic <size_t> planned_allocations;
+
+	static void bump(std::atomic <size_t> &c, size_t delta = 1) {
+		c.store(c.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+	}
+
+	static void drop(std::atomic <size_t> &c, size_t delta) {
+		c.store(c.load(std::memory_order_relaxed) - delta, std::memory_order_relaxed);
+	}
+};
+
+// Counters of every live thread, and the totals of threads that have exited
+static struct {
+	std::mutex lock;
+	std::vector <ThreadCounters *> live;
+	Allocator::Statistics retired {};
+} registry;
+
+static Allocator::Header *system_allocate(ThreadCounters &counters, size_t capacity)
+{
+	// Sizes passed to aligned_alloc must be multiples of the alignment
+	size_t bytes = ((sizeof(Allocator::Header) + capacity + 63) / 64) * 64;
+	void *raw = std::aligned_alloc(alignof(Allocator::Header), bytes);
+	if (!raw)
+		throw std::bad_alloc();
+
+	ThreadCounters::bump(counters.system_allocations);
+	return reinterpret_cast <Allocator::Header *> (raw);
+}
+
+static void system_release(ThreadCounters &counters, Allocator::Header *header)
+{
+	ThreadCounters::bump(counters.system_releases);
+	std::free(header);
+}
+
+// Free lists of the calling thread; blocks may be released by a thread other
+// than the one which allocated them, in which case they migrate
+struct ThreadCache {
+	std::vector <Allocator::Header *> lists[CLASS_COUNT];
+	ThreadCounters counters {};
+
+	ThreadCache() {
+		std::lock_guard guard(registry.lock);
+		registry.live.push_back(&counters);
+	}
+
+	~ThreadCache();
+
+	Allocator::Header *pop(size_t c) {
+		if (lists[c].empty())
+			return nullptr;
+
+		Allocator::Header *header = lists[c].back();
+		lists[c].pop_back();
+		ThreadCounters::drop(counters.bytes_cached, header->capacity);
+		return header;
+	}
+
+	bool push(Allocator::Header *header) {
+		if (counters.bytes_cached.load(std::memory_order_relaxed) + header->capacity > THREAD_CACHE_LIMIT)
+			return false;
+
+		lists[header->size_class].push_back(header);
+		ThreadCounters::bump(counters.bytes_cached, header->capacity);
+		return true;
+	}
+
+	void clear() {
+		for (auto &list : lists) {
+			for (Allocator::Header *header : list)
+				system_release(counters, header);
+			list.clear();
+		}
+
+		counters.bytes_cached.store(0, std::memory_order_relaxed);
+	}
+};
+
+// Buffers can outlive the cache of their thread (e.g. in static tensors);
+// these are trivially destructible, so they remain readable, and they
+// spare the fast path the initialization guard of the cache itself
+static thread_local ThreadCache *current = nullptr;
+static thread_local bool cache_destroyed = false;
+
+static ThreadCache *thread_cache()
+{
+	if (current) [[likely]]
+		return current;
+	if (cache_destroyed)
+		return nullptr;
+
+	static thread_local ThreadCache cache;
+	current = &cache;
+	return current;
+}
+
+// Stand-in counters for releases after the cache of a thread is gone
+static ThreadCounters orphan_counters {};
+
+static void accumulate(Allocator::Statistics &stats, const ThreadCounters &counters)
+{
+	stats.allocations += counters.allocations.load(std::memory_order_relaxed);
+	stats.releases += counters.releases.load(std::memory_order_relaxed);
+	stats.cache_hits += counters.cache_hits.load(std::memory_order_relaxed);
+	stats.system_allocations += counters.system_allocations.load(std::memory_order_relaxed);
+	stats.system_releases += counters.system_releases.load(std::memory_order_relaxed);
+	stats.bytes_cached += counters.bytes_cached.load(std::memory_order_relaxed);
+	stats.planned_allocations += counters.planned_allocations.load(std::memory_order_relaxed);
+}
+
+ThreadCache::~ThreadCache()
+{
+	clear();
+	current = nullptr;
+	cache_destroyed = true;
+
+	std::lock_guard guard(registry.lock);
+	accumulate(registry.retired, counters);
+	std::erase(registry.live, &counters);
+}
+
+static void *cached_allocate(size_t bytes, bool zero)
+{
+	size_t c = size_class(bytes);
+
+	Allocator::Header *header = nullptr;
+	if (ThreadCache *cache = thread_cache()) {
+		ThreadCounters &counters = cache->counters;
+		ThreadCounters::bump(counters.allocations);
+
+		if (c != UNCACHED)
+			header = cache->pop(c);
+
+		if (header) {
+			ThreadCounters::bump(counters.cache_hits);
+		} else {
+			size_t capacity = (c == UNCACHED) ? ((bytes + 63) / 64) * 64 : class_bytes(c);
+			header = system_allocate(counters, capacity);
+			header->size_class = c;
+			header->capacity = capacity;
+		}
+	} else {
+		size_t capacity = ((bytes + 63) / 64) * 64;
+		header = system_allocate(orphan_counters, capacity);
+		header->size_class = UNCACHED;
+		header->capacity = capacity;
+	}
+
+	size_t live = add_in_use(header->capacity);
+	Profiler::allocated(header->capacity, live);
+
+	header->counter.store(1, std::memory_order_relaxed);
+	header->ledger = nullptr;
+
+	void *data = header + 1;
+	if (zero)
+		std::memset(data, 0, bytes);
+
+	return data;
+}
+
+static void cached_release(Allocator::Header *header)
+{
+	bytes_in_use.fetch_sub(header->capacity, std::memory_order_relaxed);
+
+	ThreadCache *cache = thread_cache();
+	if (!cache) {
+		system_release(orphan_counters, header);
+		return;
+	}
+
+	ThreadCounters::bump(cache->counters.releases);
+	if (header->size_class == UNCACHED || !cache->push(header))
+		system_release(cache->counters, header);
+}
+
+// Memory plans; slots are indexed by the order of their requests in a pass,
+// and lifetimes are measured in requests, from the start of the recording
+static constexpr size_t UNRELEASED = ~size_t(0);
+
+struct Allocator::Ledger {
+	struct Slot {
+		size_t bytes;
+
+		// Requests made before the release; beyond the period if released
+		// in the pass after the recording
+		size_t release = UNRELEASED;
+
+		// Layout in the workspace, if it is part of it
+		bool planned = false;
+		size_t offset = 0;
+		std::vector <size_t> conflicts;
+		bool live = false;
+	};
+
+	std::mutex lock;
+	std::vector <Slot> slots;
+	size_t position = 0;
+	size_t period = UNRELEASED;
+
+	// Outstanding blocks; detached ledgers are destroyed with their last one
+	size_t live = 0;
+	bool detached = false;
+
+	// Set for workspaces
+	char *memory = nullptr;
+	size_t bytes = 0;
+};
+
+static thread_local MemoryPlan *active_plan = nullptr;
+
+static void destroy(Allocator::Ledger *ledger)
+{
+	if (ledger->memory) {
+		bytes_in_use.fetch_sub(ledger->bytes, std::memory_order_relaxed);
+		std::free(ledger->memory);
+	}
+
+	delete ledger;
+}
+
+static void detach(Allocator::Ledger *ledger)
+{
+	if (!ledger)
+		return;
+
+	bool last;
+	{
+		std::lock_guard guard(ledger->lock);
+		ledger->detached = true;
+		last = (ledger->live == 0);
+	}
+
+	if (last)
+		destroy(ledger);
+}
+
+// Whether two slots are ever alive at once, as the pattern repeats
+static bool overlapping(size_t i, size_t ri, size_t j, size_t rj, size_t period)
+{
+	for (long int m = -1; m <= 1; m++) {
+		long int shift = m * long(period);
+		if (long(i) < long(rj) + shift && long(j) + shift < long(ri))
+			return true;
+	}
+
+	return false;
+}
+
+static Allocator::Ledger *layout(const Allocator::Ledger &recording)
+{
+	Allocator::Ledger *workspace = new Allocator::Ledger;
+	workspace->slots.resize(recording.slots.size());
+	workspace->period = recording.period;
+
+	size_t period = recording.period;
+	auto footprint = [](size_t bytes) {
+		return sizeof(Allocator::Header) + ((bytes + 63) / 64) * 64;
+	};
+
+	// Only blocks released before their next request are planned, largest
+	// first; the others are left to the caching allocator
+	std::vector <size_t> order;
+	for (size_t i = 0; i < recording.slots.size(); i++) {
+		const Allocator::Ledger::Slot &slot = recording.slots[i];
+		workspace->slots[i].bytes = slot.bytes;
+		workspace->slots[i].release = slot.release;
+		if (slot.release <= i + period)
+			order.push_back(i);
+	}
+
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return footprint(recording.slots[a].bytes) > footprint(recording.slots[b].bytes);
+	});
+
+	// Greedy placement at the lowest offset clear of every placed block
+	// whose lifetime overlaps
+	std::vector <size_t> placed;
+	size_t total = 0;
+	for (size_t i : order) {
+		Allocator::Ledger::Slot &slot = workspace->slots[i];
+		size_t size = footprint(slot.bytes);
+
+		std::vector <std::pair <size_t, size_t>> taken;
+		for (size_t j : placed) {
+			const Allocator::Ledger::Slot &other = workspace->slots[j];
+			if (overlapping(i, slot.release, j, other.release, period))
+				taken.push_back({ other.offset, other.offset + footprint(other.bytes) });
+		}
+
+		std::sort(taken.begin(), taken.end());
+
+		size_t offset = 0;
+		for (auto [start, end] : taken) {
+			if (offset + size <= start)
+				break;
+			offset = std::max(offset, end);
+		}
+
+		slot.planned = true;
+		slot.offset = offset;
+		placed.push_back(i);
+		total = std::max(total, offset + size);
+	}
+
+	// Blocks sharing memory, which must be released before each other's reuse
+	for (size_t a = 0; a < placed.size(); a++) {
+		for (size_t b = a + 1; b < placed.size(); b++) {
+			Allocator::Ledger::Slot &x = workspace->slots[placed[a]];
+			Allocator::Ledger::Slot &y = workspace->slots[placed[b]];
+			if (x.offset < y.offset + footprint(y.bytes) && y.offset < x.offset + footprint(x.bytes)) {
+				x.conflicts.push_back(placed[b]);
+				y.conflicts.push_back(placed[a]);
+			}
+		}
+	}
+
+	workspace->bytes = std::max(total, size_t(64));
+	workspace->memory = static_cast <char *> (std::aligned_alloc(alignof(Allocator::Header), workspace->bytes));
+	if (!workspace->memory)
+		throw std::bad_alloc();
+
+	add_in_use(workspace->bytes);
+	return workspace;
+}
+
+static void *planned_allocate(MemoryPlan &plan, size_t bytes, bool zero)
+{
+	if (Allocator::Ledger *workspace = plan.workspace) {
+		std::unique_lock guard(workspace->lock);
+		if (plan.deviated || plan.cursor >= workspace->slots.size() || workspace->slots[plan.cursor].bytes != bytes) {
+			plan.deviated = true;
+			guard.unlock();
+			return cached_allocate(bytes, zero);
+		}
+
+		size_t index = plan.cursor++;
+		Allocator::Ledger::Slot &slot = workspace->slots[index];
+		if (!slot.planned) {
+			guard.unlock();
+			return cached_allocate(bytes, zero);
+		}
+
+		// Lifetimes differ from the recording
+		bool clear = !slot.live;
+		for (size_t other : slot.conflicts)
+			clear = clear && !workspace->slots[other].live;
+
+		if (!clear) {
+			plan.deviated = true;
+			guard.unlock();
+			return cached_allocate(bytes, zero);
+		}
+
+		slot.live = true;
+		workspace->live++;
+		guard.unlock();
+
+		Allocator::Header *header = reinterpret_cast <Allocator::Header *> (workspace->memory + slot.offset);
+		header->counter.store(1, std::memory_order_relaxed);
+		header->size_class = UNCACHED;
+		header->capacity = ((bytes + 63) / 64) * 64;
+		header->ledger = workspace;
+		header->slot = index;
+
+		if (ThreadCache *cache = thread_cache()) {
+			ThreadCounters::bump(cache->counters.allocations);
+			ThreadCounters::bump(cache->counters.planned_allocations);
+		}
+
+		Profiler::allocated(header->capacity, bytes_in_use.load(std::memory_order_relaxed));
+
+		void *data = header + 1;
+		if (zero)
+			std::memset(data, 0, bytes);
+
+		return data;
+	}
+
+	// Recording, or tracking the releases of the recording for another pass
+	Allocator::Ledger *recording = plan.recording;
+	void *data = cached_allocate(bytes, zero);
+
+	std::lock_guard guard(recording->lock);
+	if (recording->period == UNRELEASED) {
+		Allocator::Header *header = Allocator::header(data);
+		header->ledger = recording;
+		header->slot = recording->slots.size();
+		recording->slots.push_back({ bytes });
+		recording->live++;
+	}
+
+	recording->position++;
+	return data;
+}
+
+static void planned_release(Allocator::Header *header)
+{
+	Allocator::Ledger *ledger = header->ledger;
+	bool workspace = ledger->memory;
+
+	bool last;
+	{
+		std::lock_guard guard(ledger->lock);
+		Allocator::Ledger::Slot &slot = ledger->slots[header->slot];
+		if (workspace)
+			slot.live = false;
+		else
+			slot.release = ledger->position;
+
+		ledger->live--;
+		last = ledger->detached && (ledger->live == 0);
+	}
+
+	if (last)
+		destroy(ledger);
+
+	if (!workspace) {
+		cached_release(header);
+		return;
+	}
+
+	if (ThreadCache *cache = thread_cache())
+		ThreadCounters::bump(cache->counters.releases);
+}
+
+void *Allocator::allocate(size_t bytes, bool zero)
+{
+	if (MemoryPlan *plan = active_plan) [[unlikely]]
+		return planned_allocate(*plan, bytes, zero);
+
+	return cached_allocate(bytes, zero);
+}
+
+void Allocator::release(void *data)
+{
+	if (!data)
+		return;
+
+	Header *header = Allocator::header(data);
+	if (header->ledger) [[unlikely]] {
+		planned_release(header);
+		return;
+	}
+
+	cached_release(header);
+}
+
+void MemoryPlan::begin()
+{
+	active_plan = this;
+	cursor = 0;
+	deviated = false;
+
+	if (!workspace && !recording)
+		recording = new Allocator::Ledger;
+}
+
+void MemoryPlan::end()
+{
+	active_plan = nullptr;
+
+	if (workspace) {
+		if (deviated || cursor != workspace->slots.size()) {
+			detach(workspace);
+			workspace = nullptr;
+		}
+
+		return;
+	}
+
+	// The recorded pass; its releases are tracked through the next one
+	{
+		std::lock_guard guard(recording->lock);
+		if (recording->period == UNRELEASED) {
+			recording->period = recording->slots.size();
+			return;
+		}
+	}
+
+	workspace = layout(*recording);
+	detach(recording);
+	recording = nullptr;
+}
+
+MemoryPlan::~MemoryPlan()
+{
+	if (active_plan == this)
+		active_plan = nullptr;
+
+	detach(recording);
+	detach(workspace);
+}
+
+MemoryPlan *MemoryPlan::current()
+{
+	return active_plan;
+}
+
+size_t MemoryPlan::workspace_bytes() const
+{
+	return workspace ? workspace->bytes : 0;
+}
+
+void Allocator::trim()
+{
+	if (ThreadCache *cache = thread_cache())
+		cache->clear();
+}
+
+Allocator::Statistics Allocator::statistics()
+{
+	std::lock_guard guard(registry.lock);
+
+	Statistics stats = registry.retired;
+	for (const ThreadCounters *counters : registry.live)
+		accumulate(stats, *counters);
+	accumulate(stats, orphan_counters);
+
+	stats.bytes_in_use = bytes_in_use.load(std::memory_order_relaxed);
+	stats.peak_bytes_in_use = peak_bytes_in_use.load(std::memory_order_relaxed);
+	return stats;
+}
+
+size_t Allocator::live_bytes()
+{
+	return bytes_in_use.load(std::memory_order_relaxed);
+}
+
+// Only resets the peak, since the other counters are meant to be diffed
+void Allocator::reset_statistics()
+{
+	peak_bytes_in_use.store(bytes_in_use.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+// Printing utilities
+std::string format_as(const Allocator::Statistics &stats)
+{
+	double hit_rate = stats.allocations ? 100.0 * stats.cache_hits / stats.allocations : 0.0;
+	return fmt::format("<Allocator: {} allocations ({:.1f}% cached, {} planned), {} releases, "
+			"{} system allocations, {} system releases; "
+			"{} bytes in use (peak {}), {} bytes cached>",
+			stats.allocations, hit_rate, stats.planned_allocations, stats.releases,
+			stats.system_allocations, stats.system_releases,
+			stats.bytes_in_use, stats.peak_bytes_in_use, stats.bytes_cached);
+}
@@ -0,0 +1,302 @@
+#include <climits>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive.hpp"
+
+// Mapping files
+MappedFile::~MappedFile()
+{
+	if (data)
+		munmap((void *) data, size);
+}
+
+std::shared_ptr <MappedFile> MappedFile::from(const std::filesystem::path &path)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		fmt::print("{} {} could not open {}.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(mmap)"),
+				path.string());
+		return nullptr;
+	}
+
+	struct stat info;
+	void *data = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && info.st_size > 0)
+		data = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+	// The mapping outlives the descriptor
+	close(fd);
+
+	if (data == MAP_FAILED) {
+		fmt::print("{} {} could not map {}.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(mmap)"),
+				path.string());
+		return nullptr;
+	}
+
+	madvise(data, info.st_size, MADV_WILLNEED);
+
+	auto file = std::make_shared <MappedFile> ();
+	file->data = static_cast <unsigned char *> (data);
+	file->size = info.st_size;
+	return file;
+}
+
+// Archives
+struct archive_header {
+	char magic[8];
+	uint64_t version;
+	uint64_t count;
+	uint64_t alignment;
+};
+
+// Followed by the dimensions, then the name
+struct archive_entry {
+	uint64_t type;
+	uint64_t ndims;
+	uint64_t offset;
+	uint64_t bytes;
+	uint64_t name_length;
+};
+
+static constexpr char ARCHIVE_MAGIC[8] = "PETALAR";
+static constexpr uint64_t ARCHIVE_VERSION = 1;
+
+static size_t align(size_t offset, size_t alignment)
+{
+	return ((offset + alignment - 1) / alignment) * alignment;
+}
+
+bool Archive::save(const std::filesystem::path &path) const
+{
+	std::vector <Tensor> contents;
+	for (const auto &[name, t] : tensors) {
+		if (!t.shape || t.buffer.device != Resource::eCPU) {
+			fmt::print("{} {} cannot save tensor \"{}\", which is empty or not on the host.\n",
+					fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+					fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(archive)"),
+					name);
+			return false;
+		}
+
+		contents.push_back(t.contiguous());
+	}
+
+	// Metadata first, then the data of each tensor
+	size_t offset = sizeof(archive_header);
+	for (const auto &[name, t] : tensors)
+		offset += sizeof(archive_entry) + t.shape->size() * sizeof(uint64_t) + name.size();
+
+	std::vector <archive_entry> entries;
+	for (const Tensor &t : contents) {
+		offset = align(offset, ALIGNMENT);
+		entries.push_back({ uint64_t(t.buffer.type), t.shape->size(), offset, t.shape->elements() * Resource::element_size(t.buffer.type), 0 });
+		offset += entries.back().bytes;
+	}
+
+	// Written aside and renamed over the target, which may still be mapped
+	// by the tensors being saved (e.g. optimizer states of a checkpoint)
+	std::filesystem::path staging = path;
+	staging += ".tmp";
+
+	std::ofstream file(staging, std::ios::binary);
+
+	archive_header header {};
+	std::memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+	header.version = ARCHIVE_VERSION;
+	header.count = tensors.size();
+	header.alignment = ALIGNMENT;
+	file.write((const char *) &header, sizeof(header));
+
+	size_t i = 0;
+	for (const auto &[name, t] : tensors) {
+		archive_entry &entry = entries[i++];
+		entry.name_length = name.size();
+		file.write((const char *) &entry, sizeof(entry));
+		for (long int d : *t.shape) {
+			uint64_t dim = d;
+			file.write((const char *) &dim, sizeof(dim));
+		}
+
+		file.write(name.data(), name.size());
+	}
+
+	const char padding[ALIGNMENT] {};
+	for (size_t i = 0; i < contents.size(); i++) {
+		file.write(padding, entries[i].offset - file.tellp());
+		file.write(contents[i].buffer.data <char> (), entries[i].bytes);
+	}
+
+	file.close();
+
+	std::error_code error;
+	if (file.good())
+		std::filesystem::rename(staging, path, error);
+
+	if (!file.good() || error) {
+		fmt::print("{} {} could not write {}.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(archive)"),
+				path.string());
+		std::filesystem::remove(staging, error);
+		return false;
+	}
+
+	return true;
+}
+
+std::optional <Archive> Archive::load(const std::filesystem::path &path)
+{
+	auto file = MappedFile::from(path);
+	if (!file)
+		return std::nullopt;
+
+	auto invalid = [&](const char *const reason) {
+		fmt::print("{} {} {}: {}.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(archive)"),
+				path.string(), reason);
+		return std::nullopt;
+	};
+
+	// Reads metadata, within bounds
+	size_t cursor = 0;
+	auto read = [&](void *dst, size_t bytes) {
+		if (cursor + bytes > file->size)
+			return false;
+
+		std::memcpy(dst, file->data + cursor, bytes);
+		cursor += bytes;
+		return true;
+	};
+
+	archive_header header;
+	if (!read(&header, sizeof(header)) || std::memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)))
+		return invalid("not an archive");
+
+	if (header.version != ARCHIVE_VERSION)
+		return invalid("unsupported version");
+
+	Archive archive;
+	for (size_t i = 0; i < header.count; i++) {
+		archive_entry entry;
+		if (!read(&entry, sizeof(entry)))
+			return invalid("truncated entry");
+
+		// Sizes are checked against what is left before allocating for them
+		size_t remaining = file->size - cursor;
+		if (entry.ndims > remaining / sizeof(uint64_t)
+				|| entry.name_length > remaining - entry.ndims * sizeof(uint64_t))
+			return invalid("truncated entry");
+
+		std::vector <uint64_t> dims(entry.ndims);
+		std::string name(entry.name_length, '\0');
+		if (!read(dims.data(), dims.size() * sizeof(uint64_t)) || !read(name.data(), name.size()))
+			return invalid("truncated entry");
+
+		if (entry.type > Resource::f64)
+			return invalid("unknown element type");
+
+		// Dimensions must fit in a Shape, and their product must not wrap
+		// around to match the size of a smaller entry
+		auto type = Resource::Type(entry.type);
+		size_t elements = 1;
+		size_t bytes = 0;
+		for (uint64_t n : dims) {
+			if (n > LONG_MAX || __builtin_mul_overflow(elements, n, &elements))
+				return invalid("inconsistent entry");
+		}
+
+		if (__builtin_mul_overflow(elements, Resource::element_size(type), &bytes)
+				|| entry.bytes != bytes
+				|| entry.offset > file->size || entry.bytes > file->size - entry.offset
+				|| entry.offset % Resource::element_size(type))
+			return invalid("inconsistent entry");
+
+		// Pointing into the mapping, which the resource keeps alive
+		Shape shape(dims);
+		Resource buffer { file->data + entry.offset, elements, nullptr, type, Resource::eCPU };
+		buffer.owner = file;
+
+		archive.tensors[name] = Tensor { buffer, shape, Tensor::tagger() };
+	}
+
+	return archive;
+}
+
+// Checkpoints
+bool Checkpoint::save(const std::filesystem::path &path, const std::vector <Tensor *> &parameters, Optimizer *optimizer)
+{
+	Archive archive;
+	for (size_t i = 0; i < parameters.size(); i++)
+		archive.tensors[fmt::format("parameter.{}", i)] = *parameters[i];
+
+	if (optimizer) {
+		for (const auto &[name, states] : optimizer->states()) {
+			for (size_t i = 0; i < parameters.size(); i++) {
+				auto it = states->find(parameters[i]->tag);
+				if (it != states->end())
+					archive.tensors[fmt::format("optimizer.{}.{}", name, i)] = it->second;
+			}
+		}
+
+		Tensor iteration = Tensor::blank({ 1ul }, Resource::f64);
+		iteration.buffer.data <double> ()[0] = optimizer->iteration;
+		archive.tensors["optimizer.iteration"] = iteration;
+	}
+
+	return archive.save(path);
+}
+
+bool Checkpoint::load(const std::filesystem::path &path, const std::vector <Tensor *> &parameters, Optimizer *optimizer)
+{
+	auto archive = Archive::load(path);
+	if (!archive)
+		return false;
+
+	auto mismatch = [&](const std::string &name) {
+		fmt::print("{} {} {} has no entry {} matching the parameters.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(checkpoint)"),
+				path.string(), name);
+		return false;
+	};
+
+	auto &tensors = archive->tensors;
+	for (size_t i = 0; i < parameters.size(); i++) {
+		std::string name = fmt::format("parameter.{}", i);
+		auto it = tensors.find(name);
+		if (it == tensors.end() || !parameters[i]->copy(it->second))
+			return mismatch(name);
+	}
+
+	if (!optimizer)
+		return true;
+
+	for (const auto &[name, states] : optimizer->states()) {
+		for (size_t i = 0; i < parameters.size(); i++) {
+			auto it = tensors.find(fmt::format("optimizer.{}.{}", name, i));
+			if (it == tensors.end())
+				continue;
+
+			if (it->second.shape != parameters[i]->shape || it->second.buffer.type != parameters[i]->buffer.type)
+				return mismatch(it->first);
+
+			(*states)[parameters[i]->tag] = it->second;
+		}
+	}
+
+	auto it = tensors.find("optimizer.iteration");
+	if (it != tensors.end())
+		optimizer->iteration = it->second.buffer.data <double> ()[0];
+
+	return true;
+}
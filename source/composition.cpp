@@ -1,4 +1,10 @@
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
 #include "composition.hpp"
+#include "device.hpp"
 
 // Printing utilities
 static std::string to_string(const DynamicDeferred &dd, size_t indents = 0)
@@ -7,10 +13,10 @@ static std::string to_string(const DynamicDeferred &dd, size_t indents = 0)
 	std::string indentation = std::string(2 * indents, ' ');
 	std::string header = fmt::format("{} {{\n", dd.ftn->tag);
 	for (const auto &v : dd.args) {
-		if (std::holds_alternative <Tensor> (v))
-			header += fmt::format("{}  Tensor of shape {}\n", indentation, *std::get <Tensor> (v).shape);
+		if (v.deferred())
+			header += fmt::format("{}  {}\n", indentation, to_string(v.expression(), indents + 1));
 		else
-			header += fmt::format("{}  {}\n", indentation, to_string(std::get <DynamicDeferred> (v), indents + 1));
+			header += fmt::format("{}  Tensor of shape {}\n", indentation, *v.tensor().shape);
 	}
 
 	return header + indentation + "}";
@@ -22,6 +28,404 @@ std::string format_as(const DynamicDeferred &dd)
 	return to_string(dd);
 }
 
+// Building graphs; the DynamicDeferred tree is walked in place, and nodes
+// shared by several expressions are only walked once
+struct graph_builder {
+	Graph &graph;
+	std::unordered_map <long long int, size_t> tensors;
+	std::unordered_map <const DynamicDeferred *, size_t> visited;
+	std::map <std::pair <Function *, std::vector <size_t>>, size_t> expressions;
+
+	size_t leaf(const Tensor &t) {
+		auto it = tensors.find(t.tag);
+		if (it != tensors.end())
+			return it->second;
+
+		graph.nodes.push_back({ nullptr, {}, t });
+		graph.leaves.push_back(graph.nodes.size() - 1);
+		return tensors[t.tag] = graph.nodes.size() - 1;
+	}
+
+	size_t add(const DynamicDeferred &dd) {
+		auto seen = visited.find(&dd);
+		if (seen != visited.end())
+			return seen->second;
+
+		std::vector <size_t> inputs;
+		for (const auto &v : dd.args)
+			inputs.push_back(v.deferred() ? add(v.expression()) : leaf(v.tensor()));
+
+		auto key = std::make_pair(dd.ftn.get(), inputs);
+		auto it = expressions.find(key);
+		size_t index;
+		if (it != expressions.end()) {
+			index = it->second;
+		} else {
+			for (size_t input : inputs)
+				graph.nodes[input].consumers++;
+
+			Tensor value = dd.evaluated() ? dd.cached_eval : Tensor {};
+			graph.nodes.push_back({ dd.ftn, inputs, value });
+			index = expressions[key] = graph.nodes.size() - 1;
+		}
+
+		return visited[&dd] = index;
+	}
+};
+
+Graph Graph::from(const DynamicDeferred &dd)
+{
+	Graph graph;
+	graph_builder { graph }.add(dd);
+	return graph;
+}
+
+// Elements of the inputs and parameters, counting shared nodes once
+static size_t work(const DynamicDeferred &dd, std::unordered_set <const DynamicDeferred *> &visited)
+{
+	size_t total = 0;
+	for (Tensor *p : dd.ftn->parameters())
+		total += p->buffer.elements;
+
+	for (const auto &v : dd.args) {
+		if (!v.deferred())
+			total += v.tensor().shape ? v.tensor().shape->elements() : 0;
+		else if (visited.insert(&v.expression()).second)
+			total += work(v.expression(), visited);
+	}
+
+	return total;
+}
+
+size_t DynamicDeferred::work() const
+{
+	std::unordered_set <const DynamicDeferred *> visited;
+	return ::work(*this, visited);
+}
+
+static void reachable(DynamicDeferred *dd, std::unordered_map <DynamicDeferred *, size_t> &owners, size_t owner, bool &shared)
+{
+	auto [it, inserted] = owners.try_emplace(dd, owner);
+	if (!inserted) {
+		shared = shared || it->second != owner;
+		return;
+	}
+
+	for (auto &v : dd->args) {
+		if (v.deferred() && !shared)
+			reachable(&v.expression(), owners, owner, shared);
+	}
+}
+
+bool DynamicDeferred::disjoint(const std::vector <DynamicDeferred *> &roots)
+{
+	std::unordered_map <DynamicDeferred *, size_t> owners;
+	bool shared = false;
+	for (size_t i = 0; i < roots.size() && !shared; i++)
+		reachable(roots[i], owners, i, shared);
+
+	return !shared;
+}
+
+// Branches are nodes with at least two distinct inputs that are computed
+bool Graph::concurrent() const
+{
+	if (!Scheduler::concurrent())
+		return false;
+
+	bool branching = false;
+	size_t work = 0;
+	for (const Node &node : nodes) {
+		if (!node.ftn) {
+			work += node.value.shape ? node.value.shape->elements() : 0;
+			continue;
+		}
+
+		for (Tensor *p : node.ftn->parameters())
+			work += p->buffer.elements;
+
+		std::vector <size_t> computed;
+		for (size_t index : node.inputs) {
+			if (nodes[index].ftn && std::find(computed.begin(), computed.end(), index) == computed.end())
+				computed.push_back(index);
+		}
+
+		branching = branching || computed.size() > 1;
+	}
+
+	return branching && work >= 2 * TASK_THRESHOLD;
+}
+
+// Runs the given node in place, then waits for the tasks it leads to
+static void run_tasks(Scheduler::Group &group, const std::function <void (size_t)> &task, size_t index)
+{
+	std::exception_ptr error;
+	try {
+		task(index);
+	} catch (...) {
+		error = std::current_exception();
+	}
+
+	Scheduler::wait(group);
+	if (error)
+		std::rethrow_exception(error);
+}
+
+// A node runs once all of its inputs have their values
+void Graph::forward_tasks(bool retain)
+{
+	size_t n = nodes.size();
+
+	std::vector <std::vector <size_t>> consumers(n);
+	std::vector <std::atomic <size_t>> waiting(n);
+	std::vector <std::atomic <size_t>> remaining(n);
+	for (size_t i = 0; i < n; i++) {
+		for (size_t index : nodes[i].inputs)
+			consumers[index].push_back(i);
+
+		waiting[i] = nodes[i].inputs.size();
+		remaining[i] = nodes[i].consumers;
+	}
+
+	Scheduler::Group group;
+	std::function <void (size_t)> evaluate = [&](size_t i) {
+		Node &node = nodes[i];
+		if (node.ftn && !node.value.shape) {
+			tensor_list args;
+			for (size_t index : node.inputs)
+				args.push_back(nodes[index].value);
+
+			node.value = node.ftn->call_forward(args);
+		}
+
+		if (!retain) {
+			for (size_t index : node.inputs) {
+				if (--remaining[index] == 0 && nodes[index].ftn)
+					nodes[index].value = Tensor {};
+			}
+		}
+
+		for (size_t c : consumers[i]) {
+			if (--waiting[c] == 0)
+				Scheduler::spawn(group, [&, c]() { evaluate(c); });
+		}
+	};
+
+	for (size_t i = 0; i < n; i++) {
+		if (nodes[i].inputs.empty())
+			run_tasks(group, evaluate, i);
+	}
+}
+
+Tensor Graph::forward(bool retain)
+{
+	if (concurrent()) {
+		forward_tasks(retain);
+		return nodes.back().value;
+	}
+
+	std::vector <size_t> remaining(nodes.size());
+	for (size_t i = 0; i < nodes.size(); i++)
+		remaining[i] = nodes[i].consumers;
+
+	for (Node &node : nodes) {
+		if (node.ftn && !node.value.shape) {
+			tensor_list args;
+			for (size_t index : node.inputs)
+				args.push_back(nodes[index].value);
+
+			node.value = node.ftn->call_forward(args);
+		}
+
+		if (retain)
+			continue;
+
+		for (size_t index : node.inputs) {
+			if (--remaining[index] == 0 && nodes[index].ftn)
+				nodes[index].value = Tensor {};
+		}
+	}
+
+	return nodes.back().value;
+}
+
+// Sums into the running total, which is never modified in place since
+// deltas may be shared between several nodes
+static void accumulate(Tensor &total, const Tensor &delta)
+{
+	if (!delta.shape)
+		return;
+
+	if (!total.shape) {
+		total = delta;
+		return;
+	}
+
+	if (total.shape != delta.shape || total.buffer.type != delta.buffer.type) {
+		fmt::print("{} {} cannot accumulate a delta of shape {} into one of shape {}.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(graph)"),
+				*delta.shape, *total.shape);
+		return;
+	}
+
+	Tensor A = total.contiguous();
+	Tensor B = delta.contiguous();
+	Tensor sum = Tensor::blank_like(A);
+	type_dispatch(A.buffer.type, [&] <typename T> () {
+		kernel_ewop <kadd, T> (A.buffer, B.buffer, sum.buffer);
+	});
+
+	total = sum;
+}
+
+// A node pulls back once all of its consumers have; the deltas from them
+// are summed in the order of a pass in sequence
+void Graph::backward_tasks(std::vector <Tensor> &deltas, std::vector <Tape> &recorded, const Tape &parameters)
+{
+	size_t n = nodes.size();
+
+	struct Contribution {
+		size_t consumer;
+		size_t k;
+		Tensor delta;
+	};
+
+	std::vector <std::vector <Contribution>> contributions(n);
+	std::vector <std::mutex> locks(n);
+	std::vector <std::atomic <size_t>> remaining(n);
+	for (size_t i = 0; i < n; i++)
+		remaining[i] = nodes[i].consumers;
+
+	Scheduler::Group group;
+	std::function <void (size_t)> pull = [&](size_t i) {
+		Node &node = nodes[i];
+		if (deltas[i].shape) {
+			tensor_list args;
+			for (size_t index : node.inputs)
+				args.push_back(nodes[index].value);
+
+			recorded[i] = parameters;
+			tensor_list input_deltas = node.ftn->call_pullback(args, deltas[i].contiguous(), recorded[i]);
+			for (size_t k = 0; k < node.inputs.size() && k < input_deltas.size(); k++) {
+				size_t index = node.inputs[k];
+				std::lock_guard guard(locks[index]);
+				contributions[index].push_back({ i, k, input_deltas[k] });
+			}
+		}
+
+		deltas[i] = Tensor {};
+		for (size_t index : node.inputs) {
+			if (--remaining[index] > 0)
+				continue;
+
+			auto &cs = contributions[index];
+			std::sort(cs.begin(), cs.end(), [](const Contribution &a, const Contribution &b) {
+				return (a.consumer != b.consumer) ? a.consumer > b.consumer : a.k < b.k;
+			});
+
+			for (const Contribution &c : cs)
+				accumulate(deltas[index], c.delta);
+
+			cs.clear();
+			if (nodes[index].ftn) {
+				nodes[index].value = Tensor {};
+				Scheduler::spawn(group, [&, index]() { pull(index); });
+			}
+		}
+	};
+
+	if (nodes.back().ftn)
+		run_tasks(group, pull, n - 1);
+}
+
+tensor_list Graph::backward(const Tensor &delta, Tape &tape)
+{
+	std::vector <Tensor> deltas(nodes.size());
+	deltas.back() = delta.contiguous();
+
+	std::vector <size_t> remaining(nodes.size());
+	for (size_t i = 0; i < nodes.size(); i++)
+		remaining[i] = nodes[i].consumers;
+
+	// Functions only record the gradients of their parameters on the tape;
+	// those of leaves are accumulated here instead
+	Tape parameters;
+	for (const auto &[tag, t] : tape)
+		parameters[tag] = Tensor {};
+	for (size_t index : leaves)
+		parameters.erase(nodes[index].value.tag);
+
+	bool tasks = concurrent();
+	if (tasks) {
+		std::vector <Tape> recorded(nodes.size());
+		backward_tasks(deltas, recorded, parameters);
+		for (long int i = nodes.size() - 1; i >= 0; i--) {
+			for (const auto &[tag, t] : recorded[i])
+				accumulate(tape[tag], t);
+		}
+	}
+
+	for (long int i = nodes.size() - 1; i >= 0 && !tasks; i--) {
+		Node &node = nodes[i];
+		if (!node.ftn)
+			continue;
+
+		if (deltas[i].shape) {
+			tensor_list args;
+			for (size_t index : node.inputs)
+				args.push_back(nodes[index].value);
+
+			Tape recorded = parameters;
+			tensor_list input_deltas = node.ftn->call_pullback(args, deltas[i].contiguous(), recorded);
+			for (const auto &[tag, t] : recorded)
+				accumulate(tape[tag], t);
+
+			for (size_t k = 0; k < node.inputs.size() && k < input_deltas.size(); k++)
+				accumulate(deltas[node.inputs[k]], input_deltas[k]);
+		}
+
+		deltas[i] = Tensor {};
+		for (size_t index : node.inputs) {
+			if (--remaining[index] == 0 && nodes[index].ftn)
+				nodes[index].value = Tensor {};
+		}
+	}
+
+	tensor_list leaf_deltas;
+	for (size_t index : leaves)
+		leaf_deltas.push_back(deltas[index]);
+
+	for (size_t i = 0; i < nodes.size(); i++) {
+		long long int tag = nodes[i].value.tag;
+		if (!nodes[i].ftn && tape.contains(tag))
+			accumulate(tape[tag], deltas[i]);
+	}
+
+	return leaf_deltas;
+}
+
+tensor_list Graph::backward(Tape &tape)
+{
+	// TODO: check for dimension of output?
+	return backward(Tensor::ones({}, nodes.back().value.buffer.type), tape);
+}
+
+// Lazy expressions pull back through their graph
+tensor_list DynamicDeferred::pullback(const Tensor &delta, Tape &tape) const
+{
+	Graph graph = Graph::from(*this);
+	graph.forward();
+	return graph.backward(delta, tape);
+}
+
+tensor_list DynamicDeferred::backward(Tape &tape) const
+{
+	Graph graph = Graph::from(*this);
+	graph.forward();
+	return graph.backward(tape);
+}
+
 // Converting proxy chains
 ChainProxy::operator Chain()
 {
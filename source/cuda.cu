@@ -0,0 +1,284 @@
+#include <cublas_v2.h>
+#include <cuda_runtime.h>
+
+#include <fmt/color.h>
+
+#include "device.hpp"
+
+// Work is submitted to a single non-blocking stream, and device memory is
+// served from the stream ordered pool of the device, which keeps freed
+// blocks for reuse instead of returning them to the driver
+struct cuda_context {
+	cudaStream_t stream;
+	cublasHandle_t blas;
+
+	cuda_context() {
+		cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking);
+		cublasCreate(&blas);
+		cublasSetStream(blas, stream);
+
+		int device = 0;
+		cudaGetDevice(&device);
+
+		cudaMemPool_t pool;
+		cudaDeviceGetDefaultMemPool(&pool, device);
+
+		uint64_t threshold = UINT64_MAX;
+		cudaMemPoolSetAttribute(pool, cudaMemPoolAttrReleaseThreshold, &threshold);
+	}
+
+	~cuda_context() {
+		cudaStreamSynchronize(stream);
+		cublasDestroy(blas);
+		cudaStreamDestroy(stream);
+	}
+};
+
+static cuda_context &context()
+{
+	static cuda_context ctx;
+	return ctx;
+}
+
+static bool check(cudaError_t status, const char *const what)
+{
+	if (status == cudaSuccess)
+		return true;
+
+	fmt::print("{} {} {} failed: {}.\n",
+			fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+			fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(cuda)"),
+			what, cudaGetErrorString(status));
+
+	return false;
+}
+
+// Memory
+void *cuda_allocate(size_t bytes)
+{
+	void *ptr = nullptr;
+	if (!check(cudaMallocAsync(&ptr, std::max(bytes, size_t(1)), context().stream), "cudaMallocAsync"))
+		return nullptr;
+
+	return ptr;
+}
+
+void cuda_release(void *ptr)
+{
+	check(cudaFreeAsync(ptr, context().stream), "cudaFreeAsync");
+}
+
+void cuda_copy(void *dst, Resource::Device dst_device, const void *src, Resource::Device src_device, size_t bytes)
+{
+	cudaMemcpyKind kind = cudaMemcpyDeviceToDevice;
+	if (src_device == Resource::eCPU)
+		kind = (dst_device == Resource::eCPU) ? cudaMemcpyHostToHost : cudaMemcpyHostToDevice;
+	else if (dst_device == Resource::eCPU)
+		kind = cudaMemcpyDeviceToHost;
+
+	check(cudaMemcpyAsync(dst, src, bytes, kind, context().stream), "cudaMemcpyAsync");
+
+	// The host may read the destination right away
+	if (dst_device == Resource::eCPU)
+		cuda_synchronize();
+}
+
+void cuda_synchronize()
+{
+	check(cudaStreamSynchronize(context().stream), "cudaStreamSynchronize");
+}
+
+// Kernels; grid stride loops over a bounded grid
+static constexpr unsigned int CUDA_BLOCK = 256;
+static constexpr unsigned int CUDA_MAX_GRID = 4096;
+
+static unsigned int grid(size_t n)
+{
+	size_t blocks = (n + CUDA_BLOCK - 1) / CUDA_BLOCK;
+	return std::max(std::min(blocks, size_t(CUDA_MAX_GRID)), size_t(1));
+}
+
+template <typename T>
+__global__ void fill(T *x, T value, size_t n)
+{
+	for (size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += blockDim.x * gridDim.x)
+		x[i] = value;
+}
+
+template <typename T>
+void cuda_kernel_fill(const Resource &A, T value)
+{
+	size_t n = A.elements;
+	fill <<< grid(n), CUDA_BLOCK, 0, context().stream >>> (A.data <T> (), value, n);
+}
+
+template <ewop_mode op, typename T>
+__global__ void ewop(const T *a, const T *b, T *c, size_t n)
+{
+	for (size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += blockDim.x * gridDim.x) {
+		if constexpr (op == kadd)
+			c[i] = a[i] + b[i];
+		if constexpr (op == ksub)
+			c[i] = a[i] - b[i];
+		if constexpr (op == kmul)
+			c[i] = a[i] * b[i];
+		if constexpr (op == kdiv)
+			c[i] = a[i] / b[i];
+	}
+}
+
+template <ewop_mode op, typename T>
+void cuda_kernel_ewop(const Resource &A, const Resource &B, Resource &C)
+{
+	size_t n = A.elements;
+	ewop <op, T> <<< grid(n), CUDA_BLOCK, 0, context().stream >>> (A.data <T> (), B.data <T> (), C.data <T> (), n);
+}
+
+template <typename T>
+__global__ void activation(const T *a, T *c, size_t n, gemm_activation act)
+{
+	for (size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += blockDim.x * gridDim.x) {
+		T x = a[i];
+		if (act == gemm_relu)
+			x = (x > 0) ? x : T(0);
+		if (act == gemm_sigmoid)
+			x = T(1) / (T(1) + exp(-x));
+		c[i] = x;
+	}
+}
+
+template <typename T>
+void cuda_kernel_activation(const Resource &A, Resource &C, gemm_activation act)
+{
+	size_t n = A.elements;
+	activation <<< grid(n), CUDA_BLOCK, 0, context().stream >>> (A.data <T> (), C.data <T> (), n, act);
+}
+
+// One thread per output of A as (outer, n, inner), accumulating in double
+// precision as on the host
+template <reduce_mode op, typename T>
+__global__ void reduce(const T *a, T *c, size_t outer, size_t n, size_t inner)
+{
+	for (size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < outer * inner; i += blockDim.x * gridDim.x) {
+		const T *row = a + (i / inner) * n * inner + (i % inner);
+		if constexpr (op == kmax || op == kargmax) {
+			T best = row[0];
+			size_t index = 0;
+			for (size_t j = 1; j < n; j++) {
+				if (row[j * inner] > best) {
+					best = row[j * inner];
+					index = j;
+				}
+			}
+
+			c[i] = (op == kmax) ? best : T(index);
+		} else {
+			double sum = 0.0;
+			for (size_t j = 0; j < n; j++)
+				sum += row[j * inner];
+
+			c[i] = (op == kmean) ? sum / n : sum;
+		}
+	}
+}
+
+template <reduce_mode op, typename T>
+void cuda_kernel_reduce(const Resource &A, Resource &C, size_t outer, size_t n, size_t inner)
+{
+	reduce <op, T> <<< grid(outer * inner), CUDA_BLOCK, 0, context().stream >>> (A.data <T> (), C.data <T> (), outer, n, inner);
+}
+
+// Bias and activation over C (N x K, row major)
+template <typename T>
+__global__ void epilogue(T *c, const T *bias, size_t N, size_t K, gemm_activation act)
+{
+	for (size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < N * K; i += blockDim.x * gridDim.x) {
+		T x = c[i] + (bias ? bias[i % K] : T(0));
+		if (act == gemm_relu)
+			x = (x > 0) ? x : T(0);
+		if (act == gemm_sigmoid)
+			x = T(1) / (T(1) + exp(-x));
+		c[i] = x;
+	}
+}
+
+// Row major operands with strides (rs, cs) are column major transposes
+// when cs is unit, and column major as is when rs is unit; the leading
+// dimension must cover the rows of the column major matrix in either case
+static bool blas_operand(size_t rs, size_t cs, size_t rows, size_t cols, cublasOperation_t &op, int &ld)
+{
+	if (cs == 1) {
+		op = CUBLAS_OP_N;
+		ld = std::max(rs, cols);
+		return true;
+	}
+
+	if (rs == 1) {
+		op = CUBLAS_OP_T;
+		ld = std::max(cs, rows);
+		return true;
+	}
+
+	return false;
+}
+
+static cublasStatus_t blas_gemm(cublasOperation_t opB, cublasOperation_t opA, int K, int N, int M,
+		const float *B, int ldb, const float *A, int lda, float *C)
+{
+	const float one = 1.0f;
+	const float zero = 0.0f;
+	return cublasSgemm(context().blas, opB, opA, K, N, M, &one, B, ldb, A, lda, &zero, C, K);
+}
+
+static cublasStatus_t blas_gemm(cublasOperation_t opB, cublasOperation_t opA, int K, int N, int M,
+		const double *B, int ldb, const double *A, int lda, double *C)
+{
+	const double one = 1.0;
+	const double zero = 0.0;
+	return cublasDgemm(context().blas, opB, opA, K, N, M, &one, B, ldb, A, lda, &zero, C, K);
+}
+
+template <typename T>
+void cuda_kernel_gemm_bias(const Resource &A, size_t rsA, size_t csA, const Resource &B, size_t rsB, size_t csB,
+		const Resource *bias, Resource &C, size_t N, size_t M, size_t K, gemm_activation act)
+{
+	if (M == 0) {
+		cuda_kernel_fill <T> (C, T(0));
+	} else {
+		// C^T = B^T A^T in column major terms, which is C in row major
+		cublasOperation_t opA;
+		cublasOperation_t opB;
+		int lda;
+		int ldb;
+
+		if (!blas_operand(rsA, csA, N, M, opA, lda) || !blas_operand(rsB, csB, M, K, opB, ldb)) {
+			fmt::print("{} {} operands need a unit stride along one of their dimensions.\n",
+					fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+					fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(cuda)"));
+			return;
+		}
+
+		blas_gemm(opB, opA, K, N, M, B.data <T> (), ldb, A.data <T> (), lda, C.data <T> ());
+	}
+
+	if (bias || act != gemm_identity) {
+		const T *b = bias ? bias->data <T> () : nullptr;
+		epilogue <<< grid(N * K), CUDA_BLOCK, 0, context().stream >>> (C.data <T> (), b, N, K, act);
+	}
+}
+
+#define INSTANTIATE_CUDA_KERNELS(T) \
+	template void cuda_kernel_fill <T> (const Resource &, T); \
+	template void cuda_kernel_ewop <kadd, T> (const Resource &, const Resource &, Resource &); \
+	template void cuda_kernel_ewop <ksub, T> (const Resource &, const Resource &, Resource &); \
+	template void cuda_kernel_ewop <kmul, T> (const Resource &, const Resource &, Resource &); \
+	template void cuda_kernel_ewop <kdiv, T> (const Resource &, const Resource &, Resource &); \
+	template void cuda_kernel_activation <T> (const Resource &, Resource &, gemm_activation); \
+	template void cuda_kernel_reduce <ksum, T> (const Resource &, Resource &, size_t, size_t, size_t); \
+	template void cuda_kernel_reduce <kmean, T> (const Resource &, Resource &, size_t, size_t, size_t); \
+	template void cuda_kernel_reduce <kmax, T> (const Resource &, Resource &, size_t, size_t, size_t); \
+	template void cuda_kernel_reduce <kargmax, T> (const Resource &, Resource &, size_t, size_t, size_t); \
+	template void cuda_kernel_gemm_bias <T> (const Resource &, size_t, size_t, const Resource &, size_t, size_t, const Resource *, Resource &, size_t, size_t, size_t, gemm_activation);
+
+INSTANTIATE_CUDA_KERNELS(float)
+INSTANTIATE_CUDA_KERNELS(double)
@@ -0,0 +1,326 @@
+#include <numeric>
+
+#include "dataset.hpp"
+
+// IDX files
+std::optional <IDX> IDX::from(const std::filesystem::path &path)
+{
+	static constexpr unsigned char UNSIGNED_BYTE = 0x08;
+
+	auto file = MappedFile::from(path);
+	if (!file)
+		return std::nullopt;
+
+	auto invalid = [&](const char *const reason) {
+		fmt::print("{} {} {}: {}.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(idx)"),
+				path.string(), reason);
+		return std::nullopt;
+	};
+
+	const unsigned char *bytes = file->data;
+	if (file->size < 4 || bytes[0] != 0 || bytes[1] != 0)
+		return invalid("not an IDX file");
+
+	if (bytes[2] != UNSIGNED_BYTE)
+		return invalid("only unsigned byte elements are supported");
+
+	size_t ndims = bytes[3];
+	size_t header = 4 + 4 * ndims;
+	if (ndims == 0 || file->size < header)
+		return invalid("truncated header");
+
+	IDX idx;
+	idx.file = file;
+	for (size_t i = 0; i < ndims; i++) {
+		const unsigned char *d = &bytes[4 + 4 * i];
+		idx.dims.push_back((size_t(d[0]) << 24) | (size_t(d[1]) << 16) | (size_t(d[2]) << 8) | size_t(d[3]));
+	}
+
+	idx.elements = bytes + header;
+	if (file->size < header + idx.items() * idx.item_size())
+		return invalid("truncated elements");
+
+	return idx;
+}
+
+// Datasets over IDX files
+std::optional <IDXDataset> IDXDataset::from(const std::filesystem::path &images, const std::filesystem::path &labels, size_t classes)
+{
+	auto X = IDX::from(images);
+	auto Y = IDX::from(labels);
+	if (!X || !Y)
+		return std::nullopt;
+
+	if (X->items() != Y->items() || Y->item_size() != 1) {
+		fmt::print("{} {} {} and {} do not hold matching images and labels.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(dataset)"),
+				images.string(), labels.string());
+		return std::nullopt;
+	}
+
+	IDXDataset dataset;
+	dataset.images = *X;
+	dataset.labels = *Y;
+	dataset.classes = classes;
+	return dataset;
+}
+
+void IDXDataset::decode(const size_t *indices, size_t count, Tensor &X, Tensor &Y) const
+{
+	size_t F = features();
+	size_t C = classes;
+
+	type_dispatch(X.buffer.type, [&] <typename T> () {
+		T *x = X.buffer.data <T> ();
+		T *y = Y.buffer.data <T> ();
+
+		constexpr T scale = T(1) / T(255);
+		for (size_t i = 0; i < count; i++) {
+			const unsigned char *pixels = images.item(indices[i]);
+			T *row = &x[i * F];
+
+			#pragma omp simd
+			for (size_t j = 0; j < F; j++)
+				row[j] = pixels[j] * scale;
+
+			unsigned char label = *labels.item(indices[i]);
+			std::fill(&y[i * C], &y[(i + 1) * C], T(0));
+			if (label < C)
+				y[i * C + label] = 1;
+		}
+	});
+}
+
+// Datasets resident in tensors
+void TensorDataset::decode(const size_t *indices, size_t count, Tensor &bX, Tensor &bY) const
+{
+	size_t x_row = X.buffer.bytes() / size();
+	size_t y_row = Y.buffer.bytes() / size();
+
+	const char *x = X.buffer.data <char> ();
+	const char *y = Y.buffer.data <char> ();
+	char *dx = bX.buffer.data <char> ();
+	char *dy = bY.buffer.data <char> ();
+
+	for (size_t i = 0; i < count; i++) {
+		std::memcpy(&dx[i * x_row], &x[indices[i] * x_row], x_row);
+		std::memcpy(&dy[i * y_row], &y[indices[i] * y_row], y_row);
+	}
+}
+
+std::optional <std::pair <Tensor, Tensor>> TensorDataset::view(size_t start, size_t end) const
+{
+	return std::make_pair(X.slice(start, end), Y.slice(start, end));
+}
+
+TensorDataset TensorDataset::from(const Dataset &source, size_t limit)
+{
+	// Chunks of rows are decoded in parallel
+	static constexpr size_t DECODE_CHUNK = 256;
+
+	size_t N = limit ? std::min(limit, source.size()) : source.size();
+
+	TensorDataset dataset;
+	dataset.X = Tensor::blank({ N, source.features() }, source.type());
+	dataset.Y = Tensor::blank({ N, source.targets() }, source.type());
+
+	std::vector <size_t> indices(N);
+	std::iota(indices.begin(), indices.end(), 0);
+
+	// Views are made up front, since tagging is not thread safe
+	std::vector <std::pair <Tensor, Tensor>> chunks;
+	for (size_t start = 0; start < N; start += DECODE_CHUNK)
+		chunks.push_back(*dataset.view(start, std::min(start + DECODE_CHUNK, N)));
+
+	#pragma omp parallel for schedule(dynamic)
+	for (size_t c = 0; c < chunks.size(); c++) {
+		auto &[X, Y] = chunks[c];
+		source.decode(&indices[c * DECODE_CHUNK], X.shape.value()[0], X, Y);
+	}
+
+	return dataset;
+}
+
+// Caches are archives of both tensors
+bool TensorDataset::save(const std::filesystem::path &path) const
+{
+	Archive archive;
+	archive.tensors["X"] = X;
+	archive.tensors["Y"] = Y;
+	return archive.save(path);
+}
+
+std::optional <TensorDataset> TensorDataset::load(const std::filesystem::path &path)
+{
+	if (!std::filesystem::exists(path))
+		return std::nullopt;
+
+	auto archive = Archive::load(path);
+	if (!archive)
+		return std::nullopt;
+
+	auto X = archive->tensors.find("X");
+	auto Y = archive->tensors.find("Y");
+	if (X == archive->tensors.end() || Y == archive->tensors.end()
+			|| X->second.shape->size() != 2 || Y->second.shape->size() != 2
+			|| X->second.shape.value()[0] != Y->second.shape.value()[0]
+			|| X->second.buffer.type != Y->second.buffer.type) {
+		fmt::print("{} {} ignoring invalid dataset cache {}.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(dataset)"),
+				path.string());
+		return std::nullopt;
+	}
+
+	TensorDataset dataset;
+	dataset.X = X->second;
+	dataset.Y = Y->second;
+	return dataset;
+}
+
+// Loading batches
+DataLoader::DataLoader(const std::shared_ptr <const Dataset> &source, const Options &opts)
+		: dataset(source), options(opts), rng(opts.seed)
+{
+	options.batch_size = std::max(options.batch_size, size_t(1));
+
+	size_t N = dataset->size();
+	count = options.drop_last ? N / options.batch_size : (N + options.batch_size - 1) / options.batch_size;
+	views = (options.shuffle != samples) && dataset->view(0, std::min(options.batch_size, N));
+
+	prepare(0);
+	if (views || count == 0)
+		return;
+
+	// A ring deeper than an epoch would hold batches from three epochs
+	size_t depth = std::clamp(options.prefetch, size_t(1), count);
+	ring.resize(depth);
+	for (Slot &slot : ring) {
+		slot.X = Tensor::blank({ options.batch_size, dataset->features() }, dataset->type());
+		slot.Y = Tensor::blank({ options.batch_size, dataset->targets() }, dataset->type());
+	}
+
+	for (size_t i = 0; i < std::max(options.workers, size_t(1)); i++)
+		threads.emplace_back(&DataLoader::work, this);
+}
+
+DataLoader::~DataLoader()
+{
+	{
+		std::lock_guard <std::mutex> guard(lock);
+		stopping = true;
+	}
+
+	consumed.notify_all();
+	for (std::thread &thread : threads)
+		thread.join();
+}
+
+std::unique_ptr <DataLoader> DataLoader::from(const std::shared_ptr <const Dataset> &dataset, const Options &options)
+{
+	return std::make_unique <DataLoader> (dataset, options);
+}
+
+// Orders for the given epoch
+void DataLoader::prepare(size_t epoch)
+{
+	std::vector <size_t> &samples_order = order[epoch & 1];
+	std::vector <size_t> &batches_order = batch_order[epoch & 1];
+
+	samples_order.resize(dataset->size());
+	std::iota(samples_order.begin(), samples_order.end(), 0);
+	if (options.shuffle == samples)
+		std::shuffle(samples_order.begin(), samples_order.end(), rng);
+
+	batches_order.resize(count);
+	std::iota(batches_order.begin(), batches_order.end(), 0);
+	if (options.shuffle == batches)
+		std::shuffle(batches_order.begin(), batches_order.end(), rng);
+}
+
+// First sample (in the order of its epoch) and number of samples of a batch
+std::pair <size_t, size_t> DataLoader::locate(size_t k) const
+{
+	size_t b = batch_order[(k / count) & 1][k % count];
+	size_t start = b * options.batch_size;
+	return { start, std::min(options.batch_size, dataset->size() - start) };
+}
+
+void DataLoader::work()
+{
+	std::unique_lock <std::mutex> guard(lock);
+	while (true) {
+		consumed.wait(guard, [&]() {
+			return stopping || ring[issued % ring.size()].state == Slot::empty;
+		});
+
+		if (stopping)
+			return;
+
+		size_t k = issued++;
+		if (k % count == 0 && k > 0)
+			prepare(k / count);
+
+		Slot &slot = ring[k % ring.size()];
+		slot.state = Slot::filling;
+
+		auto [start, n] = locate(k);
+		const size_t *indices = &order[(k / count) & 1][start];
+
+		guard.unlock();
+		dataset->decode(indices, n, slot.X, slot.Y);
+		guard.lock();
+
+		slot.count = n;
+		slot.state = Slot::ready;
+		produced.notify_all();
+	}
+}
+
+std::optional <Batch> DataLoader::next()
+{
+	if (count == 0)
+		return std::nullopt;
+
+	// End of an epoch, reported once
+	if (delivered > 0 && delivered % count == 0 && !boundary) {
+		boundary = true;
+		return std::nullopt;
+	}
+
+	boundary = false;
+
+	size_t k = delivered++;
+	if (views) {
+		if (k % count == 0 && k > 0)
+			prepare(k / count);
+
+		auto [start, n] = locate(k);
+		auto [X, Y] = *dataset->view(start, start + n);
+		return Batch { X, Y };
+	}
+
+	std::unique_lock <std::mutex> guard(lock);
+
+	// The previous batch is no longer in use
+	if (k > 0) {
+		ring[(k - 1) % ring.size()].state = Slot::empty;
+		consumed.notify_all();
+	}
+
+	Slot &slot = ring[k % ring.size()];
+	produced.wait(guard, [&]() { return slot.state == Slot::ready; });
+	slot.state = Slot::held;
+
+	// Fresh tags, since the buffers are reused
+	if (slot.count < options.batch_size)
+		return Batch { slot.X.slice(0, slot.count), slot.Y.slice(0, slot.count) };
+
+	return Batch {
+		Tensor { slot.X.buffer, *slot.X.shape, Tensor::tagger() },
+		Tensor { slot.Y.buffer, *slot.Y.shape, Tensor::tagger() }
+	};
+}
@@ -0,0 +1,468 @@
+#include <cerrno>
+#include <chrono>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "distributed.hpp"
+
+// How long to wait for the neighbours of a rank to come up
+static constexpr std::chrono::seconds CONNECT_TIMEOUT { 60 };
+
+static void report(const std::string &message)
+{
+	fmt::print("{} {} {}\n",
+			fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+			fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(distributed)"),
+			message);
+}
+
+static std::optional <std::pair <std::string, std::string>> split_endpoint(const std::string &endpoint)
+{
+	size_t colon = endpoint.rfind(':');
+	if (colon == std::string::npos || colon + 1 == endpoint.size())
+		return std::nullopt;
+
+	return std::make_pair(endpoint.substr(0, colon), endpoint.substr(colon + 1));
+}
+
+static addrinfo *resolve(const char *host, const std::string &port)
+{
+	addrinfo hints {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = host ? 0 : AI_PASSIVE;
+
+	addrinfo *result = nullptr;
+	if (getaddrinfo(host, port.c_str(), &hints, &result) != 0)
+		return nullptr;
+
+	return result;
+}
+
+static bool send_all(int fd, const char *data, size_t bytes)
+{
+	while (bytes > 0) {
+		ssize_t n = send(fd, data, bytes, MSG_NOSIGNAL);
+		if (n <= 0)
+			return false;
+
+		data += n;
+		bytes -= n;
+	}
+
+	return true;
+}
+
+static bool recv_all(int fd, char *data, size_t bytes)
+{
+	while (bytes > 0) {
+		ssize_t n = recv(fd, data, bytes, 0);
+		if (n <= 0)
+			return false;
+
+		data += n;
+		bytes -= n;
+	}
+
+	return true;
+}
+
+ProcessGroup::~ProcessGroup()
+{
+	if (next >= 0)
+		close(next);
+	if (previous >= 0)
+		close(previous);
+}
+
+std::unique_ptr <ProcessGroup> ProcessGroup::from(size_t rank, const std::vector <std::string> &endpoints)
+{
+	if (rank >= endpoints.size()) {
+		report(fmt::format("rank {} is out of range for {} endpoints.", rank, endpoints.size()));
+		return nullptr;
+	}
+
+	std::unique_ptr <ProcessGroup> group(new ProcessGroup());
+	group->rank = rank;
+	group->size = endpoints.size();
+	if (group->size == 1)
+		return group;
+
+	auto own = split_endpoint(endpoints[rank]);
+	auto target = split_endpoint(endpoints[(rank + 1) % group->size]);
+	if (!own || !target) {
+		report("endpoints must be of the form host:port.");
+		return nullptr;
+	}
+
+	// Listening first, so that the previous rank can connect in the meantime
+	addrinfo *local = resolve(nullptr, own->second);
+	if (!local) {
+		report(fmt::format("cannot resolve the port of {}.", endpoints[rank]));
+		return nullptr;
+	}
+
+	int listener = socket(local->ai_family, local->ai_socktype, local->ai_protocol);
+	int enable = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+	bool listening = listener >= 0
+			&& bind(listener, local->ai_addr, local->ai_addrlen) == 0
+			&& listen(listener, 1) == 0;
+
+	freeaddrinfo(local);
+	if (!listening) {
+		report(fmt::format("cannot listen on {}.", endpoints[rank]));
+		if (listener >= 0)
+			close(listener);
+		return nullptr;
+	}
+
+	// Retrying until the next rank listens
+	addrinfo *remote = resolve(target->first.c_str(), target->second);
+	auto deadline = std::chrono::steady_clock::now() + CONNECT_TIMEOUT;
+	while (remote && std::chrono::steady_clock::now() < deadline) {
+		group->next = socket(remote->ai_family, remote->ai_socktype, remote->ai_protocol);
+		if (connect(group->next, remote->ai_addr, remote->ai_addrlen) == 0)
+			break;
+
+		close(group->next);
+		group->next = -1;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	if (remote)
+		freeaddrinfo(remote);
+
+	uint64_t self = rank;
+	if (group->next < 0 || !send_all(group->next, (const char *) &self, sizeof(self))) {
+		report(fmt::format("cannot connect to rank {} at {}.",
+				(rank + 1) % group->size, endpoints[(rank + 1) % group->size]));
+		close(listener);
+		return nullptr;
+	}
+
+	setsockopt(group->next, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+	// The previous rank announces itself
+	pollfd incoming { listener, POLLIN, 0 };
+	if (poll(&incoming, 1, std::chrono::milliseconds(CONNECT_TIMEOUT).count()) > 0)
+		group->previous = accept(listener, nullptr, nullptr);
+
+	close(listener);
+
+	uint64_t other = -1;
+	size_t expected = (rank + group->size - 1) % group->size;
+	if (group->previous < 0 || !recv_all(group->previous, (char *) &other, sizeof(other)) || other != expected) {
+		report(fmt::format("rank {} did not connect to {}.", expected, endpoints[rank]));
+		return nullptr;
+	}
+
+	return group;
+}
+
+bool ProcessGroup::exchange(const char *out, size_t out_bytes, char *in, size_t in_bytes)
+{
+	while (out_bytes > 0 || in_bytes > 0) {
+		pollfd fds[2] {
+			{ next, short(out_bytes > 0 ? POLLOUT : 0), 0 },
+			{ previous, short(in_bytes > 0 ? POLLIN : 0), 0 },
+		};
+
+		if (poll(fds, 2, -1) < 0)
+			return false;
+
+		if (fds[0].revents & (POLLERR | POLLHUP) || fds[1].revents & POLLERR)
+			return false;
+
+		if (fds[0].revents & POLLOUT) {
+			ssize_t n = send(next, out, out_bytes, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				return false;
+
+			out += std::max(n, ssize_t(0));
+			out_bytes -= std::max(n, ssize_t(0));
+		}
+
+		if (fds[1].revents & (POLLIN | POLLHUP)) {
+			ssize_t n = recv(previous, in, in_bytes, MSG_DONTWAIT);
+			if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+				return false;
+
+			in += std::max(n, ssize_t(0));
+			in_bytes -= std::max(n, ssize_t(0));
+		}
+	}
+
+	return true;
+}
+
+bool ProcessGroup::all_reduce(const Resource &buffer)
+{
+	if (buffer.device != Resource::eCPU) {
+		report("collectives only work on host buffers.");
+		return false;
+	}
+
+	if (size == 1)
+		return true;
+
+	return type_dispatch(buffer.type, [&] <typename T> () {
+		T *data = buffer.data <T> ();
+		size_t n = buffer.elements;
+
+		auto begin = [&](size_t chunk) { return (chunk % size) * n / size; };
+		auto end = [&](size_t chunk) { return (chunk % size + 1) * n / size; };
+
+		std::vector <T> scratch(n / size + 1);
+
+		// After step s, chunk rank - s - 1 holds the sum over s + 2 ranks,
+		// so that each rank ends up with the total of chunk rank + 1
+		for (size_t s = 0; s + 1 < size; s++) {
+			size_t out = rank + size - s;
+			size_t in = rank + 2 * size - s - 1;
+
+			bool ok = exchange((const char *) (data + begin(out)), (end(out) - begin(out)) * sizeof(T),
+					(char *) scratch.data(), (end(in) - begin(in)) * sizeof(T));
+			if (!ok) {
+				report(fmt::format("rank {} lost its neighbours during a reduction.", rank));
+				return false;
+			}
+
+			T *dst = data + begin(in);
+			size_t count = end(in) - begin(in);
+
+			#pragma omp parallel for simd if (count >= MAP_PARALLEL_THRESHOLD)
+			for (size_t i = 0; i < count; i++)
+				dst[i] += scratch[i];
+		}
+
+		// Passing the totals around
+		for (size_t s = 0; s + 1 < size; s++) {
+			size_t out = rank + size + 1 - s;
+			size_t in = rank + size - s;
+
+			bool ok = exchange((const char *) (data + begin(out)), (end(out) - begin(out)) * sizeof(T),
+					(char *) (data + begin(in)), (end(in) - begin(in)) * sizeof(T));
+			if (!ok) {
+				report(fmt::format("rank {} lost its neighbours during a reduction.", rank));
+				return false;
+			}
+		}
+
+		return true;
+	});
+}
+
+bool ProcessGroup::broadcast(const Resource &buffer, size_t root)
+{
+	if (buffer.device != Resource::eCPU) {
+		report("collectives only work on host buffers.");
+		return false;
+	}
+
+	if (size == 1)
+		return true;
+
+	// Forwarded around the ring, starting from the root
+	size_t bytes = buffer.elements * Resource::element_size(buffer.type);
+	char *data = buffer.data <char> ();
+
+	bool ok = true;
+	if (rank != root)
+		ok = exchange(nullptr, 0, data, bytes);
+
+	if (ok && (rank + 1) % size != root)
+		ok = exchange(data, bytes, nullptr, 0);
+
+	if (!ok)
+		report(fmt::format("rank {} lost its neighbours during a broadcast.", rank));
+
+	return ok;
+}
+
+// Data parallel wrapper
+DataParallel::DataParallel(const std::shared_ptr <Chain> &m, ProcessGroup &g, const ParameterArena &a, const Options &options)
+		: Function("data parallel " + m->tag), model(m), group(&g), arena(a)
+{
+	// Buckets from the last parameter to the first, in the order in which the
+	// pullback is done with them
+	size_t n = arena.parameters.size();
+	size_t element_size = Resource::element_size(arena.grads.buffer.type);
+
+	bucket_of.resize(n);
+	for (size_t last = n; last > 0; ) {
+		size_t first = last - 1;
+		size_t end = last < n ? arena.offsets[last] : arena.grads.buffer.elements;
+		while (first > 0 && (end - arena.offsets[first]) * element_size < options.bucket_bytes)
+			first--;
+
+		for (size_t i = first; i < last; i++)
+			bucket_of[i] = buckets.size();
+
+		buckets.push_back({ first, last, *arena.grads.buffer.slice(arena.offsets[first], end) });
+		last = first;
+	}
+
+	for (size_t i = 0; i < n; i++)
+		index[arena.parameters[i]->tag] = i;
+
+	reducer = std::make_unique <Reducer> ();
+	reducer->group = group;
+	reducer->thread = std::thread(&Reducer::work, reducer.get());
+}
+
+DataParallel::~DataParallel()
+{
+	if (!reducer)
+		return;
+
+	{
+		std::lock_guard <std::mutex> guard(reducer->lock);
+		reducer->stopping = true;
+	}
+
+	reducer->changed.notify_all();
+	reducer->thread.join();
+}
+
+std::optional <DataParallel> DataParallel::from(const std::shared_ptr <Chain> &model, ProcessGroup &group, const Options &options)
+{
+	auto arena = ParameterArena::from(model->parameters());
+	if (!arena) {
+		report("the model has no parameters to train.");
+		return std::nullopt;
+	}
+
+	// Every rank starts from the same parameters
+	if (!group.broadcast(arena->values.buffer))
+		return std::nullopt;
+
+	return std::optional <DataParallel> (std::in_place, model, group, *arena, options);
+}
+
+void DataParallel::gather(Function &layer, const Tape &tape, std::vector <size_t> &pending, std::vector <bool> &done) const
+{
+	for (Tensor *t : layer.parameters()) {
+		auto it = index.find(t->tag);
+		if (it == index.end() || done[it->second])
+			continue;
+
+		size_t i = it->second;
+		done[i] = true;
+
+		Tensor g = arena.grad(i);
+		auto grad = tape.find(t->tag);
+		if (grad == tape.end() || !grad->second.shape || !g.copy(grad->second))
+			g.buffer.memset(0.0);
+
+		size_t b = bucket_of[i];
+		if (--pending[b] == 0)
+			reducer->submit(&buckets[b]);
+	}
+}
+
+tensor_list DataParallel::pullback_args(const tensor_list &args, const Tensor &delta, Tape &tape) const
+{
+	std::vector <size_t> pending;
+	for (const Bucket &bucket : buckets)
+		pending.push_back(bucket.last - bucket.first);
+
+	std::vector <bool> done(arena.parameters.size(), false);
+
+	bool layered = model->checkpoints.empty()
+			&& !model->node_args.empty()
+			&& args.size() == model->node_args[0].size();
+
+	for (size_t i = 0; layered && i < args.size(); i++)
+		layered = args[i].tag == model->node_args[0][i].tag;
+
+	// Layer by layer, so that reductions start early; otherwise the chain
+	// does the whole pullback (and reports mismatched arguments) first
+	tensor_list deltas;
+	if (layered) {
+		Tensor d = delta.contiguous();
+		for (long int i = model->nodes.size() - 1; i >= 0; i--) {
+			d = model->nodes[i]->call_pullback(model->node_args[i], d, tape)[0];
+			gather(*model->nodes[i], tape, pending, done);
+		}
+
+		deltas = { d };
+	} else {
+		deltas = model->call_pullback(args, delta, tape);
+	}
+
+	// Every bucket is reduced whatever happened, so that the other ranks are
+	// not left waiting
+	gather(*model, tape, pending, done);
+	if (!reducer->wait(buckets.size()))
+		report("gradients are only those of this rank after a failed reduction.");
+
+	for (size_t i = 0; i < arena.parameters.size(); i++) {
+		long long int tag = arena.parameters[i]->tag;
+		if (tape.contains(tag))
+			tape[tag] = arena.grad(i);
+	}
+
+	return deltas;
+}
+
+void DataParallel::Reducer::submit(const Bucket *bucket)
+{
+	{
+		std::lock_guard <std::mutex> guard(lock);
+		queue.push_back(bucket);
+	}
+
+	changed.notify_all();
+}
+
+bool DataParallel::Reducer::wait(size_t count)
+{
+	std::unique_lock <std::mutex> guard(lock);
+	changed.wait(guard, [&]() { return reduced >= count; });
+
+	bool ok = !failed;
+	reduced = 0;
+	failed = false;
+	return ok;
+}
+
+void DataParallel::Reducer::work()
+{
+	std::unique_lock <std::mutex> guard(lock);
+	while (true) {
+		changed.wait(guard, [&]() { return stopping || !queue.empty(); });
+		if (queue.empty())
+			return;
+
+		const Bucket *bucket = queue.front();
+		queue.pop_front();
+		guard.unlock();
+
+		// Averaged over the ranks, in place; copying the bucket would count
+		// a reference from this thread, which need not be atomic
+		const Resource &grads = bucket->grads;
+		bool ok = group->all_reduce(grads);
+		if (ok) {
+			type_dispatch(grads.type, [&] <typename T> () {
+				T *g = grads.data <T> ();
+				T k = T(1) / T(group->size);
+
+				#pragma omp parallel for simd if (grads.elements >= MAP_PARALLEL_THRESHOLD)
+				for (size_t i = 0; i < grads.elements; i++)
+					g[i] *= k;
+			});
+		}
+
+		guard.lock();
+		failed = failed || !ok;
+		reduced++;
+		changed.notify_all();
+	}
+}
@@ -1,8 +1,176 @@
 #include "gradients.hpp"
 #include "ops.hpp"
 
+// Packing parameters
+std::optional <ParameterArena> ParameterArena::from(const std::vector <Tensor *> &parameters)
+{
+	if (parameters.empty())
+		return std::nullopt;
+
+	Resource::Type type = parameters[0]->buffer.type;
+	Resource::Device device = parameters[0]->buffer.device;
+
+	size_t alignment = ALIGNMENT / Resource::element_size(type);
+	std::vector <size_t> offsets;
+
+	size_t elements = 0;
+	for (Tensor *t : parameters) {
+		if (t->buffer.type != type || t->buffer.device != device) {
+			fmt::print("{} {} parameters must share a type and device to be packed.\n",
+					fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+					fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(arena)"));
+			return std::nullopt;
+		}
+
+		offsets.push_back(elements);
+		elements += ((t->shape->elements() + alignment - 1) / alignment) * alignment;
+	}
+
+	ParameterArena arena;
+	arena.values = Tensor::zeros({ elements }, type, device);
+	arena.grads = Tensor::zeros({ elements }, type, device);
+	arena.parameters = parameters;
+	arena.offsets = offsets;
+
+	// Moving the values over, keeping the tags and shapes of the tensors
+	for (size_t i = 0; i < parameters.size(); i++) {
+		Tensor *t = parameters[i];
+		Resource slice = *arena.values.buffer.slice(offsets[i], offsets[i] + t->shape->elements());
+		slice.copy(t->contiguous().buffer);
+
+		t->buffer = slice;
+		t->strides = {};
+	}
+
+	return arena;
+}
+
+Tensor ParameterArena::grad(size_t i) const
+{
+	const Tensor *t = parameters[i];
+	Resource slice = *grads.buffer.slice(offsets[i], offsets[i] + t->shape->elements());
+	return Tensor { slice, *t->shape, Tensor::tagger() };
+}
+
+void ParameterArena::gather(const Tape &tape)
+{
+	for (size_t i = 0; i < parameters.size(); i++) {
+		Tensor g = grad(i);
+		auto it = tape.find(parameters[i]->tag);
+		if (it == tape.end() || !it->second.shape || !g.copy(it->second))
+			g.buffer.memset(0.0);
+	}
+}
+
+void ParameterArena::zero_grad()
+{
+	grads.buffer.memset(0.0);
+}
+
+double ParameterArena::clip(double max_norm)
+{
+	if (!host_accessible("clip", grads.buffer))
+		return 0.0;
+
+	// Padding between parameters is always zero
+	double norm = 0.0;
+	type_dispatch(grads.buffer.type, [&] <typename T> () {
+		T *g = grads.buffer.data <T> ();
+		size_t n = grads.buffer.elements;
+
+		double sum = 0.0;
+		#pragma omp parallel for simd reduction(+:sum) if (n >= MAP_PARALLEL_THRESHOLD)
+		for (size_t i = 0; i < n; i++)
+			sum += double(g[i]) * g[i];
+
+		norm = std::sqrt(sum);
+		if (norm <= max_norm)
+			return;
+
+		T k = max_norm / norm;
+		cpu_kernel_map <T> (grads.buffer, grads.buffer, [k](T x) { return k * x; });
+	});
+
+	return norm;
+}
+
+Tape ParameterArena::tape() const
+{
+	Tape tape;
+	tape[values.tag] = grads;
+	return tape;
+}
+
 Optimizer::~Optimizer() {}
 
+// Parameters that have a gradient on the tape, along with their states,
+// which are created on first use
+static std::vector <optimizer_slot> gather(std::unordered_map <long long int, Tensor *> &destinations,
+		const Tape &tape, const char *const name, state_map *first = nullptr, state_map *second = nullptr)
+{
+	std::vector <optimizer_slot> slots;
+	for (const auto &[tag, grad] : tape) {
+		if (!destinations.contains(tag) || !grad.shape)
+			continue;
+
+		Tensor *t = destinations[tag];
+		if (t->shape != grad.shape || !ops::matching_types(name, *t, grad) || !host_accessible(name, t->buffer))
+			continue;
+
+		// Updates run over the buffer as is, so views would be updated out of order
+		if (!t->is_contiguous()) {
+			fmt::print("{} {} cannot update a strided view of shape {} in place.\n",
+					fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+					fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "({})", name),
+					*t->shape);
+			continue;
+		}
+
+		optimizer_slot slot { t->buffer, grad.contiguous().buffer };
+		if (first) {
+			if (!first->contains(tag))
+				(*first)[tag] = Tensor::zeros_like(*t);
+			slot.first = (*first)[tag].buffer;
+		}
+
+		if (second) {
+			if (!second->contains(tag))
+				(*second)[tag] = Tensor::zeros_like(*t);
+			slot.second = (*second)[tag].buffer;
+		}
+
+		slots.push_back(slot);
+	}
+
+	return slots;
+}
+
+template <optimizer_mode op>
+static void launch(const std::vector <optimizer_slot> &slots, const optimizer_step &step, bool foreach)
+{
+	// Each launch is for a single element type
+	for (Resource::Type type : { Resource::f32, Resource::f64 }) {
+		std::vector <optimizer_slot> group;
+		for (const optimizer_slot &slot : slots) {
+			if (slot.param.type == type)
+				group.push_back(slot);
+		}
+
+		if (group.empty())
+			continue;
+
+		type_dispatch(type, [&] <typename T> () {
+			if (foreach) {
+				cpu_kernel_optimizer <op, T> (group, step);
+				return;
+			}
+
+			for (const optimizer_slot &slot : group)
+				cpu_kernel_optimizer <op, T> ({ slot }, step);
+		});
+	}
+}
+
 // Vanilla SGD optimizer
 SGD SGD::from(const std::vector <Tensor *> &dst, double lr)
 {
@@ -15,12 +183,8 @@ SGD SGD::from(const std::vector <Tensor *> &dst, double lr)
 
 void SGD::step(const Tape &tape)
 {
-	for (const auto &[tag, grad] : tape) {
-		if (destinations.contains(tag)) {
-			Tensor *t = destinations[tag];
-			t->copy(*t - lr * grad);
-		}
-	}
+	iteration++;
+	launch <ksgd> (gather(destinations, tape, "SGD"), { lr }, foreach);
 }
 
 // SGD with basic momentum
@@ -37,17 +201,8 @@ Momentum Momentum::from(const std::vector <Tensor *> &dst, double lr, double mom
 
 void Momentum::step(const Tape &tape)
 {
-	for (const auto &[tag, grad] : tape) {
-		if (destinations.contains(tag)) {
-			Tensor *t = destinations[tag];
-			if (!velocity.contains(tag))
-				velocity[tag] = Tensor::zeros_like(grad);
-
-			Tensor &m = velocity[tag];
-			m = momentum * m - lr * grad;
-			t->copy(*t + m);
-		}
-	}
+	iteration++;
+	launch <kmomentum> (gather(destinations, tape, "Momentum", &velocity), { lr, momentum }, foreach);
 }
 
 // Adam
@@ -69,36 +224,6 @@ void Adam::step(const Tape &tape)
 	constexpr double epsilon = 1e-6f;
 
 	iteration++;
-	for (const auto &[tag, grad] : tape) {
-		if (destinations.contains(tag)) {
-			Tensor *t = destinations[tag];
-
-			// Initialization if necessary
-			if (!M.contains(tag))
-				M[tag] = Tensor::zeros_like(grad);
-			if (!Mh.contains(tag))
-				Mh[tag] = Tensor::zeros_like(grad);
-			if (!S.contains(tag))
-				S[tag] = Tensor::zeros_like(grad);
-			if (!Sh.contains(tag))
-				Sh[tag] = Tensor::zeros_like(grad);
-
-			// Update
-			Tensor &Mx = M[tag];
-			Tensor &Sx = S[tag];
-
-			Mx = beta1 * Mx - (1 - beta1) * grad;
-			Sx = beta2 * Sx + (1 - beta2) * (grad * grad);
-
-			Tensor &Mhx = Mh[tag];
-			Tensor &Shx = Sh[tag];
-
-			Mhx = Mx / (1.0 - powf(beta1, iteration));
-			Shx = Sx / (1.0 - powf(beta2, iteration));
-
-			Tensor J = *t + (lr * Mhx) / sqrt(Shx + epsilon);
-
-			t->copy(J);
-		}
-	}
+	optimizer_step hyperparameters { lr, beta1, beta2, epsilon, iteration };
+	launch <kadam> (gather(destinations, tape, "Adam", &M, &S), hyperparameters, foreach);
 }
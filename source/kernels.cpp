@@ -1,23 +1,1439 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+
+#include <omp.h>
+
 #include "kernels.hpp"
 
+// Reusable, cache line aligned scratch space for packing
+template <typename T>
+struct aligned_scratch {
+	T *ptr = nullptr;
+	size_t capacity = 0;
+
+	~aligned_scratch() {
+		std::free(ptr);
+	}
+
+	T *reserve(size_t elements) {
+		if (elements > capacity) {
+			std::free(ptr);
+			size_t bytes = ((elements * sizeof(T) + 63) / 64) * 64;
+			ptr = (T *) std::aligned_alloc(64, bytes);
+			capacity = bytes / sizeof(T);
+		}
+
+		return ptr;
+	}
+};
+
+// Vector types for the micro-kernels; the instruction set used to lower them
+// is determined by the target of the function they are inlined into
+template <typename T, size_t Bytes>
+struct simd;
+
+template <>
+struct simd <float, 16> {
+	typedef float type __attribute__((vector_size(16)));
+};
+
+template <>
+struct simd <float, 32> {
+	typedef float type __attribute__((vector_size(32)));
+};
+
+template <>
+struct simd <float, 64> {
+	typedef float type __attribute__((vector_size(64)));
+};
+
+template <>
+struct simd <double, 16> {
+	typedef double type __attribute__((vector_size(16)));
+};
+
+template <>
+struct simd <double, 32> {
+	typedef double type __attribute__((vector_size(32)));
+};
+
+template <>
+struct simd <double, 64> {
+	typedef double type __attribute__((vector_size(64)));
+};
+
+// Computes an (MR x NR) tile of C from packed panels of A and B, where NR is
+// NV vectors wide; the accumulators are meant to reside in registers
+template <typename T, size_t Bytes, size_t MR, size_t NV>
+[[gnu::always_inline]]
+inline void gemm_microkernel_body(size_t kc, const T *__restrict__ Ap, const T *__restrict__ Bp, T *__restrict__ C, size_t ldc, bool accumulate)
+{
+	using V = typename simd <T, Bytes> ::type;
+	constexpr size_t W = Bytes / sizeof(T);
+
+	V acc[MR][NV] = {};
+	for (size_t p = 0; p < kc; p++) {
+		V b[NV];
+
+		#pragma GCC unroll 8
+		for (size_t j = 0; j < NV; j++)
+			__builtin_memcpy(&b[j], &Bp[(p * NV + j) * W], sizeof(V));
+
+		#pragma GCC unroll 16
+		for (size_t i = 0; i < MR; i++) {
+			#pragma GCC unroll 8
+			for (size_t j = 0; j < NV; j++)
+				acc[i][j] += Ap[p * MR + i] * b[j];
+		}
+	}
+
+	#pragma GCC unroll 16
+	for (size_t i = 0; i < MR; i++) {
+		#pragma GCC unroll 8
+		for (size_t j = 0; j < NV; j++) {
+			T *dst = &C[i * ldc + j * W];
+			if (accumulate) {
+				V c;
+				__builtin_memcpy(&c, dst, sizeof(V));
+				acc[i][j] += c;
+			}
+
+			__builtin_memcpy(dst, &acc[i][j], sizeof(V));
+		}
+	}
+}
+
+template <typename T>
+using gemm_microkernel = void (*)(size_t, const T *, const T *, T *, size_t, bool);
+
+// The tiles are three vectors wide, so that NR is the same number of
+// bytes for either precision (e.g. 8 x 24 doubles or 8 x 48 floats)
+template <typename T>
+[[gnu::target("avx512f")]]
+static void gemm_microkernel_avx512(size_t kc, const T *Ap, const T *Bp, T *C, size_t ldc, bool accumulate)
+{
+	gemm_microkernel_body <T, 64, 8, 3> (kc, Ap, Bp, C, ldc, accumulate);
+}
+
+template <typename T>
+[[gnu::target("avx2,fma")]]
+static void gemm_microkernel_avx2(size_t kc, const T *Ap, const T *Bp, T *C, size_t ldc, bool accumulate)
+{
+	gemm_microkernel_body <T, 32, 6, 2> (kc, Ap, Bp, C, ldc, accumulate);
+}
+
+template <typename T>
+static void gemm_microkernel_generic(size_t kc, const T *Ap, const T *Bp, T *C, size_t ldc, bool accumulate)
+{
+	gemm_microkernel_body <T, 16, 4, 2> (kc, Ap, Bp, C, ldc, accumulate);
+}
+
+// Micro-kernel and its register blocking, chosen once at runtime
+template <typename T>
+struct gemm_config {
+	gemm_microkernel <T> kernel;
+	size_t MR;
+	size_t NR;
+};
+
+// Largest tile over all micro-kernels, in bytes per row
+static constexpr size_t GEMM_MAX_MR = 8;
+static constexpr size_t GEMM_MAX_NR_BYTES = 3 * 64;
+
+template <typename T>
+static const gemm_config <T> &gemm_select()
+{
+	static const gemm_config <T> config = []() -> gemm_config <T> {
+		constexpr size_t W = 16 / sizeof(T);
+
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			return { gemm_microkernel_avx512 <T>, 8, 12 * W };
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+			return { gemm_microkernel_avx2 <T>, 6, 4 * W };
+		return { gemm_microkernel_generic <T>, 4, 2 * W };
+	} ();
+
+	return config;
+}
+
+// Cache blocking; KC x NR panels of B stay in L1, MC x KC blocks of A in L2
+// and KC x NC blocks of B in L3 (NC is a multiple of every NR above)
+static constexpr size_t GEMM_KC = 256;
+static constexpr size_t GEMM_MC = 144;
+static constexpr size_t GEMM_NC = 3072;
+
+// Below this many multiply-adds, threading costs more than it saves
+static constexpr size_t GEMM_PARALLEL_THRESHOLD = 1 << 15;
+
+// Pack an (mc x kc) block of A into MR-row panels, zero padding the tail panel
+template <typename T>
+static void gemm_pack_A(size_t mc, size_t kc, const T *A, size_t rs, size_t cs, T *Ap, size_t MR)
+{
+	for (size_t ir = 0; ir < mc; ir += MR) {
+		size_t mr = std::min(MR, mc - ir);
+		T *panel = &Ap[ir * kc];
+		for (size_t p = 0; p < kc; p++) {
+			for (size_t i = 0; i < mr; i++)
+				panel[p * MR + i] = A[(ir + i) * rs + p * cs];
+			for (size_t i = mr; i < MR; i++)
+				panel[p * MR + i] = T(0);
+		}
+	}
+}
+
+// Pack a single (kc x NR) panel of B, zero padding the tail columns
+template <typename T>
+static void gemm_pack_B(size_t kc, size_t nr, const T *B, size_t rs, size_t cs, T *panel, size_t NR)
+{
+	for (size_t p = 0; p < kc; p++) {
+		for (size_t j = 0; j < nr; j++)
+			panel[p * NR + j] = B[p * rs + j * cs];
+		for (size_t j = nr; j < NR; j++)
+			panel[p * NR + j] = T(0);
+	}
+}
+
+// Bias and activation over an (mr x nr) tile of C
+template <typename T>
+static void gemm_epilogue(T *C, size_t ldc, size_t mr, size_t nr, const T *bias, gemm_activation act)
+{
+	for (size_t i = 0; i < mr; i++) {
+		T *c = &C[i * ldc];
+		if (bias) {
+			#pragma omp simd
+			for (size_t j = 0; j < nr; j++)
+				c[j] += bias[j];
+		}
+
+		if (act == gemm_relu) {
+			#pragma omp simd
+			for (size_t j = 0; j < nr; j++)
+				c[j] = (c[j] > 0) ? c[j] : T(0);
+		}
+
+		if (act == gemm_sigmoid) {
+			#pragma omp simd
+			for (size_t j = 0; j < nr; j++)
+				c[j] = fast_sigmoid(c[j]);
+		}
+	}
+}
+
+// Blocked driver over strided operands: C (N x K, row major) = A (N x M) * B (M x K),
+// followed by the epilogue (if any)
+template <typename T>
+static void gemm_driver(size_t N, size_t M, size_t K,
+		const T *A, size_t rsA, size_t csA,
+		const T *B, size_t rsB, size_t csB,
+		T *C, size_t ldc,
+		const T *bias = nullptr, gemm_activation act = gemm_identity)
+{
+	const gemm_config <T> &config = gemm_select <T> ();
+	const size_t MR = config.MR;
+	const size_t NR = config.NR;
+
+	bool epilogue = bias || act != gemm_identity;
+	if (M == 0) {
+		for (size_t i = 0; i < N; i++)
+			std::fill(&C[i * ldc], &C[i * ldc + K], T(0));
+		if (epilogue)
+			gemm_epilogue(C, ldc, N, K, bias, act);
+		return;
+	}
+
+	bool parallel = N * M * K >= GEMM_PARALLEL_THRESHOLD;
+	size_t threads = parallel ? omp_get_max_threads() : 1;
+
+	// Shrink the row blocks until every thread has one, if possible...
+	size_t mc = (N + threads - 1) / threads;
+	mc = std::clamp(((mc + MR - 1) / MR) * MR, MR, GEMM_MC);
+	size_t mblocks = (N + mc - 1) / mc;
+
+	// ...and split the columns of each block for the remaining threads
+	size_t ngroups = std::max <size_t> (1, threads / mblocks);
+
+	thread_local aligned_scratch <T> B_scratch;
+	T *Bp = B_scratch.reserve(GEMM_KC * GEMM_NC);
+
+	#pragma omp parallel if (parallel)
+	{
+		thread_local aligned_scratch <T> A_scratch;
+		T *Ap = A_scratch.reserve(GEMM_MC * GEMM_KC);
+
+		alignas(64) T edge[GEMM_MAX_MR * GEMM_MAX_NR_BYTES / sizeof(T)];
+
+		for (size_t jc = 0; jc < K; jc += GEMM_NC) {
+			size_t nc = std::min(GEMM_NC, K - jc);
+			size_t npanels = (nc + NR - 1) / NR;
+			size_t panels_per_group = (npanels + ngroups - 1) / ngroups;
+
+			for (size_t pc = 0; pc < M; pc += GEMM_KC) {
+				size_t kc = std::min(GEMM_KC, M - pc);
+				bool last = epilogue && (pc + kc == M);
+
+				#pragma omp for
+				for (size_t jp = 0; jp < npanels; jp++) {
+					size_t jr = jp * NR;
+					gemm_pack_B(kc, std::min(NR, nc - jr),
+						&B[pc * rsB + (jc + jr) * csB], rsB, csB,
+						&Bp[jp * NR * kc], NR);
+				}
+
+				#pragma omp for collapse(2) schedule(dynamic)
+				for (size_t ib = 0; ib < mblocks; ib++) {
+					for (size_t g = 0; g < ngroups; g++) {
+						size_t ic = ib * mc;
+						size_t mcb = std::min(mc, N - ic);
+
+						size_t jp_begin = g * panels_per_group;
+						size_t jp_end = std::min(npanels, jp_begin + panels_per_group);
+						if (jp_begin >= jp_end)
+							continue;
+
+						gemm_pack_A(mcb, kc, &A[ic * rsA + pc * csA], rsA, csA, Ap, MR);
+
+						for (size_t jp = jp_begin; jp < jp_end; jp++) {
+							size_t jr = jp * NR;
+							size_t nr = std::min(NR, nc - jr);
+							for (size_t ir = 0; ir < mcb; ir += MR) {
+								size_t mr = std::min(MR, mcb - ir);
+								T *Ct = &C[(ic + ir) * ldc + jc + jr];
+								const T *Apanel = &Ap[ir * kc];
+								const T *Bpanel = &Bp[jp * NR * kc];
+								if (mr == MR && nr == NR) {
+									config.kernel(kc, Apanel, Bpanel, Ct, ldc, pc > 0);
+								} else {
+									// Partial tiles go through a local buffer
+									config.kernel(kc, Apanel, Bpanel, edge, NR, false);
+									for (size_t i = 0; i < mr; i++) {
+										for (size_t j = 0; j < nr; j++) {
+											T v = edge[i * NR + j];
+											Ct[i * ldc + j] = (pc > 0) ? Ct[i * ldc + j] + v : v;
+										}
+									}
+								}
+
+								// The tile is still in cache
+								if (last)
+									gemm_epilogue(Ct, ldc, mr, nr, bias ? &bias[jc + jr] : nullptr, act);
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
 // General matrix multiplication
-void cpu_kernel_gemm(const Resource &A, const Resource &B, Resource &C, size_t N, size_t M, size_t K)
+template <typename T>
+void cpu_kernel_gemm(const Resource &A, const Resource &B, Resource &C, size_t N, size_t M, size_t K, bool transA, bool transB)
 {
-	// A is (N, M)
-	// B is (M, K)
+	// op(A) is (N, M); A itself is stored as (M, N) if transposed
+	// op(B) is (M, K); B itself is stored as (K, M) if transposed
 	// C is thus (N, K)
+	size_t rsA = transA ? 1 : M;
+	size_t csA = transA ? N : 1;
+	size_t rsB = transB ? 1 : K;
+	size_t csB = transB ? M : 1;
+
+	// Transposition only changes how the operands are packed
+	gemm_driver(N, M, K, A.data <T> (), rsA, csA, B.data <T> (), rsB, csB, C.data <T> (), K);
+}
 
-	// TODO: optimize
-	for (size_t i = 0; i < N; i++) {
-		for (size_t j = 0; j < K; j++) {
-			double sum = 0.0f;
-			for (size_t k = 0; k < M; k++) {
-				double a = A.ptr[i * M + k];
-				double b = B.ptr[k * K + j];
-				sum += a * b;
+template <typename T>
+void cpu_kernel_gemm(const Resource &A, size_t rsA, size_t csA, const Resource &B, size_t rsB, size_t csB, Resource &C, size_t N, size_t M, size_t K)
+{
+	gemm_driver(N, M, K, A.data <T> (), rsA, csA, B.data <T> (), rsB, csB, C.data <T> (), K);
+}
+
+template <typename T>
+void cpu_kernel_gemm_bias(const Resource &A, size_t rsA, size_t csA, const Resource &B, size_t rsB, size_t csB,
+		const Resource *bias, Resource &C, size_t N, size_t M, size_t K, gemm_activation act)
+{
+	gemm_driver(N, M, K, A.data <T> (), rsA, csA, B.data <T> (), rsB, csB, C.data <T> (), K,
+		bias ? bias->data <T> () : (const T *) nullptr, act);
+}
+
+// Copying between two strided layouts of the same shape
+static constexpr size_t STRIDED_PARALLEL_THRESHOLD = 1 << 16;
+
+template <typename T>
+void cpu_kernel_strided_copy(const Resource &src, const std::vector <long int> &src_strides,
+		Resource &dst, const std::vector <long int> &dst_strides,
+		const std::vector <long int> &shape)
+{
+	size_t dims = shape.size();
+	if (dims == 0) {
+		dst.data <T> ()[0] = src.data <T> ()[0];
+		return;
+	}
+
+	// Rows along the innermost dimension are copied in one go
+	size_t inner = shape[dims - 1];
+	long int sinner = src_strides[dims - 1];
+	long int dinner = dst_strides[dims - 1];
+
+	size_t outer = 1;
+	for (size_t d = 0; d + 1 < dims; d++)
+		outer *= shape[d];
+
+	#pragma omp parallel for if (outer * inner >= STRIDED_PARALLEL_THRESHOLD)
+	for (size_t o = 0; o < outer; o++) {
+		long int soffset = 0;
+		long int doffset = 0;
+
+		size_t r = o;
+		for (long int d = dims - 2; d >= 0; d--) {
+			size_t index = r % shape[d];
+			r /= shape[d];
+			soffset += index * src_strides[d];
+			doffset += index * dst_strides[d];
+		}
+
+		const T *s = &src.data <T> ()[soffset];
+		T *t = &dst.data <T> ()[doffset];
+		if (sinner == 1 && dinner == 1) {
+			std::memcpy(t, s, inner * sizeof(T));
+		} else {
+			for (size_t j = 0; j < inner; j++)
+				t[j * dinner] = s[j * sinner];
+		}
+	}
+}
+
+// Rows of a broadcast operation are split into blocks, so that outputs with
+// few rows (e.g. a tensor and a scalar) still spread over the threads
+static constexpr size_t BROADCAST_BLOCK = 1 << 12;
+
+template <ewop_mode op, typename T>
+void cpu_kernel_strided_ewop(const Resource &A, const std::vector <long int> &A_strides,
+		const Resource &B, const std::vector <long int> &B_strides,
+		Resource &C, const std::vector <long int> &shape)
+{
+	auto ftn = [](T a, T b) {
+		if constexpr (op == kadd)
+			return a + b;
+		if constexpr (op == ksub)
+			return a - b;
+		if constexpr (op == kmul)
+			return a * b;
+		if constexpr (op == kdiv)
+			return a / b;
+	};
+
+	// Dimensions of size one are dropped, and neighbours that both operands
+	// step through uniformly are merged, so that bias-like operands end up
+	// as (rows, inner) with a contiguous inner dimension
+	std::vector <long int> dims;
+	std::vector <long int> sa;
+	std::vector <long int> sb;
+	for (size_t d = 0; d < shape.size(); d++) {
+		if (shape[d] == 1)
+			continue;
+
+		if (!dims.empty() && sa.back() == A_strides[d] * shape[d] && sb.back() == B_strides[d] * shape[d]) {
+			dims.back() *= shape[d];
+			sa.back() = A_strides[d];
+			sb.back() = B_strides[d];
+			continue;
+		}
+
+		dims.push_back(shape[d]);
+		sa.push_back(A_strides[d]);
+		sb.push_back(B_strides[d]);
+	}
+
+	if (dims.empty()) {
+		dims = { 1 };
+		sa = { 0 };
+		sb = { 0 };
+	}
+
+	size_t n = dims.size();
+	size_t inner = dims[n - 1];
+	long int ainner = sa[n - 1];
+	long int binner = sb[n - 1];
+
+	size_t outer = 1;
+	for (size_t d = 0; d + 1 < n; d++)
+		outer *= dims[d];
+
+	size_t blocks = (inner + BROADCAST_BLOCK - 1) / BROADCAST_BLOCK;
+
+	#pragma omp parallel for if (outer * inner >= MAP_PARALLEL_THRESHOLD)
+	for (size_t k = 0; k < outer * blocks; k++) {
+		size_t o = k / blocks;
+		size_t start = (k % blocks) * BROADCAST_BLOCK;
+		size_t count = std::min(inner - start, BROADCAST_BLOCK);
+
+		long int aoffset = start * ainner;
+		long int boffset = start * binner;
+
+		size_t r = o;
+		for (long int d = n - 2; d >= 0; d--) {
+			size_t index = r % dims[d];
+			r /= dims[d];
+			aoffset += index * sa[d];
+			boffset += index * sb[d];
+		}
+
+		const T *a = &A.data <T> ()[aoffset];
+		const T *b = &B.data <T> ()[boffset];
+		T *c = &C.data <T> ()[o * inner + start];
+
+		if (ainner == 1 && binner == 1) {
+			#pragma omp simd
+			for (size_t j = 0; j < count; j++)
+				c[j] = ftn(a[j], b[j]);
+		} else if (ainner == 1 && binner == 0) {
+			T y = b[0];
+			#pragma omp simd
+			for (size_t j = 0; j < count; j++)
+				c[j] = ftn(a[j], y);
+		} else if (ainner == 0 && binner == 1) {
+			T x = a[0];
+			#pragma omp simd
+			for (size_t j = 0; j < count; j++)
+				c[j] = ftn(x, b[j]);
+		} else {
+			for (size_t j = 0; j < count; j++)
+				c[j] = ftn(a[j * ainner], b[j * binner]);
+		}
+	}
+}
+
+// Convolutions multiply blocks of this many patch elements at a time, so
+// that the patch matrix stays in cache instead of being materialized for
+// the whole batch
+static constexpr size_t CONV_BLOCK = 1 << 18;
+
+// Pointwise convolutions need no patches, the input is the patch matrix
+static bool conv_pointwise(const conv_shape &s)
+{
+	return s.kernel == 1 && s.stride == 1 && s.padding == 0;
+}
+
+// Patches of the output pixels [first, first + rows) into the rows of P
+template <typename T>
+static void im2col(const T *x, T *p, const conv_shape &s, size_t first, size_t rows)
+{
+	const size_t OH = s.out_height();
+	const size_t OW = s.out_width();
+	const size_t C = s.channels;
+	const size_t K = s.kernel;
+	const size_t patch = s.patch();
+
+	#pragma omp parallel for if (rows * patch >= MAP_PARALLEL_THRESHOLD)
+	for (size_t r = 0; r < rows; r++) {
+		size_t pixel = first + r;
+		size_t n = pixel / (OH * OW);
+		size_t oh = (pixel / OW) % OH;
+		size_t ow = pixel % OW;
+
+		long int w0 = long(ow * s.stride) - long(s.padding);
+		bool inside = w0 >= 0 && w0 + long(K) <= long(s.width);
+
+		T *pr = &p[r * patch];
+		for (size_t i = 0; i < K; i++) {
+			long int h = long(oh * s.stride + i) - long(s.padding);
+			T *dst = &pr[i * K * C];
+			if (h < 0 || h >= long(s.height)) {
+				std::fill(dst, dst + K * C, T(0));
+				continue;
+			}
+
+			// A row of the window is contiguous in NHWC
+			const T *src = &x[(n * s.height + h) * s.width * C];
+			if (inside) {
+				std::memcpy(dst, &src[w0 * C], K * C * sizeof(T));
+				continue;
 			}
 
-			C.ptr[i * K + j] = sum;
+			for (size_t j = 0; j < K; j++) {
+				long int w = w0 + long(j);
+				if (w < 0 || w >= long(s.width))
+					std::fill(&dst[j * C], &dst[(j + 1) * C], T(0));
+				else
+					std::memcpy(&dst[j * C], &src[w * C], C * sizeof(T));
+			}
 		}
 	}
 }
+
+// Adds the patches in the rows of P, for the output pixels [first, first +
+// rows), back into the image they came from; each input pixel gathers what
+// its windows contribute, so that threads never write to the same pixel
+template <typename T>
+static void col2im(const T *p, T *x, const conv_shape &s, size_t first, size_t rows)
+{
+	const size_t OH = s.out_height();
+	const size_t OW = s.out_width();
+	const size_t C = s.channels;
+	const size_t K = s.kernel;
+	const size_t patch = s.patch();
+	const size_t last = first + rows;
+
+	// Input rows (over the batch) that the windows of these pixels reach
+	size_t n0 = first / (OH * OW);
+	size_t n1 = (last - 1) / (OH * OW);
+	long int h0 = long(((first / OW) % OH) * s.stride) - long(s.padding);
+	long int h1 = long((((last - 1) / OW) % OH) * s.stride + K) - long(s.padding);
+	size_t g0 = n0 * s.height + std::max(h0, 0l);
+	size_t g1 = n1 * s.height + std::min(h1, long(s.height));
+
+	#pragma omp parallel for collapse(2) if ((g1 - g0) * s.width * C >= MAP_PARALLEL_THRESHOLD)
+	for (size_t g = g0; g < g1; g++) {
+		for (size_t w = 0; w < s.width; w++) {
+			size_t n = g / s.height;
+			size_t h = g % s.height;
+			T *dst = &x[(g * s.width + w) * C];
+
+			for (size_t i = 0; i < K; i++) {
+				long int sh = long(h + s.padding) - long(i);
+				if (sh < 0 || sh % s.stride || size_t(sh) / s.stride >= OH)
+					continue;
+
+				size_t oh = size_t(sh) / s.stride;
+				for (size_t j = 0; j < K; j++) {
+					long int sw = long(w + s.padding) - long(j);
+					if (sw < 0 || sw % s.stride || size_t(sw) / s.stride >= OW)
+						continue;
+
+					size_t pixel = (n * OH + oh) * OW + size_t(sw) / s.stride;
+					if (pixel < first || pixel >= last)
+						continue;
+
+					const T *src = &p[(pixel - first) * patch + (i * K + j) * C];
+
+					#pragma omp simd
+					for (size_t c = 0; c < C; c++)
+						dst[c] += src[c];
+				}
+			}
+		}
+	}
+}
+
+// Winograd F(2x2, 3x3): each 2x2 output tile comes from a 4x4 input tile d
+// as A^T [(G g G^T) . (B^T d B)] A, so that the products over the channels
+// take 16 multiplications per tile instead of 36. For each of the 16
+// elements of the transformed tiles, the products over a block of tiles
+// form a GEMM of (tiles x C) by (C x K). Below a few channels on either
+// side, these GEMMs are too thin to pay for the transforms
+static constexpr size_t WINOGRAD_MIN_CHANNELS = 8;
+
+static bool winograd_eligible(const conv_shape &s, size_t K)
+{
+	return s.kernel == 3 && s.stride == 1 && s.channels >= WINOGRAD_MIN_CHANNELS && K >= WINOGRAD_MIN_CHANNELS;
+}
+
+template <typename T>
+static void winograd_conv(const T *x, const T *w, const T *bias, T *y, const conv_shape &s, size_t K, gemm_activation act)
+{
+	const size_t C = s.channels;
+	const size_t H = s.height;
+	const size_t W = s.width;
+	const size_t OH = s.out_height();
+	const size_t OW = s.out_width();
+	const size_t TH = (OH + 1) / 2;
+	const size_t TW = (OW + 1) / 2;
+	const size_t tiles = s.batch * TH * TW;
+
+	// Filters, as U[e] (C x K) = (G g G^T)[e]
+	thread_local aligned_scratch <T> U_scratch;
+	T *U = U_scratch.reserve(16 * C * K);
+
+	#pragma omp parallel for if (16 * C * K >= MAP_PARALLEL_THRESHOLD)
+	for (size_t c = 0; c < C; c++) {
+		for (size_t k = 0; k < K; k++) {
+			T g[3][3];
+			for (size_t i = 0; i < 3; i++) {
+				for (size_t j = 0; j < 3; j++)
+					g[i][j] = w[((i * 3 + j) * C + c) * K + k];
+			}
+
+			T t[4][3];
+			for (size_t j = 0; j < 3; j++) {
+				t[0][j] = g[0][j];
+				t[1][j] = (g[0][j] + g[1][j] + g[2][j]) / 2;
+				t[2][j] = (g[0][j] - g[1][j] + g[2][j]) / 2;
+				t[3][j] = g[2][j];
+			}
+
+			for (size_t i = 0; i < 4; i++) {
+				T *u = &U[(i * 4 * C + c) * K + k];
+				u[0] = t[i][0];
+				u[C * K] = (t[i][0] + t[i][1] + t[i][2]) / 2;
+				u[2 * C * K] = (t[i][0] - t[i][1] + t[i][2]) / 2;
+				u[3 * C * K] = t[i][2];
+			}
+		}
+	}
+
+	// Pixels in the padding read from a row of zeros
+	thread_local aligned_scratch <T> zero_scratch;
+	T *zeros = zero_scratch.reserve(C);
+	std::fill(zeros, zeros + C, T(0));
+
+	size_t block = std::max <size_t> (16, CONV_BLOCK / (16 * std::max(C, K)));
+	block = std::min(block, tiles);
+
+	thread_local aligned_scratch <T> V_scratch;
+	thread_local aligned_scratch <T> M_scratch;
+	T *V = V_scratch.reserve(16 * block * C);
+	T *M = M_scratch.reserve(16 * block * K);
+
+	for (size_t first = 0; first < tiles; first += block) {
+		size_t count = std::min(block, tiles - first);
+
+		// Input tiles, as V[e] (count x C) = (B^T d B)[e]
+		#pragma omp parallel for if (16 * count * C >= MAP_PARALLEL_THRESHOLD)
+		for (size_t t = 0; t < count; t++) {
+			size_t tile = first + t;
+			size_t n = tile / (TH * TW);
+			size_t ty = (tile / TW) % TH;
+			size_t tx = tile % TW;
+
+			const T *d[4][4];
+			for (size_t i = 0; i < 4; i++) {
+				long int h = long(2 * ty + i) - long(s.padding);
+				for (size_t j = 0; j < 4; j++) {
+					long int ww = long(2 * tx + j) - long(s.padding);
+					bool inside = h >= 0 && h < long(H) && ww >= 0 && ww < long(W);
+					d[i][j] = inside ? &x[((n * H + h) * W + ww) * C] : zeros;
+				}
+			}
+
+			// Both halves of the transform run over contiguous channels,
+			// first B^T d by columns of the tile...
+			thread_local aligned_scratch <T> u_scratch;
+			T *u = u_scratch.reserve(16 * C);
+			for (size_t j = 0; j < 4; j++) {
+				const T *d0 = d[0][j];
+				const T *d1 = d[1][j];
+				const T *d2 = d[2][j];
+				const T *d3 = d[3][j];
+				T *u0 = &u[(0 * 4 + j) * C];
+				T *u1 = &u[(1 * 4 + j) * C];
+				T *u2 = &u[(2 * 4 + j) * C];
+				T *u3 = &u[(3 * 4 + j) * C];
+
+				#pragma omp simd
+				for (size_t c = 0; c < C; c++) {
+					u0[c] = d0[c] - d2[c];
+					u1[c] = d1[c] + d2[c];
+					u2[c] = d2[c] - d1[c];
+					u3[c] = d1[c] - d3[c];
+				}
+			}
+
+			// ...then (B^T d) B by its rows
+			for (size_t i = 0; i < 4; i++) {
+				const T *u0 = &u[(i * 4 + 0) * C];
+				const T *u1 = &u[(i * 4 + 1) * C];
+				const T *u2 = &u[(i * 4 + 2) * C];
+				const T *u3 = &u[(i * 4 + 3) * C];
+				T *v0 = &V[((i * 4 + 0) * count + t) * C];
+				T *v1 = &V[((i * 4 + 1) * count + t) * C];
+				T *v2 = &V[((i * 4 + 2) * count + t) * C];
+				T *v3 = &V[((i * 4 + 3) * count + t) * C];
+
+				#pragma omp simd
+				for (size_t c = 0; c < C; c++) {
+					v0[c] = u0[c] - u2[c];
+					v1[c] = u1[c] + u2[c];
+					v2[c] = u2[c] - u1[c];
+					v3[c] = u1[c] - u3[c];
+				}
+			}
+		}
+
+		for (size_t e = 0; e < 16; e++)
+			gemm_driver(count, C, K, &V[e * count * C], C, 1, &U[e * C * K], K, 1, &M[e * count * K], K);
+
+		// Output tiles, as A^T m A, then the bias and activation; pixels
+		// past the edge of an odd sized output are written to a sink
+		#pragma omp parallel for if (16 * count * K >= MAP_PARALLEL_THRESHOLD)
+		for (size_t t = 0; t < count; t++) {
+			size_t tile = first + t;
+			size_t n = tile / (TH * TW);
+			size_t ty = (tile / TW) % TH;
+			size_t tx = tile % TW;
+
+			thread_local aligned_scratch <T> sink_scratch;
+			T *sink = sink_scratch.reserve(K);
+
+			T *o[2][2];
+			for (size_t i = 0; i < 2; i++) {
+				for (size_t j = 0; j < 2; j++) {
+					size_t oh = 2 * ty + i;
+					size_t ow = 2 * tx + j;
+					o[i][j] = (oh < OH && ow < OW) ? &y[((n * OH + oh) * OW + ow) * K] : sink;
+				}
+			}
+
+			// A^T m by columns of the tile, then (A^T m) A by its rows
+			thread_local aligned_scratch <T> a_scratch;
+			T *a = a_scratch.reserve(8 * K);
+			for (size_t j = 0; j < 4; j++) {
+				const T *m0 = &M[((0 * 4 + j) * count + t) * K];
+				const T *m1 = &M[((1 * 4 + j) * count + t) * K];
+				const T *m2 = &M[((2 * 4 + j) * count + t) * K];
+				const T *m3 = &M[((3 * 4 + j) * count + t) * K];
+				T *a0 = &a[(0 * 4 + j) * K];
+				T *a1 = &a[(1 * 4 + j) * K];
+
+				#pragma omp simd
+				for (size_t k = 0; k < K; k++) {
+					a0[k] = m0[k] + m1[k] + m2[k];
+					a1[k] = m1[k] - m2[k] - m3[k];
+				}
+			}
+
+			for (size_t i = 0; i < 2; i++) {
+				const T *a0 = &a[(i * 4 + 0) * K];
+				const T *a1 = &a[(i * 4 + 1) * K];
+				const T *a2 = &a[(i * 4 + 2) * K];
+				const T *a3 = &a[(i * 4 + 3) * K];
+				T *o0 = o[i][0];
+				T *o1 = o[i][1];
+
+				#pragma omp simd
+				for (size_t k = 0; k < K; k++) {
+					o0[k] = a0[k] + a1[k] + a2[k];
+					o1[k] = a1[k] - a2[k] - a3[k];
+				}
+			}
+
+			if (bias || act != gemm_identity) {
+				for (size_t i = 0; i < 2; i++) {
+					for (size_t j = 0; j < 2; j++)
+						gemm_epilogue(o[i][j], K, 1, K, bias, act);
+				}
+			}
+		}
+	}
+}
+
+template <typename T>
+void cpu_kernel_conv2d(const Resource &X, const Resource &W, const Resource *bias, Resource &Y,
+		const conv_shape &s, size_t K, gemm_activation act, conv_algorithm algorithm)
+{
+	const T *x = X.data <T> ();
+	const T *w = W.data <T> ();
+	const T *b = bias ? bias->data <T> () : (const T *) nullptr;
+	T *y = Y.data <T> ();
+
+	if (algorithm == conv_auto)
+		algorithm = winograd_eligible(s, K) ? conv_winograd : conv_im2col;
+
+	// Only where it applies, otherwise through im2col
+	if (algorithm == conv_winograd && s.kernel == 3 && s.stride == 1)
+		return winograd_conv(x, w, b, y, s, K, act);
+
+	const size_t pixels = s.pixels();
+	const size_t patch = s.patch();
+	if (conv_pointwise(s))
+		return gemm_driver(pixels, patch, K, x, patch, 1, w, K, 1, y, K, b, act);
+
+	size_t block = std::min(pixels, std::max <size_t> (1, CONV_BLOCK / patch));
+
+	thread_local aligned_scratch <T> P_scratch;
+	T *p = P_scratch.reserve(block * patch);
+	for (size_t first = 0; first < pixels; first += block) {
+		size_t rows = std::min(block, pixels - first);
+		im2col(x, p, s, first, rows);
+		gemm_driver(rows, patch, K, p, patch, 1, w, K, 1, &y[first * K], K, b, act);
+	}
+}
+
+// Patch deltas are D * W^T, where element (i, j) of W^T is W[j * K + i]
+template <typename T>
+void cpu_kernel_conv2d_input(const Resource &D, const Resource &W, Resource &DX, const conv_shape &s, size_t K)
+{
+	const T *d = D.data <T> ();
+	const T *w = W.data <T> ();
+	T *dx = DX.data <T> ();
+
+	const size_t pixels = s.pixels();
+	const size_t patch = s.patch();
+	if (conv_pointwise(s))
+		return gemm_driver(pixels, K, patch, d, K, 1, w, 1, K, dx, patch);
+
+	std::fill(dx, dx + DX.elements, T(0));
+
+	size_t block = std::min(pixels, std::max <size_t> (1, CONV_BLOCK / patch));
+
+	thread_local aligned_scratch <T> P_scratch;
+	T *p = P_scratch.reserve(block * patch);
+	for (size_t first = 0; first < pixels; first += block) {
+		size_t rows = std::min(block, pixels - first);
+		gemm_driver(rows, K, patch, &d[first * K], K, 1, w, 1, K, p, patch);
+		col2im(p, dx, s, first, rows);
+	}
+}
+
+// Weight deltas are patches^T * D, summed over the blocks of pixels
+template <typename T>
+void cpu_kernel_conv2d_weights(const Resource &X, const Resource &D, Resource &DW, const conv_shape &s, size_t K)
+{
+	const T *x = X.data <T> ();
+	const T *d = D.data <T> ();
+	T *dw = DW.data <T> ();
+
+	const size_t pixels = s.pixels();
+	const size_t patch = s.patch();
+	if (conv_pointwise(s))
+		return gemm_driver(patch, pixels, K, x, 1, patch, d, K, 1, dw, K);
+
+	size_t block = std::min(pixels, std::max <size_t> (1, CONV_BLOCK / patch));
+
+	thread_local aligned_scratch <T> P_scratch;
+	thread_local aligned_scratch <T> partial_scratch;
+	T *p = P_scratch.reserve(block * patch);
+	T *partial = partial_scratch.reserve(patch * K);
+	for (size_t first = 0; first < pixels; first += block) {
+		size_t rows = std::min(block, pixels - first);
+		im2col(x, p, s, first, rows);
+		if (first == 0) {
+			gemm_driver(patch, rows, K, p, 1, patch, d, K, 1, dw, K);
+			continue;
+		}
+
+		gemm_driver(patch, rows, K, p, 1, patch, &d[first * K], K, 1, partial, K);
+
+		size_t n = patch * K;
+		#pragma omp parallel for simd if (n >= MAP_PARALLEL_THRESHOLD)
+		for (size_t i = 0; i < n; i++)
+			dw[i] += partial[i];
+	}
+}
+
+// Pooling windows of the same image overlap when the stride is less than
+// the kernel, so the pullback splits the work by image and by channels
+static constexpr size_t POOL_CHANNEL_BLOCK = 16;
+
+template <pool_mode op, typename T>
+void cpu_kernel_pool(const Resource &X, Resource &Y, const conv_shape &s)
+{
+	const T *x = X.data <T> ();
+	T *y = Y.data <T> ();
+
+	const size_t OH = s.out_height();
+	const size_t OW = s.out_width();
+	const size_t C = s.channels;
+	const size_t pixels = s.pixels();
+
+	#pragma omp parallel for if (pixels * s.patch() >= MAP_PARALLEL_THRESHOLD)
+	for (size_t pixel = 0; pixel < pixels; pixel++) {
+		size_t n = pixel / (OH * OW);
+		size_t oh = (pixel / OW) % OH;
+		size_t ow = pixel % OW;
+
+		T *out = &y[pixel * C];
+		std::fill(out, out + C, (op == pool_max) ? std::numeric_limits <T> ::lowest() : T(0));
+
+		size_t count = 0;
+		for (size_t i = 0; i < s.kernel; i++) {
+			long int h = long(oh * s.stride + i) - long(s.padding);
+			if (h < 0 || h >= long(s.height))
+				continue;
+
+			for (size_t j = 0; j < s.kernel; j++) {
+				long int w = long(ow * s.stride + j) - long(s.padding);
+				if (w < 0 || w >= long(s.width))
+					continue;
+
+				const T *in = &x[((n * s.height + h) * s.width + w) * C];
+				count++;
+
+				if constexpr (op == pool_max) {
+					#pragma omp simd
+					for (size_t c = 0; c < C; c++)
+						out[c] = (in[c] > out[c]) ? in[c] : out[c];
+				} else {
+					#pragma omp simd
+					for (size_t c = 0; c < C; c++)
+						out[c] += in[c];
+				}
+			}
+		}
+
+		if (op == pool_average && count > 0) {
+			T scale = T(1) / T(count);
+
+			#pragma omp simd
+			for (size_t c = 0; c < C; c++)
+				out[c] *= scale;
+		}
+	}
+}
+
+template <pool_mode op, typename T>
+void cpu_kernel_pool_pullback(const Resource &X, const Resource &D, Resource &DX, const conv_shape &s)
+{
+	const T *x = X.data <T> ();
+	const T *d = D.data <T> ();
+	T *dx = DX.data <T> ();
+
+	const size_t OH = s.out_height();
+	const size_t OW = s.out_width();
+	const size_t C = s.channels;
+	const size_t blocks = (C + POOL_CHANNEL_BLOCK - 1) / POOL_CHANNEL_BLOCK;
+
+	std::fill(dx, dx + DX.elements, T(0));
+
+	#pragma omp parallel for collapse(2) if (s.pixels() * s.patch() >= MAP_PARALLEL_THRESHOLD)
+	for (size_t n = 0; n < s.batch; n++) {
+		for (size_t cb = 0; cb < blocks; cb++) {
+			size_t c0 = cb * POOL_CHANNEL_BLOCK;
+			size_t c1 = std::min(C, c0 + POOL_CHANNEL_BLOCK);
+
+			for (size_t oh = 0; oh < OH; oh++) {
+				for (size_t ow = 0; ow < OW; ow++) {
+					const T *delta = &d[((n * OH + oh) * OW + ow) * C];
+
+					// Window, clipped to the image
+					long int hs = long(oh * s.stride) - long(s.padding);
+					long int ws = long(ow * s.stride) - long(s.padding);
+					size_t h0 = std::max(hs, 0l);
+					size_t h1 = std::min(hs + long(s.kernel), long(s.height));
+					size_t w0 = std::max(ws, 0l);
+					size_t w1 = std::min(ws + long(s.kernel), long(s.width));
+					if (h0 >= h1 || w0 >= w1)
+						continue;
+
+					if constexpr (op == pool_average) {
+						T scale = T(1) / T((h1 - h0) * (w1 - w0));
+						for (size_t h = h0; h < h1; h++) {
+							for (size_t w = w0; w < w1; w++) {
+								T *out = &dx[((n * s.height + h) * s.width + w) * C];
+
+								#pragma omp simd
+								for (size_t c = c0; c < c1; c++)
+									out[c] += delta[c] * scale;
+							}
+						}
+					} else {
+						for (size_t c = c0; c < c1; c++) {
+							size_t at = ((n * s.height + h0) * s.width + w0) * C;
+							T best = x[at + c];
+							for (size_t h = h0; h < h1; h++) {
+								for (size_t w = w0; w < w1; w++) {
+									size_t index = ((n * s.height + h) * s.width + w) * C;
+									if (x[index + c] > best) {
+										best = x[index + c];
+										at = index;
+									}
+								}
+							}
+
+							dx[at + c] += delta[c];
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+// Fused elementwise programs are interpreted over chunks small enough for
+// the whole stack to stay in L1, so that each input is only read once
+static constexpr size_t FUSED_CHUNK = 256;
+static constexpr size_t FUSED_PARALLEL_THRESHOLD = 1 << 15;
+
+template <typename T>
+void cpu_kernel_fused(const std::vector <fused_instruction> &code, const std::vector <Resource> &inputs, Resource &out, size_t elements)
+{
+	bool reduce = !code.empty() && code.back().op == f_sum;
+	size_t chunks = (elements + FUSED_CHUNK - 1) / FUSED_CHUNK;
+
+	double total = 0.0;
+
+	#pragma omp parallel for reduction(+:total) if (elements >= FUSED_PARALLEL_THRESHOLD)
+	for (size_t c = 0; c < chunks; c++) {
+		size_t begin = c * FUSED_CHUNK;
+		size_t n = std::min(FUSED_CHUNK, elements - begin);
+
+		// Loads only point into their input; results go to the scratch
+		// slot of the stack entry they replace
+		alignas(64) T scratch[FUSED_MAX_DEPTH][FUSED_CHUNK];
+		const T *operands[FUSED_MAX_DEPTH];
+		size_t top = 0;
+
+		for (const fused_instruction &instr : code) {
+			if (instr.op == f_load) {
+				operands[top++] = inputs[instr.index].data <T> () + begin;
+				continue;
+			}
+
+			if (instr.op == f_sum) {
+				const T *x = operands[top - 1];
+
+				double partial = 0.0;
+				#pragma omp simd reduction(+:partial)
+				for (size_t i = 0; i < n; i++)
+					partial += x[i];
+
+				total += partial;
+				continue;
+			}
+
+			if (fused_arity(instr.op) == 2) {
+				const T *x = operands[top - 2];
+				const T *y = operands[top - 1];
+				T *dst = scratch[top - 2];
+
+				switch (instr.op) {
+				case f_add:
+					#pragma omp simd
+					for (size_t i = 0; i < n; i++)
+						dst[i] = x[i] + y[i];
+					break;
+				case f_sub:
+					#pragma omp simd
+					for (size_t i = 0; i < n; i++)
+						dst[i] = x[i] - y[i];
+					break;
+				case f_mul:
+					#pragma omp simd
+					for (size_t i = 0; i < n; i++)
+						dst[i] = x[i] * y[i];
+					break;
+				default:
+					#pragma omp simd
+					for (size_t i = 0; i < n; i++)
+						dst[i] = x[i] / y[i];
+					break;
+				}
+
+				operands[--top - 1] = dst;
+				continue;
+			}
+
+			const T *x = operands[top - 1];
+			T *dst = scratch[top - 1];
+			T k = instr.k;
+
+			switch (instr.op) {
+			case f_addk:
+				#pragma omp simd
+				for (size_t i = 0; i < n; i++)
+					dst[i] = k + x[i];
+				break;
+			case f_scalek:
+				#pragma omp simd
+				for (size_t i = 0; i < n; i++)
+					dst[i] = k * x[i];
+				break;
+			case f_square:
+				#pragma omp simd
+				for (size_t i = 0; i < n; i++)
+					dst[i] = x[i] * x[i];
+				break;
+			case f_sqrt:
+				#pragma omp simd
+				for (size_t i = 0; i < n; i++)
+					dst[i] = std::sqrt(x[i]);
+				break;
+			case f_sigmoid:
+				#pragma omp simd
+				for (size_t i = 0; i < n; i++)
+					dst[i] = fast_sigmoid(x[i]);
+				break;
+			case f_relu:
+				#pragma omp simd
+				for (size_t i = 0; i < n; i++)
+					dst[i] = (x[i] > 0) ? x[i] : T(0);
+				break;
+			default:
+				break;
+			}
+
+			operands[top - 1] = dst;
+		}
+
+		if (!reduce)
+			std::memcpy(out.data <T> () + begin, operands[0], n * sizeof(T));
+	}
+
+	if (reduce)
+		out.data <T> ()[0] = total;
+}
+
+// Reductions; rows along the reduced axis are contiguous when inner is one,
+// otherwise the inner elements are reduced side by side in SIMD lanes
+static constexpr size_t PAIRWISE_BLOCK = 128;
+static constexpr size_t REDUCE_CHUNK = 1 << 14;
+static constexpr size_t REDUCE_LANES = 256;
+static constexpr size_t REDUCE_PARALLEL_THRESHOLD = 1 << 15;
+
+// Pairwise summation, so that the error grows with log(n) rather than n
+template <typename T>
+static double pairwise_sum(const T *x, size_t n)
+{
+	if (n <= PAIRWISE_BLOCK) {
+		double sum = 0.0;
+
+		#pragma omp simd reduction(+:sum)
+		for (size_t i = 0; i < n; i++)
+			sum += x[i];
+
+		return sum;
+	}
+
+	size_t half = ((n / 2 + PAIRWISE_BLOCK - 1) / PAIRWISE_BLOCK) * PAIRWISE_BLOCK;
+	return pairwise_sum(x, half) + pairwise_sum(x + half, n - half);
+}
+
+template <typename T>
+static T row_max(const T *x, size_t n)
+{
+	T max = -std::numeric_limits <T> ::infinity();
+
+	#pragma omp simd reduction(max:max)
+	for (size_t i = 0; i < n; i++)
+		max = (x[i] > max) ? x[i] : max;
+
+	return max;
+}
+
+// First index of the maximum
+template <typename T>
+static size_t row_argmax(const T *x, size_t n)
+{
+	T max = row_max(x, n);
+	for (size_t i = 0; i < n; i++) {
+		if (x[i] == max)
+			return i;
+	}
+
+	return 0;
+}
+
+// Reduction of a single contiguous row, split into chunks across threads
+template <reduce_mode op, typename T>
+static double reduce_row(const T *x, size_t n, bool parallel)
+{
+	size_t chunks = (n + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+	if (!parallel || chunks < 2) {
+		if constexpr (op == ksum)
+			return pairwise_sum(x, n);
+		if constexpr (op == kmean)
+			return pairwise_sum(x, n) / n;
+		if constexpr (op == kmax)
+			return row_max(x, n);
+		if constexpr (op == kargmax)
+			return row_argmax(x, n);
+	}
+
+	std::vector <double> partials(chunks);
+	std::vector <size_t> indices(chunks);
+
+	#pragma omp parallel for
+	for (size_t c = 0; c < chunks; c++) {
+		size_t begin = c * REDUCE_CHUNK;
+		size_t m = std::min(REDUCE_CHUNK, n - begin);
+		if constexpr (op == ksum || op == kmean) {
+			partials[c] = pairwise_sum(x + begin, m);
+		} else {
+			indices[c] = begin + row_argmax(x + begin, m);
+			partials[c] = x[indices[c]];
+		}
+	}
+
+	if constexpr (op == ksum || op == kmean) {
+		double sum = pairwise_sum(partials.data(), chunks);
+		return (op == kmean) ? sum / n : sum;
+	}
+
+	// Earlier chunks win ties, as in row_argmax
+	size_t best = 0;
+	for (size_t c = 1; c < chunks; c++) {
+		if (partials[c] > partials[best])
+			best = c;
+	}
+
+	return (op == kmax) ? partials[best] : indices[best];
+}
+
+// Reduction of n rows of inner elements, for at most REDUCE_LANES of them;
+// sums are compensated (Kahan) since they run sequentially along n
+template <reduce_mode op, typename T>
+static void reduce_lanes(const T *x, size_t n, size_t stride, size_t lanes, T *out)
+{
+	double acc[REDUCE_LANES];
+	double comp[REDUCE_LANES];
+	size_t index[REDUCE_LANES];
+
+	for (size_t k = 0; k < lanes; k++) {
+		acc[k] = (op == ksum || op == kmean) ? 0.0 : -std::numeric_limits <double> ::infinity();
+		comp[k] = 0.0;
+		index[k] = 0;
+	}
+
+	for (size_t j = 0; j < n; j++) {
+		const T *row = x + j * stride;
+		if constexpr (op == ksum || op == kmean) {
+			#pragma omp simd
+			for (size_t k = 0; k < lanes; k++) {
+				double y = row[k] - comp[k];
+				double t = acc[k] + y;
+				comp[k] = (t - acc[k]) - y;
+				acc[k] = t;
+			}
+		} else {
+			#pragma omp simd
+			for (size_t k = 0; k < lanes; k++) {
+				bool greater = row[k] > acc[k];
+				acc[k] = greater ? double(row[k]) : acc[k];
+				index[k] = greater ? j : index[k];
+			}
+		}
+	}
+
+	for (size_t k = 0; k < lanes; k++) {
+		if constexpr (op == ksum || op == kmax)
+			out[k] = acc[k];
+		if constexpr (op == kmean)
+			out[k] = acc[k] / n;
+		if constexpr (op == kargmax)
+			out[k] = index[k];
+	}
+}
+
+template <reduce_mode op, typename T>
+void cpu_kernel_reduce(const Resource &A, Resource &C, size_t outer, size_t n, size_t inner)
+{
+	const T *a = A.data <T> ();
+	T *c = C.data <T> ();
+
+	bool parallel = outer * n * inner >= REDUCE_PARALLEL_THRESHOLD;
+
+	if (inner == 1) {
+		// A single long row is split across threads, otherwise rows are
+		if (outer == 1) {
+			c[0] = reduce_row <op> (a, n, parallel);
+			return;
+		}
+
+		#pragma omp parallel for if (parallel)
+		for (size_t o = 0; o < outer; o++)
+			c[o] = reduce_row <op> (&a[o * n], n, false);
+
+		return;
+	}
+
+	size_t blocks = (inner + REDUCE_LANES - 1) / REDUCE_LANES;
+
+	#pragma omp parallel for collapse(2) if (parallel)
+	for (size_t o = 0; o < outer; o++) {
+		for (size_t b = 0; b < blocks; b++) {
+			size_t begin = b * REDUCE_LANES;
+			size_t lanes = std::min(REDUCE_LANES, inner - begin);
+			reduce_lanes <op> (&a[o * n * inner + begin], n, inner, lanes, &c[o * inner + begin]);
+		}
+	}
+}
+
+// Optimizer updates
+static constexpr size_t OPTIMIZER_CHUNK = 1 << 14;
+
+template <optimizer_mode op, typename T>
+void cpu_kernel_optimizer(const std::vector <optimizer_slot> &slots, const optimizer_step &step)
+{
+	// Work is split in chunks across all slots, so that many small parameters
+	// still share the threads of a single region
+	struct chunk {
+		size_t slot;
+		size_t start;
+		size_t end;
+	};
+
+	std::vector <chunk> chunks;
+	size_t total = 0;
+	for (size_t i = 0; i < slots.size(); i++) {
+		size_t n = slots[i].param.elements;
+		for (size_t start = 0; start < n; start += OPTIMIZER_CHUNK)
+			chunks.push_back({ i, start, std::min(start + OPTIMIZER_CHUNK, n) });
+		total += n;
+	}
+
+	T lr = step.lr;
+	T beta1 = step.beta1;
+	T beta2 = step.beta2;
+	T epsilon = step.epsilon;
+
+	// Bias corrections of the Adam moments
+	T c1 = 1.0 / (1.0 - std::pow(step.beta1, double(step.iteration)));
+	T c2 = 1.0 / (1.0 - std::pow(step.beta2, double(step.iteration)));
+
+	#pragma omp parallel for schedule(dynamic) if (total >= MAP_PARALLEL_THRESHOLD)
+	for (size_t c = 0; c < chunks.size(); c++) {
+		const optimizer_slot &slot = slots[chunks[c].slot];
+		T *p = slot.param.data <T> ();
+		const T *g = slot.grad.data <T> ();
+		T *m = slot.first.data <T> ();
+		T *v = slot.second.data <T> ();
+
+		size_t start = chunks[c].start;
+		size_t end = chunks[c].end;
+		if constexpr (op == ksgd) {
+			#pragma omp simd
+			for (size_t i = start; i < end; i++)
+				p[i] -= lr * g[i];
+		}
+
+		if constexpr (op == kmomentum) {
+			#pragma omp simd
+			for (size_t i = start; i < end; i++) {
+				m[i] = beta1 * m[i] - lr * g[i];
+				p[i] += m[i];
+			}
+		}
+
+		if constexpr (op == kadam) {
+			#pragma omp simd
+			for (size_t i = start; i < end; i++) {
+				m[i] = beta1 * m[i] + (T(1) - beta1) * g[i];
+				v[i] = beta2 * v[i] + (T(1) - beta2) * g[i] * g[i];
+				p[i] -= lr * (m[i] * c1) / std::sqrt(v[i] * c2 + epsilon);
+			}
+		}
+	}
+}
+
+// Instantiations for each supported element type
+#define INSTANTIATE_KERNELS(T) \
+	template void cpu_kernel_gemm <T> (const Resource &, const Resource &, Resource &, size_t, size_t, size_t, bool, bool); \
+	template void cpu_kernel_gemm <T> (const Resource &, size_t, size_t, const Resource &, size_t, size_t, Resource &, size_t, size_t, size_t); \
+	template void cpu_kernel_gemm_bias <T> (const Resource &, size_t, size_t, const Resource &, size_t, size_t, const Resource *, Resource &, size_t, size_t, size_t, gemm_activation); \
+	template void cpu_kernel_strided_copy <T> (const Resource &, const std::vector <long int> &, Resource &, const std::vector <long int> &, const std::vector <long int> &); \
+	template void cpu_kernel_strided_ewop <kadd, T> (const Resource &, const std::vector <long int> &, const Resource &, const std::vector <long int> &, Resource &, const std::vector <long int> &); \
+	template void cpu_kernel_strided_ewop <ksub, T> (const Resource &, const std::vector <long int> &, const Resource &, const std::vector <long int> &, Resource &, const std::vector <long int> &); \
+	template void cpu_kernel_strided_ewop <kmul, T> (const Resource &, const std::vector <long int> &, const Resource &, const std::vector <long int> &, Resource &, const std::vector <long int> &); \
+	template void cpu_kernel_strided_ewop <kdiv, T> (const Resource &, const std::vector <long int> &, const Resource &, const std::vector <long int> &, Resource &, const std::vector <long int> &); \
+	template void cpu_kernel_conv2d <T> (const Resource &, const Resource &, const Resource *, Resource &, const conv_shape &, size_t, gemm_activation, conv_algorithm); \
+	template void cpu_kernel_conv2d_input <T> (const Resource &, const Resource &, Resource &, const conv_shape &, size_t); \
+	template void cpu_kernel_conv2d_weights <T> (const Resource &, const Resource &, Resource &, const conv_shape &, size_t); \
+	template void cpu_kernel_pool <pool_average, T> (const Resource &, Resource &, const conv_shape &); \
+	template void cpu_kernel_pool <pool_max, T> (const Resource &, Resource &, const conv_shape &); \
+	template void cpu_kernel_pool_pullback <pool_average, T> (const Resource &, const Resource &, Resource &, const conv_shape &); \
+	template void cpu_kernel_pool_pullback <pool_max, T> (const Resource &, const Resource &, Resource &, const conv_shape &); \
+	template void cpu_kernel_fused <T> (const std::vector <fused_instruction> &, const std::vector <Resource> &, Resource &, size_t); \
+	template void cpu_kernel_reduce <ksum, T> (const Resource &, Resource &, size_t, size_t, size_t); \
+	template void cpu_kernel_reduce <kmean, T> (const Resource &, Resource &, size_t, size_t, size_t); \
+	template void cpu_kernel_reduce <kmax, T> (const Resource &, Resource &, size_t, size_t, size_t); \
+	template void cpu_kernel_reduce <kargmax, T> (const Resource &, Resource &, size_t, size_t, size_t); \
+	template void cpu_kernel_optimizer <ksgd, T> (const std::vector <optimizer_slot> &, const optimizer_step &); \
+	template void cpu_kernel_optimizer <kmomentum, T> (const std::vector <optimizer_slot> &, const optimizer_step &); \
+	template void cpu_kernel_optimizer <kadam, T> (const std::vector <optimizer_slot> &, const optimizer_step &);
+
+INSTANTIATE_KERNELS(float)
+INSTANTIATE_KERNELS(double)
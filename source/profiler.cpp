@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <fmt/color.h>
+
+#include "allocator.hpp"
+#include "profiler.hpp"
+
+using profiler_clock = std::chrono::steady_clock;
+
+// Calls in progress on a thread, innermost last
+struct Frame {
+	std::string_view tag;
+	Profiler::Phase phase;
+	profiler_clock::time_point start;
+	double children;
+	size_t flops;
+	size_t bytes;
+	size_t peak;
+};
+
+// Only the owning thread records into its log
+struct ThreadLog {
+	size_t id;
+	std::vector <Frame> stack;
+	std::vector <Profiler::Event> events;
+};
+
+static struct {
+	std::mutex lock;
+	std::vector <std::shared_ptr <ThreadLog>> logs;
+	std::atomic <profiler_clock::rep> origin = 0;
+} registry;
+
+static ThreadLog &thread_log()
+{
+	static thread_local std::shared_ptr <ThreadLog> log = []() {
+		auto log = std::make_shared <ThreadLog> ();
+		std::lock_guard guard(registry.lock);
+		log->id = registry.logs.size();
+		registry.logs.push_back(log);
+		return log;
+	}();
+
+	return *log;
+}
+
+static double microseconds(profiler_clock::duration d)
+{
+	return std::chrono::duration <double, std::micro> (d).count();
+}
+
+void Profiler::start()
+{
+	{
+		std::lock_guard guard(registry.lock);
+		for (auto &log : registry.logs)
+			log->events.clear();
+	}
+
+	registry.origin.store(profiler_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+	enabled.store(true, std::memory_order_release);
+}
+
+void Profiler::stop()
+{
+	enabled.store(false, std::memory_order_release);
+}
+
+bool Profiler::begin(std::string_view tag, Phase phase)
+{
+	ThreadLog &log = thread_log();
+	log.stack.push_back({ tag, phase, profiler_clock::now(), 0.0, 0, 0, Allocator::live_bytes() });
+	return true;
+}
+
+void Profiler::end()
+{
+	auto now = profiler_clock::now();
+
+	ThreadLog &log = thread_log();
+	Frame frame = log.stack.back();
+	log.stack.pop_back();
+
+	profiler_clock::time_point origin { profiler_clock::duration(registry.origin.load(std::memory_order_relaxed)) };
+	double duration = microseconds(now - frame.start);
+
+	if (!log.stack.empty()) {
+		Frame &parent = log.stack.back();
+		parent.children += duration;
+		parent.flops += frame.flops;
+		parent.bytes += frame.bytes;
+		parent.peak = std::max(parent.peak, frame.peak);
+	}
+
+	log.events.push_back({
+		std::string(frame.tag), frame.phase, log.id, log.stack.size(),
+		microseconds(frame.start - origin), duration, duration - frame.children,
+		frame.flops, frame.bytes, frame.peak
+	});
+}
+
+void Profiler::count_flops(size_t n)
+{
+	ThreadLog &log = thread_log();
+	if (!log.stack.empty())
+		log.stack.back().flops += n;
+}
+
+void Profiler::count_allocation(size_t bytes, size_t live)
+{
+	ThreadLog &log = thread_log();
+	if (log.stack.empty())
+		return;
+
+	Frame &frame = log.stack.back();
+	frame.bytes += bytes;
+	frame.peak = std::max(frame.peak, live);
+}
+
+// Reports
+std::vector <Profiler::Event> Profiler::events()
+{
+	std::lock_guard guard(registry.lock);
+
+	std::vector <Event> all;
+	for (auto &log : registry.logs)
+		all.insert(all.end(), log->events.begin(), log->events.end());
+
+	std::sort(all.begin(), all.end(), [](const Event &a, const Event &b) {
+		return a.start < b.start;
+	});
+
+	return all;
+}
+
+// Heaviest by self time first
+std::vector <Profiler::Entry> Profiler::summary()
+{
+	std::map <std::pair <std::string, Phase>, Entry> entries;
+	for (const Event &e : events()) {
+		Entry &entry = entries.try_emplace({ e.tag, e.phase }, Entry { e.tag, e.phase, 0, 0.0, 0.0, 0, 0, 0 }).first->second;
+		entry.calls++;
+		entry.total += e.duration;
+		entry.self += e.self;
+		entry.flops += e.flops;
+		entry.bytes += e.bytes;
+		entry.peak = std::max(entry.peak, e.peak);
+	}
+
+	std::vector <Entry> sorted;
+	for (auto &[key, entry] : entries)
+		sorted.push_back(entry);
+
+	std::sort(sorted.begin(), sorted.end(), [](const Entry &a, const Entry &b) {
+		return a.self > b.self;
+	});
+
+	return sorted;
+}
+
+static std::string escape(const std::string &str)
+{
+	std::string out;
+	for (char c : str) {
+		if (c == '"' || c == '\\')
+			out += '\\';
+		if (c >= 0 && c < 0x20)
+			out += fmt::format("\\u{:04x}", int(c));
+		else
+			out += c;
+	}
+
+	return out;
+}
+
+// Complete events of the Chrome trace format, viewable in Perfetto or in
+// chrome://tracing
+bool Profiler::export_trace(const std::filesystem::path &path)
+{
+	std::ofstream file(path);
+	if (!file) {
+		fmt::print("{} {} could not open {} for writing.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(profiler)"),
+				path.string());
+		return false;
+	}
+
+	file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+
+	std::vector <Event> all = events();
+	for (size_t i = 0; i < all.size(); i++) {
+		const Event &e = all[i];
+		file << fmt::format("{}\n{{\"name\": \"{}\", \"cat\": \"{}\", \"ph\": \"X\", \"pid\": 0, \"tid\": {}, "
+				"\"ts\": {:.3f}, \"dur\": {:.3f}, \"args\": {{\"flops\": {}, \"bytes\": {}, \"peak\": {}}}}}",
+				(i > 0) ? "," : "", escape(e.tag), format_as(e.phase), e.thread,
+				e.start, e.duration, e.flops, e.bytes, e.peak);
+	}
+
+	file << "\n]}\n";
+	return bool(file);
+}
+
+std::string Profiler::table(size_t rows)
+{
+	std::string out = fmt::format("{:<40} {:<8} {:>8} {:>12} {:>12} {:>10} {:>12} {:>10}\n",
+			"function", "phase", "calls", "total (ms)", "self (ms)", "GFLOP/s", "alloc (MB)", "peak (MB)");
+
+	std::vector <Entry> entries = summary();
+	for (size_t i = 0; i < entries.size() && i < rows; i++) {
+		const Entry &e = entries[i];
+		double gflops = (e.total > 0) ? e.flops / (e.total * 1e3) : 0.0;
+		out += fmt::format("{:<40.40} {:<8} {:>8} {:>12.3f} {:>12.3f} {:>10.2f} {:>12.2f} {:>10.2f}\n",
+				e.tag, format_as(e.phase), e.calls, e.total / 1e3, e.self / 1e3,
+				gflops, e.bytes / 1e6, e.peak / 1e6);
+	}
+
+	return out;
+}
+
+// Printing utilities
+std::string format_as(Profiler::Phase phase)
+{
+	return (phase == Profiler::forward) ? "forward" : "pullback";
+}
@@ -1,9 +1,110 @@
+#include <fmt/color.h>
+
+#include "device.hpp"
 #include "resource.hpp"
 
+void Resource::memset(double value) const
+{
+	type_dispatch(type, [&] <typename T> () {
+#ifdef PETAL_CUDA
+		if (device == eCUDA)
+			return cuda_kernel_fill <T> (*this, value);
+#endif
+
+#ifdef PETAL_VULKAN
+		if (device == eVulkan)
+			return vulkan_kernel_fill <T> (*this, value);
+#endif
+
+		T *values = data <T> ();
+		for (size_t i = 0; i < elements; i++)
+			values[i] = value;
+	});
+}
+
+// Devices other than the host
+static void unsupported(Resource::Device device)
+{
+	fmt::print("{} {} device {} is not supported by this build.\n",
+			fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+			fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(resource)"),
+			device);
+}
+
+std::optional <Resource> Resource::device_from(size_t elements, Type type, Device device, bool zero)
+{
+#ifdef PETAL_CUDA
+	if (device == eCUDA) {
+		void *ptr = cuda_allocate(elements * element_size(type));
+		if (!ptr)
+			return std::nullopt;
+
+		// Device memory has no header for a counter
+		Resource r { ptr, elements, nullptr, type, device };
+		r.owner = std::shared_ptr <void> (ptr, cuda_release);
+		if (zero)
+			r.memset(0.0);
+
+		return r;
+	}
+#endif
+
+#ifdef PETAL_VULKAN
+	// Shaders are single precision
+	if (device == eVulkan && type == f32) {
+		std::shared_ptr <const void> buffer;
+		void *ptr = vulkan_allocate(elements * element_size(type), buffer);
+		if (!ptr)
+			return std::nullopt;
+
+		Resource r { ptr, elements, nullptr, type, device };
+		r.owner = buffer;
+		if (zero)
+			r.memset(0.0);
+
+		return r;
+	}
+#endif
+
+	unsupported(device);
+	return std::nullopt;
+}
+
+bool Resource::device_copy(const Resource &r)
+{
+#ifdef PETAL_CUDA
+	if ((device == eCUDA || device == eCPU) && (r.device == eCUDA || r.device == eCPU)) {
+		if (ptr != r.ptr)
+			cuda_copy(ptr, device, r.ptr, r.device, bytes());
+		return true;
+	}
+#endif
+
+#ifdef PETAL_VULKAN
+	if ((device == eVulkan || device == eCPU) && (r.device == eVulkan || r.device == eCPU)) {
+		if (ptr != r.ptr)
+			vulkan_copy(ptr, r.ptr, bytes());
+		return true;
+	}
+#endif
+
+	unsupported(device != eCPU ? device : r.device);
+	return false;
+}
+
 // Printing
 std::string format_as(Resource::Type type)
 {
-	return "Float32";
+	switch (type) {
+	case Resource::f32:
+		return "Float32";
+	case Resource::f64:
+		return "Float64";
+	default:
+		break;
+	}
+
+	return "?";
 }
 
 std::string format_as(Resource::Device device)
@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <omp.h>
+
+#include "allocator.hpp"
+#include "scheduler.hpp"
+
+struct Job {
+	Scheduler::Group *group;
+	std::function <void ()> work;
+};
+
+struct JobQueue {
+	std::mutex lock;
+	std::deque <Job> jobs;
+};
+
+// Queue 0 is shared by the threads outside of the pool, and each worker
+// owns one of the others
+static struct Pool {
+	std::mutex lock;
+	std::condition_variable available;
+
+	std::vector <std::unique_ptr <JobQueue>> queues;
+	std::vector <std::thread> workers;
+
+	std::atomic <size_t> queued = 0;
+	std::atomic <size_t> running = 0;
+
+	size_t size = 0;
+	int cores = 1;
+	bool stopping = false;
+
+	void stop() {
+		{
+			std::lock_guard guard(lock);
+			stopping = true;
+		}
+
+		available.notify_all();
+		for (std::thread &worker : workers)
+			worker.join();
+
+		workers.clear();
+		queues.clear();
+		stopping = false;
+	}
+
+	~Pool() {
+		stop();
+	}
+} pool;
+
+static thread_local size_t self = 0;
+
+// Own jobs newest first, then the oldest jobs of the others
+static bool take(Job &job)
+{
+	size_t n = pool.queues.size();
+	for (size_t i = 0; i < n; i++) {
+		JobQueue &queue = *pool.queues[(self + i) % n];
+
+		std::lock_guard guard(queue.lock);
+		if (queue.jobs.empty())
+			continue;
+
+		if (i == 0) {
+			job = std::move(queue.jobs.back());
+			queue.jobs.pop_back();
+		} else {
+			job = std::move(queue.jobs.front());
+			queue.jobs.pop_front();
+		}
+
+		pool.queued--;
+		return true;
+	}
+
+	return false;
+}
+
+static void run(Job &job)
+{
+	// Kernels of concurrent jobs share the cores
+	size_t busy = ++pool.running;
+	int before = omp_get_max_threads();
+	omp_set_num_threads(std::max(1, pool.cores / int(busy)));
+
+	try {
+		job.work();
+	} catch (...) {
+		std::lock_guard guard(job.group->lock);
+		if (!job.group->error)
+			job.group->error = std::current_exception();
+	}
+
+	omp_set_num_threads(before);
+	pool.running--;
+
+	// The group may be gone as soon as it has no pending jobs
+	if (job.group->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		pool.available.notify_all();
+}
+
+static void work(size_t index)
+{
+	self = index;
+
+	std::unique_lock guard(pool.lock);
+	while (true) {
+		pool.available.wait(guard, []() { return pool.stopping || pool.queued > 0; });
+		if (pool.stopping)
+			return;
+
+		guard.unlock();
+
+		Job job;
+		while (take(job))
+			run(job);
+
+		guard.lock();
+	}
+}
+
+static void start(size_t threads)
+{
+	pool.cores = omp_get_num_procs();
+	pool.size = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+
+#ifdef PETAL_NONATOMIC_REFCOUNT
+	// Tasks would share tensors across threads
+	pool.size = 1;
+#endif
+
+	for (size_t i = 0; i < pool.size; i++)
+		pool.queues.push_back(std::make_unique <JobQueue> ());
+
+	for (size_t i = 1; i < pool.size; i++)
+		pool.workers.emplace_back(work, i);
+}
+
+size_t Scheduler::threads()
+{
+	static std::once_flag started;
+	std::call_once(started, []() {
+		if (!pool.size)
+			start(0);
+	});
+
+	return pool.size;
+}
+
+void Scheduler::set_threads(size_t count)
+{
+	threads();
+	pool.stop();
+	start(count);
+}
+
+bool Scheduler::concurrent()
+{
+	return threads() > 1 && !MemoryPlan::current();
+}
+
+void Scheduler::spawn(Group &group, std::function <void ()> work)
+{
+	group.pending++;
+
+	Job job { &group, std::move(work) };
+	if (threads() == 1)
+		return run(job);
+
+	{
+		JobQueue &queue = *pool.queues[self];
+		std::lock_guard guard(queue.lock);
+		queue.jobs.push_back(std::move(job));
+	}
+
+	{
+		std::lock_guard guard(pool.lock);
+		pool.queued++;
+	}
+
+	pool.available.notify_one();
+}
+
+void Scheduler::wait(Group &group)
+{
+	while (group.pending.load(std::memory_order_acquire) > 0) {
+		Job job;
+		if (take(job)) {
+			run(job);
+			continue;
+		}
+
+		// The remaining jobs are running elsewhere
+		std::unique_lock guard(pool.lock);
+		pool.available.wait_for(guard, std::chrono::microseconds(100), [&]() {
+			return pool.queued > 0 || group.pending.load(std::memory_order_acquire) == 0;
+		});
+	}
+
+	if (group.error)
+		std::rethrow_exception(group.error);
+}
@@ -0,0 +1,148 @@
+#include "session.hpp"
+
+// Batched serving
+Batcher::Batcher(const std::shared_ptr <const Function> &m, const Options &opts)
+		: model(m), options(opts)
+{
+	options.max_batch = std::max(options.max_batch, size_t(1));
+
+#ifndef PETAL_NONATOMIC_REFCOUNT
+	for (size_t i = 0; i < std::max(options.workers, size_t(1)); i++)
+		threads.emplace_back(&Batcher::work, this);
+#endif
+}
+
+Batcher::~Batcher()
+{
+	{
+		std::lock_guard <std::mutex> guard(lock);
+		stopping = true;
+	}
+
+	submitted.notify_all();
+	for (std::thread &thread : threads)
+		thread.join();
+}
+
+std::unique_ptr <Batcher> Batcher::from(const std::shared_ptr <const Function> &model, const Options &options)
+{
+	return std::make_unique <Batcher> (model, options);
+}
+
+std::future <Tensor> Batcher::submit(const Tensor &X)
+{
+	Request request;
+	std::future <Tensor> result = request.result.get_future();
+
+#ifdef PETAL_NONATOMIC_REFCOUNT
+	// Samples and results are handed between threads
+	fmt::print("{} {} batching needs atomic reference counts (PETAL_ATOMIC_REFCOUNT).\n",
+			fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+			fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(batcher)"));
+	request.result.set_value(Tensor {});
+	return result;
+#endif
+
+	// Rows are gathered on the host
+	if (!X.shape || X.buffer.device != Resource::eCPU) {
+		fmt::print("{} {} expected a host Tensor as a sample.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(batcher)"));
+		request.result.set_value(Tensor {});
+		return result;
+	}
+
+	request.X = X;
+	request.arrival = std::chrono::steady_clock::now();
+
+	{
+		std::lock_guard <std::mutex> guard(lock);
+		queue.push_back(std::move(request));
+	}
+
+	// Workers waiting on a partial batch check whether it is full
+	submitted.notify_all();
+	return result;
+}
+
+// Gathers the samples into rows, runs the model once and scatters the rows
+// of its output; the output is copied out before the next batch, so that
+// the session can reuse its memory
+void Batcher::serve(Session &session, std::vector <Request> &batch)
+{
+	const Tensor &first = batch[0].X;
+	size_t B = batch.size();
+
+	Shape shape = *first.shape;
+	shape.insert(shape.begin(), long(B));
+
+	Tensor X = Tensor::blank(shape, first.buffer.type);
+	size_t row_bytes = first.shape->elements() * Resource::element_size(first.buffer.type);
+
+	for (size_t i = 0; i < B; i++) {
+		Tensor sample = batch[i].X.contiguous();
+		std::memcpy(X.buffer.data <char> () + i * row_bytes, sample.buffer.data <char> (), row_bytes);
+	}
+
+	Tensor Y = session.run({ X });
+	if (!Y.shape || Y.shape->size() < 1 || Y.shape.value()[0] != long(B) || Y.buffer.device != Resource::eCPU) {
+		fmt::print("{} {} model output does not have a row for each of the {} samples.\n",
+				fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+				fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(batcher)"),
+				B);
+
+		for (Request &request : batch)
+			request.result.set_value(Tensor {});
+
+		return;
+	}
+
+	Y = Y.contiguous();
+
+	Shape row_shape = Y.shape->pop();
+	size_t out_bytes = row_shape.elements() * Resource::element_size(Y.buffer.type);
+	for (size_t i = 0; i < B; i++) {
+		Tensor row = Tensor::blank(row_shape, Y.buffer.type);
+		std::memcpy(row.buffer.data <char> (), Y.buffer.data <char> () + i * out_bytes, out_bytes);
+		batch[i].result.set_value(row);
+	}
+}
+
+void Batcher::work()
+{
+	Session session(model);
+
+	std::unique_lock <std::mutex> guard(lock);
+	while (true) {
+		submitted.wait(guard, [&]() { return stopping || !queue.empty(); });
+		if (queue.empty())
+			return;
+
+		// Wait for more requests, up to the budget of the oldest one
+		auto deadline = queue.front().arrival + options.budget;
+		submitted.wait_until(guard, deadline, [&]() {
+			return stopping || queue.size() >= options.max_batch;
+		});
+
+		// Another worker may have taken them in the meantime
+		if (queue.empty())
+			continue;
+
+		Shape shape = *queue.front().X.shape;
+		Resource::Type type = queue.front().X.buffer.type;
+
+		std::vector <Request> batch;
+		while (!queue.empty() && batch.size() < options.max_batch) {
+			const Tensor &X = queue.front().X;
+			if (X.shape != shape || X.buffer.type != type)
+				break;
+
+			batch.push_back(std::move(queue.front()));
+			queue.pop_front();
+		}
+
+		guard.unlock();
+		serve(session, batch);
+		guard.lock();
+	}
+}
@@ -7,7 +7,8 @@
 decltype(Tensor::tagger) Tensor::tagger;
 
 // Formatting tensors
-static std::string string_data(const double *const ptr, const std::optional <Shape> &opt_shape)
+template <typename T>
+static std::string string_data(const T *const ptr, const std::optional <Shape> &opt_shape)
 {
 	if (!opt_shape)
 		return "nil";
@@ -15,12 +16,12 @@ static std::string string_data(const double *const ptr, const std::optional <Sha
 	Shape shape = opt_shape.value();
 	if (shape.size() == 0) {
 		// Single element
-		double v = ptr[0];
+		T v = ptr[0];
 		return fmt::format("{:.4f}", v);
 	}
 
 	Shape sub_shape = shape.pop();
-	size_t sub_size = sub_shape.size();
+	size_t sub_size = sub_shape.elements();
 
 	std::string str = "[";
 	for (size_t i = 0; i < shape[0]; i++) {
@@ -46,5 +47,8 @@ std::string format_as(const Shape &s)
 std::string format_as(const Tensor &t)
 {
 	std::string header = "<Tensor: " + fmt::format("{}; {}; {}", *t.shape, t.buffer.type, t.buffer.device) + "> = ";
-	return header + string_data(t.buffer.ptr, t.shape);
+	Tensor values = t.to(Resource::eCPU).contiguous();
+	return header + type_dispatch(t.buffer.type, [&] <typename T> () {
+		return string_data(values.buffer.data <T> (), t.shape);
+	});
 }
@@ -0,0 +1,584 @@
+#include <bit>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include <fmt/color.h>
+
+#include "device.hpp"
+
+// SPIR-V of source/shaders, generated at build time
+#include "shaders/fill.h"
+#include "shaders/ewop.h"
+#include "shaders/activation.h"
+#include "shaders/reduce.h"
+#include "shaders/gemm.h"
+
+static bool check(VkResult status, const char *const what)
+{
+	if (status == VK_SUCCESS)
+		return true;
+
+	fmt::print("{} {} {} failed with status {}.\n",
+			fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+			fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(vulkan)"),
+			what, int(status));
+
+	return false;
+}
+
+// Buffers are addressed by shaders through their device address, which
+// is passed along with the other parameters as push constants
+struct vulkan_buffer {
+	VkBuffer buffer = VK_NULL_HANDLE;
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceAddress address = 0;
+	void *mapped = nullptr;
+	size_t capacity = 0;
+};
+
+enum vulkan_pipeline {
+	p_fill,
+	p_ewop,
+	p_activation,
+	p_reduce,
+	p_gemm,
+	p_count
+};
+
+static constexpr uint32_t PUSH_CONSTANT_BYTES = 128;
+
+// A single compute queue, with one command buffer and its fence. Released
+// buffers are kept by capacity for reuse; those released while commands
+// are recorded may still be read by them, and are retired until the next
+// submission completes. All threads share the context, and hence record
+// into (and submit) the same command buffer under its lock; recursive,
+// since dispatches may flush.
+struct vulkan_context {
+	VkInstance instance = VK_NULL_HANDLE;
+	VkPhysicalDevice physical = VK_NULL_HANDLE;
+	VkDevice device = VK_NULL_HANDLE;
+	VkQueue queue = VK_NULL_HANDLE;
+	VkCommandPool pool = VK_NULL_HANDLE;
+	VkCommandBuffer commands = VK_NULL_HANDLE;
+	VkFence fence = VK_NULL_HANDLE;
+	VkPipelineLayout layout = VK_NULL_HANDLE;
+	VkPipeline pipelines[p_count] = {};
+
+	uint32_t family = 0;
+	uint32_t memory_type = 0;
+	bool valid = false;
+
+	std::recursive_mutex lock;
+
+	bool recording = false;
+	size_t batches = 0;
+
+	std::multimap <size_t, vulkan_buffer *> cache;
+	std::vector <vulkan_buffer *> retired;
+
+	vulkan_context() {
+		VkApplicationInfo app { VK_STRUCTURE_TYPE_APPLICATION_INFO };
+		app.pApplicationName = "petals";
+		app.apiVersion = VK_API_VERSION_1_2;
+
+		VkInstanceCreateInfo instance_info { VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO };
+		instance_info.pApplicationInfo = &app;
+		if (!check(vkCreateInstance(&instance_info, nullptr, &instance), "vkCreateInstance"))
+			return;
+
+		if (!select_device() || !create_device() || !create_pipelines())
+			return;
+
+		valid = true;
+	}
+
+	// Discrete devices first, among those with compute and buffer device
+	// addresses
+	bool select_device() {
+		uint32_t count = 0;
+		vkEnumeratePhysicalDevices(instance, &count, nullptr);
+		std::vector <VkPhysicalDevice> devices(count);
+		vkEnumeratePhysicalDevices(instance, &count, devices.data());
+
+		int best = -1;
+		for (VkPhysicalDevice candidate : devices) {
+			VkPhysicalDeviceProperties properties;
+			vkGetPhysicalDeviceProperties(candidate, &properties);
+			if (properties.apiVersion < VK_API_VERSION_1_2)
+				continue;
+
+			VkPhysicalDeviceVulkan12Features features12 { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+			VkPhysicalDeviceFeatures2 features { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+			features.pNext = &features12;
+			vkGetPhysicalDeviceFeatures2(candidate, &features);
+			if (!features12.bufferDeviceAddress)
+				continue;
+
+			uint32_t families = 0;
+			vkGetPhysicalDeviceQueueFamilyProperties(candidate, &families, nullptr);
+			std::vector <VkQueueFamilyProperties> queues(families);
+			vkGetPhysicalDeviceQueueFamilyProperties(candidate, &families, queues.data());
+
+			int compute = -1;
+			for (uint32_t i = 0; i < families && compute < 0; i++) {
+				if (queues[i].queueFlags & VK_QUEUE_COMPUTE_BIT)
+					compute = i;
+			}
+
+			if (compute < 0)
+				continue;
+
+			int score = (properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) ? 2 : 1;
+			if (score > best) {
+				best = score;
+				physical = candidate;
+				family = compute;
+			}
+		}
+
+		if (best < 0) {
+			fmt::print("{} {} no device supports Vulkan 1.2 compute with buffer device addresses.\n",
+					fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+					fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(vulkan)"));
+			return false;
+		}
+
+		// Host visible memory, preferably local to the device (unified
+		// memory, or resizable BAR on discrete devices)
+		VkPhysicalDeviceMemoryProperties memory;
+		vkGetPhysicalDeviceMemoryProperties(physical, &memory);
+
+		constexpr VkMemoryPropertyFlags host = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+		constexpr VkMemoryPropertyFlags local = host | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+
+		int found = -1;
+		for (VkMemoryPropertyFlags wanted : { local, host }) {
+			for (uint32_t i = 0; i < memory.memoryTypeCount && found < 0; i++) {
+				if ((memory.memoryTypes[i].propertyFlags & wanted) == wanted)
+					found = i;
+			}
+		}
+
+		memory_type = found;
+		return found >= 0;
+	}
+
+	bool create_device() {
+		float priority = 1.0f;
+		VkDeviceQueueCreateInfo queue_info { VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO };
+		queue_info.queueFamilyIndex = family;
+		queue_info.queueCount = 1;
+		queue_info.pQueuePriorities = &priority;
+
+		VkPhysicalDeviceVulkan12Features features12 { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+		features12.bufferDeviceAddress = VK_TRUE;
+
+		VkDeviceCreateInfo device_info { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO };
+		device_info.pNext = &features12;
+		device_info.queueCreateInfoCount = 1;
+		device_info.pQueueCreateInfos = &queue_info;
+		if (!check(vkCreateDevice(physical, &device_info, nullptr, &device), "vkCreateDevice"))
+			return false;
+
+		vkGetDeviceQueue(device, family, 0, &queue);
+
+		VkCommandPoolCreateInfo pool_info { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+		pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+		pool_info.queueFamilyIndex = family;
+		if (!check(vkCreateCommandPool(device, &pool_info, nullptr, &pool), "vkCreateCommandPool"))
+			return false;
+
+		VkCommandBufferAllocateInfo commands_info { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+		commands_info.commandPool = pool;
+		commands_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		commands_info.commandBufferCount = 1;
+		if (!check(vkAllocateCommandBuffers(device, &commands_info, &commands), "vkAllocateCommandBuffers"))
+			return false;
+
+		VkFenceCreateInfo fence_info { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+		return check(vkCreateFence(device, &fence_info, nullptr, &fence), "vkCreateFence");
+	}
+
+	bool create_pipelines() {
+		VkPushConstantRange range { VK_SHADER_STAGE_COMPUTE_BIT, 0, PUSH_CONSTANT_BYTES };
+
+		VkPipelineLayoutCreateInfo layout_info { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+		layout_info.pushConstantRangeCount = 1;
+		layout_info.pPushConstantRanges = &range;
+		if (!check(vkCreatePipelineLayout(device, &layout_info, nullptr, &layout), "vkCreatePipelineLayout"))
+			return false;
+
+		struct { const uint32_t *code; size_t bytes; } shaders[p_count] = {
+			{ fill_spirv, sizeof(fill_spirv) },
+			{ ewop_spirv, sizeof(ewop_spirv) },
+			{ activation_spirv, sizeof(activation_spirv) },
+			{ reduce_spirv, sizeof(reduce_spirv) },
+			{ gemm_spirv, sizeof(gemm_spirv) },
+		};
+
+		for (size_t i = 0; i < p_count; i++) {
+			VkShaderModuleCreateInfo module_info { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+			module_info.codeSize = shaders[i].bytes;
+			module_info.pCode = shaders[i].code;
+
+			VkShaderModule module;
+			if (!check(vkCreateShaderModule(device, &module_info, nullptr, &module), "vkCreateShaderModule"))
+				return false;
+
+			VkComputePipelineCreateInfo pipeline_info { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+			pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+			pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+			pipeline_info.stage.module = module;
+			pipeline_info.stage.pName = "main";
+			pipeline_info.layout = layout;
+
+			VkResult status = vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &pipelines[i]);
+			vkDestroyShaderModule(device, module, nullptr);
+			if (!check(status, "vkCreateComputePipelines"))
+				return false;
+		}
+
+		return true;
+	}
+};
+
+// Never destroyed, since resources with static storage may outlive it
+static vulkan_context &context()
+{
+	static vulkan_context *ctx = new vulkan_context;
+	return *ctx;
+}
+
+// Command recording and submission
+static VkCommandBuffer begin()
+{
+	vulkan_context &ctx = context();
+	if (!ctx.recording) {
+		VkCommandBufferBeginInfo info { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+		info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		check(vkBeginCommandBuffer(ctx.commands, &info), "vkBeginCommandBuffer");
+		ctx.recording = true;
+	}
+
+	return ctx.commands;
+}
+
+// Submits everything recorded so far and waits for it on the fence; host
+// writes to mapped (coherent) memory are visible to the submission
+static void flush()
+{
+	vulkan_context &ctx = context();
+	std::lock_guard guard(ctx.lock);
+	if (!ctx.recording)
+		return;
+
+	ctx.recording = false;
+	check(vkEndCommandBuffer(ctx.commands), "vkEndCommandBuffer");
+
+	VkSubmitInfo submit { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+	submit.commandBufferCount = 1;
+	submit.pCommandBuffers = &ctx.commands;
+	if (check(vkQueueSubmit(ctx.queue, 1, &submit, ctx.fence), "vkQueueSubmit")) {
+		check(vkWaitForFences(ctx.device, 1, &ctx.fence, VK_TRUE, UINT64_MAX), "vkWaitForFences");
+		vkResetFences(ctx.device, 1, &ctx.fence);
+	}
+
+	for (vulkan_buffer *buffer : ctx.retired)
+		ctx.cache.emplace(buffer->capacity, buffer);
+
+	ctx.retired.clear();
+}
+
+template <typename P>
+static void dispatch(vulkan_pipeline pipeline, const P &parameters, uint32_t x, uint32_t y = 1)
+{
+	static_assert(sizeof(P) <= PUSH_CONSTANT_BYTES);
+
+	vulkan_context &ctx = context();
+	std::lock_guard guard(ctx.lock);
+
+	VkCommandBuffer commands = begin();
+	vkCmdBindPipeline(commands, VK_PIPELINE_BIND_POINT_COMPUTE, ctx.pipelines[pipeline]);
+	vkCmdPushConstants(commands, ctx.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(P), &parameters);
+	vkCmdDispatch(commands, x, y, 1);
+
+	// Each dispatch sees the results of the previous ones, as does the host
+	VkMemoryBarrier barrier { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_HOST_READ_BIT;
+	vkCmdPipelineBarrier(commands,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_HOST_BIT,
+			0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	if (ctx.batches == 0)
+		flush();
+}
+
+VulkanBatch::VulkanBatch()
+{
+	vulkan_context &ctx = context();
+	std::lock_guard guard(ctx.lock);
+	ctx.batches++;
+}
+
+VulkanBatch::~VulkanBatch()
+{
+	vulkan_context &ctx = context();
+	std::lock_guard guard(ctx.lock);
+	if (--ctx.batches == 0)
+		flush();
+}
+
+// Memory; capacities are rounded up to powers of two, so that released
+// buffers serve any later request of the same class
+static constexpr size_t MIN_BUFFER_BYTES = 256;
+
+static vulkan_buffer *create(size_t capacity)
+{
+	vulkan_context &ctx = context();
+
+	VkBufferCreateInfo buffer_info { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+	buffer_info.size = capacity;
+	buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+		| VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+		| VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+		| VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	auto buffer = new vulkan_buffer;
+	buffer->capacity = capacity;
+
+	auto fail = [&]() -> vulkan_buffer * {
+		if (buffer->memory)
+			vkFreeMemory(ctx.device, buffer->memory, nullptr);
+		if (buffer->buffer)
+			vkDestroyBuffer(ctx.device, buffer->buffer, nullptr);
+		delete buffer;
+		return nullptr;
+	};
+
+	if (!check(vkCreateBuffer(ctx.device, &buffer_info, nullptr, &buffer->buffer), "vkCreateBuffer"))
+		return fail();
+
+	VkMemoryRequirements requirements;
+	vkGetBufferMemoryRequirements(ctx.device, buffer->buffer, &requirements);
+	if (!(requirements.memoryTypeBits & (1u << ctx.memory_type)))
+		return fail();
+
+	VkMemoryAllocateFlagsInfo flags { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO };
+	flags.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+
+	VkMemoryAllocateInfo memory_info { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
+	memory_info.pNext = &flags;
+	memory_info.allocationSize = requirements.size;
+	memory_info.memoryTypeIndex = ctx.memory_type;
+	if (!check(vkAllocateMemory(ctx.device, &memory_info, nullptr, &buffer->memory), "vkAllocateMemory"))
+		return fail();
+
+	if (!check(vkBindBufferMemory(ctx.device, buffer->buffer, buffer->memory, 0), "vkBindBufferMemory")
+			|| !check(vkMapMemory(ctx.device, buffer->memory, 0, VK_WHOLE_SIZE, 0, &buffer->mapped), "vkMapMemory"))
+		return fail();
+
+	VkBufferDeviceAddressInfo address_info { VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO };
+	address_info.buffer = buffer->buffer;
+	buffer->address = vkGetBufferDeviceAddress(ctx.device, &address_info);
+
+	return buffer;
+}
+
+static void release(vulkan_buffer *buffer)
+{
+	vulkan_context &ctx = context();
+	std::lock_guard guard(ctx.lock);
+	if (ctx.recording)
+		ctx.retired.push_back(buffer);
+	else
+		ctx.cache.emplace(buffer->capacity, buffer);
+}
+
+void *vulkan_allocate(size_t bytes, std::shared_ptr <const void> &owner)
+{
+	vulkan_context &ctx = context();
+	if (!ctx.valid)
+		return nullptr;
+
+	size_t capacity = std::bit_ceil(std::max(bytes, MIN_BUFFER_BYTES));
+
+	std::lock_guard guard(ctx.lock);
+
+	vulkan_buffer *buffer = nullptr;
+	if (auto it = ctx.cache.find(capacity); it != ctx.cache.end()) {
+		buffer = it->second;
+		ctx.cache.erase(it);
+	} else if (!(buffer = create(capacity))) {
+		return nullptr;
+	}
+
+	owner = std::shared_ptr <vulkan_buffer> (buffer, release);
+	return buffer->mapped;
+}
+
+// Pending work may still write to either side
+void vulkan_copy(void *dst, const void *src, size_t bytes)
+{
+	flush();
+	std::memcpy(dst, src, bytes);
+}
+
+void vulkan_synchronize()
+{
+	flush();
+}
+
+// Device address of the first element of a resource, which may be a slice
+static VkDeviceAddress address(const Resource &r)
+{
+	auto buffer = static_cast <const vulkan_buffer *> (r.owner.get());
+	return buffer->address + ((const char *) r.ptr - (const char *) buffer->mapped);
+}
+
+// Kernels; grid stride loops over a bounded grid
+static constexpr uint32_t VULKAN_GROUP = 256;
+static constexpr uint32_t VULKAN_MAX_GROUPS = 4096;
+static constexpr uint32_t VULKAN_TILE = 16;
+
+static uint32_t groups(size_t n)
+{
+	size_t count = (n + VULKAN_GROUP - 1) / VULKAN_GROUP;
+	return std::max(std::min(count, size_t(VULKAN_MAX_GROUPS)), size_t(1));
+}
+
+template <typename T>
+static bool supported()
+{
+	if constexpr (std::is_same_v <T, float>)
+		return true;
+
+	fmt::print("{} {} kernels only support Float32 resources.\n",
+			fmt::format(fmt::fg(fmt::rgb(0xFF8888)), "[petals]"),
+			fmt::format(fmt::fg(fmt::rgb(0x8888FF)), "(vulkan)"));
+
+	return false;
+}
+
+template <typename T>
+void vulkan_kernel_fill(const Resource &A, T value)
+{
+	if (!supported <T> ())
+		return;
+
+	struct {
+		VkDeviceAddress c;
+		uint32_t n;
+		float value;
+	} parameters { address(A), uint32_t(A.elements), float(value) };
+
+	dispatch(p_fill, parameters, groups(A.elements));
+}
+
+template <ewop_mode op, typename T>
+void vulkan_kernel_ewop(const Resource &A, const Resource &B, Resource &C)
+{
+	if (!supported <T> ())
+		return;
+
+	struct {
+		VkDeviceAddress a;
+		VkDeviceAddress b;
+		VkDeviceAddress c;
+		uint32_t n;
+		uint32_t mode;
+	} parameters { address(A), address(B), address(C), uint32_t(A.elements), uint32_t(op) };
+
+	dispatch(p_ewop, parameters, groups(A.elements));
+}
+
+template <typename T>
+void vulkan_kernel_activation(const Resource &A, Resource &C, gemm_activation act)
+{
+	if (!supported <T> ())
+		return;
+
+	struct {
+		VkDeviceAddress a;
+		VkDeviceAddress c;
+		uint32_t n;
+		uint32_t act;
+	} parameters { address(A), address(C), uint32_t(A.elements), uint32_t(act) };
+
+	dispatch(p_activation, parameters, groups(A.elements));
+}
+
+// One work group for each output; accumulation is in single precision
+template <reduce_mode op, typename T>
+void vulkan_kernel_reduce(const Resource &A, Resource &C, size_t outer, size_t n, size_t inner)
+{
+	if (!supported <T> ())
+		return;
+
+	struct {
+		VkDeviceAddress a;
+		VkDeviceAddress c;
+		uint32_t outer;
+		uint32_t n;
+		uint32_t inner;
+		uint32_t mode;
+	} parameters { address(A), address(C), uint32_t(outer), uint32_t(n), uint32_t(inner), uint32_t(op) };
+
+	size_t outputs = std::max(outer * inner, size_t(1));
+	dispatch(p_reduce, parameters, uint32_t(std::min(outputs, size_t(VULKAN_MAX_GROUPS))));
+}
+
+// Tiled through shared memory, with the epilogue applied in place
+template <typename T>
+void vulkan_kernel_gemm_bias(const Resource &A, size_t rsA, size_t csA, const Resource &B, size_t rsB, size_t csB,
+		const Resource *bias, Resource &C, size_t N, size_t M, size_t K, gemm_activation act)
+{
+	if (!supported <T> ())
+		return;
+
+	struct {
+		VkDeviceAddress a;
+		VkDeviceAddress b;
+		VkDeviceAddress c;
+		VkDeviceAddress bias;
+		uint32_t N;
+		uint32_t M;
+		uint32_t K;
+		uint32_t rsA;
+		uint32_t csA;
+		uint32_t rsB;
+		uint32_t csB;
+		uint32_t act;
+		uint32_t biased;
+	} parameters {
+		address(A), address(B), address(C), bias ? address(*bias) : 0,
+		uint32_t(N), uint32_t(M), uint32_t(K),
+		uint32_t(rsA), uint32_t(csA), uint32_t(rsB), uint32_t(csB),
+		uint32_t(act), bias != nullptr
+	};
+
+	uint32_t x = (K + VULKAN_TILE - 1) / VULKAN_TILE;
+	uint32_t y = (N + VULKAN_TILE - 1) / VULKAN_TILE;
+	dispatch(p_gemm, parameters, std::max(x, 1u), std::max(y, 1u));
+}
+
+#define INSTANTIATE_VULKAN_KERNELS(T) \
+	template void vulkan_kernel_fill <T> (const Resource &, T); \
+	template void vulkan_kernel_ewop <kadd, T> (const Resource &, const Resource &, Resource &); \
+	template void vulkan_kernel_ewop <ksub, T> (const Resource &, const Resource &, Resource &); \
+	template void vulkan_kernel_ewop <kmul, T> (const Resource &, const Resource &, Resource &); \
+	template void vulkan_kernel_ewop <kdiv, T> (const Resource &, const Resource &, Resource &); \
+	template void vulkan_kernel_activation <T> (const Resource &, Resource &, gemm_activation); \
+	template void vulkan_kernel_reduce <ksum, T> (const Resource &, Resource &, size_t, size_t, size_t); \
+	template void vulkan_kernel_reduce <kmean, T> (const Resource &, Resource &, size_t, size_t, size_t); \
+	template void vulkan_kernel_reduce <kmax, T> (const Resource &, Resource &, size_t, size_t, size_t); \
+	template void vulkan_kernel_reduce <kargmax, T> (const Resource &, Resource &, size_t, size_t, size_t); \
+	template void vulkan_kernel_gemm_bias <T> (const Resource &, size_t, size_t, const Resource &, size_t, size_t, const Resource *, Resource &, size_t, size_t, size_t, gemm_activation);
+
+INSTANTIATE_VULKAN_KERNELS(float)
+INSTANTIATE_VULKAN_KERNELS(double)
@@ -0,0 +1,142 @@
+#include <benchmark/benchmark.h>
+
+#include "allocator.hpp"
+#include "ops.hpp"
+
+// Reports allocator activity over the lifetime of a benchmark
+static void report(benchmark::State &state, const Allocator::Statistics &before)
+{
+	Allocator::Statistics after = Allocator::statistics();
+	size_t allocations = after.allocations - before.allocations;
+	size_t hits = after.cache_hits - before.cache_hits;
+
+	// Every thread sees the totals over all threads, hence the averaging
+	state.counters["allocs/s"] = benchmark::Counter(allocations,
+			benchmark::Counter::kIsRate | benchmark::Counter::kAvgThreads);
+	state.counters["hit%"] = benchmark::Counter(allocations ? 100.0 * hits / allocations : 0.0,
+			benchmark::Counter::kAvgThreads);
+	state.counters["system"] = benchmark::Counter(after.system_allocations - before.system_allocations,
+			benchmark::Counter::kAvgThreads);
+}
+
+// Baseline; what Resource::from used to do
+static void BM_system_new(benchmark::State &state)
+{
+	size_t elements = state.range(0);
+	for (auto _ : state) {
+		float *ptr = new float[elements] { 0 };
+		auto *counter = new std::atomic <long long int> (1);
+		benchmark::DoNotOptimize(ptr);
+		delete counter;
+		delete[] ptr;
+	}
+}
+
+BENCHMARK(BM_system_new)->RangeMultiplier(16)->Range(16, 1 << 20);
+
+// Raw pooled blocks, including the counter
+static void BM_allocate(benchmark::State &state)
+{
+	size_t bytes = state.range(0) * sizeof(double);
+	Allocator::Statistics before = Allocator::statistics();
+	for (auto _ : state) {
+		void *ptr = Allocator::allocate(bytes);
+		benchmark::DoNotOptimize(ptr);
+		Allocator::release(ptr);
+	}
+
+	report(state, before);
+}
+
+BENCHMARK(BM_allocate)->RangeMultiplier(16)->Range(16, 1 << 20);
+
+// Uninitialized, pooled tensors
+static void BM_blank(benchmark::State &state)
+{
+	size_t elements = state.range(0);
+	Allocator::Statistics before = Allocator::statistics();
+	for (auto _ : state) {
+		Tensor t = Tensor::blank({ elements });
+		benchmark::DoNotOptimize(t.buffer.ptr);
+	}
+
+	report(state, before);
+}
+
+BENCHMARK(BM_blank)->RangeMultiplier(16)->Range(16, 1 << 20);
+
+// Zeroed, pooled tensors
+static void BM_zeros(benchmark::State &state)
+{
+	size_t elements = state.range(0);
+	for (auto _ : state) {
+		Tensor t = Tensor::zeros({ elements });
+		benchmark::DoNotOptimize(t.buffer.ptr);
+	}
+}
+
+BENCHMARK(BM_zeros)->RangeMultiplier(16)->Range(16, 1 << 20);
+
+// Many live tensors of mixed sizes, released out of order
+static void BM_churn(benchmark::State &state)
+{
+	constexpr size_t LIVE = 64;
+	static const size_t sizes[] = { 1, 10, 300, 3000, 23550, 78500 };
+
+	Allocator::Statistics before = Allocator::statistics();
+	std::vector <Tensor> live(LIVE);
+
+	size_t i = 0;
+	for (auto _ : state) {
+		live[(i * 37) % LIVE] = Tensor::blank({ sizes[i % std::size(sizes)] });
+		i++;
+	}
+
+	report(state, before);
+}
+
+BENCHMARK(BM_churn)->Threads(1)->Threads(4);
+
+// Temporaries of an MNIST sized forward and pullback through a single layer
+static void BM_linear_step(benchmark::State &state)
+{
+	Linear L = Linear::from(784, 30);
+	Tensor X = Tensor::randn({ 100, 784 });
+	Tensor delta = Tensor::randn({ 100, 30 });
+
+	Allocator::Statistics before = Allocator::statistics();
+	for (auto _ : state) {
+		Tape tape = Tape::from(L.parameters());
+		Tensor Y = L.forward(X);
+		L.pullback_args({ X }, delta, tape);
+	}
+
+	report(state, before);
+}
+
+BENCHMARK(BM_linear_step);
+
+// The same, with every step as a pass of a memory plan
+static void BM_planned_linear_step(benchmark::State &state)
+{
+	Linear L = Linear::from(784, 30);
+	Tensor X = Tensor::randn({ 100, 784 });
+	Tensor delta = Tensor::randn({ 100, 30 });
+
+	MemoryPlan plan;
+	Allocator::Statistics before = Allocator::statistics();
+	for (auto _ : state) {
+		MemoryPlan::Pass pass(plan);
+		Tape tape = Tape::from(L.parameters());
+		Tensor Y = L.forward(X);
+		L.pullback_args({ X }, delta, tape);
+	}
+
+	report(state, before);
+	state.counters["planned%"] = benchmark::Counter(100.0 * (Allocator::statistics().planned_allocations - before.planned_allocations)
+			/ std::max(size_t(1), Allocator::statistics().allocations - before.allocations));
+}
+
+BENCHMARK(BM_planned_linear_step);
+
+BENCHMARK_MAIN();
@@ -1,6 +1,32 @@
+#include <omp.h>
+
 #include <benchmark/benchmark.h>
 
 #include "ops.hpp"
+#include "composition.hpp"
+#include "session.hpp"
+#include "static_chain.hpp"
+
+// Throughput counters, from the nominal traffic and work of one iteration
+static void throughput(benchmark::State &state, double bytes, double flops)
+{
+	state.counters["bytes/s"] = benchmark::Counter(bytes,
+			benchmark::Counter::kIsIterationInvariantRate,
+			benchmark::Counter::kIs1024);
+	state.counters["FLOP/s"] = benchmark::Counter(flops,
+			benchmark::Counter::kIsIterationInvariantRate);
+}
+
+// Elementwise benchmarks take the number of elements, as rows of 100
+static void elementwise_sizes(benchmark::internal::Benchmark *b)
+{
+	b->Arg(10'000)->Arg(100'000)->Arg(1'000'000);
+}
+
+static Tensor rows(size_t elements)
+{
+	return Tensor::randn({ elements / 100, 100ul });
+}
 
 // Tensor generation
 static void BM_randn(benchmark::State &state)
@@ -11,61 +37,610 @@ static void BM_randn(benchmark::State &state)
 
 BENCHMARK(BM_randn);
 
+// Handing tensors around, as argument lists and tapes do
+static void BM_tensor_copy(benchmark::State &state)
+{
+	Tensor A = Tensor::blank({ 100 });
+	for (auto _ : state) {
+		Tensor B = A;
+		benchmark::DoNotOptimize(B);
+	}
+}
+
+static void BM_tensor_move(benchmark::State &state)
+{
+	Tensor A = Tensor::blank({ 100 });
+	for (auto _ : state) {
+		Tensor B = std::move(A);
+		benchmark::DoNotOptimize(B);
+		A = std::move(B);
+	}
+}
+
+BENCHMARK(BM_tensor_copy);
+BENCHMARK(BM_tensor_move);
+
 // Tensor unary operations
-#define BM_Unary(ftn, ...)                                  \
-	static void BM_##ftn(benchmark::State &state) {     \
-		Tensor A = Tensor::randn({ __VA_ARGS__ });  \
-		for (auto _ : state)                        \
-			ops::ftn.forward(A);                \
-	}                                                   \
-	BENCHMARK(BM_##ftn);
-
-BM_Unary(relu,    100, 100, 100)
-BM_Unary(sigmoid, 100, 100, 100)
-BM_Unary(softmax, 100, 100, 100)
-BM_Unary(square,  100, 100, 100)
-BM_Unary(sum,     100, 100, 100)
+#define BM_Unary(ftn)                                                        \
+	static void BM_##ftn(benchmark::State &state) {                      \
+		size_t n = state.range(0);                                   \
+		Tensor A = rows(n);                                          \
+		size_t out = 0;                                              \
+		for (auto _ : state)                                         \
+			out = ops::ftn.forward(A).buffer.elements;           \
+		throughput(state, sizeof(float) * (n + out), n);             \
+	}                                                                    \
+	BENCHMARK(BM_##ftn)->Apply(elementwise_sizes);
+
+BM_Unary(relu)
+BM_Unary(sigmoid)
+BM_Unary(softmax)
+BM_Unary(square)
+BM_Unary(sum)
 
 // Binary operations
-#define BM_Binary(ftn, ...)                                 \
-	static void BM_##ftn(benchmark::State &state) {     \
-		Tensor A = Tensor::randn({ __VA_ARGS__ });  \
-		Tensor B = Tensor::randn({ __VA_ARGS__ });  \
-		for (auto _ : state)                        \
-			ops::ftn.forward(A, B);             \
-	}                                                   \
-	BENCHMARK(BM_##ftn);
-
-BM_Binary(add,    100, 100, 100)
-BM_Binary(sub,    100, 100, 100)
-BM_Binary(mul,    100, 100, 100)
-BM_Binary(div,    100, 100, 100)
+#define BM_Binary(ftn)                                                       \
+	static void BM_##ftn(benchmark::State &state) {                      \
+		size_t n = state.range(0);                                   \
+		Tensor A = rows(n);                                          \
+		Tensor B = rows(n);                                          \
+		for (auto _ : state)                                         \
+			ops::ftn.forward(A, B);                              \
+		throughput(state, sizeof(float) * 3 * n, n);                 \
+	}                                                                    \
+	BENCHMARK(BM_##ftn)->Apply(elementwise_sizes);
+
+BM_Binary(add)
+BM_Binary(sub)
+BM_Binary(mul)
+BM_Binary(div)
 
 // Floating point combinations
-#define BM_Unary_Custom(ftn, ...)                           \
-	static void BM_##ftn(benchmark::State &state) {     \
-		Tensor A = Tensor::randn({ __VA_ARGS__ });  \
-		auto F = ops::ftn::from(1.0);               \
-		for (auto _ : state)                        \
-			F.forward(A);                       \
-	}                                                   \
-	BENCHMARK(BM_##ftn);
+#define BM_Unary_Custom(ftn)                                                 \
+	static void BM_##ftn(benchmark::State &state) {                      \
+		size_t n = state.range(0);                                   \
+		Tensor A = rows(n);                                          \
+		auto F = ops::ftn::from(1.0);                                \
+		for (auto _ : state)                                         \
+			F.forward(A);                                        \
+		throughput(state, sizeof(float) * 2 * n, n);                 \
+	}                                                                    \
+	BENCHMARK(BM_##ftn)->Apply(elementwise_sizes);
+
+BM_Unary_Custom(_addk)
+BM_Unary_Custom(_scalek)
+
+// Expressions, with and without elementwise fusion
+static void BM_expression(benchmark::State &state)
+{
+	bool fusing = state.range(0);
+	Tensor A = Tensor::randn({ 100, 100, 100 });
+	Tensor B = Tensor::randn({ 100, 100, 100 });
+	for (auto _ : state)
+		(sum(square(A - B))/10).eval(fusing);
+}
+
+BENCHMARK(BM_expression)->Arg(0)->Arg(1);
+
+// Building an expression alone, nested to the given depth, with constants
+// at every level
+static void BM_expression_build(benchmark::State &state)
+{
+	size_t depth = state.range(0);
+	Tensor A = Tensor::randn({ 10, 10 });
+	Tensor B = Tensor::randn({ 10, 10 });
+	for (auto _ : state) {
+		DynamicDeferred expression = A - B;
+		for (size_t i = 0; i < depth; i++)
+			expression = 0.5 * square(expression - B) + 1.0;
+
+		benchmark::DoNotOptimize(sum(expression) / 10);
+	}
+
+	state.SetItemsProcessed(state.iterations() * (3 * depth + 3));
+}
+
+BENCHMARK(BM_expression_build)->Arg(1)->Arg(10)->Arg(100);
+
+// Pullbacks of every function that has one, from a delta shaped as its
+// output; the inputs are read and their deltas written, on top of the delta
+template <typename F>
+static void pullback(benchmark::State &state, F &ftn, size_t inputs)
+{
+	size_t n = state.range(0);
+
+	tensor_list args;
+	for (size_t i = 0; i < inputs; i++)
+		args.push_back(rows(n));
+
+	Tensor out = ftn.forward_args(args);
+	Tensor delta = Tensor::randn(*out.shape);
+	for (auto _ : state) {
+		Tape tape;
+		ftn.pullback_args(args, delta, tape);
+	}
+
+	throughput(state, sizeof(float) * (2 * inputs * n + delta.buffer.elements), inputs * n);
+}
+
+#define BM_Pullback(ftn, inputs)                                             \
+	static void BM_##ftn##_pullback(benchmark::State &state) {           \
+		pullback(state, ops::ftn, inputs);                           \
+	}                                                                    \
+	BENCHMARK(BM_##ftn##_pullback)->Apply(elementwise_sizes);
+
+BM_Pullback(add, 2)
+BM_Pullback(sub, 2)
+BM_Pullback(mul, 2)
+BM_Pullback(div, 2)
+BM_Pullback(square, 1)
+BM_Pullback(sum, 1)
+BM_Pullback(mean, 1)
+BM_Pullback(max, 1)
+BM_Pullback(relu, 1)
+BM_Pullback(sigmoid, 1)
+BM_Pullback(softmax, 1)
+BM_Pullback(softmax_cross_entropy, 2)
+
+static void BM__scalek_pullback(benchmark::State &state)
+{
+	auto F = ops::_scalek::from(2.0);
+	pullback(state, F, 1);
+}
+
+BENCHMARK(BM__scalek_pullback)->Apply(elementwise_sizes);
+
+// Adding a bias row to every row, with the bias copied out to the full
+// shape first (0) or broadcast through zero strides (1)
+static void BM_broadcast_add(benchmark::State &state)
+{
+	size_t n = 1'000'000;
+	Tensor A = rows(n);
+	Tensor bias = Tensor::randn({ 100ul });
+	for (auto _ : state) {
+		if (state.range(0))
+			ops::add.forward(A, bias);
+		else
+			ops::add.forward(A, bias.broadcast(*A.shape).contiguous());
+	}
+
+	throughput(state, sizeof(float) * 2 * n, n);
+}
+
+BENCHMARK(BM_broadcast_add)->Arg(0)->Arg(1);
+
+// Matrix multiplication; arguments are (N, M, K) for (N x M) * (M x K)
+template <typename T>
+static void BM_gemm(benchmark::State &state)
+{
+	size_t N = state.range(0);
+	size_t M = state.range(1);
+	size_t K = state.range(2);
+
+	Tensor A = Tensor::randn({ N, M }, resource_type_of <T>);
+	Tensor B = Tensor::randn({ M, K }, resource_type_of <T>);
+	Tensor C = Tensor::blank({ N, K }, resource_type_of <T>);
+	for (auto _ : state)
+		cpu_kernel_gemm <T> (A.buffer, B.buffer, C.buffer, N, M, K);
 
-BM_Unary_Custom(_addk,   100, 100, 100);
-BM_Unary_Custom(_scalek, 100, 100, 100);
+	state.counters["FLOP/s"] = benchmark::Counter(2.0 * N * M * K,
+			benchmark::Counter::kIsIterationInvariantRate);
+}
+
+static void gemm_shapes(benchmark::internal::Benchmark *b)
+{
+	b
+	// Square
+	->Args({ 128, 128, 128 })
+	->Args({ 512, 512, 512 })
+	->Args({ 1024, 1024, 1024 })
+	// Tall-skinny
+	->Args({ 4096, 64, 64 })
+	->Args({ 64, 4096, 64 })
+	// MNIST layers; forward, input delta and weight delta
+	->Args({ 100, 785, 30 })
+	->Args({ 100, 30, 785 })
+	->Args({ 785, 100, 30 });
+}
 
-// TODO: Pullbacks
+BENCHMARK_TEMPLATE(BM_gemm, float)->Apply(gemm_shapes);
+BENCHMARK_TEMPLATE(BM_gemm, double)->Apply(gemm_shapes);
+
+// Machine learning; Linear layers take (batch, in, out, bias)
+static void linear_shapes(benchmark::internal::Benchmark *b)
+{
+	for (long int bias : { 0, 1 }) {
+		b
+		->Args({ 100, 100, 100, bias })
+		->Args({ 100, 784, 30, bias })
+		->Args({ 100, 30, 10, bias })
+		->Args({ 256, 512, 512, bias })
+		->Args({ 1024, 1024, 1024, bias });
+	}
+}
 
-// Machine learning
 static void BM_linear(benchmark::State &state)
 {
-	// TODO: with and without bias
-	Linear L = Linear::from(100, 100);
-	Tensor A = Tensor::randn({ 100, 100 });
+	size_t N = state.range(0);
+	size_t in = state.range(1);
+	size_t out = state.range(2);
+
+	Linear L = Linear::from(in, out, state.range(3));
+	Tensor A = Tensor::randn({ N, in });
 	for (auto _ : state)
 		L.forward(A);
+
+	throughput(state, sizeof(float) * (N * in + in * out + N * out), 2.0 * N * in * out);
+}
+
+BENCHMARK(BM_linear)->Apply(linear_shapes);
+
+// Both the input and the weight deltas
+static void BM_linear_pullback(benchmark::State &state)
+{
+	size_t N = state.range(0);
+	size_t in = state.range(1);
+	size_t out = state.range(2);
+
+	Linear L = Linear::from(in, out, state.range(3));
+	Tensor A = Tensor::randn({ N, in });
+	Tensor delta = Tensor::randn(*L.forward(A).shape);
+	for (auto _ : state) {
+		Tape tape = Tape::from(L.parameters());
+		L.pullback_args({ A }, delta, tape);
+	}
+
+	throughput(state, sizeof(float) * 2 * (N * in + in * out + N * out), 4.0 * N * in * out);
+}
+
+BENCHMARK(BM_linear_pullback)->Apply(linear_shapes);
+
+// Convolutions over a batch of 8 images of 64x64, by channels in and out,
+// kernel and algorithm
+static void conv_shapes(benchmark::internal::Benchmark *b)
+{
+	for (long int algorithm : { conv_im2col, conv_winograd }) {
+		b
+		->Args({ 16, 16, 3, algorithm })
+		->Args({ 32, 32, 3, algorithm })
+		->Args({ 64, 64, 3, algorithm });
+	}
+
+	b
+	->Args({ 64, 64, 1, conv_auto })
+	->Args({ 3, 32, 5, conv_auto });
+}
+
+static void BM_conv2d(benchmark::State &state)
+{
+	size_t C = state.range(0);
+	size_t K = state.range(1);
+	size_t kernel = state.range(2);
+	size_t pixels = 8 * 64 * 64;
+
+	Conv2D conv = Conv2D::from(C, K, kernel, { .padding = kernel / 2 });
+	conv.algorithm = conv_algorithm(state.range(3));
+
+	Tensor X = Tensor::randn({ 8ul, 64ul, 64ul, C });
+	for (auto _ : state)
+		conv.forward(X);
+
+	throughput(state, sizeof(float) * (pixels * (C + K) + kernel * kernel * C * K), 2.0 * pixels * kernel * kernel * C * K);
+}
+
+BENCHMARK(BM_conv2d)->Apply(conv_shapes);
+
+// The same convolution as a Linear layer over patches unrolled beforehand
+static void BM_conv2d_unrolled(benchmark::State &state)
+{
+	size_t C = state.range(0);
+	size_t K = state.range(1);
+	size_t kernel = state.range(2);
+	size_t pixels = 8 * 64 * 64;
+	long int padding = kernel / 2;
+
+	Linear L = Linear::from(kernel * kernel * C, K);
+	Tensor X = Tensor::randn({ 8ul, 64ul, 64ul, C });
+	for (auto _ : state) {
+		Tensor P = Tensor::zeros({ pixels, kernel * kernel * C });
+		const float *x = X.buffer.data <float> ();
+		float *p = P.buffer.data <float> ();
+		for (size_t pixel = 0; pixel < pixels; pixel++) {
+			long int h = (pixel / 64) % 64;
+			long int w = pixel % 64;
+			for (size_t i = 0; i < kernel; i++) {
+				for (size_t j = 0; j < kernel; j++) {
+					long int y = h + i - padding;
+					long int v = w + j - padding;
+					if (y >= 0 && y < 64 && v >= 0 && v < 64)
+						std::copy_n(&x[((pixel / 4096 * 64 + y) * 64 + v) * C], C, &p[(pixel * kernel + i) * kernel * C + j * C]);
+				}
+			}
+		}
+
+		L.forward(P);
+	}
+
+	throughput(state, sizeof(float) * (pixels * (C + K) + kernel * kernel * C * K), 2.0 * pixels * kernel * kernel * C * K);
+}
+
+BENCHMARK(BM_conv2d_unrolled)->Args({ 16, 16, 3 })->Args({ 64, 64, 3 });
+
+// Both the input and the weight deltas
+static void BM_conv2d_pullback(benchmark::State &state)
+{
+	size_t C = state.range(0);
+	size_t K = state.range(1);
+	size_t kernel = state.range(2);
+	size_t pixels = 8 * 64 * 64;
+
+	Conv2D conv = Conv2D::from(C, K, kernel, { .padding = kernel / 2 });
+	Tensor X = Tensor::randn({ 8ul, 64ul, 64ul, C });
+	Tensor delta = Tensor::randn(*conv.forward(X).shape);
+	for (auto _ : state) {
+		Tape tape = Tape::from(conv.parameters());
+		conv.pullback_args({ X }, delta, tape);
+	}
+
+	throughput(state, sizeof(float) * 2 * (pixels * (C + K) + kernel * kernel * C * K), 4.0 * pixels * kernel * kernel * C * K);
+}
+
+BENCHMARK(BM_conv2d_pullback)->Args({ 16, 16, 3 })->Args({ 64, 64, 3 })->Args({ 64, 64, 1 });
+
+// Upsampling by two, from 32x32 images
+static void BM_conv_transpose2d(benchmark::State &state)
+{
+	size_t C = state.range(0);
+
+	ConvTranspose2D conv = ConvTranspose2D::from(C, C, 4, { .stride = 2, .padding = 1 });
+	Tensor X = Tensor::randn({ 8ul, 32ul, 32ul, C });
+	for (auto _ : state)
+		conv.forward(X);
+
+	throughput(state, sizeof(float) * 5 * X.buffer.elements, 2.0 * X.buffer.elements * 16 * C);
+}
+
+BENCHMARK(BM_conv_transpose2d)->Arg(16)->Arg(64);
+
+// Pooling 2x2 windows of 64 channels, forward and pullback
+static void BM_pool2d(benchmark::State &state)
+{
+	Pool2D pool = Pool2D::from(pool_mode(state.range(0)), 2, { .stride = 2 });
+	Tensor X = Tensor::randn({ 8, 64, 64, 64 });
+	Tensor delta = Tensor::randn(*pool.forward(X).shape);
+	for (auto _ : state) {
+		Tape tape;
+		pool.forward(X);
+		pool.pullback_args({ X }, delta, tape);
+	}
+
+	throughput(state, sizeof(float) * 3 * X.buffer.elements, 2.0 * X.buffer.elements);
+}
+
+BENCHMARK(BM_pool2d)->Arg(pool_average)->Arg(pool_max);
+
+// The MNIST model, forward and backward through the graph of a loss, for
+// a given batch size
+static Chain mnist_model()
+{
+	return Linear::from(784, 30, true, Resource::f32, gemm_sigmoid) >> Linear::from(30, 10);
+}
+
+static constexpr double MNIST_FLOPS_PER_SAMPLE = 2.0 * (784 * 30 + 30 * 10);
+
+static void BM_chain(benchmark::State &state)
+{
+	size_t N = state.range(0);
+
+	Chain model = mnist_model();
+	Tensor X = Tensor::randn({ N, 784ul });
+	for (auto _ : state) {
+		Tape tape = Tape::from(model.parameters());
+		DynamicDeferred loss = sum(square(model(X)));
+		loss.eval();
+		loss.backward(tape);
+	}
+
+	throughput(state, sizeof(float) * 3 * N * 784, 3 * N * MNIST_FLOPS_PER_SAMPLE);
+}
+
+BENCHMARK(BM_chain)->Arg(10)->Arg(100)->Arg(1000);
+
+// Inference alone, through a Chain and through the equivalent StaticChain
+static void BM_chain_inference(benchmark::State &state)
+{
+	size_t N = state.range(0);
+
+	Chain model = mnist_model();
+	Tensor X = Tensor::randn({ N, 784ul });
+	for (auto _ : state)
+		benchmark::DoNotOptimize(model.forward(X));
+
+	throughput(state, sizeof(float) * N * 784, N * MNIST_FLOPS_PER_SAMPLE);
+}
+
+static void BM_static_chain(benchmark::State &state)
+{
+	size_t N = state.range(0);
+
+	auto model = StaticChain <fixed::Linear <784, 30>, fixed::Sigmoid, fixed::Linear <30, 10>> ::from();
+	Tensor X = Tensor::randn({ N, 784ul });
+	Tensor Y = Tensor::blank({ N, 10ul });
+	for (auto _ : state) {
+		model.forward(X.buffer.data <float> (), Y.buffer.data <float> (), N);
+		benchmark::ClobberMemory();
+	}
+
+	throughput(state, sizeof(float) * N * 784, N * MNIST_FLOPS_PER_SAMPLE);
+}
+
+BENCHMARK(BM_chain_inference)->Arg(1)->Arg(10)->Arg(100);
+BENCHMARK(BM_static_chain)->Arg(1)->Arg(10)->Arg(100);
+
+// Single sample requests from several clients at once, served one at a time
+// or gathered into batches of up to the given size
+static std::unique_ptr <Batcher> batcher;
+
+static void BM_batcher(benchmark::State &state)
+{
+	if (state.thread_index() == 0) {
+		auto model = std::make_shared <const Chain> (mnist_model());
+		batcher = Batcher::from(model, { .max_batch = size_t(state.range(0)), .budget = std::chrono::microseconds(200) });
+	}
+
+	Tensor X = Tensor::randn({ 784ul });
+	for (auto _ : state)
+		benchmark::DoNotOptimize(batcher->submit(X).get());
+
+	if (state.thread_index() == 0)
+		batcher.reset();
+
+	state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_batcher)->Arg(1)->Arg(16)->Arg(64)->Threads(16)->UseRealTime();
+
+// Independent branches of a graph, forward and backward, run in sequence
+// (one scheduler thread) or as tasks (one per core)
+static void BM_branches(benchmark::State &state)
+{
+	size_t N = 256;
+	Scheduler::set_threads(state.range(0));
+
+	std::vector <Chain> branches;
+	for (size_t i = 0; i < 4; i++)
+		branches.push_back(Chain::from(Linear::from(784, 256, true, Resource::f32, gemm_sigmoid)));
+
+	Tensor X = Tensor::randn({ N, 784ul });
+	for (auto _ : state) {
+		Tape tape = Tape::from(branches[0].parameters());
+		DynamicDeferred loss = sum(square(branches[0](X) - branches[1](X)) - square(branches[2](X) - branches[3](X)));
+		loss.eval();
+		loss.backward(tape);
+	}
+
+	Scheduler::set_threads(0);
+	throughput(state, sizeof(float) * 4 * 3 * N * 784, 4 * 3 * 2.0 * N * 784 * 256);
+}
+
+BENCHMARK(BM_branches)->Arg(1)->Arg(0)->UseRealTime();
+
+// A whole training step as in the MNIST example: forward, loss, backward,
+// gathering into the parameter arena and the Adam update
+static void train_step(benchmark::State &state, size_t N, bool planning)
+{
+	Chain model = mnist_model();
+	ParameterArena arena = *ParameterArena::from(model.parameters());
+	Adam opt = Adam::from({ &arena.values }, 0.01f);
+
+	Tensor X = Tensor::randn({ N, 784ul });
+	Tensor Y = Tensor::zeros({ N, 10ul });
+	for (size_t i = 0; i < N; i++)
+		Y.buffer.data <float> ()[i * 10 + i % 10] = 1;
+
+	MemoryPlan plan;
+	for (auto _ : state) {
+		std::optional <MemoryPlan::Pass> pass;
+		if (planning)
+			pass.emplace(plan);
+
+		Tape tape = Tape::from(model.parameters());
+		auto loss = softmax_cross_entropy(model(X), Y);
+		loss.eval();
+		loss.backward(tape);
+
+		arena.gather(tape);
+		opt.step(arena.tape());
+	}
+
+	state.SetItemsProcessed(state.iterations() * N);
+	throughput(state, sizeof(float) * 3 * N * 784, 3 * N * MNIST_FLOPS_PER_SAMPLE);
+}
+
+// Arguments are (batch, memory planning)
+static void BM_train_step(benchmark::State &state)
+{
+	train_step(state, state.range(0), state.range(1));
+}
+
+BENCHMARK(BM_train_step)->Args({ 100, 0 })->Args({ 100, 1 })->Args({ 1000, 1 });
+
+// Optimizer steps over the parameters of the MNIST model, per tensor or
+// all at once
+static void BM_adam(benchmark::State &state)
+{
+	Chain model = mnist_model();
+
+	Tape tape;
+	for (Tensor *t : model.parameters())
+		tape[t->tag] = Tensor::randn(*t->shape);
+
+	Adam opt = Adam::from(model.parameters());
+	opt.foreach = state.range(0);
+	for (auto _ : state)
+		opt.step(tape);
+}
+
+BENCHMARK(BM_adam)->Arg(0)->Arg(1);
+
+// Scaling with the number of OpenMP threads, the first argument, up to
+// those available; timed by wall clock, since the work is spread out
+struct thread_count {
+	int previous;
+
+	thread_count(int threads) : previous(omp_get_max_threads()) {
+		omp_set_num_threads(threads);
+	}
+
+	~thread_count() {
+		omp_set_num_threads(previous);
+	}
+};
+
+static void thread_counts(benchmark::internal::Benchmark *b)
+{
+	int available = omp_get_max_threads();
+	for (int t = 1; t < available; t *= 2)
+		b->Arg(t);
+
+	b->Arg(available)->UseRealTime();
+}
+
+static void BM_threads_add(benchmark::State &state)
+{
+	thread_count threads(state.range(0));
+
+	size_t n = 1'000'000;
+	Tensor A = rows(n);
+	Tensor B = rows(n);
+	for (auto _ : state)
+		ops::add.forward(A, B);
+
+	throughput(state, sizeof(float) * 3 * n, n);
+}
+
+static void BM_threads_gemm(benchmark::State &state)
+{
+	thread_count threads(state.range(0));
+
+	size_t n = 512;
+	Tensor A = Tensor::randn({ n, n });
+	Tensor B = Tensor::randn({ n, n });
+	Tensor C = Tensor::blank({ n, n });
+	for (auto _ : state)
+		cpu_kernel_gemm <float> (A.buffer, B.buffer, C.buffer, n, n, n);
+
+	throughput(state, sizeof(float) * 3 * n * n, 2.0 * n * n * n);
+}
+
+static void BM_threads_train_step(benchmark::State &state)
+{
+	thread_count threads(state.range(0));
+	train_step(state, 100, true);
 }
 
-BENCHMARK(BM_linear);
+BENCHMARK(BM_threads_add)->Apply(thread_counts);
+BENCHMARK(BM_threads_gemm)->Apply(thread_counts);
+BENCHMARK(BM_threads_train_step)->Apply(thread_counts);
 
 BENCHMARK_MAIN();
@@ -0,0 +1,258 @@
+#include <fstream>
+
+#include <gtest/gtest.h>
+
+#include "dataset.hpp"
+
+static constexpr size_t SAMPLES = 250;
+static constexpr size_t PIXELS = 12;
+
+// Small IDX files, where the pixels of each image encode its index
+static std::filesystem::path write_idx(const std::string &name, const std::vector <size_t> &dims, const std::vector <unsigned char> &elements)
+{
+	std::filesystem::path path = std::filesystem::temp_directory_path() / name;
+	std::ofstream file(path, std::ios::binary);
+
+	unsigned char header[4] = { 0, 0, 0x08, (unsigned char) dims.size() };
+	file.write((const char *) header, 4);
+	for (size_t d : dims) {
+		unsigned char bytes[4] = { 0, 0, (unsigned char) (d >> 8), (unsigned char) d };
+		file.write((const char *) bytes, 4);
+	}
+
+	file.write((const char *) elements.data(), elements.size());
+	return path;
+}
+
+static std::shared_ptr <IDXDataset> synthetic()
+{
+	std::vector <unsigned char> images(SAMPLES * PIXELS);
+	std::vector <unsigned char> labels(SAMPLES);
+	for (size_t i = 0; i < SAMPLES; i++) {
+		for (size_t j = 0; j < PIXELS; j++)
+			images[i * PIXELS + j] = (j == 0) ? i : j;
+		labels[i] = i % 10;
+	}
+
+	auto X = write_idx("petals-images-idx3-ubyte", { SAMPLES, 3, 4 }, images);
+	auto Y = write_idx("petals-labels-idx1-ubyte", { SAMPLES }, labels);
+	return std::make_shared <IDXDataset> (*IDXDataset::from(X, Y));
+}
+
+// Index of a decoded sample, from its first pixel
+static size_t sample_of(const Tensor &X, size_t row)
+{
+	return std::round(X.buffer.data <float> ()[row * PIXELS] * 255.0f);
+}
+
+TEST(DatasetTest, DecodesIDX)
+{
+	auto dataset = synthetic();
+	ASSERT_EQ(dataset->size(), SAMPLES);
+	ASSERT_EQ(dataset->features(), PIXELS);
+
+	size_t indices[] = { 7, 3 };
+	Tensor X = Tensor::blank({ 2ul, PIXELS });
+	Tensor Y = Tensor::blank({ 2ul, 10ul });
+	dataset->decode(indices, 2, X, Y);
+
+	ASSERT_EQ(sample_of(X, 0), 7);
+	ASSERT_FLOAT_EQ(X.buffer.data <float> ()[PIXELS + 5], 5 / 255.0f);
+	for (size_t j = 0; j < 10; j++)
+		ASSERT_EQ(Y.buffer.data <float> ()[10 + j], j == 3);
+}
+
+TEST(DatasetTest, CacheRoundTrip)
+{
+	TensorDataset resident = TensorDataset::from(*synthetic());
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "petals-dataset.cache";
+	ASSERT_TRUE(resident.save(path));
+
+	auto loaded = TensorDataset::load(path);
+	ASSERT_TRUE(loaded);
+	ASSERT_EQ(loaded->X.shape, resident.X.shape);
+	ASSERT_EQ(std::memcmp(loaded->X.buffer.ptr, resident.X.buffer.ptr, resident.X.buffer.bytes()), 0);
+	ASSERT_EQ(std::memcmp(loaded->Y.buffer.ptr, resident.Y.buffer.ptr, resident.Y.buffer.bytes()), 0);
+}
+
+// Every sample is seen exactly once per epoch, in any mode
+TEST(DataLoaderTest, CoversEachEpoch)
+{
+	auto streamed = synthetic();
+	auto resident = std::make_shared <TensorDataset> (TensorDataset::from(*streamed));
+
+	for (auto shuffle : { DataLoader::none, DataLoader::batches, DataLoader::samples }) {
+		for (std::shared_ptr <const Dataset> dataset : { std::shared_ptr <const Dataset> (streamed), std::shared_ptr <const Dataset> (resident) }) {
+			DataLoader::Options options;
+			options.batch_size = 16;
+			options.shuffle = shuffle;
+			options.drop_last = false;
+			options.workers = 3;
+
+			auto loader = DataLoader::from(dataset, options);
+			ASSERT_EQ(loader->size(), (SAMPLES + 15) / 16);
+
+			for (size_t epoch = 0; epoch < 3; epoch++) {
+				std::vector <size_t> seen(SAMPLES, 0);
+				while (auto batch = loader->next()) {
+					for (size_t i = 0; i < batch->X.shape.value()[0]; i++) {
+						size_t s = sample_of(batch->X, i);
+						seen[s]++;
+						ASSERT_EQ(batch->Y.buffer.data <float> ()[i * 10 + s % 10], 1.0f);
+					}
+				}
+
+				for (size_t s = 0; s < SAMPLES; s++)
+					ASSERT_EQ(seen[s], 1) << "sample " << s << ", shuffle mode " << shuffle;
+			}
+		}
+	}
+}
+
+TEST(DataLoaderTest, ViewsResidentData)
+{
+	auto resident = std::make_shared <TensorDataset> (TensorDataset::from(*synthetic()));
+
+	DataLoader::Options options;
+	options.batch_size = 50;
+	options.shuffle = DataLoader::batches;
+
+	auto loader = DataLoader::from(resident, options);
+	ASSERT_TRUE(loader->zero_copy());
+
+	const float *base = resident->X.buffer.data <float> ();
+	while (auto batch = loader->next()) {
+		size_t offset = batch->X.buffer.data <float> () - base;
+		ASSERT_EQ(offset % (50 * PIXELS), 0);
+		ASSERT_EQ(sample_of(batch->X, 0), offset / PIXELS);
+	}
+
+	// Decoding into the ring when samples are shuffled
+	options.shuffle = DataLoader::samples;
+	ASSERT_FALSE(DataLoader::from(resident, options)->zero_copy());
+}
+
+// Archives and checkpoints
+TEST(ArchiveTest, MapsTensors)
+{
+	Archive archive;
+	archive.tensors["A"] = Tensor::randn({ 3ul, 5ul }, Resource::f64);
+	archive.tensors["B"] = Tensor::randn({ 2ul, 7ul }).transpose();
+	archive.tensors["scalar"] = Tensor::ones({});
+	archive.tensors["strided"] = Tensor::randn({ 4ul, 6ul }, Resource::f64).slice(1, 3, 1);
+
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "petals-archive.bin";
+	ASSERT_TRUE(archive.save(path));
+
+	auto loaded = Archive::load(path);
+	ASSERT_TRUE(loaded);
+	ASSERT_EQ(loaded->tensors.size(), archive.tensors.size());
+
+	for (const auto &[name, t] : archive.tensors) {
+		const Tensor &l = loaded->tensors[name];
+		Tensor c = t.contiguous();
+		ASSERT_EQ(l.shape, t.shape) << name;
+		ASSERT_EQ(l.buffer.type, t.buffer.type) << name;
+		ASSERT_EQ(std::memcmp(l.buffer.ptr, c.buffer.ptr, c.buffer.bytes()), 0) << name;
+
+		// Straight from the mapping, aligned
+		ASSERT_EQ(l.buffer.counter, nullptr);
+		ASSERT_EQ(uintptr_t(l.buffer.ptr) % Archive::ALIGNMENT, 0);
+	}
+
+	// Tensors keep the mapping alive, and are writable without touching the file
+	Tensor A = loaded->tensors["A"];
+	loaded.reset();
+	A.buffer.data <double> ()[0] = 42;
+	ASSERT_NE(Archive::load(path)->tensors["A"].buffer.data <double> ()[0], 42);
+}
+
+TEST(ArchiveTest, RejectsCorruptEntries)
+{
+	Archive archive;
+	archive.tensors["A"] = Tensor::randn({ 3ul, 5ul });
+
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "petals-corrupt.bin";
+	ASSERT_TRUE(archive.save(path));
+
+	// Entry fields, past the header: type, ndims, offset, bytes, name length,
+	// then the dimensions
+	auto patch = [&](size_t field, uint64_t value) {
+		std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+		file.seekp(4 * sizeof(uint64_t) + field * sizeof(uint64_t));
+		file.write((const char *) &value, sizeof(value));
+	};
+
+	auto corrupt = [&](size_t field, uint64_t value) {
+		ASSERT_TRUE(archive.save(path));
+		patch(field, value);
+	};
+
+	corrupt(1, uint64_t(1) << 61);
+	ASSERT_FALSE(Archive::load(path));
+
+	corrupt(4, ~uint64_t(0));
+	ASSERT_FALSE(Archive::load(path));
+
+	corrupt(2, ~uint64_t(0));
+	ASSERT_FALSE(Archive::load(path));
+
+	// Dimensions whose product wraps around to an empty entry
+	corrupt(5, uint64_t(1) << 33);
+	patch(6, uint64_t(1) << 31);
+	patch(3, 0);
+	ASSERT_FALSE(Archive::load(path));
+
+	corrupt(5, ~uint64_t(0));
+	ASSERT_FALSE(Archive::load(path));
+
+	corrupt(1, 2);
+	ASSERT_TRUE(Archive::load(path));
+}
+
+TEST(CheckpointTest, ResumesOptimizer)
+{
+	auto train = [](Tensor &W, Adam &opt, size_t steps) {
+		for (size_t i = 0; i < steps; i++) {
+			Tape tape;
+			tape[W.tag] = W.clone();
+			opt.step(tape);
+		}
+	};
+
+	Tensor W = Tensor::randn({ 4ul, 3ul }, Resource::f64);
+	Tensor reference = W.clone();
+
+	Adam opt = Adam::from({ &W });
+	Adam reference_opt = Adam::from({ &reference });
+	train(W, opt, 3);
+	train(reference, reference_opt, 6);
+
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "petals-checkpoint.bin";
+	ASSERT_TRUE(Checkpoint::save(path, { &W }, &opt));
+
+	// A fresh run picks up from the checkpoint
+	Tensor resumed = Tensor::zeros({ 4ul, 3ul }, Resource::f64);
+	Adam resumed_opt = Adam::from({ &resumed });
+	ASSERT_TRUE(Checkpoint::load(path, { &resumed }, &resumed_opt));
+	ASSERT_EQ(resumed_opt.iteration, 3);
+
+	train(resumed, resumed_opt, 3);
+	for (size_t i = 0; i < W.buffer.elements; i++)
+		ASSERT_DOUBLE_EQ(resumed.buffer.data <double> ()[i], reference.buffer.data <double> ()[i]);
+
+	// Saving over the file the resumed states are still mapped from
+	ASSERT_TRUE(Checkpoint::save(path, { &resumed }, &resumed_opt));
+	ASSERT_FALSE(std::filesystem::exists(path.string() + ".tmp"));
+
+	Tensor again = Tensor::zeros({ 4ul, 3ul }, Resource::f64);
+	Adam again_opt = Adam::from({ &again });
+	ASSERT_TRUE(Checkpoint::load(path, { &again }, &again_opt));
+	ASSERT_EQ(again_opt.iteration, 6);
+	for (size_t i = 0; i < W.buffer.elements; i++)
+		ASSERT_DOUBLE_EQ(again.buffer.data <double> ()[i], reference.buffer.data <double> ()[i]);
+
+	// Shapes must match
+	Tensor other = Tensor::zeros({ 2ul, 3ul }, Resource::f64);
+	ASSERT_FALSE(Checkpoint::load(path, { &other }));
+}
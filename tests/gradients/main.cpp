@@ -1,15 +1,20 @@
+#include <fstream>
 #include <functional>
+#include <numeric>
+#include <thread>
 
 #include <fmt/color.h>
 
 #include <gtest/gtest.h>
 
 #include "composition.hpp"
+#include "distributed.hpp"
+#include "session.hpp"
+#include "static_chain.hpp"
 #include "tensor.hpp"
 #include "autograd.hpp"
 #include "ops.hpp"
 
-// TODO: use only f64 buffers for gradient checking
 // TODO: put into a util
 bool buffer_cheq(const Resource &A, const Resource &B)
 {
@@ -17,7 +22,7 @@ bool buffer_cheq(const Resource &A, const Resource &B)
 		return false;
 
 	for (size_t i = 0; i < A.elements; i++) {
-		if (A.ptr[i] != B.ptr[i])
+		if (A.data <double> ()[i] != B.data <double> ()[i])
 			return false;
 	}
 
@@ -30,10 +35,10 @@ bool buffer_close(const Resource &A, const Resource &B, float tolerance)
 		return false;
 
 	for (size_t i = 0; i < A.elements; i++) {
-		if (std::abs(A.ptr[i] - B.ptr[i]) > tolerance) {
+		if (std::abs(A.data <double> ()[i] - B.data <double> ()[i]) > tolerance) {
 			fmt::print("delta is {} > {}\n\tA: {}, B: {}\n",
-				std::abs(A.ptr[i] - B.ptr[i]),
-				tolerance, A.ptr[i], B.ptr[i]);
+				std::abs(A.data <double> ()[i] - B.data <double> ()[i]),
+				tolerance, A.data <double> ()[i], B.data <double> ()[i]);
 			return false;
 		}
 	}
@@ -53,27 +58,27 @@ bool check_pullback(const std::function <DynamicDeferred (const Tensor &)> &f, b
 	const Shape shape { 3, 3 };
 
 	Tape tape;
-	Tensor X = Tensor::randn(shape) - 0.5;
+	Tensor X = Tensor::randn(shape, Resource::f64) - 0.5;
 
 	auto Y = f(X);
 	Tensor eY = Y;
 
 	// Tensor dY = Tensor::ones({});
-	Tensor dY = Tensor::randn({}) - 0.5;
+	Tensor dY = Tensor::randn({}, Resource::f64) - 0.5;
 	Tensor dX = Y.pullback(dY, tape)[0];
 
 	Tensor gt_dX = Tensor::zeros_like(dX);
 	for (size_t i = 0; i < gt_dX.buffer.elements; i++) {
 		Tensor pX = X.clone();
-		pX.buffer.ptr[i] += epsilon;
+		pX.buffer.data <double> ()[i] += epsilon;
 		Tensor pY = f(pX);
 
 		Tensor nX = X.clone();
-		nX.buffer.ptr[i] -= epsilon;
+		nX.buffer.data <double> ()[i] -= epsilon;
 		Tensor nY = f(nX);
 
-		float dw = (pY.buffer.ptr[0] - nY.buffer.ptr[0])/(2 * epsilon);
-		gt_dX.buffer.ptr[i] = dw * dY.buffer.ptr[0];
+		double dw = (pY.buffer.data <double> ()[0] - nY.buffer.data <double> ()[0])/(2 * epsilon);
+		gt_dX.buffer.data <double> ()[i] = dw * dY.buffer.data <double> ()[0];
 	}
 
 
@@ -96,9 +101,9 @@ bool test_linear()
 	constexpr float epsilon = 1e-6f;
 	constexpr float tolerance = 1e-4f;
 
-	Tensor X = Tensor::randn({ BATCH, WIDTH });
-	Tensor Y = Tensor::randn({ BATCH, HEIGHT });
-	Linear linear = Linear::from(WIDTH, HEIGHT);
+	Tensor X = Tensor::randn({ BATCH, WIDTH }, Resource::f64);
+	Tensor Y = Tensor::randn({ BATCH, HEIGHT }, Resource::f64);
+	Linear linear = Linear::from(WIDTH, HEIGHT, true, Resource::f64);
 
 	// Gradient checking on the parameters
 	Tensor gt_dW = Tensor::zeros_like(linear.W);
@@ -106,19 +111,19 @@ bool test_linear()
 		// epsilon+
 		Linear p_linear = linear;
 		p_linear.W = linear.W.clone();
-		p_linear.W.buffer.ptr[i] += epsilon;
+		p_linear.W.buffer.data <double> ()[i] += epsilon;
 
 		Tensor p_out = sum(square(p_linear.forward(X) - Y));
 
 		// epsilon-
 		Linear n_linear = linear;
 		n_linear.W = linear.W.clone();
-		n_linear.W.buffer.ptr[i] -= epsilon;
+		n_linear.W.buffer.data <double> ()[i] -= epsilon;
 
 		Tensor n_out = sum(square(n_linear.forward(X) - Y));
 
-		float dw = (p_out.buffer.ptr[0] - n_out.buffer.ptr[0])/(2 * epsilon);
-		gt_dW.buffer.ptr[i] = dw;
+		double dw = (p_out.buffer.data <double> ()[0] - n_out.buffer.data <double> ()[0])/(2 * epsilon);
+		gt_dW.buffer.data <double> ()[i] = dw;
 	}
 
 	fmt::print("FD dW = {}\n", gt_dW);
@@ -148,10 +153,10 @@ bool test_dnn()
 	constexpr float epsilon = 1e-6f;
 	constexpr float tolerance = 1e-4f;
 
-	Tensor X = Tensor::randn({ BATCH, WIDTH });
-	Tensor Y = Tensor::randn({ BATCH, HEIGHT });
-	Linear linear1 = Linear::from(WIDTH, 2 * HEIGHT);
-	Linear linear2 = Linear::from(2 * HEIGHT, HEIGHT);
+	Tensor X = Tensor::randn({ BATCH, WIDTH }, Resource::f64);
+	Tensor Y = Tensor::randn({ BATCH, HEIGHT }, Resource::f64);
+	Linear linear1 = Linear::from(WIDTH, 2 * HEIGHT, true, Resource::f64);
+	Linear linear2 = Linear::from(2 * HEIGHT, HEIGHT, true, Resource::f64);
 
 	// Gradient checking the second layer
 	{
@@ -160,7 +165,7 @@ bool test_dnn()
 			// epsilon+
 			Linear p_linear = linear2;
 			p_linear.W = linear2.W.clone();
-			p_linear.W.buffer.ptr[i] += epsilon;
+			p_linear.W.buffer.data <double> ()[i] += epsilon;
 
 			Tensor l1_out = linear1.forward(X);
 			Tensor relu_out = ops::relu.forward(l1_out);
@@ -170,15 +175,15 @@ bool test_dnn()
 			// epsilon-
 			Linear n_linear = linear2;
 			n_linear.W = linear2.W.clone();
-			n_linear.W.buffer.ptr[i] -= epsilon;
+			n_linear.W.buffer.data <double> ()[i] -= epsilon;
 
 			l1_out = linear1.forward(X);
 			relu_out = ops::relu.forward(l1_out);
 			l2_out = n_linear.forward(relu_out);
 			Tensor n_out = sum(square(l2_out - Y));
 
-			float dw = (p_out.buffer.ptr[0] - n_out.buffer.ptr[0])/(2 * epsilon);
-			gt_dW.buffer.ptr[i] = dw;
+			double dw = (p_out.buffer.data <double> ()[0] - n_out.buffer.data <double> ()[0])/(2 * epsilon);
+			gt_dW.buffer.data <double> ()[i] = dw;
 		}
 
 		fmt::print("FD dW = {}\n", gt_dW);
@@ -209,7 +214,7 @@ bool test_dnn()
 			// epsilon+
 			Linear p_linear = linear1;
 			p_linear.W = linear1.W.clone();
-			p_linear.W.buffer.ptr[i] += epsilon;
+			p_linear.W.buffer.data <double> ()[i] += epsilon;
 
 			Tensor l1_out = p_linear.forward(X);
 			Tensor relu_out = ops::relu.forward(l1_out);
@@ -219,15 +224,15 @@ bool test_dnn()
 			// epsilon-
 			Linear n_linear = linear1;
 			n_linear.W = linear1.W.clone();
-			n_linear.W.buffer.ptr[i] -= epsilon;
+			n_linear.W.buffer.data <double> ()[i] -= epsilon;
 
 			l1_out = n_linear.forward(X);
 			relu_out = ops::relu.forward(l1_out);
 			l2_out = linear2.forward(relu_out);
 			Tensor n_out = sum(square(l2_out - Y));
 
-			float dw = (p_out.buffer.ptr[0] - n_out.buffer.ptr[0])/(2 * epsilon);
-			gt_dW.buffer.ptr[i] = dw;
+			double dw = (p_out.buffer.data <double> ()[0] - n_out.buffer.data <double> ()[0])/(2 * epsilon);
+			gt_dW.buffer.data <double> ()[i] = dw;
 		}
 
 		fmt::print("\n\nFD dW = {}\n", gt_dW);
@@ -280,6 +285,19 @@ TEST(SquareTest, Delta)
 	ASSERT_TRUE(robust_test(chk));
 }
 
+TEST(BroadcastTest, Delta)
+{
+	// X is broadcast along a leading dimension, and the others along X
+	Tensor B = Tensor::randn({ 2, 3, 3 }, Resource::f64);
+	Tensor C = Tensor::randn({ 3, 1 }, Resource::f64);
+	Tensor D = Tensor::randn({ 3 }, Resource::f64);
+
+	auto ftn = [&](const Tensor &X) { return sum(square(X * B + C) - B / (X + 3.0) * D); };
+	auto chk = [ftn](bool printing) { return check_pullback(ftn, printing); };
+
+	ASSERT_TRUE(robust_test(chk));
+}
+
 // TODO: for functions with discontinuities, forward differences is not good
 // TEST(ReLUTest, Delta)
 // {
@@ -297,6 +315,187 @@ TEST(SigmoidTest, Delta)
 	ASSERT_TRUE(robust_test(chk));
 }
 
+TEST(SoftmaxTest, Delta)
+{
+	auto ftn = [](const Tensor &X) { return sum(square(softmax(X))); };
+	auto chk = [ftn](bool printing) { return check_pullback(ftn, printing); };
+
+	ASSERT_TRUE(robust_test(chk));
+}
+
+TEST(SoftmaxCrossEntropyTest, Delta)
+{
+	Tensor Y = Tensor::zeros({ 3, 3 }, Resource::f64);
+	for (size_t i = 0; i < 3; i++)
+		Y.buffer.data <double> ()[i * 3 + (i + 1) % 3] = 1.0;
+
+	auto ftn = [Y](const Tensor &X) { return softmax_cross_entropy(X, Y); };
+	auto chk = [ftn](bool printing) { return check_pullback(ftn, printing); };
+
+	ASSERT_TRUE(robust_test(chk));
+}
+
+TEST(SoftmaxCrossEntropyTest, UnnormalizedTargets)
+{
+	// Rows of targets that sum to neither one nor each other
+	Tensor Y = Tensor::zeros({ 3, 3 }, Resource::f64);
+	for (size_t i = 0; i < 9; i++)
+		Y.buffer.data <double> ()[i] = 0.25 * (i % 4) + 0.1 * (i / 3);
+
+	auto ftn = [Y](const Tensor &X) { return softmax_cross_entropy(X, Y); };
+	auto chk = [ftn](bool printing) { return check_pullback(ftn, printing); };
+
+	ASSERT_TRUE(robust_test(chk));
+}
+
+TEST(GraphTest, SharedSubexpression)
+{
+	auto ftn = [](const Tensor &X) {
+		DynamicDeferred Y = square(X);
+		return sum(Y - square(Y));
+	};
+
+	auto chk = [ftn](bool printing) { return check_pullback(ftn, printing); };
+	ASSERT_TRUE(robust_test(chk));
+
+	// Recorded once: X, square(X), square(Y), the difference and the sum
+	Tensor X = Tensor::randn({ 3, 3 }, Resource::f64);
+	ASSERT_EQ(Graph::from(ftn(X)).nodes.size(), 5);
+}
+
+TEST(GraphTest, SharedHandles)
+{
+	Tensor X = Tensor::randn({ 3, 3 }, Resource::f64);
+	Tensor B = Tensor::randn({ 3, 3 }, Resource::f64);
+
+	// Copies of an expression share the nodes below its top
+	DynamicDeferred Z = square(X - B) + 1.0;
+	DynamicDeferred loss = sum(Z * Z);
+	const DynamicDeferred &product = loss.args[0].expression();
+	ASSERT_EQ(&product.args[0].expression().args[0].expression(), &product.args[1].expression().args[0].expression());
+
+	// Constants reuse the same function
+	ASSERT_EQ(Z.ftn, (X + 1.0).ftn);
+	ASSERT_NE(Z.ftn, (X + 2.0).ftn);
+
+	// Each leaf is listed once, however many times it is used
+	Graph graph = Graph::from(loss);
+	ASSERT_EQ(graph.leaves.size(), 2);
+
+	Tape tape;
+	tensor_list deltas = loss.backward(tape);
+	ASSERT_EQ(deltas.size(), 2);
+	for (size_t i = 0; i < X.buffer.elements; i++) {
+		double d = X.buffer.data <double> ()[i] - B.buffer.data <double> ()[i];
+		ASSERT_NEAR(deltas[0].buffer.data <double> ()[i], 4 * (d * d + 1) * d, 1e-9);
+		ASSERT_NEAR(deltas[1].buffer.data <double> ()[i], -4 * (d * d + 1) * d, 1e-9);
+	}
+}
+
+TEST(GraphTest, DeepSharedExpressions)
+{
+	// Every level uses the one below three times, so walking each use
+	// instead of each node would take 3^depth steps
+	constexpr size_t depth = 24;
+
+	Tensor X = Tensor::blank({ 16 }, Resource::f64);
+	std::vector <double> y(16);
+	std::vector <double> dy(16);
+	for (size_t i = 0; i < 16; i++) {
+		double x = -0.5 + i / 32.0;
+		X.buffer.data <double> ()[i] = x;
+		y[i] = x * x - 0.5;
+		dy[i] = 2 * x;
+	}
+
+	for (size_t d = 0; d < depth; d++) {
+		for (size_t i = 0; i < 16; i++) {
+			dy[i] *= 2 * y[i] + 1;
+			y[i] = y[i] * y[i] + y[i];
+		}
+	}
+
+	auto ftn = [&]() {
+		DynamicDeferred Y = square(X) - 0.5;
+		for (size_t d = 0; d < depth; d++)
+			Y = Y * Y + Y;
+
+		return sum(Y);
+	};
+
+	double total = std::accumulate(y.begin(), y.end(), 0.0);
+	for (bool fusing : { true, false }) {
+		DynamicDeferred loss = ftn();
+		ASSERT_NEAR(loss.eval(fusing).buffer.data <double> ()[0], total, 1e-12);
+	}
+
+	// X, square(X) - 0.5, a product and a sum per level, and the reduction
+	DynamicDeferred loss = ftn();
+	Graph graph = Graph::from(loss);
+	ASSERT_EQ(graph.nodes.size(), 2 * depth + 4);
+	ASSERT_EQ(graph.leaves.size(), 1);
+
+	Tape tape;
+	tensor_list deltas = loss.backward(tape);
+	ASSERT_EQ(deltas.size(), 1);
+	for (size_t i = 0; i < 16; i++)
+		ASSERT_NEAR(deltas[0].buffer.data <double> ()[i], dy[i], 1e-12);
+}
+
+TEST(GraphTest, AccumulatesOnTape)
+{
+	Tensor X = Tensor::randn({ 4, 4 }, Resource::f64);
+	Tape tape = Tape::from({ &X });
+
+	DynamicDeferred loss = sum(X - square(X));
+	loss.eval();
+	loss.backward(tape);
+
+	for (size_t i = 0; i < X.buffer.elements; i++) {
+		double x = X.buffer.data <double> ()[i];
+		ASSERT_NEAR(tape[X.tag].buffer.data <double> ()[i], 1 - 2 * x, 1e-12);
+	}
+}
+
+TEST(GraphTest, ConcurrentBranches)
+{
+	Chain a = Chain::from(Linear::from(256, 64, true, Resource::f64, gemm_sigmoid));
+	Chain b = Chain::from(Linear::from(256, 64, true, Resource::f64));
+	Chain c = Chain::from(Linear::from(256, 64, false, Resource::f64, gemm_relu));
+
+	Tensor X = Tensor::randn({ 256, 256 }, Resource::f64);
+	auto run = [&](size_t threads) {
+		Scheduler::set_threads(threads);
+
+		std::vector <Tensor *> targets { &X };
+		for (Chain *chain : { &a, &b, &c }) {
+			auto ps = chain->parameters();
+			targets.insert(targets.end(), ps.begin(), ps.end());
+		}
+
+		Tape tape = Tape::from(targets);
+		DynamicDeferred loss = sum(square(a(X) - b(X)) - c(X));
+		EXPECT_EQ(Graph::from(loss).concurrent(), Scheduler::threads() > 1);
+
+		Tensor value = loss.eval();
+		loss.backward(tape);
+
+		std::vector <Tensor> result { value };
+		for (Tensor *t : targets)
+			result.push_back(tape[t->tag]);
+
+		return result;
+	};
+
+	std::vector <Tensor> sequential = run(1);
+	std::vector <Tensor> concurrent = run(4);
+	Scheduler::set_threads(0);
+
+	ASSERT_EQ(sequential.size(), concurrent.size());
+	for (size_t i = 0; i < sequential.size(); i++)
+		ASSERT_TRUE(buffer_close(sequential[i].buffer, concurrent[i].buffer, 1e-9));
+}
+
 TEST(LinearTest, GradientChecking)
 {
 	ASSERT_TRUE(test_linear());
@@ -305,7 +504,7 @@ TEST(LinearTest, GradientChecking)
 TEST(LinearTest, Delta)
 {
 	struct LinearTester {
-		Linear linear = Linear::from(3, 5);
+		Linear linear = Linear::from(3, 5, true, Resource::f64);
 
 		DynamicDeferred operator()(const Tensor &X) {
 			return sum(DynamicDeferred::from(nop_ptr(&linear), { X }));
@@ -318,7 +517,558 @@ TEST(LinearTest, Delta)
 	ASSERT_TRUE(robust_test(chk));
 }
 
+TEST(LinearTest, FusedActivation)
+{
+	Linear fused = Linear::from(6, 4, true, Resource::f64, gemm_sigmoid);
+	Linear plain = fused;
+	plain.activation = gemm_identity;
+
+	Tensor X = Tensor::randn({ 5, 6 }, Resource::f64);
+	Tensor delta = Tensor::randn({ 5, 4 }, Resource::f64);
+
+	// Same as applying the activation after the layer
+	Tensor Y = fused.forward(X);
+	Tensor gt_Y = ops::sigmoid.forward(plain.forward(X));
+	auto near = [](const Tensor &A, const Tensor &B) {
+		for (size_t i = 0; i < A.buffer.elements; i++) {
+			if (std::abs(A.buffer.data <double> ()[i] - B.buffer.data <double> ()[i]) > 1e-12)
+				return false;
+		}
+
+		return A.buffer.elements == B.buffer.elements;
+	};
+
+	ASSERT_TRUE(near(Y, gt_Y));
+
+	Tape tape = Tape::from({ &X, &fused.W });
+	fused.pullback_args({ X }, delta, tape);
+
+	Tensor pre = plain.forward(X);
+	Tape gt_tape = Tape::from({ &pre });
+	Tensor gt_delta = ops::sigmoid.pullback_args({ pre }, delta, gt_tape)[0];
+
+	Tape linear_tape;
+	linear_tape[X.tag] = Tensor {};
+	linear_tape[plain.W.tag] = Tensor {};
+	plain.pullback_args({ X }, gt_delta, linear_tape);
+
+	ASSERT_TRUE(near(tape[X.tag], linear_tape[X.tag]));
+	ASSERT_TRUE(near(tape[fused.W.tag], linear_tape[plain.W.tag]));
+}
+
 TEST(DNNTest, GradientChecking)
 {
 	ASSERT_TRUE(test_dnn());
 }
+
+// Gradient checking of a layer on a single input, for the objective <f(X), R>
+bool check_layer(Function &f, Tensor X)
+{
+	constexpr double epsilon = 1e-6;
+	constexpr float tolerance = 1e-5f;
+
+	Tensor R = Tensor::randn(*f.forward(X).shape, Resource::f64);
+	auto objective = [&]() {
+		Tensor Y = f.forward(X);
+		double sum = 0.0;
+		for (size_t i = 0; i < Y.buffer.elements; i++)
+			sum += Y.buffer.data <double> ()[i] * R.buffer.data <double> ()[i];
+		return sum;
+	};
+
+	std::vector <Tensor *> targets = f.parameters();
+	targets.push_back(&X);
+
+	Tape tape = Tape::from(targets);
+	f.forward(X);
+	f.pullback_args({ X }, R, tape);
+
+	for (Tensor *t : targets) {
+		Tensor gt = Tensor::zeros_like(*t);
+		for (size_t i = 0; i < t->buffer.elements; i++) {
+			double &v = t->buffer.data <double> ()[i];
+			double saved = v;
+
+			v = saved + epsilon;
+			double p = objective();
+			v = saved - epsilon;
+			double n = objective();
+			v = saved;
+
+			gt.buffer.data <double> ()[i] = (p - n) / (2 * epsilon);
+		}
+
+		if (!buffer_close(tape[t->tag].buffer, gt.buffer, tolerance))
+			return false;
+	}
+
+	return true;
+}
+
+TEST(ConvTest, GradientChecking)
+{
+	Tensor X = Tensor::randn({ 2, 7, 6, 3 }, Resource::f64);
+
+	Conv2D conv = Conv2D::from(3, 4, 3, { .stride = 2, .padding = 1, .type = Resource::f64 });
+	ASSERT_TRUE(check_layer(conv, X));
+
+	Conv2D sigmoid = Conv2D::from(3, 5, 2, { .activation = gemm_sigmoid, .type = Resource::f64 });
+	ASSERT_TRUE(check_layer(sigmoid, X));
+
+	ConvTranspose2D up = ConvTranspose2D::from(3, 2, 4, { .stride = 2, .padding = 1, .type = Resource::f64 });
+	ASSERT_EQ(up.forward(X).shape, Shape({ 2, 14, 12, 2 }));
+	ASSERT_TRUE(check_layer(up, X));
+
+	for (pool_mode mode : { pool_average, pool_max }) {
+		Pool2D pool = Pool2D::from(mode, 3, { .stride = 2, .padding = 1 });
+		ASSERT_TRUE(check_layer(pool, X));
+	}
+}
+
+TEST(ConvTest, Chain)
+{
+	Chain model = Conv2D::from(3, 8, 3, { .padding = 1, .activation = gemm_relu, .type = Resource::f64 })
+		>> Pool2D::from(pool_max, 2, { .stride = 2 })
+		>> ops::flatten
+		>> Linear::from(4 * 3 * 8, 5, true, Resource::f64);
+
+	Tensor X = Tensor::randn({ 2, 8, 6, 3 }, Resource::f64);
+	ASSERT_EQ(model.forward(X).shape, Shape({ 2, 5 }));
+	ASSERT_TRUE(check_layer(model, X));
+}
+
+TEST(ChainTest, Checkpointing)
+{
+	constexpr size_t DEPTH = 8;
+
+	std::vector <std::shared_ptr <Function>> layers;
+	for (size_t i = 0; i < DEPTH; i++)
+		layers.push_back(value_ptr(Linear::from(64, 64, true, Resource::f64, (i % 2) ? gemm_relu : gemm_sigmoid)));
+
+	Chain full = Chain::from(layers);
+
+	// Same parameters, in layers of its own
+	std::vector <std::shared_ptr <Function>> copies;
+	for (auto &layer : layers)
+		copies.push_back(value_ptr(*std::dynamic_pointer_cast <Linear> (layer)));
+
+	Chain checkpointed = Chain::from(copies);
+	checkpointed.checkpoint(3);
+
+	Tensor X = Tensor::randn({ 128, 64 }, Resource::f64);
+	Tensor delta = Tensor::randn({ 128, 64 }, Resource::f64);
+
+	// Activations held between the forward and the pullback
+	auto run = [&](Chain &chain, size_t &held) {
+		Tape tape = Tape::from(chain.parameters());
+		tape[X.tag] = Tensor {};
+
+		size_t before = Allocator::live_bytes();
+		Tensor Y = chain.forward(X);
+		held = Allocator::live_bytes() - before;
+
+		tensor_list dX = chain.pullback(delta, tape);
+
+		std::vector <Tensor> result { Y, dX[0] };
+		for (Tensor *p : chain.parameters())
+			result.push_back(tape[p->tag]);
+
+		return result;
+	};
+
+	size_t full_held;
+	size_t checkpointed_held;
+	std::vector <Tensor> expected = run(full, full_held);
+	std::vector <Tensor> result = run(checkpointed, checkpointed_held);
+
+	ASSERT_EQ(expected.size(), result.size());
+	for (size_t i = 0; i < expected.size(); i++)
+		ASSERT_TRUE(buffer_close(expected[i].buffer, result[i].buffer, 1e-12));
+
+	// Inputs of layers 3 and 6 along with the output, instead of the
+	// output of every layer
+	ASSERT_GE(full_held, DEPTH * 128 * 64 * sizeof(double));
+	ASSERT_LE(checkpointed_held * DEPTH, 3 * full_held);
+}
+
+TEST(StaticChainTest, MatchesChain)
+{
+	Linear first = Linear::from(12, 8, true, Resource::f64, gemm_sigmoid);
+	Linear second = Linear::from(8, 5, false, Resource::f64, gemm_relu);
+	Linear third = Linear::from(5, 3, true, Resource::f64);
+	Chain model = first >> second >> third >> ops::softmax;
+
+	using Static = StaticChain <
+		fixed::Linear <12, 8>, fixed::Sigmoid,
+		fixed::Linear <8, 5, false>, fixed::ReLU,
+		fixed::Linear <5, 3>, fixed::Softmax
+	>;
+
+	static_assert(Static::inputs == 12 && Static::outputs == 3 && Static::widest == 8);
+
+	auto fixed_model = Static::from(model.parameters());
+	ASSERT_TRUE(fixed_model);
+
+	// Through the GEMM and then the direct path, reusing the workspace
+	for (size_t rows : { 40, 3 }) {
+		Tensor X = Tensor::randn({ rows, 12ul }, Resource::f64);
+		Tensor Y = fixed_model->forward(X);
+		Tensor gt_Y = model.forward(X);
+
+		ASSERT_EQ(Y.shape, gt_Y.shape);
+		for (size_t i = 0; i < Y.buffer.elements; i++)
+			ASSERT_NEAR(Y.buffer.data <double> ()[i], gt_Y.buffer.data <double> ()[i], 1e-12);
+	}
+
+	// Parameters must match the layers
+	ASSERT_FALSE(Static::from({ &first.W, &second.W }));
+	ASSERT_FALSE(Static::from({ &first.W, &third.W, &second.W }));
+	ASSERT_FALSE(fixed_model->forward(Tensor::randn({ 2ul, 12ul })).shape);
+}
+
+TEST(SessionTest, ConcurrentInference)
+{
+	constexpr size_t THREADS = 4;
+	constexpr size_t REQUESTS = 16;
+
+	auto model = std::make_shared <const Chain> (
+		Linear::from(12, 8, true, Resource::f64, gemm_sigmoid)
+		>> Linear::from(8, 5, true, Resource::f64)
+		>> ops::softmax
+	);
+
+	std::vector <Tensor> inputs;
+	std::vector <Tensor> expected;
+	for (size_t i = 0; i < THREADS * REQUESTS; i++) {
+		inputs.push_back(Tensor::randn({ 1 + i % 3, 12ul }, Resource::f64));
+		expected.push_back(model->call_infer({ inputs.back() }));
+	}
+
+	std::vector <Tensor> outputs(inputs.size());
+	std::vector <std::thread> workers;
+	for (size_t t = 0; t < THREADS; t++) {
+		workers.emplace_back([&, t]() {
+			Session session(model);
+			for (size_t i = t; i < inputs.size(); i += THREADS)
+				outputs[i] = session(inputs[i]).clone();
+		});
+	}
+
+	for (auto &worker : workers)
+		worker.join();
+
+	for (size_t i = 0; i < inputs.size(); i++) {
+		ASSERT_EQ(outputs[i].shape, expected[i].shape);
+		ASSERT_TRUE(buffer_cheq(outputs[i].buffer, expected[i].buffer));
+	}
+
+	// Inference leaves nothing behind for a pullback
+	ASSERT_TRUE(model->node_args.empty());
+}
+
+#ifndef PETAL_NONATOMIC_REFCOUNT
+
+TEST(SessionTest, BatchedRequests)
+{
+	constexpr size_t THREADS = 4;
+	constexpr size_t REQUESTS = 32;
+
+	auto model = std::make_shared <const Chain> (
+		Linear::from(12, 8, true, Resource::f64, gemm_relu)
+		>> Linear::from(8, 5, true, Resource::f64)
+	);
+
+	std::vector <Tensor> inputs;
+	for (size_t i = 0; i < THREADS * REQUESTS; i++)
+		inputs.push_back(Tensor::randn({ 12ul }, Resource::f64));
+
+	std::vector <Tensor> outputs(inputs.size());
+	{
+		Batcher batcher(model, { .max_batch = 16, .budget = std::chrono::milliseconds(2), .workers = 2 });
+
+		std::vector <std::thread> clients;
+		for (size_t t = 0; t < THREADS; t++) {
+			clients.emplace_back([&, t]() {
+				std::vector <std::pair <size_t, std::future <Tensor>>> pending;
+				for (size_t i = t; i < inputs.size(); i += THREADS)
+					pending.emplace_back(i, batcher.submit(inputs[i]));
+
+				for (auto &[i, result] : pending)
+					outputs[i] = result.get();
+			});
+		}
+
+		for (auto &client : clients)
+			client.join();
+
+		// Invalid samples fail on their own
+		ASSERT_FALSE(batcher.submit(Tensor {}).get().shape);
+	}
+
+	// Rows match unbatched inference
+	for (size_t i = 0; i < inputs.size(); i++) {
+		Tensor expected = model->call_infer({ inputs[i].reshape(1, 12) });
+		ASSERT_EQ(outputs[i].shape, Shape { 5 });
+		for (size_t j = 0; j < 5; j++)
+			ASSERT_NEAR(outputs[i].buffer.data <double> ()[j], expected.buffer.data <double> ()[j], 1e-12);
+	}
+}
+
+#else
+
+TEST(SessionTest, BatchedRequests)
+{
+	auto model = std::make_shared <const Chain> (
+		Linear::from(12, 8, true, Resource::f64, gemm_relu)
+		>> Linear::from(8, 5, true, Resource::f64)
+	);
+
+	Batcher batcher(model, { .max_batch = 16, .budget = std::chrono::milliseconds(2), .workers = 2 });
+	ASSERT_FALSE(batcher.submit(Tensor::randn({ 12ul }, Resource::f64)).get().shape);
+}
+
+#endif
+
+// Optimizers
+TEST(OptimizerTest, AdamMatchesReference)
+{
+	constexpr double lr = 0.01;
+	constexpr double beta1 = 0.9;
+	constexpr double beta2 = 0.999;
+	constexpr double epsilon = 1e-6f;
+
+	Tensor A = Tensor::randn({ 30, 40 }, Resource::f64);
+	Tensor B = Tensor::randn({ 7 }, Resource::f64);
+	Tensor fA = A.clone();
+	Tensor fB = B.clone();
+	Tensor gA = Tensor::randn({ 30, 40 }, Resource::f64);
+	Tensor gB = Tensor::randn({ 7 }, Resource::f64);
+
+	Adam single = Adam::from({ &A, &B }, lr, beta1, beta2);
+	Adam foreach = Adam::from({ &fA, &fB }, lr, beta1, beta2);
+	single.foreach = false;
+
+	// Reference for the first element of A
+	double x = A.buffer.data <double> ()[0];
+	double g = gA.buffer.data <double> ()[0];
+	double m = 0.0;
+	double s = 0.0;
+
+	for (size_t i = 1; i <= 3; i++) {
+		Tape tape;
+		tape[A.tag] = gA;
+		tape[B.tag] = gB;
+		single.step(tape);
+
+		Tape ftape;
+		ftape[fA.tag] = gA;
+		ftape[fB.tag] = gB;
+		foreach.step(ftape);
+
+		m = beta1 * m + (1 - beta1) * g;
+		s = beta2 * s + (1 - beta2) * g * g;
+		x -= lr * (m / (1 - std::pow(beta1, i))) / std::sqrt(s / (1 - std::pow(beta2, i)) + epsilon);
+	}
+
+	ASSERT_NEAR(A.buffer.data <double> ()[0], x, 1e-12);
+	ASSERT_TRUE(buffer_cheq(A.buffer, fA.buffer));
+	ASSERT_TRUE(buffer_cheq(B.buffer, fB.buffer));
+}
+
+TEST(OptimizerTest, SkipsStridedParameters)
+{
+	Tensor W = Tensor::randn({ 3, 4 }, Resource::f64);
+	Tensor V = W.transpose();
+	Tensor reference = W.clone();
+
+	Adam opt = Adam::from({ &V });
+	Tape tape;
+	tape[V.tag] = Tensor::randn({ 4, 3 }, Resource::f64);
+	opt.step(tape);
+
+	ASSERT_TRUE(buffer_cheq(W.buffer, reference.buffer));
+}
+
+TEST(OptimizerTest, ParameterArena)
+{
+	Chain model = Linear::from(5, 7, true, Resource::f64) >> ops::sigmoid >> Linear::from(7, 3, true, Resource::f64);
+	Chain reference = Linear::from(5, 7, true, Resource::f64) >> ops::sigmoid >> Linear::from(7, 3, true, Resource::f64);
+	for (size_t i = 0; i < 2; i++)
+		reference.parameters()[i]->copy(*model.parameters()[i]);
+
+	Tensor X = Tensor::randn({ 4, 5 }, Resource::f64);
+	Tensor before = model.forward(X);
+
+	// Packing leaves the model unchanged
+	ParameterArena arena = *ParameterArena::from(model.parameters());
+	ASSERT_TRUE(buffer_cheq(model.forward(X).buffer, before.buffer));
+	for (size_t i = 0; i < 2; i++) {
+		const Tensor *t = model.parameters()[i];
+		ASSERT_EQ(t->buffer.data <double> (), arena.values.buffer.data <double> () + arena.offsets[i]);
+	}
+
+	Adam packed = Adam::from({ &arena.values });
+	Adam separate = Adam::from(reference.parameters());
+	for (size_t i = 0; i < 3; i++) {
+		Tape tape = Tape::from(model.parameters());
+		DynamicDeferred loss = sum(square(model(X)));
+		loss.eval();
+		loss.backward(tape);
+
+		Tape rtape = Tape::from(reference.parameters());
+		DynamicDeferred rloss = sum(square(reference(X)));
+		rloss.eval();
+		rloss.backward(rtape);
+
+		arena.gather(tape);
+		packed.step(arena.tape());
+		separate.step(rtape);
+	}
+
+	for (size_t i = 0; i < 2; i++)
+		ASSERT_TRUE(buffer_close(model.parameters()[i]->buffer, reference.parameters()[i]->buffer, 1e-12));
+
+	// Clipping by the global norm
+	double norm = arena.clip(1e-3);
+	ASSERT_GT(norm, 1e-3);
+	ASSERT_NEAR(arena.clip(1.0), 1e-3, 1e-12);
+}
+
+TEST(DataParallelTest, AveragesGradients)
+{
+	constexpr size_t RANKS = 3;
+	constexpr size_t ROWS = 4;
+
+	std::vector <std::string> endpoints;
+	for (size_t r = 0; r < RANKS; r++)
+		endpoints.push_back(fmt::format("127.0.0.1:{}", 39611 + r));
+
+	Tensor X = Tensor::randn({ RANKS * ROWS, 6ul }, Resource::f64);
+
+	// Ranks as threads, each over its own copy of the model
+	std::vector <std::vector <Tensor>> initial(RANKS);
+	std::vector <std::vector <Tensor>> grads(RANKS);
+	std::vector <Tensor> trained(RANKS);
+
+	std::vector <std::thread> ranks;
+	for (size_t r = 0; r < RANKS; r++) {
+		ranks.emplace_back([&, r]() {
+			auto group = ProcessGroup::from(r, endpoints);
+			ASSERT_TRUE(group);
+
+			auto model = std::make_shared <Chain> (
+				Linear::from(6, 9, true, Resource::f64)
+				>> ops::sigmoid
+				>> Linear::from(9, 7, true, Resource::f64)
+				>> ops::sigmoid
+				>> Linear::from(7, 3, true, Resource::f64)
+			);
+
+			// Small buckets, for several reductions in flight
+			auto ddp = DataParallel::from(model, *group, { .bucket_bytes = 256 });
+			ASSERT_TRUE(ddp);
+
+			for (Tensor *t : ddp->parameters())
+				initial[r].push_back(t->clone());
+
+			Tape tape = Tape::from(ddp->parameters());
+			DynamicDeferred loss = sum(square((*ddp)(X.slice(r * ROWS, (r + 1) * ROWS))));
+			loss.eval();
+			loss.backward(tape);
+
+			for (Tensor *t : ddp->parameters())
+				grads[r].push_back(tape[t->tag].clone());
+
+			SGD opt = SGD::from({ &ddp->arena.values }, 0.1);
+			opt.step(ddp->arena.tape());
+			trained[r] = ddp->arena.values.clone();
+		});
+	}
+
+	for (auto &rank : ranks)
+		rank.join();
+
+	// Same as the whole batch on one model, with the gradient averaged
+	Chain reference = Linear::from(6, 9, true, Resource::f64)
+		>> ops::sigmoid
+		>> Linear::from(9, 7, true, Resource::f64)
+		>> ops::sigmoid
+		>> Linear::from(7, 3, true, Resource::f64);
+
+	std::vector <Tensor *> parameters = reference.parameters();
+	ASSERT_EQ(initial[0].size(), parameters.size());
+	for (size_t i = 0; i < parameters.size(); i++)
+		parameters[i]->copy(initial[0][i]);
+
+	Tape tape = Tape::from(parameters);
+	DynamicDeferred loss = sum(square(reference(X)));
+	loss.eval();
+	loss.backward(tape);
+
+	for (size_t r = 0; r < RANKS; r++) {
+		for (size_t i = 0; i < parameters.size(); i++) {
+			ASSERT_TRUE(buffer_cheq(initial[r][i].buffer, initial[0][i].buffer));
+
+			const Tensor &expected = tape[parameters[i]->tag];
+			ASSERT_EQ(grads[r][i].shape, expected.shape);
+			for (size_t j = 0; j < expected.buffer.elements; j++) {
+				ASSERT_NEAR(grads[r][i].buffer.data <double> ()[j] * RANKS,
+						expected.buffer.data <double> ()[j], 1e-10);
+			}
+		}
+
+		// Parameters stay in sync after a step
+		ASSERT_TRUE(buffer_cheq(trained[r].buffer, trained[0].buffer));
+	}
+}
+
+// Profiling
+TEST(ProfilerTest, RecordsCalls)
+{
+	Linear first = Linear::from(8, 4, true, Resource::f64);
+	Chain model = first >> ops::relu >> Linear::from(4, 2, true, Resource::f64);
+	Tensor X = Tensor::randn({ 16ul, 8ul }, Resource::f64);
+
+	Profiler::start();
+	Tape tape = Tape::from(model.parameters());
+	DynamicDeferred loss = sum(square(model(X)));
+	loss.eval();
+	loss.backward(tape);
+	Profiler::stop();
+
+#ifdef PETAL_PROFILE
+	auto entries = Profiler::summary();
+	auto find = [&](const std::string &tag, Profiler::Phase phase) {
+		auto it = std::find_if(entries.begin(), entries.end(), [&](const Profiler::Entry &e) {
+			return e.tag == tag && e.phase == phase;
+		});
+
+		return (it == entries.end()) ? nullptr : &*it;
+	};
+
+	const Profiler::Entry *layer = find(first.tag, Profiler::forward);
+	const Profiler::Entry *chain = find(model.tag, Profiler::forward);
+	ASSERT_TRUE(layer && chain);
+	ASSERT_TRUE(find(first.tag, Profiler::pullback));
+
+	ASSERT_EQ(layer->calls, 1);
+	ASSERT_EQ(layer->flops, 2 * 16 * 8 * 4);
+	ASSERT_GE(layer->bytes, 16 * 4 * sizeof(double));
+	ASSERT_GE(layer->peak, layer->bytes);
+
+	// Chains include their layers
+	ASSERT_EQ(chain->flops, 2 * 16 * 8 * 4 + 16 * 4 + 2 * 16 * 4 * 2);
+	ASSERT_GE(chain->total, layer->total);
+	ASSERT_LT(chain->self, chain->total);
+
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "petals-trace.json";
+	ASSERT_TRUE(Profiler::export_trace(path));
+
+	std::ifstream file(path);
+	std::string trace((std::istreambuf_iterator <char> (file)), std::istreambuf_iterator <char> ());
+	ASSERT_NE(trace.find("\"traceEvents\""), std::string::npos);
+	ASSERT_NE(trace.find(first.tag), std::string::npos);
+#else
+	ASSERT_TRUE(Profiler::events().empty());
+#endif
+}
@@ -0,0 +1,909 @@
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "allocator.hpp"
+#include "kernels.hpp"
+#include "ops.hpp"
+#include "tensor.hpp"
+
+// Reference implementations
+static Tensor naive_gemm(const Tensor &A, const Tensor &B)
+{
+	size_t N = A.shape.value()[0];
+	size_t M = A.shape.value()[1];
+	size_t K = B.shape.value()[1];
+
+	const double *a = A.buffer.data <double> ();
+	const double *b = B.buffer.data <double> ();
+
+	Tensor C = Tensor::zeros({ N, K }, Resource::f64);
+	double *c = C.buffer.data <double> ();
+	for (size_t i = 0; i < N; i++) {
+		for (size_t k = 0; k < M; k++) {
+			for (size_t j = 0; j < K; j++)
+				c[i * K + j] += a[i * M + k] * b[k * K + j];
+		}
+	}
+
+	return C;
+}
+
+static Tensor to_f32(const Tensor &X)
+{
+	Tensor Y = Tensor::blank(*X.shape, Resource::f32);
+	for (size_t i = 0; i < X.buffer.elements; i++)
+		Y.buffer.data <float> ()[i] = X.buffer.data <double> ()[i];
+	return Y;
+}
+
+template <typename T>
+static double max_difference(const Resource &A, const Resource &B)
+{
+	double delta = 0.0;
+	for (size_t i = 0; i < A.elements; i++)
+		delta = std::max(delta, std::abs(double(A.data <T> ()[i]) - B.data <double> ()[i]));
+	return delta;
+}
+
+// GEMM engine
+class GEMMTest : public testing::TestWithParam <std::tuple <size_t, size_t, size_t>> {};
+
+TEST_P(GEMMTest, MatchesReference)
+{
+	auto [N, M, K] = GetParam();
+
+	Tensor A = Tensor::randn({ N, M }, Resource::f64);
+	Tensor B = Tensor::randn({ M, K }, Resource::f64);
+	Tensor C = Tensor::blank({ N, K }, Resource::f64);
+
+	cpu_kernel_gemm <double> (A.buffer, B.buffer, C.buffer, N, M, K);
+
+	Tensor gt_C = naive_gemm(A, B);
+	ASSERT_LT(max_difference <double> (C.buffer, gt_C.buffer), 1e-9 * M);
+}
+
+TEST_P(GEMMTest, SinglePrecision)
+{
+	auto [N, M, K] = GetParam();
+
+	Tensor A = Tensor::randn({ N, M }, Resource::f64);
+	Tensor B = Tensor::randn({ M, K }, Resource::f64);
+	Tensor C = Tensor::blank({ N, K }, Resource::f32);
+
+	cpu_kernel_gemm <float> (to_f32(A).buffer, to_f32(B).buffer, C.buffer, N, M, K);
+
+	Tensor gt_C = naive_gemm(A, B);
+	ASSERT_LT(max_difference <float> (C.buffer, gt_C.buffer), 1e-5 * M);
+}
+
+TEST_P(GEMMTest, TransposedOperands)
+{
+	auto [N, M, K] = GetParam();
+
+	Tensor A = Tensor::randn({ N, M }, Resource::f64);
+	Tensor B = Tensor::randn({ M, K }, Resource::f64);
+	Tensor At = A.transpose().contiguous();
+	Tensor Bt = B.transpose().contiguous();
+	Tensor gt_C = naive_gemm(A, B);
+
+	for (auto [transA, transB] : { std::pair(true, false), std::pair(false, true), std::pair(true, true) }) {
+		Tensor C = Tensor::blank({ N, K }, Resource::f64);
+		cpu_kernel_gemm <double> ((transA ? At : A).buffer, (transB ? Bt : B).buffer, C.buffer, N, M, K, transA, transB);
+		ASSERT_LT(max_difference <double> (C.buffer, gt_C.buffer), 1e-9 * M) << "transA = " << transA << ", transB = " << transB;
+	}
+}
+
+TEST_P(GEMMTest, BiasEpilogue)
+{
+	auto [N, M, K] = GetParam();
+
+	Tensor A = Tensor::randn({ N, M }, Resource::f64);
+	Tensor B = Tensor::randn({ M, K }, Resource::f64);
+	Tensor bias = Tensor::randn({ K }, Resource::f64);
+	Tensor gt_C = naive_gemm(A, B);
+
+	for (gemm_activation act : { gemm_identity, gemm_relu, gemm_sigmoid }) {
+		Tensor C = Tensor::blank({ N, K }, Resource::f64);
+		cpu_kernel_gemm_bias <double> (A.buffer, M, 1, B.buffer, K, 1, &bias.buffer, C.buffer, N, M, K, act);
+
+		Tensor expected = Tensor::blank({ N, K }, Resource::f64);
+		for (size_t i = 0; i < N * K; i++) {
+			double x = gt_C.buffer.data <double> ()[i] + bias.buffer.data <double> ()[i % K];
+			if (act == gemm_relu)
+				x = std::max(x, 0.0);
+			if (act == gemm_sigmoid)
+				x = 1 / (1 + std::exp(-x));
+			expected.buffer.data <double> ()[i] = x;
+		}
+
+		ASSERT_LT(max_difference <double> (C.buffer, expected.buffer), 1e-9 * M) << "activation = " << act;
+	}
+}
+
+INSTANTIATE_TEST_SUITE_P(Shapes, GEMMTest, testing::Values(
+	std::make_tuple(1, 1, 1),
+	std::make_tuple(3, 5, 7),
+	std::make_tuple(17, 33, 9),
+	std::make_tuple(100, 785, 30),
+	std::make_tuple(100, 30, 785),
+	std::make_tuple(257, 300, 129),
+	std::make_tuple(1, 1000, 3100),
+	std::make_tuple(2000, 16, 3)
+));
+
+// Strided views
+TEST(ViewTest, TransposeSharesBuffer)
+{
+	Tensor A = Tensor::randn({ 3, 5 });
+	Tensor At = A.transpose();
+
+	ASSERT_EQ(At.buffer.ptr, A.buffer.ptr);
+	ASSERT_FALSE(At.is_contiguous());
+
+	Tensor materialized = At.contiguous();
+	for (size_t i = 0; i < 3; i++) {
+		for (size_t j = 0; j < 5; j++)
+			ASSERT_EQ(materialized.buffer.data <float> ()[j * 3 + i], A.buffer.data <float> ()[i * 5 + j]);
+	}
+}
+
+TEST(ViewTest, SliceAndPermute)
+{
+	Tensor A = Tensor::randn({ 4, 6, 5 });
+
+	// Slicing the middle dimension
+	Tensor S = A.slice(2, 5, 1).contiguous();
+	ASSERT_EQ(*S.shape, Shape({ 4, 3, 5 }));
+	for (size_t i = 0; i < 4; i++) {
+		for (size_t j = 0; j < 3; j++) {
+			for (size_t k = 0; k < 5; k++)
+				ASSERT_EQ(S.buffer.data <float> ()[(i * 3 + j) * 5 + k], A.buffer.data <float> ()[(i * 6 + j + 2) * 5 + k]);
+		}
+	}
+
+	// Permuting all dimensions
+	Tensor P = A.permute(2, 0, 1).contiguous();
+	ASSERT_EQ(*P.shape, Shape({ 5, 4, 6 }));
+	for (size_t i = 0; i < 4; i++) {
+		for (size_t j = 0; j < 6; j++) {
+			for (size_t k = 0; k < 5; k++)
+				ASSERT_EQ(P.buffer.data <float> ()[(k * 4 + i) * 6 + j], A.buffer.data <float> ()[(i * 6 + j) * 5 + k]);
+		}
+	}
+
+	// Views outlive the tensor they come from
+	Tensor row = Tensor::randn({ 2, 3 })[1];
+	ASSERT_EQ(row.clone().buffer.elements, 3);
+}
+
+TEST(ViewTest, BroadcastAndConcat)
+{
+	Tensor bias = Tensor::randn({ 4 });
+	Tensor B = bias.broadcast({ 3, 4 });
+	ASSERT_EQ(B.buffer.elements, 4);
+
+	Tensor ones = Tensor::ones({ 3, 1 });
+	Tensor C = Tensor::concat(B, ones, 1);
+	ASSERT_EQ(*C.shape, Shape({ 3, 5 }));
+	for (size_t i = 0; i < 3; i++) {
+		for (size_t j = 0; j < 4; j++)
+			ASSERT_EQ(C.buffer.data <float> ()[i * 5 + j], bias.buffer.data <float> ()[j]);
+		ASSERT_EQ(C.buffer.data <float> ()[i * 5 + 4], 1.0);
+	}
+}
+
+// Views print in logical order
+TEST(ViewTest, Formatting)
+{
+	Tensor A = Tensor::blank({ 2, 3 });
+	for (size_t i = 0; i < 6; i++)
+		A.buffer.data <float> ()[i] = i;
+
+	std::string transposed = fmt::format("{}", A.transpose());
+	ASSERT_NE(transposed.find("[[0.0000, 3.0000], [1.0000, 4.0000], [2.0000, 5.0000]]"), std::string::npos) << transposed;
+
+	std::string broadcast = fmt::format("{}", A[1].broadcast({ 2, 3 }));
+	ASSERT_NE(broadcast.find("[[3.0000, 4.0000, 5.0000], [3.0000, 4.0000, 5.0000]]"), std::string::npos) << broadcast;
+}
+
+// Broadcasting binary operations match the same operations over
+// materialized copies of the operands
+TEST(BroadcastTest, MatchesMaterialized)
+{
+	std::vector <std::pair <Shape, Shape>> cases {
+		{ { 5, 4 }, { 4 } },
+		{ { 3, 1 }, { 1, 6 } },
+		{ { 2, 3, 4 }, { 3, 1 } },
+		{ { 300, 200 }, {} },
+		{ { 7 }, { 40, 30, 7 } },
+	};
+
+	for (const auto &[sA, sB] : cases) {
+		Tensor A = Tensor::randn(sA, Resource::f64);
+		Tensor B = Tensor::randn(sB, Resource::f64) + 3.0;
+
+		Shape shape = *ops::broadcast_shape(sA, sB);
+		Tensor mA = A.broadcast(shape).contiguous();
+		Tensor mB = B.broadcast(shape).contiguous();
+
+		std::vector <std::pair <Function *, Function *>> functions {
+			{ &ops::add, &ops::add },
+			{ &ops::sub, &ops::sub },
+			{ &ops::mul, &ops::mul },
+			{ &ops::div, &ops::div },
+		};
+
+		for (auto [f, g] : functions) {
+			Tensor C = f->forward(A, B);
+			Tensor expected = g->forward(mA, mB);
+			ASSERT_EQ(C.shape, expected.shape);
+			ASSERT_EQ(max_difference <double> (C.buffer, expected.buffer), 0.0);
+		}
+	}
+
+	// Incompatible shapes
+	ASSERT_FALSE(ops::add.forward(Tensor::randn({ 3 }), Tensor::randn({ 4 })).shape);
+	ASSERT_FALSE(ops::mul.forward(Tensor::randn({ 2, 3 }), Tensor::randn({ 3, 2 })).shape);
+}
+
+TEST(BroadcastTest, PullbackReduces)
+{
+	Tensor A = Tensor::randn({ 5, 4 }, Resource::f64);
+	Tensor B = Tensor::randn({ 4 }, Resource::f64);
+	Tensor delta = Tensor::randn({ 5, 4 }, Resource::f64);
+
+	Tape tape;
+	tensor_list sums = ops::add.pullback_args({ A, B }, delta, tape);
+	tensor_list products = ops::mul.pullback_args({ A, B }, delta, tape);
+	ASSERT_EQ(*sums[0].shape, Shape({ 5, 4 }));
+	ASSERT_EQ(*sums[1].shape, Shape({ 4 }));
+	ASSERT_EQ(*products[1].shape, Shape({ 4 }));
+
+	const double *a = A.buffer.data <double> ();
+	const double *d = delta.buffer.data <double> ();
+	for (size_t j = 0; j < 4; j++) {
+		double sum = 0.0;
+		double product = 0.0;
+		for (size_t i = 0; i < 5; i++) {
+			sum += d[i * 4 + j];
+			product += d[i * 4 + j] * a[i * 4 + j];
+		}
+
+		ASSERT_NEAR(sums[1].buffer.data <double> ()[j], sum, 1e-12);
+		ASSERT_NEAR(products[1].buffer.data <double> ()[j], product, 1e-12);
+	}
+}
+
+// Elementwise fusion
+TEST(FusionTest, MatchesUnfused)
+{
+	Tensor A = Tensor::randn({ 70, 90 }, Resource::f64);
+	Tensor B = Tensor::randn({ 70, 90 }, Resource::f64);
+
+	auto expression = [&]() { return (2.0 * A - B) * sqrt(B + 1.0); };
+
+	DynamicDeferred fused = expression();
+	DynamicDeferred unfused = expression();
+	Tensor F = fused.eval();
+	Tensor U = unfused.eval(false);
+
+	ASSERT_TRUE(fused.fused);
+	ASSERT_EQ(*F.shape, *U.shape);
+	ASSERT_LT(max_difference <double> (F.buffer, U.buffer), 1e-12);
+}
+
+TEST(FusionTest, TrailingReduction)
+{
+	Tensor A = Tensor::randn({ 1000, 100 }, Resource::f64);
+	Tensor B = Tensor::randn({ 1000, 100 }, Resource::f64);
+
+	DynamicDeferred fused = sum(square(A - B));
+	DynamicDeferred unfused = sum(square(A - B));
+	Tensor F = fused.eval();
+	Tensor U = unfused.eval(false);
+
+	ASSERT_TRUE(fused.fused);
+	ASSERT_EQ(F.shape->size(), 0);
+	ASSERT_NEAR(F.buffer.data <double> ()[0], U.buffer.data <double> ()[0], 1e-9);
+
+	// The pullback recomputes the intermediates it needs
+	Tape tape;
+	Tensor dA = fused.backward(tape)[0];
+	Tensor dB = fused.backward(tape)[1];
+	for (size_t i = 0; i < A.buffer.elements; i++) {
+		double d = A.buffer.data <double> ()[i] - B.buffer.data <double> ()[i];
+		ASSERT_NEAR(dA.buffer.data <double> ()[i], 2 * d, 1e-12);
+		ASSERT_NEAR(dB.buffer.data <double> ()[i], -2 * d, 1e-12);
+	}
+}
+
+// Reductions
+static Tensor naive_reduce(const Tensor &A, long int dim, reduce_mode op)
+{
+	const Shape &shape = *A.shape;
+	size_t outer = 1;
+	size_t inner = 1;
+	Shape reduced;
+	for (long int i = 0; i < long(shape.size()); i++) {
+		if (i < dim)
+			outer *= shape.at(i);
+		if (i > dim)
+			inner *= shape.at(i);
+		if (i != dim)
+			reduced.push_back(shape.at(i));
+	}
+
+	size_t n = shape.at(dim);
+	const double *a = A.buffer.data <double> ();
+
+	Tensor C = Tensor::blank(reduced, Resource::f64);
+	double *c = C.buffer.data <double> ();
+	for (size_t i = 0; i < outer; i++) {
+		for (size_t k = 0; k < inner; k++) {
+			double sum = 0.0;
+			size_t best = 0;
+			for (size_t j = 0; j < n; j++) {
+				double x = a[(i * n + j) * inner + k];
+				sum += x;
+				if (x > a[(i * n + best) * inner + k])
+					best = j;
+			}
+
+			double value = a[(i * n + best) * inner + k];
+			if (op == ksum)
+				value = sum;
+			if (op == kmean)
+				value = sum / n;
+			if (op == kargmax)
+				value = best;
+
+			c[i * inner + k] = value;
+		}
+	}
+
+	return C;
+}
+
+TEST(ReductionTest, MatchesReference)
+{
+	Tensor A = Tensor::randn({ 7, 300, 13 }, Resource::f64);
+
+	for (long int dim : { 0, 1, 2, -1 }) {
+		long int d = (dim < 0) ? dim + 3 : dim;
+
+		Tensor S = sum(A, dim).eval();
+		Tensor M = mean(A, dim).eval();
+		Tensor X = max(A, dim).eval();
+		Tensor I = argmax(A, dim).eval();
+
+		ASSERT_LT(max_difference <double> (S.buffer, naive_reduce(A, d, ksum).buffer), 1e-10) << "dim = " << dim;
+		ASSERT_LT(max_difference <double> (M.buffer, naive_reduce(A, d, kmean).buffer), 1e-12) << "dim = " << dim;
+		ASSERT_EQ(max_difference <double> (X.buffer, naive_reduce(A, d, kmax).buffer), 0.0) << "dim = " << dim;
+		ASSERT_EQ(max_difference <double> (I.buffer, naive_reduce(A, d, kargmax).buffer), 0.0) << "dim = " << dim;
+	}
+
+	// Reducing everything
+	Tensor S = sum(A).eval();
+	ASSERT_EQ(S.shape->size(), 0);
+	ASSERT_NEAR(S.buffer.data <double> ()[0], sum(sum(A, 0)).eval().buffer.data <double> ()[0], 1e-9);
+}
+
+TEST(ReductionTest, SinglePrecisionAccuracy)
+{
+	// Naive float accumulation drifts by more than a percent here
+	constexpr size_t N = 10000000;
+	Tensor A = Tensor::blank({ N });
+	A = 0.1;
+
+	Tensor S = sum(A).eval();
+	ASSERT_NEAR(S.buffer.data <float> ()[0], 0.1f * N, 1.0);
+
+	// Strided lanes, accumulated in compensated form
+	Tensor B = Tensor::blank({ N / 100, 100ul });
+	B = 0.1;
+
+	Tensor columns = sum(B, 0).eval();
+	for (size_t i = 0; i < 100; i++)
+		ASSERT_NEAR(columns.buffer.data <float> ()[i], 0.1f * N / 100, 1e-2);
+}
+
+TEST(ReductionTest, Pullbacks)
+{
+	Tensor A = Tensor::randn({ 5, 8 }, Resource::f64);
+
+	Tape tape;
+	DynamicDeferred m = mean(A, 1);
+	m.eval();
+	Tensor dA = m.pullback(Tensor::ones({ 5ul }, Resource::f64), tape)[0];
+	for (size_t i = 0; i < A.buffer.elements; i++)
+		ASSERT_NEAR(dA.buffer.data <double> ()[i], 1.0 / 8, 1e-15);
+
+	DynamicDeferred x = max(A, 0);
+	x.eval();
+	Tensor dX = x.pullback(Tensor::ones({ 8ul }, Resource::f64), tape)[0];
+	Tensor I = argmax(A, 0).eval();
+	for (size_t i = 0; i < 5; i++) {
+		for (size_t j = 0; j < 8; j++) {
+			double expected = (I.buffer.data <double> ()[j] == i);
+			ASSERT_EQ(dX.buffer.data <double> ()[i * 8 + j], expected);
+		}
+	}
+}
+
+// Convolutions and pooling, against direct loops over the windows
+static Tensor naive_conv2d(const Tensor &X, const Tensor &W, const conv_shape &s, size_t K, bool bias)
+{
+	size_t OH = s.out_height();
+	size_t OW = s.out_width();
+	const double *x = X.buffer.data <double> ();
+	const double *w = W.buffer.data <double> ();
+
+	Tensor Y = Tensor::zeros({ s.batch, OH, OW, K }, Resource::f64);
+	double *y = Y.buffer.data <double> ();
+	for (size_t n = 0; n < s.batch; n++) {
+		for (size_t oh = 0; oh < OH; oh++) {
+			for (size_t ow = 0; ow < OW; ow++) {
+				double *out = &y[((n * OH + oh) * OW + ow) * K];
+				for (size_t k = 0; k < K; k++)
+					out[k] = bias ? w[s.patch() * K + k] : 0.0;
+
+				for (size_t i = 0; i < s.kernel; i++) {
+					for (size_t j = 0; j < s.kernel; j++) {
+						long int h = long(oh * s.stride + i) - long(s.padding);
+						long int v = long(ow * s.stride + j) - long(s.padding);
+						if (h < 0 || h >= long(s.height) || v < 0 || v >= long(s.width))
+							continue;
+
+						for (size_t c = 0; c < s.channels; c++) {
+							double a = x[((n * s.height + h) * s.width + v) * s.channels + c];
+							for (size_t k = 0; k < K; k++)
+								out[k] += a * w[((i * s.kernel + j) * s.channels + c) * K + k];
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return Y;
+}
+
+static double dot(const Tensor &A, const Tensor &B)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < A.buffer.elements; i++)
+		sum += A.buffer.data <double> ()[i] * B.buffer.data <double> ()[i];
+	return sum;
+}
+
+class ConvTest : public testing::TestWithParam <std::tuple <size_t, size_t, size_t, size_t>> {};
+
+TEST_P(ConvTest, MatchesReference)
+{
+	auto [C, K, kernel, stride] = GetParam();
+
+	for (size_t padding : { 0ul, kernel / 2 }) {
+		conv_shape s { 3, 11, 8, C, kernel, stride, padding };
+
+		Tensor X = Tensor::randn({ s.batch, s.height, s.width, C }, Resource::f64);
+		Tensor W = Tensor::randn({ s.patch() + 1, K }, Resource::f64);
+		Resource bias = *W.buffer.slice(s.patch() * K);
+		Tensor gt_Y = naive_conv2d(X, W, s, K, true);
+
+		for (conv_algorithm algorithm : { conv_auto, conv_im2col, conv_winograd }) {
+			Tensor Y = Tensor::blank(*gt_Y.shape, Resource::f64);
+			cpu_kernel_conv2d <double> (X.buffer, W.buffer, &bias, Y.buffer, s, K, gemm_identity, algorithm);
+			ASSERT_LT(max_difference <double> (Y.buffer, gt_Y.buffer), 1e-10);
+		}
+
+		Tensor Y = Tensor::blank(*gt_Y.shape, Resource::f32);
+		cpu_kernel_conv2d <float> (to_f32(X).buffer, to_f32(W).buffer, nullptr, Y.buffer, s, K);
+		ASSERT_LT(max_difference <float> (Y.buffer, naive_conv2d(X, W, s, K, false).buffer), 1e-3);
+	}
+}
+
+// The input and weight deltas are the adjoints of the convolution
+TEST_P(ConvTest, PullbackIsAdjoint)
+{
+	auto [C, K, kernel, stride] = GetParam();
+
+	for (size_t padding : { 0ul, kernel / 2 }) {
+		conv_shape s { 2, 9, 10, C, kernel, stride, padding };
+
+		Tensor X = Tensor::randn({ s.batch, s.height, s.width, C }, Resource::f64);
+		Tensor W = Tensor::randn({ s.patch(), K }, Resource::f64);
+		Tensor D = Tensor::randn({ s.batch, s.out_height(), s.out_width(), K }, Resource::f64);
+
+		Tensor Y = Tensor::blank(*D.shape, Resource::f64);
+		Tensor dX = Tensor::blank_like(X);
+		Tensor dW = Tensor::blank_like(W);
+		cpu_kernel_conv2d <double> (X.buffer, W.buffer, nullptr, Y.buffer, s, K);
+		cpu_kernel_conv2d_input <double> (D.buffer, W.buffer, dX.buffer, s, K);
+		cpu_kernel_conv2d_weights <double> (X.buffer, D.buffer, dW.buffer, s, K);
+
+		double expected = dot(Y, D);
+		ASSERT_NEAR(dot(X, dX), expected, 1e-9 * std::abs(expected) + 1e-9);
+		ASSERT_NEAR(dot(W, dW), expected, 1e-9 * std::abs(expected) + 1e-9);
+	}
+}
+
+// Channels in and out, kernel and stride
+INSTANTIATE_TEST_SUITE_P(Shapes, ConvTest, testing::Values(
+	std::make_tuple(1, 1, 1, 1),
+	std::make_tuple(5, 7, 1, 1),
+	std::make_tuple(3, 4, 3, 1),
+	std::make_tuple(16, 12, 3, 1),
+	std::make_tuple(8, 9, 3, 2),
+	std::make_tuple(6, 5, 5, 3),
+	std::make_tuple(4, 3, 2, 2)
+));
+
+// Patches and Winograd tiles over several blocks, which straddle images
+TEST(ConvBlockTest, SpansBlocks)
+{
+	for (size_t stride : { 1ul, 2ul }) {
+		conv_shape s { 3, 37, 29, 64, 3, stride, 1 };
+		size_t K = 48;
+
+		Tensor X = Tensor::randn({ s.batch, s.height, s.width, s.channels }, Resource::f64);
+		Tensor W = Tensor::randn({ s.patch(), K }, Resource::f64);
+		Tensor D = Tensor::randn({ s.batch, s.out_height(), s.out_width(), K }, Resource::f64);
+		Tensor gt_Y = naive_conv2d(X, W, s, K, false);
+
+		for (conv_algorithm algorithm : { conv_im2col, conv_winograd }) {
+			Tensor Y = Tensor::blank(*gt_Y.shape, Resource::f64);
+			cpu_kernel_conv2d <double> (X.buffer, W.buffer, nullptr, Y.buffer, s, K, gemm_identity, algorithm);
+			ASSERT_LT(max_difference <double> (Y.buffer, gt_Y.buffer), 1e-9);
+		}
+
+		Tensor dX = Tensor::blank_like(X);
+		Tensor dW = Tensor::blank_like(W);
+		cpu_kernel_conv2d_input <double> (D.buffer, W.buffer, dX.buffer, s, K);
+		cpu_kernel_conv2d_weights <double> (X.buffer, D.buffer, dW.buffer, s, K);
+
+		double expected = dot(gt_Y, D);
+		ASSERT_NEAR(dot(X, dX), expected, 1e-9 * std::abs(expected));
+		ASSERT_NEAR(dot(W, dW), expected, 1e-9 * std::abs(expected));
+	}
+}
+
+TEST(PoolTest, MatchesReference)
+{
+	conv_shape s { 2, 7, 6, 19, 3, 2, 1 };
+	Tensor X = Tensor::randn({ s.batch, s.height, s.width, s.channels }, Resource::f64);
+	Tensor D = Tensor::randn({ s.batch, s.out_height(), s.out_width(), s.channels }, Resource::f64);
+
+	Tensor average = Tensor::blank_like(D);
+	Tensor maximum = Tensor::blank_like(D);
+	Tensor dAverage = Tensor::blank_like(X);
+	Tensor dMaximum = Tensor::blank_like(X);
+	cpu_kernel_pool <pool_average, double> (X.buffer, average.buffer, s);
+	cpu_kernel_pool <pool_max, double> (X.buffer, maximum.buffer, s);
+	cpu_kernel_pool_pullback <pool_average, double> (X.buffer, D.buffer, dAverage.buffer, s);
+	cpu_kernel_pool_pullback <pool_max, double> (X.buffer, D.buffer, dMaximum.buffer, s);
+
+	const double *x = X.buffer.data <double> ();
+	const double *d = D.buffer.data <double> ();
+	Tensor gt_dAverage = Tensor::zeros_like(X);
+	Tensor gt_dMaximum = Tensor::zeros_like(X);
+	for (size_t p = 0; p < s.pixels(); p++) {
+		size_t n = p / (s.out_height() * s.out_width());
+		size_t oh = (p / s.out_width()) % s.out_height();
+		size_t ow = p % s.out_width();
+		for (size_t c = 0; c < s.channels; c++) {
+			std::vector <size_t> window;
+			for (size_t i = 0; i < s.kernel; i++) {
+				for (size_t j = 0; j < s.kernel; j++) {
+					long int h = long(oh * s.stride + i) - long(s.padding);
+					long int w = long(ow * s.stride + j) - long(s.padding);
+					if (h >= 0 && h < long(s.height) && w >= 0 && w < long(s.width))
+						window.push_back(((n * s.height + h) * s.width + w) * s.channels + c);
+				}
+			}
+
+			double sum = 0.0;
+			size_t best = window[0];
+			for (size_t index : window) {
+				sum += x[index];
+				best = (x[index] > x[best]) ? index : best;
+			}
+
+			size_t at = p * s.channels + c;
+			ASSERT_NEAR(average.buffer.data <double> ()[at], sum / window.size(), 1e-12);
+			ASSERT_EQ(maximum.buffer.data <double> ()[at], x[best]);
+
+			for (size_t index : window)
+				gt_dAverage.buffer.data <double> ()[index] += d[at] / window.size();
+			gt_dMaximum.buffer.data <double> ()[best] += d[at];
+		}
+	}
+
+	ASSERT_LT(max_difference <double> (dAverage.buffer, gt_dAverage.buffer), 1e-12);
+	ASSERT_LT(max_difference <double> (dMaximum.buffer, gt_dMaximum.buffer), 1e-12);
+}
+
+// Devices
+#ifdef PETAL_CUDA
+
+TEST(DeviceTest, CUDARoundTrip)
+{
+	Tensor A = Tensor::randn({ 37ul, 53ul }, Resource::f64);
+	Tensor B = Tensor::randn({ 53ul, 29ul }, Resource::f64);
+
+	Tensor dA = A.to(Resource::eCUDA);
+	Tensor dB = B.to(Resource::eCUDA);
+	ASSERT_EQ(dA.buffer.device, Resource::eCUDA);
+	ASSERT_EQ(max_difference <double> (dA.to(Resource::eCPU).buffer, A.buffer), 0.0);
+
+	// Kernels dispatch on the device of their operands
+	Tensor dC = Tensor::blank({ 37ul, 29ul }, Resource::f64, Resource::eCUDA);
+	ops::gemm(dA, dB, dC);
+	ASSERT_LT(max_difference <double> (dC.to(Resource::eCPU).buffer, naive_gemm(A, B).buffer), 1e-9 * 53);
+
+	Tensor dS = ops::add.forward(dA, dA);
+	Tensor S = ops::add.forward(A, A);
+	ASSERT_EQ(max_difference <double> (dS.to(Resource::eCPU).buffer, S.buffer), 0.0);
+
+	// Transposed views go through cuBLAS as they are
+	Tensor dT = Tensor::blank({ 29ul, 29ul }, Resource::f64, Resource::eCUDA);
+	ops::gemm(dB.transpose(), dB, dT);
+	ASSERT_LT(max_difference <double> (dT.to(Resource::eCPU).buffer, naive_gemm(B.transpose().contiguous(), B).buffer), 1e-9 * 53);
+
+	// Reductions and constants have kernels of their own
+	for (long int dim : { 0, 1 }) {
+		Tensor S = sum(dA, dim).eval().to(Resource::eCPU);
+		ASSERT_LT(max_difference <double> (S.buffer, naive_reduce(A, dim, ksum).buffer), 1e-10) << "dim = " << dim;
+	}
+
+	Tensor dH = ops::_scalek::from(0.5).forward(dA);
+	Tensor H = ops::_scalek::from(0.5).forward(A);
+	ASSERT_EQ(max_difference <double> (dH.to(Resource::eCPU).buffer, H.buffer), 0.0);
+
+	// Views are gathered through the host
+	Tensor dBT = dB.transpose().contiguous();
+	ASSERT_EQ(dBT.buffer.device, Resource::eCUDA);
+	ASSERT_EQ(max_difference <double> (dBT.to(Resource::eCPU).buffer, B.transpose().contiguous().buffer), 0.0);
+
+	// Other operations are refused rather than read on the host
+	ASSERT_FALSE(ops::softmax.forward(dA).shape);
+}
+
+#else
+
+TEST(DeviceTest, UnsupportedDevices)
+{
+	ASSERT_FALSE(Resource::from(16, Resource::f32, Resource::eCUDA));
+	ASSERT_FALSE(Tensor::randn({ 4ul }).to(Resource::eCUDA).shape);
+}
+
+#endif
+
+#ifdef PETAL_VULKAN
+
+TEST(DeviceTest, VulkanRoundTrip)
+{
+	Tensor A = Tensor::randn({ 37ul, 53ul }, Resource::f64);
+	Tensor B = Tensor::randn({ 53ul, 29ul }, Resource::f64);
+
+	Tensor vA = to_f32(A).to(Resource::eVulkan);
+	Tensor vB = to_f32(B).to(Resource::eVulkan);
+	ASSERT_EQ(vA.buffer.device, Resource::eVulkan);
+	ASSERT_LT(max_difference <float> (vA.to(Resource::eCPU).buffer, A.buffer), 1e-6);
+
+	// Shaders are single precision
+	ASSERT_FALSE(Resource::from(16, Resource::f64, Resource::eVulkan));
+
+	Tensor vC = Tensor::blank({ 37ul, 29ul }, Resource::f32, Resource::eVulkan);
+	ops::gemm(vA, vB, vC);
+	ASSERT_LT(max_difference <float> (vC.to(Resource::eCPU).buffer, naive_gemm(A, B).buffer), 1e-5 * 53);
+
+	// Strided operands are read in place
+	Tensor vT = Tensor::blank({ 29ul, 29ul }, Resource::f32, Resource::eVulkan);
+	ops::gemm(vB.transpose(), vB, vT);
+	ASSERT_LT(max_difference <float> (vT.to(Resource::eCPU).buffer, naive_gemm(B.transpose().contiguous(), B).buffer), 1e-5 * 53);
+
+	for (long int dim : { 0, 1 }) {
+		Tensor S = sum(vA, dim).eval().to(Resource::eCPU);
+		ASSERT_LT(max_difference <float> (S.buffer, naive_reduce(A, dim, ksum).buffer), 1e-4) << "dim = " << dim;
+	}
+}
+
+TEST(DeviceTest, VulkanChain)
+{
+	Chain model = Linear::from(53, 17, true, Resource::f32, gemm_relu) >> ops::sigmoid >> Linear::from(17, 5);
+
+	Tensor X = Tensor::randn({ 64ul, 53ul });
+	Tensor expected = model(X);
+
+	// The forward is a single submission, read back once complete
+	for (Tensor *p : model.parameters())
+		*p = p->to(Resource::eVulkan);
+
+	Tensor Y = Tensor(model(X.to(Resource::eVulkan))).to(Resource::eCPU);
+	ASSERT_EQ(Y.shape, expected.shape);
+	for (size_t i = 0; i < Y.buffer.elements; i++)
+		ASSERT_NEAR(Y.buffer.data <float> ()[i], expected.buffer.data <float> ()[i], 1e-4);
+}
+
+TEST(DeviceTest, VulkanHostFallbacks)
+{
+	// Softmax runs on the host, within the batch of the forward
+	Chain model = Linear::from(53, 17) >> ops::_scalek::from(0.5) >> ops::softmax;
+
+	Tensor X = Tensor::randn({ 64ul, 53ul });
+	Tensor expected = model(X);
+
+	for (Tensor *p : model.parameters())
+		*p = p->to(Resource::eVulkan);
+
+	Tensor Y = Tensor(model(X.to(Resource::eVulkan))).to(Resource::eCPU);
+	ASSERT_EQ(Y.shape, expected.shape);
+	for (size_t i = 0; i < Y.buffer.elements; i++)
+		ASSERT_NEAR(Y.buffer.data <float> ()[i], expected.buffer.data <float> ()[i], 1e-5);
+}
+
+TEST(DeviceTest, VulkanThreads)
+{
+	Tensor A = Tensor::randn({ 37ul, 53ul }, Resource::f64);
+	Tensor B = Tensor::randn({ 53ul, 29ul }, Resource::f64);
+	Tensor expected = naive_gemm(A, B);
+
+	// Every thread records into (and submits) the shared command buffer,
+	// some of them within batches
+	std::vector <Tensor> results(8);
+	std::vector <std::thread> threads;
+	for (size_t t = 0; t < results.size(); t++) {
+		threads.emplace_back([&, t]() {
+			std::optional <VulkanBatch> batch;
+			if (t % 2)
+				batch.emplace();
+
+			Tensor vA = to_f32(A).to(Resource::eVulkan);
+			Tensor vB = to_f32(B).to(Resource::eVulkan);
+			Tensor vC = Tensor::blank({ 37ul, 29ul }, Resource::f32, Resource::eVulkan);
+			for (size_t i = 0; i < 16; i++)
+				ops::gemm(vA, vB, vC);
+
+			batch.reset();
+			results[t] = vC.to(Resource::eCPU);
+		});
+	}
+
+	for (std::thread &thread : threads)
+		thread.join();
+
+	for (const Tensor &C : results)
+		ASSERT_LT(max_difference <float> (C.buffer, expected.buffer), 1e-5 * 53);
+}
+
+#endif
+
+TEST(DeviceTest, HostTransfersShare)
+{
+	Tensor A = Tensor::randn({ 4ul, 4ul });
+	ASSERT_EQ(A.to(Resource::eCPU).buffer.ptr, A.buffer.ptr);
+}
+
+// Caching allocator
+TEST(AllocatorTest, ReusesBlocks)
+{
+	Allocator::Statistics before = Allocator::statistics();
+
+	void *first = nullptr;
+	{
+		Tensor A = Tensor::blank({ 1000 });
+		first = A.buffer.ptr;
+		ASSERT_EQ(A.buffer.counter, &Allocator::header(first)->counter);
+	}
+
+	// The block of the same size class comes straight back
+	Tensor B = Tensor::blank({ 990 });
+	ASSERT_EQ(B.buffer.ptr, first);
+
+	Allocator::Statistics after = Allocator::statistics();
+	ASSERT_EQ(after.allocations - before.allocations, 2);
+	ASSERT_GE(after.cache_hits - before.cache_hits, 1);
+}
+
+TEST(AllocatorTest, ZeroedOnRequest)
+{
+	{
+		Tensor A = Tensor::blank({ 500 });
+		A = 1.0;
+	}
+
+	Tensor Z = Tensor::zeros({ 500 });
+	for (size_t i = 0; i < 500; i++)
+		ASSERT_EQ(Z.buffer.data <float> ()[i], 0.0);
+}
+
+TEST(AllocatorTest, MovesKeepCount)
+{
+	Tensor A = Tensor::blank({ 100 });
+	std::atomic <long long int> *counter = A.buffer.counter;
+	ASSERT_EQ(counter->load(), 1);
+
+	Tensor B = A;
+	ASSERT_EQ(counter->load(), 2);
+
+	// Moves hand over the reference and empty the source
+	Tensor C = std::move(B);
+	ASSERT_EQ(counter->load(), 2);
+	ASSERT_EQ(B.buffer.ptr, nullptr);
+	ASSERT_EQ(B.buffer.counter, nullptr);
+
+	Tensor D = Tensor::blank({ 100 });
+	D = std::move(C);
+	ASSERT_EQ(counter->load(), 2);
+	ASSERT_EQ(D.buffer.ptr, A.buffer.ptr);
+
+	// Assigning a slice of itself keeps the block alive
+	D.buffer = *D.buffer.slice(10);
+	ASSERT_EQ(counter->load(), 2);
+	ASSERT_EQ(D.buffer.elements, 90);
+
+	{
+		std::vector <Tensor> ts;
+		for (size_t i = 0; i < 8; i++)
+			ts.push_back(A);
+		ASSERT_EQ(counter->load(), 10);
+	}
+
+	ASSERT_EQ(counter->load(), 2);
+}
+
+TEST(AllocatorTest, MemoryPlan)
+{
+	Tensor X = Tensor::randn({ 50, 20 }, Resource::f64);
+	Tensor Y = Tensor::randn({ 50, 10 }, Resource::f64);
+	Tensor W1 = Tensor::randn({ 21, 30 }, Resource::f64);
+	Tensor W2 = Tensor::randn({ 31, 10 }, Resource::f64);
+
+	auto train = [&](MemoryPlan *plan, size_t steps) {
+		Chain model = Linear::from(20, 30, true, Resource::f64) >> ops::sigmoid >> Linear::from(30, 10, true, Resource::f64);
+		model.parameters()[0]->copy(W1);
+		model.parameters()[1]->copy(W2);
+
+		ParameterArena arena = *ParameterArena::from(model.parameters());
+		Adam opt = Adam::from({ &arena.values });
+
+		size_t allocations = 0;
+		size_t planned = 0;
+		for (size_t i = 0; i < steps; i++) {
+			Allocator::Statistics before = Allocator::statistics();
+			if (plan)
+				plan->begin();
+
+			Tape tape = Tape::from(model.parameters());
+			DynamicDeferred loss = softmax_cross_entropy(model(X), Y);
+			loss.eval();
+			loss.backward(tape);
+			arena.gather(tape);
+			opt.step(arena.tape());
+
+			if (plan)
+				plan->end();
+
+			// Counting the last step only
+			Allocator::Statistics after = Allocator::statistics();
+			allocations = after.allocations - before.allocations;
+			planned = after.planned_allocations - before.planned_allocations;
+		}
+
+		return std::make_tuple(arena.values.clone(), allocations, planned);
+	};
+
+	constexpr size_t STEPS = 8;
+
+	MemoryPlan plan;
+	auto [planned_values, allocations, planned] = train(&plan, STEPS);
+	auto [values, _, unplanned] = train(nullptr, STEPS);
+
+	// Steady state steps are served entirely from the workspace
+	ASSERT_TRUE(plan.planned());
+	ASSERT_GT(allocations, 0);
+	ASSERT_EQ(planned, allocations);
+	ASSERT_EQ(unplanned, 0);
+	ASSERT_EQ(max_difference <double> (planned_values.buffer, values.buffer), 0.0);
+}
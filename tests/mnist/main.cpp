@@ -1,7 +1,8 @@
 #include <cassert>
+#include <cstdlib>
 #include <filesystem>
-#include <fstream>
 
+#include "dataset.hpp"
 #include "ops.hpp"
 #include "composition.hpp"
 
@@ -16,13 +17,10 @@ static const std::unordered_map <std::string, std::string> DATA_URLS {
 int main()
 {
 	constexpr size_t IMAGE_SIZE = 784;
-	constexpr size_t TRAIN_BATCHES = 600;
 	constexpr size_t BATCH_SIZE = 100;
 	constexpr size_t VALIDATION_SIZE = 1000;
 	constexpr size_t EPOCHS = 10;
 
-	static_assert(TRAIN_BATCHES * BATCH_SIZE <= 60000);
-
 	// TODO: pass config to this or choose the config
 
 	// Create the data directory
@@ -34,142 +32,79 @@ int main()
 		}
 	}
 
-	// Load the data
-	// TODO: method that returns this...
-	std::ifstream f_train_images(DATA_DIRECTORY / "train-images-idx3-ubyte");
-	std::ifstream f_train_labels(DATA_DIRECTORY / "train-labels-idx1-ubyte");
-
-	assert(f_train_images.good());
-	assert(f_train_labels.good());
-
-	std::ifstream f_validation_images(DATA_DIRECTORY / "t10k-images-idx3-ubyte");
-	std::ifstream f_validation_labels(DATA_DIRECTORY / "t10k-labels-idx1-ubyte");
-
-	assert(f_validation_images.good());
-	assert(f_validation_labels.good());
-
-	// Headers
-	char header[16];
-
-	f_train_images.read(header, 16);
-	f_validation_images.read(header, 16);
-
-	f_train_labels.read(header, 8);
-	f_validation_labels.read(header, 8);
-
-	// TODO: displaying these images
-	// TODO: single tensor here
-	std::vector <Tensor> tXs;
-	std::vector <Tensor> tYs;
+	// Load the data; the training set is decoded in batches by the loader
+	// threads, straight from the mapped files
+	auto train = IDXDataset::from(DATA_DIRECTORY / "train-images-idx3-ubyte", DATA_DIRECTORY / "train-labels-idx1-ubyte");
+	auto validation = IDXDataset::from(DATA_DIRECTORY / "t10k-images-idx3-ubyte", DATA_DIRECTORY / "t10k-labels-idx1-ubyte");
 
-	for (size_t n = 0; n < TRAIN_BATCHES; n++) {
-		Tensor tX = Tensor::zeros({ BATCH_SIZE, IMAGE_SIZE });
-		Tensor tY = Tensor::zeros({ BATCH_SIZE, 10ul });
+	assert(train);
+	assert(validation && validation->size() >= VALIDATION_SIZE);
 
-		for (size_t i = 0; i < BATCH_SIZE; i++) {
-			// Read the image
-			unsigned char image[IMAGE_SIZE + 1] { 0 };
-			f_train_images.read((char *) image, IMAGE_SIZE);
+	// Validation samples are decoded once, and cached for later runs
+	static const std::filesystem::path VALIDATION_CACHE = DATA_DIRECTORY / "validation.cache";
 
-			for (size_t j = 0; j < IMAGE_SIZE; j++) {
-				size_t index = i * IMAGE_SIZE + j;
-				tX.buffer.ptr[index] = image[j] / 255.0f;
-			}
-
-			// Read the label
-			unsigned char label;
-			f_train_labels.read((char *) &label, 1);
-
-			for (size_t j = 0; j < 10; j++) {
-				size_t index = i * 10 + j;
-				tY.buffer.ptr[index] = (label == j);
-			}
-		}
-
-		tXs.push_back(tX);
-		tYs.push_back(tY);
+	auto cached = TensorDataset::load(VALIDATION_CACHE);
+	if (!cached || cached->size() != VALIDATION_SIZE) {
+		cached = TensorDataset::from(*validation, VALIDATION_SIZE);
+		cached->save(VALIDATION_CACHE);
 	}
 
-	f_train_images.close();
-	f_train_labels.close();
-
-	// Loading validation data
-	Tensor vX = Tensor::zeros({ VALIDATION_SIZE, IMAGE_SIZE });
-	Tensor vY = Tensor::zeros({ VALIDATION_SIZE, 10ul });
-
-	for (size_t i = 0; i < VALIDATION_SIZE; i++) {
-		// Read the image
-		unsigned char image[IMAGE_SIZE + 1] { 0 };
-		f_validation_images.read((char *) image, IMAGE_SIZE);
-
-		for (size_t j = 0; j < IMAGE_SIZE; j++) {
-			size_t index = i * IMAGE_SIZE + j;
-			vX.buffer.ptr[index] = image[j] / 255.0f;
-		}
-
-		// Read the label
-		unsigned char label;
-		f_validation_labels.read((char *) &label, 1);
+	const Tensor &vX = cached->X;
+	const Tensor &vY = cached->Y;
 
-		for (size_t j = 0; j < 10; j++) {
-			size_t index = i * 10 + j;
-			vY.buffer.ptr[index] = (label == j);
-		}
-	}
+	DataLoader::Options options;
+	options.batch_size = BATCH_SIZE;
+	options.shuffle = DataLoader::samples;
 
-	f_validation_images.close();
-	f_validation_labels.close();
+	auto loader = DataLoader::from(std::make_shared <IDXDataset> (*train), options);
 
 	// Construct the model
 	// Chain model = Linear::from(IMAGE_SIZE, 30) >> Linear::from(30, 10) >> ops::softmax;
-	Chain model = Linear::from(IMAGE_SIZE, 30) >> ops::sigmoid >> Linear::from(30, 10) >> ops::softmax;
+	// Chain model = Linear::from(IMAGE_SIZE, 30) >> ops::sigmoid >> Linear::from(30, 10) >> ops::softmax;
+
+	// Outputs logits; the softmax is fused into the loss, and the sigmoid
+	// into the epilogue of the first layer
+	Chain model = Linear::from(IMAGE_SIZE, 30, true, Resource::f32, gemm_sigmoid) >> Linear::from(30, 10);
 
 	auto validation_score = [&]() {
 		Tensor pY = model(vX);
 
+		Tensor predicted = argmax(pY, 1).eval();
+		Tensor truth = argmax(vY, 1).eval();
+
 		size_t correct = 0;
-		for (size_t i = 0; i < VALIDATION_SIZE; i++) {
-			size_t max_predicted = 0;
-			float max_predicted_value = 0.0f;
-			for (size_t j = 0; j < 10; j++) {
-				size_t index = i * 10 + j;
-				float x = pY.buffer.ptr[index];
-				if (x > max_predicted_value) {
-					max_predicted_value = x;
-					max_predicted = j;
-				}
-			}
-
-			size_t max_true = 0;
-			float max_true_value = 0.0f;
-			for (size_t j = 0; j < 10; j++) {
-				size_t index = i * 10 + j;
-				float x = vY.buffer.ptr[index];
-				if (x > max_true_value) {
-					max_true_value = x;
-					max_true = j;
-				}
-			}
-
-			// if (i == 0) {
-			// 	fmt::print("pY = {}\namax = {} -> avalue = {} -> label = {}\n", pY[i], max_predicted, max_predicted_value, max_true);
-			// }
-
-			correct += (max_predicted == max_true);
-		}
+		for (size_t i = 0; i < VALIDATION_SIZE; i++)
+			correct += (predicted.buffer.data <float> ()[i] == truth.buffer.data <float> ()[i]);
 
 		return correct/float(VALIDATION_SIZE);
 	};
 
-	// auto opt = Momentum::from(model.parameters(), 0.001f);
-	auto opt = Adam::from(model.parameters(), 0.01f);
+	// Optimizing all parameters at once, from a single buffer
+	ParameterArena arena = *ParameterArena::from(model.parameters());
+
+	// auto opt = Momentum::from({ &arena.values }, 0.001f);
+	auto opt = Adam::from({ &arena.values }, 0.01f);
 
-	for (size_t n = 0; n < EPOCHS; n++) {
+	// Resuming from the latest checkpoint, if any
+	static const std::filesystem::path CHECKPOINT = DATA_DIRECTORY / "checkpoint";
+	if (std::filesystem::exists(CHECKPOINT) && Checkpoint::load(CHECKPOINT, { &arena.values }, &opt))
+		fmt::print("resuming from {} after {} steps\n", CHECKPOINT.string(), opt.iteration);
+
+	// Every training step requests the same buffers
+	MemoryPlan plan;
+
+	// Profiling the first epoch of the run, if requested
+	bool profiling = std::getenv("PETALS_PROFILE");
+	if (profiling)
+		Profiler::start();
+
+	for (size_t n = opt.iteration / loader->size(); n < EPOCHS; n++) {
 		fmt::print("\n\nepoch {}, accuracy {}\n", n, validation_score());
-		for (size_t i = 0; i < TRAIN_BATCHES; i++) {
-			// TODO: we can just slice...
-			const Tensor &tX = tXs[i];
-			const Tensor &tY = tYs[i];
+		while (auto batch = loader->next()) {
+			MemoryPlan::Pass pass(plan);
+
+			const Tensor &tX = batch->X;
+			const Tensor &tY = batch->Y;
 
 			// fmt::print("layer: {}\n", (*model.parameters()[1])[0]);
 			auto predicted = model(tX);
@@ -178,8 +113,7 @@ int main()
 
 			Tape tape = Tape::from(model.parameters());
 
-			// TODO: mean
-			auto loss = sum(square(predicted - tY))/10;
+			auto loss = softmax_cross_entropy(predicted, tY);
 			// fmt::print("loss graph: {}\n", loss);
 			// fmt::print("  > loss: {}\n", loss.eval());
 			loss.eval();
@@ -189,7 +123,17 @@ int main()
 			// for (const auto &[tag, grad] : tape)
 			// 	fmt::print("  {} -> {}\n", tag, sum(grad).eval().buffer.ptr[0]);
 
-			opt.step(tape);
+			arena.gather(tape);
+			opt.step(arena.tape());
 		}
+
+		if (profiling) {
+			profiling = false;
+			Profiler::stop();
+			fmt::print("{}", Profiler::table());
+			Profiler::export_trace(DATA_DIRECTORY / "trace.json");
+		}
+
+		Checkpoint::save(CHECKPOINT, { &arena.values }, &opt);
 	}
 }